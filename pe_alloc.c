@@ -0,0 +1,113 @@
+#include "pe_alloc.h"
+#include "pe_engine.h"
+
+/*
+ * Desc: Prepended to every counted block, padded so the block after it is
+         aligned like malloc's.
+ */
+typedef struct alloc_header alloc_header;
+struct alloc_header {
+    _Alignas(max_align_t) size_t size;
+    int tag;
+};
+
+const char *alloc_tag_names[NUM_ALLOC_TAGS] = {
+	"orders", "ledger", "products", "traders", "buffers", "reports"
+};
+
+static alloc_counters counters[NUM_ALLOC_TAGS];
+
+/*
+ * Desc: Moves a tag's live bytes by delta and raises its peak to match.
+ */
+static void account(int tag, long delta) {
+	alloc_counters *c = &counters[tag];
+	long live = atomic_fetch_add_explicit(&c->live, delta, memory_order_relaxed) + delta;
+	long peak = atomic_load_explicit(&c->peak, memory_order_relaxed);
+	while (live > peak && !atomic_compare_exchange_weak_explicit(&c->peak, &peak, live,
+			memory_order_relaxed, memory_order_relaxed)) {
+		// peak now holds the newer value, try again if still lower
+	}
+}
+
+void *pe_malloc(int tag, size_t size) {
+	alloc_header *h = (alloc_header*)malloc(sizeof(alloc_header) + size);
+	if (h == NULL) {
+		return NULL;
+	}
+	h->size = size;
+	h->tag = tag;
+	account(tag, (long)size);
+	atomic_fetch_add_explicit(&counters[tag].allocs, 1, memory_order_relaxed);
+	return h + 1;
+}
+
+void *pe_calloc(int tag, size_t num, size_t size) {
+	if (size != 0 && num > (SIZE_MAX - sizeof(alloc_header)) / size) {
+		return NULL;
+	}
+	void *ptr = pe_malloc(tag, num * size);
+	if (ptr != NULL) {
+		memset(ptr, 0, num * size);
+	}
+	return ptr;
+}
+
+void *pe_realloc(int tag, void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return pe_malloc(tag, size);
+	}
+	alloc_header *h = (alloc_header*)ptr - 1;
+	size_t old_size = h->size;
+	tag = h->tag;
+	alloc_header *grown = (alloc_header*)realloc(h, sizeof(alloc_header) + size);
+	if (grown == NULL) {
+		return NULL;
+	}
+	grown->size = size;
+	account(tag, (long)size - (long)old_size);
+	return grown + 1;
+}
+
+void pe_free(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+	alloc_header *h = (alloc_header*)ptr - 1;
+	int tag = h->tag;
+	account(tag, -(long)h->size);
+	atomic_fetch_add_explicit(&counters[tag].frees, 1, memory_order_relaxed);
+	free(h);
+}
+
+void alloc_read(int tag, alloc_usage *out) {
+	alloc_counters *c = &counters[tag];
+	out->live = atomic_load_explicit(&c->live, memory_order_relaxed);
+	out->peak = atomic_load_explicit(&c->peak, memory_order_relaxed);
+	out->allocs = atomic_load_explicit(&c->allocs, memory_order_relaxed);
+	out->frees = atomic_load_explicit(&c->frees, memory_order_relaxed);
+}
+
+void alloc_summary(int num_traders) {
+	alloc_usage usage[NUM_ALLOC_TAGS];
+	long live = 0;
+	long peak = 0;
+	printf("%s\t--MEMORY--\n", LOG_PREFIX);
+	printf("%s\t%-10s %12s %12s %10s %10s\n", LOG_PREFIX, "subsystem", "live-bytes", "peak-bytes", "allocs", "frees");
+	for (int i = 0; i < NUM_ALLOC_TAGS; i++) {
+		alloc_read(i, &usage[i]);
+		printf("%s\t%-10s %12ld %12ld %10ld %10ld\n", LOG_PREFIX, alloc_tag_names[i],
+			usage[i].live, usage[i].peak, usage[i].allocs, usage[i].frees);
+		live += usage[i].live;
+		// the tags peak at different times, this is an upper bound
+		peak += usage[i].peak;
+	}
+	printf("%s\t%-10s %12ld %12ld\n", LOG_PREFIX, "total", live, peak);
+
+	// every live order block is a resting order
+	long resting = usage[MEM_ORDERS].allocs - usage[MEM_ORDERS].frees;
+	printf("%s\tPer resting order: %ld bytes (%ld resting), per trader: %ld bytes\n", LOG_PREFIX,
+		resting > 0 ? usage[MEM_ORDERS].live / resting : 0, resting,
+		num_traders > 0 ? usage[MEM_TRADERS].live / num_traders : 0);
+	fflush(stdout);
+}
@@ -0,0 +1,81 @@
+#ifndef PE_ALLOC_H
+#define PE_ALLOC_H
+
+#include "pe_common.h"
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * Allocation wrappers that count what each part of the exchange holds. Every
+ * block carries a small header with its size and tag, so it must be freed
+ * with pe_free and resized with pe_realloc. Counted are the bytes asked for,
+ * not the allocator's (or the sanitizers') overhead, so the numbers are the
+ * same in sanitized and optimized builds.
+ */
+
+enum alloc_tag {
+	MEM_ORDERS = 0, // resting order nodes
+	MEM_LEDGER, // the matches ledger
+	MEM_PRODUCTS, // product strings, the list of them and the per-product book heads
+	MEM_TRADERS, // trader structs and their order --> product maps
+	MEM_BUFFERS, // event batches and queue cells
+	MEM_REPORTS, // scratch copies of the book made while printing it
+	NUM_ALLOC_TAGS
+};
+
+/*
+ * Desc: The counters of one tag, updated by any thread allocating under it.
+ * Fields: The bytes held now and at most, and the number of blocks
+           allocated and freed.
+ */
+typedef struct alloc_counters alloc_counters;
+struct alloc_counters {
+    _Alignas(64) _Atomic long live;
+    _Atomic long peak;
+    _Atomic long allocs;
+    _Atomic long frees;
+};
+
+/*
+ * Desc: A copy of one tag's counters at some point.
+ * Fields: As in alloc_counters.
+ */
+typedef struct alloc_usage alloc_usage;
+struct alloc_usage {
+    long live;
+    long peak;
+    long allocs;
+    long frees;
+};
+
+extern const char *alloc_tag_names[NUM_ALLOC_TAGS];
+
+/*
+ * Desc: malloc, calloc and realloc counted under a tag. pe_realloc keeps the
+         tag of the block it resizes, the tag only counts when ptr is NULL.
+ * Return: The block, NULL if it could not be allocated.
+ */
+void *pe_malloc(int tag, size_t size);
+void *pe_calloc(int tag, size_t num, size_t size);
+void *pe_realloc(int tag, void *ptr, size_t size);
+
+/*
+ * Desc: Frees a block from pe_malloc, pe_calloc or pe_realloc. NULL is
+         ignored.
+ */
+void pe_free(void *ptr);
+
+/*
+ * Desc: Reads one tag's counters.
+ * Params: The tag, where to store its counters.
+ */
+void alloc_read(int tag, alloc_usage *out);
+
+/*
+ * Desc: Prints the counters of every tag and the bytes held per resting
+         order and per trader.
+ * Params: The number of traders.
+ */
+void alloc_summary(int num_traders);
+
+#endif
@@ -0,0 +1,360 @@
+#include "pe_config.h"
+#include <getopt.h>
+#include <sched.h>
+
+enum option_flag {
+	OPT_REPORT_INTERVAL = 256,
+	OPT_REPORT_EVERY,
+	OPT_SHARDS,
+	OPT_GATEWAYS,
+	OPT_PIN_MAIN,
+	OPT_PIN_SHARDS,
+	OPT_PIN_GATEWAYS,
+	OPT_PIN_TRADERS,
+	OPT_SCHED_FIFO,
+	OPT_CONNECT_TIMEOUT,
+	OPT_ZYGOTE,
+	OPT_JOURNAL,
+	OPT_FSYNC,
+	OPT_SNAPSHOT_INTERVAL,
+	OPT_JOURNAL_SEGMENT,
+	OPT_REPLICATE,
+	OPT_STANDBY,
+	OPT_LATENCY,
+	OPT_CONTROL,
+	OPT_TRACE,
+	OPT_TRACE_EVERY,
+	OPT_PERF_COUNTERS,
+	OPT_MEMORY,
+	OPT_MARKET_DETAIL
+};
+
+static struct option long_options[] = {
+	{"report-interval", required_argument, NULL, OPT_REPORT_INTERVAL},
+	{"report-every", required_argument, NULL, OPT_REPORT_EVERY},
+	{"shards", required_argument, NULL, OPT_SHARDS},
+	{"gateways", required_argument, NULL, OPT_GATEWAYS},
+	{"pin-main", required_argument, NULL, OPT_PIN_MAIN},
+	{"pin-shards", required_argument, NULL, OPT_PIN_SHARDS},
+	{"pin-gateways", required_argument, NULL, OPT_PIN_GATEWAYS},
+	{"pin-traders", required_argument, NULL, OPT_PIN_TRADERS},
+	{"sched-fifo", required_argument, NULL, OPT_SCHED_FIFO},
+	{"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT},
+	{"zygote", no_argument, NULL, OPT_ZYGOTE},
+	{"journal", required_argument, NULL, OPT_JOURNAL},
+	{"fsync", required_argument, NULL, OPT_FSYNC},
+	{"snapshot-interval", required_argument, NULL, OPT_SNAPSHOT_INTERVAL},
+	{"journal-segment", required_argument, NULL, OPT_JOURNAL_SEGMENT},
+	{"replicate", required_argument, NULL, OPT_REPLICATE},
+	{"standby", required_argument, NULL, OPT_STANDBY},
+	{"latency", no_argument, NULL, OPT_LATENCY},
+	{"control", required_argument, NULL, OPT_CONTROL},
+	{"trace", required_argument, NULL, OPT_TRACE},
+	{"trace-every", required_argument, NULL, OPT_TRACE_EVERY},
+	{"perf-counters", no_argument, NULL, OPT_PERF_COUNTERS},
+	{"memory", no_argument, NULL, OPT_MEMORY},
+	{"market-detail", no_argument, NULL, OPT_MARKET_DETAIL},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
+
+/*
+ * Desc: Converts an option argument to a non-negative long.
+ * Params: The string to convert, a pointer to store the result in.
+ * Return: 0 on success, 1 if the string is not a valid non-negative number.
+ */
+static int parse_count(char *str, long *out) {
+	char *end = NULL;
+	errno = 0;
+	long value = strtol(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || value < 0) {
+		return 1;
+	}
+	*out = value;
+	return 0;
+}
+
+/*
+ * Desc: Parses a CPU list of comma separated CPUs and ranges, e.g. "0-3,6".
+ * Params: The string to parse, the list to fill.
+ * Return: 0 on success, 1 if the list is malformed or too long.
+ */
+static int parse_cpu_list(char *str, cpu_list *list) {
+	list->size = 0;
+	char *cursor = str;
+	while (*cursor != '\0') {
+		char *end = NULL;
+		long first = strtol(cursor, &end, 10);
+		long last = first;
+		if (end == cursor || first < 0 || first >= CPU_SETSIZE) {
+			return 1;
+		}
+		if (*end == '-') {
+			cursor = end + 1;
+			last = strtol(cursor, &end, 10);
+			if (end == cursor || last < first || last >= CPU_SETSIZE) {
+				return 1;
+			}
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			if (list->size == MAX_PIN_CPUS) {
+				return 1;
+			}
+			list->cpus[list->size++] = (int)cpu;
+		}
+
+		if (*end == ',') {
+			end++;
+		} else if (*end != '\0') {
+			return 1;
+		}
+		cursor = end;
+	}
+	return list->size == 0;
+}
+
+/*
+ * Desc: Converts an --fsync argument to an enum fsync_policy value.
+ * Params: The string to convert, a pointer to store the result in.
+ * Return: 0 on success, 1 if the policy is unknown.
+ */
+static int parse_fsync_policy(char *str, int *out) {
+	if (strcmp(str, "none") == 0) {
+		*out = FSYNC_NONE;
+	} else if (strcmp(str, "batch") == 0) {
+		*out = FSYNC_BATCH;
+	} else if (strcmp(str, "every") == 0) {
+		*out = FSYNC_EVERY;
+	} else {
+		return 1;
+	}
+	return 0;
+}
+
+int parse_config(int argc, char **argv, exchange_config *cfg) {
+	// defaults reproduce the original behaviour: report after every command
+	cfg->report_interval_ms = 0;
+	cfg->report_every = 1;
+	cfg->num_shards = 0;
+	cfg->num_gateways = 0;
+	cfg->pin_main.size = 0;
+	cfg->pin_shards.size = 0;
+	cfg->pin_gateways.size = 0;
+	cfg->pin_traders.size = 0;
+	cfg->sched_priority = 0;
+	cfg->connect_timeout_ms = DEFAULT_CONNECT_TIMEOUT_MS;
+	cfg->use_zygote = 0;
+	cfg->journal_path = NULL;
+	cfg->fsync_policy = FSYNC_BATCH;
+	cfg->snapshot_interval_ms = DEFAULT_SNAPSHOT_MS;
+	cfg->journal_segment_kb = DEFAULT_JOURNAL_SEGMENT_KB;
+	cfg->replicate_path = NULL;
+	cfg->standby_path = NULL;
+	cfg->record_latency = 0;
+	cfg->control_path = NULL;
+	cfg->trace_path = NULL;
+	cfg->trace_every = DEFAULT_TRACE_EVERY;
+	cfg->perf_counters = 0;
+	cfg->report_memory = 0;
+	cfg->market_detail = 0;
+
+	int every_given = 0;
+	long value = 0;
+	int opt;
+	optind = 1;
+	// '+' stops at the product file so trader arguments are left untouched
+	while ((opt = getopt_long(argc, argv, "+h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_REPORT_INTERVAL:
+			if (parse_count(optarg, &cfg->report_interval_ms)) {
+				return -1;
+			}
+			break;
+		case OPT_REPORT_EVERY:
+			if (parse_count(optarg, &cfg->report_every)) {
+				return -1;
+			}
+			every_given = 1;
+			break;
+		case OPT_SHARDS:
+			if (parse_count(optarg, &value) || value > MAX_SHARDS) {
+				return -1;
+			}
+			cfg->num_shards = (int)value;
+			break;
+		case OPT_GATEWAYS:
+			if (parse_count(optarg, &value) || value > MAX_GATEWAYS) {
+				return -1;
+			}
+			cfg->num_gateways = (int)value;
+			break;
+		case OPT_PIN_MAIN:
+			if (parse_cpu_list(optarg, &cfg->pin_main)) {
+				return -1;
+			}
+			break;
+		case OPT_PIN_SHARDS:
+			if (parse_cpu_list(optarg, &cfg->pin_shards)) {
+				return -1;
+			}
+			break;
+		case OPT_PIN_GATEWAYS:
+			if (parse_cpu_list(optarg, &cfg->pin_gateways)) {
+				return -1;
+			}
+			break;
+		case OPT_PIN_TRADERS:
+			if (parse_cpu_list(optarg, &cfg->pin_traders)) {
+				return -1;
+			}
+			break;
+		case OPT_SCHED_FIFO:
+			if (parse_count(optarg, &value) || value < 1 || value > MAX_SCHED_PRIORITY) {
+				return -1;
+			}
+			cfg->sched_priority = (int)value;
+			break;
+		case OPT_CONNECT_TIMEOUT:
+			if (parse_count(optarg, &cfg->connect_timeout_ms)) {
+				return -1;
+			}
+			break;
+		case OPT_ZYGOTE:
+			cfg->use_zygote = 1;
+			break;
+		case OPT_JOURNAL:
+			cfg->journal_path = optarg;
+			break;
+		case OPT_FSYNC:
+			if (parse_fsync_policy(optarg, &cfg->fsync_policy)) {
+				return -1;
+			}
+			break;
+		case OPT_SNAPSHOT_INTERVAL:
+			if (parse_count(optarg, &cfg->snapshot_interval_ms)) {
+				return -1;
+			}
+			break;
+		case OPT_JOURNAL_SEGMENT:
+			if (parse_count(optarg, &cfg->journal_segment_kb) || cfg->journal_segment_kb < 1
+					|| cfg->journal_segment_kb > MAX_JOURNAL_SEGMENT_KB) {
+				return -1;
+			}
+			break;
+		case OPT_REPLICATE:
+			cfg->replicate_path = optarg;
+			break;
+		case OPT_STANDBY:
+			cfg->standby_path = optarg;
+			break;
+		case OPT_LATENCY:
+			cfg->record_latency = 1;
+			break;
+		case OPT_CONTROL:
+			cfg->control_path = optarg;
+			break;
+		case OPT_TRACE:
+			cfg->trace_path = optarg;
+			break;
+		case OPT_TRACE_EVERY:
+			if (parse_count(optarg, &cfg->trace_every) || cfg->trace_every < 1) {
+				return -1;
+			}
+			break;
+		case OPT_PERF_COUNTERS:
+			cfg->perf_counters = 1;
+			break;
+		case OPT_MEMORY:
+			cfg->report_memory = 1;
+			break;
+		case OPT_MARKET_DETAIL:
+			cfg->market_detail = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	// replication streams the journal, a standby keeps its own
+	if ((cfg->replicate_path != NULL || cfg->standby_path != NULL) && cfg->journal_path == NULL) {
+		return -1;
+	}
+
+	// gateways and matching threads only make sense together
+	if (cfg->num_gateways > 0 && cfg->num_shards == 0) {
+		cfg->num_shards = 1;
+	} else if (cfg->num_shards > 0 && cfg->num_gateways == 0) {
+		cfg->num_gateways = 1;
+	}
+
+	// matching threads run ahead of the main loop, so a per-command report
+	// can't line up with the commands; snapshot periodically instead
+	if (cfg->num_shards > 0 && every_given && cfg->report_every > 0) {
+		return -1;
+	}
+	if (cfg->num_shards > 0 && cfg->report_interval_ms == 0 && !every_given) {
+		cfg->report_interval_ms = DEFAULT_SHARD_REPORT_MS;
+	}
+
+	// a timer on its own replaces the per-command reports
+	if (cfg->report_interval_ms > 0 && !every_given) {
+		cfg->report_every = 0;
+	}
+
+	return optind;
+}
+
+int placement_configured(exchange_config *cfg) {
+	return cfg->pin_main.size > 0 || cfg->pin_shards.size > 0 || cfg->pin_gateways.size > 0
+		|| cfg->pin_traders.size > 0 || cfg->sched_priority > 0;
+}
+
+void print_usage(char *prog) {
+	printf("Usage: %s [options] <product file> <trader> [trader ...]\n", prog);
+	printf("Options:\n");
+	printf("  --report-interval=MS  print the orderbook and positions every MS milliseconds\n");
+	printf("  --report-every=N      print the orderbook and positions every N commands\n");
+	printf("                        (default 1, or 0 when --report-interval is given)\n");
+	printf("  --shards=N            match products on N threads, product i on thread i %% N\n");
+	printf("                        (default 0: match on the main thread; implies\n");
+	printf("                        --report-interval=%d unless a report option is given,\n", DEFAULT_SHARD_REPORT_MS);
+	printf("                        --report-every can't be used with it)\n");
+	printf("  --gateways=N          read and write trader fifos on N threads, trader i on\n");
+	printf("                        thread i %% N (default 1 with --shards, implies --shards=1)\n");
+	printf("  --pin-main=CPUS       pin the main thread to the first CPU of CPUS (e.g. 0-3,6)\n");
+	printf("  --pin-shards=CPUS     pin matching thread i to the i-th CPU of CPUS, round-robin\n");
+	printf("  --pin-gateways=CPUS   pin gateway thread i to the i-th CPU of CPUS, round-robin\n");
+	printf("  --pin-traders=CPUS    pin trader i to the i-th CPU of CPUS, round-robin\n");
+	printf("  --sched-fifo=PRIO     run exchange threads as SCHED_FIFO with priority PRIO (1-99)\n");
+	printf("  --connect-timeout=MS  leave out traders that haven't opened their fifos after MS\n");
+	printf("                        milliseconds (default %d, 0 waits forever)\n", DEFAULT_CONNECT_TIMEOUT_MS);
+	printf("  --zygote              launch traders from a helper forked at startup instead of\n");
+	printf("                        posix_spawn from the exchange\n");
+	printf("  --journal=PATH        write every accepted command to a journal at PATH before\n");
+	printf("                        its responses are sent; an existing journal is recovered\n");
+	printf("  --fsync=POLICY        how journal writes reach the disk: none, batch (one\n");
+	printf("                        msync per group of commands, default) or every\n");
+	printf("  --journal-segment=KB  preallocate the journal in segment files of KB KiB\n");
+	printf("                        (default %d)\n", DEFAULT_JOURNAL_SEGMENT_KB);
+	printf("  --replicate=SOCKET    stream the journal to a standby connecting on the Unix\n");
+	printf("                        socket SOCKET (needs --journal)\n");
+	printf("  --standby=SOCKET      follow the primary on SOCKET and only launch the traders\n");
+	printf("                        if it dies (needs --journal)\n");
+	printf("  --latency             record latency histograms from reading each command to\n");
+	printf("                        writing its response, printed at exit and on SIGUSR2\n");
+	printf("  --control=SOCKET      answer stats, book, trader and histograms queries on the\n");
+	printf("                        Unix socket SOCKET while trading\n");
+	printf("  --trace=FILE          write spans of command processing, match sweeps and\n");
+	printf("                        outbound flushes to FILE as Chrome trace-event JSON\n");
+	printf("  --trace-every=N       trace every N-th command and flush of each thread\n");
+	printf("                        (default %d)\n", DEFAULT_TRACE_EVERY);
+	printf("  --perf-counters       count cycles, instructions, cache and branch misses per\n");
+	printf("                        stage with perf_event_open, printed per million commands\n");
+	printf("  --memory              print the bytes held per subsystem, per resting order and\n");
+	printf("                        per trader at exit\n");
+	printf("  --market-detail       append the quantity and price an order had before to\n");
+	printf("                        MARKET lines (0 0 for new orders), so traders can keep\n");
+	printf("                        an exact book\n");
+	printf("  --snapshot-interval=MS  snapshot the exchange state to PATH.snap every MS\n");
+	printf("                        milliseconds (default %d, 0 disables)\n", DEFAULT_SNAPSHOT_MS);
+}
@@ -0,0 +1,95 @@
+#ifndef PE_CONFIG_H
+#define PE_CONFIG_H
+
+#include "pe_common.h"
+#include "pe_trace.h"
+
+#define MAX_SHARDS 64
+#define MAX_GATEWAYS 64
+#define MAX_PIN_CPUS 256 // entries in a --pin-* CPU list
+#define MAX_SCHED_PRIORITY 99
+#define DEFAULT_CONNECT_TIMEOUT_MS 10000 // how long traders get to open their fifos
+#define DEFAULT_SHARD_REPORT_MS 1000 // snapshot period when matching is threaded
+#define DEFAULT_SNAPSHOT_MS 60000 // state snapshot period when journaling
+#define DEFAULT_JOURNAL_SEGMENT_KB 65536 // size of each preallocated journal segment
+#define MAX_JOURNAL_SEGMENT_KB 16777216
+
+enum fsync_policy {
+    FSYNC_NONE = 0, // never synced, the page cache decides
+    FSYNC_BATCH, // one msync per group of journal records
+    FSYNC_EVERY // one msync per journal record
+};
+
+/*
+ * Desc: A CPU list given to a --pin-* option, e.g. "0-3,6".
+ * Fields: The number of CPUs in the list and the CPUs in the order given.
+ */
+typedef struct cpu_list cpu_list;
+struct cpu_list {
+    int size; // 0 --> leave unpinned
+    int cpus[MAX_PIN_CPUS];
+};
+
+/*
+ * Desc: Startup configuration for pe_exchange, filled from the command line
+         options given before the product file.
+ * Fields: The reporting policy, the number of matching and gateway threads,
+           where threads and traders are placed, how traders are launched,
+           the trader connect timeout, the journal, replication, latency
+           recording, the control socket, tracing, hardware counters, the
+           memory summary and the MARKET message format.
+           With the defaults the
+           orderbook and positions are printed after every command and
+           everything runs on the main thread wherever the scheduler likes.
+ */
+typedef struct exchange_config exchange_config;
+struct exchange_config {
+    long report_interval_ms; // period of the snapshot timer, 0 --> no timer
+    long report_every; // report after this many commands, 0 --> never
+    int num_shards; // matching threads, 0 --> match on the main thread
+    int num_gateways; // trader I/O threads, only used with matching threads
+    cpu_list pin_main; // CPUs for the main thread
+    cpu_list pin_shards; // CPUs for the matching threads, round-robin
+    cpu_list pin_gateways; // CPUs for the gateway threads, round-robin
+    cpu_list pin_traders; // CPUs for the trader processes, round-robin
+    int sched_priority; // SCHED_FIFO priority for exchange threads, 0 --> default policy
+    long connect_timeout_ms; // traders not connected by then are left out, 0 --> wait forever
+    int use_zygote; // launch traders from a pre-forked helper instead of posix_spawn
+    char *journal_path; // write-ahead journal of accepted commands, NULL --> none
+    int fsync_policy; // enum fsync_policy, how journal writes are made durable
+    long snapshot_interval_ms; // period of state snapshots next to the journal, 0 --> none
+    long journal_segment_kb; // size of each journal segment file
+    char *replicate_path; // Unix socket a standby follows the journal on, NULL --> none
+    char *standby_path; // run as a standby of the primary on this socket, NULL --> primary
+    int record_latency; // keep read-to-response latency histograms
+    char *control_path; // Unix socket answering live queries, NULL --> none
+    char *trace_path; // Chrome trace-event JSON written at exit, NULL --> not tracing
+    long trace_every; // trace every N-th command and flush of each thread
+    int perf_counters; // count hardware events per stage with perf_event_open
+    int report_memory; // print the bytes held per subsystem at exit
+    int market_detail; // MARKET lines also carry what an amend or cancel removed
+};
+
+/*
+ * Desc: Parses the leading options of the pe_exchange command line into cfg.
+         Parsing stops at the first non-option argument (the product file).
+ * Params: The argument count and vector given to main, a pointer to the
+           config struct to fill.
+ * Return: The index of the first positional argument, -1 on invalid options.
+ */
+int parse_config(int argc, char **argv, exchange_config *cfg);
+
+/*
+ * Desc: Tells whether any placement option (--pin-*, --sched-fifo) was given.
+ * Params: A pointer to the parsed config.
+ * Return: 1 if placement was configured, 0 otherwise.
+ */
+int placement_configured(exchange_config *cfg);
+
+/*
+ * Desc: Prints the usage message and the supported options to stdout.
+ * Params: The name the program was invoked with.
+ */
+void print_usage(char *prog);
+
+#endif
@@ -0,0 +1,446 @@
+#include "pe_control.h"
+#include "pe_shard.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+
+static const char *side_names[2] = {"buy", "sell"};
+static const char *command_names[4] = {"buy", "sell", "amend", "cancel"};
+
+/*
+ * Desc: Milliseconds elapsed on CLOCK_MONOTONIC since a point in time.
+ */
+static long elapsed_ms(struct timespec *since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/*
+ * Desc: Sums the commands every shard has applied; inline, the main loop
+         counts them on shard 0.
+ */
+static long commands_applied(exchange *ex) {
+	return shards_processed(ex->shards, ex->num_shards > 0 ? ex->num_shards : 1);
+}
+
+/*
+ * Desc: Measures the command rate since the last sample.
+ */
+static void take_sample(control_server *ctl) {
+	long ms = elapsed_ms(&ctl->sampled);
+	long commands = commands_applied(ctl->ex);
+	if (ms > 0) {
+		ctl->command_rate = (commands - ctl->sampled_commands) * 1000.0 / ms;
+	}
+	ctl->sampled_commands = commands;
+	clock_gettime(CLOCK_MONOTONIC, &ctl->sampled);
+}
+
+/*
+ * Desc: Prints an error answer.
+ */
+static void answer_error(FILE *out, int json, const char *message) {
+	if (json) {
+		fprintf(out, "{\"error\":\"%s\"}\n", message);
+	} else {
+		fprintf(out, "error: %s\n", message);
+	}
+}
+
+/*
+ * Desc: Answers stats: command counts and rates, traders, totals over every
+         book, the queues between threads and the memory held per subsystem.
+ */
+static void answer_stats(control_server *ctl, FILE *out, int json) {
+	exchange *ex = ctl->ex;
+	int connected = 0;
+	for (trader *cursor = ex->head; cursor != NULL; cursor = cursor->next) {
+		connected += !atomic_load_explicit(&cursor->disconnected, memory_order_relaxed);
+	}
+	long totals[5] = {0, 0, 0, 0, 0}; // resting buys, resting sells, trades, volume, turnover
+	for (int p = 0; p < ex->prods.size; p++) {
+		book_stats *stats = &ex->stats[p];
+		totals[0] += atomic_load_explicit(&stats->orders[BUY], memory_order_relaxed);
+		totals[1] += atomic_load_explicit(&stats->orders[SELL], memory_order_relaxed);
+		totals[2] += atomic_load_explicit(&stats->trades, memory_order_relaxed);
+		totals[3] += atomic_load_explicit(&stats->volume, memory_order_relaxed);
+		totals[4] += atomic_load_explicit(&stats->turnover, memory_order_relaxed);
+	}
+	long uptime = elapsed_ms(&ctl->started);
+	long commands = commands_applied(ex);
+	int shard_count = ex->num_shards > 0 ? ex->num_shards : 1;
+	alloc_usage memory[NUM_ALLOC_TAGS];
+	for (int i = 0; i < NUM_ALLOC_TAGS; i++) {
+		alloc_read(i, &memory[i]);
+	}
+	long resting = totals[0] + totals[1];
+	long per_order = resting > 0 ? memory[MEM_ORDERS].live / resting : 0;
+	long per_trader = ex->num_traders > 0 ? memory[MEM_TRADERS].live / ex->num_traders : 0;
+
+	if (!json) {
+		fprintf(out, "uptime_ms: %ld\n", uptime);
+		fprintf(out, "commands: %ld\n", commands);
+		fprintf(out, "commands_per_sec: %.1f\n", ctl->command_rate);
+		fprintf(out, "traders: %d connected %d\n", ex->num_traders, connected);
+		fprintf(out, "resting_orders: buy %ld sell %ld\n", totals[0], totals[1]);
+		fprintf(out, "trades: %ld volume %ld turnover %ld\n", totals[2], totals[3], totals[4]);
+		for (int i = 0; i < shard_count; i++) {
+			fprintf(out, "shard %d: processed %ld queued %zu\n", i,
+				atomic_load_explicit(&ex->shards[i].processed, memory_order_relaxed),
+				mpsc_length(&ex->shards[i].inbound));
+		}
+		for (int i = 0; i < ex->gateways.size; i++) {
+			fprintf(out, "gateway %d: queued %zu\n", i, mpsc_length(&ex->gateways.list[i].outbound));
+		}
+		if (ex->jrnl.current.fd != -1) {
+			fprintf(out, "journal_committed: %llu\n", (unsigned long long)journal_committed_seq(&ex->jrnl));
+		}
+		for (int i = 0; i < NUM_ALLOC_TAGS; i++) {
+			fprintf(out, "memory %s: live %ld peak %ld allocs %ld frees %ld\n", alloc_tag_names[i],
+				memory[i].live, memory[i].peak, memory[i].allocs, memory[i].frees);
+		}
+		fprintf(out, "memory_per_order: %ld\n", per_order);
+		fprintf(out, "memory_per_trader: %ld\n", per_trader);
+		return;
+	}
+
+	fprintf(out, "{\"uptime_ms\":%ld,\"commands\":%ld,\"commands_per_sec\":%.1f,\"traders\":%d,\"connected\":%d,"
+		"\"resting_orders\":{\"buy\":%ld,\"sell\":%ld},\"trades\":%ld,\"volume\":%ld,\"turnover\":%ld,\"shards\":[",
+		uptime, commands, ctl->command_rate, ex->num_traders, connected, totals[0], totals[1], totals[2],
+		totals[3], totals[4]);
+	for (int i = 0; i < shard_count; i++) {
+		fprintf(out, "%s{\"processed\":%ld,\"queued\":%zu}", i > 0 ? "," : "",
+			atomic_load_explicit(&ex->shards[i].processed, memory_order_relaxed),
+			mpsc_length(&ex->shards[i].inbound));
+	}
+	fprintf(out, "],\"gateways\":[");
+	for (int i = 0; i < ex->gateways.size; i++) {
+		fprintf(out, "%s{\"queued\":%zu}", i > 0 ? "," : "", mpsc_length(&ex->gateways.list[i].outbound));
+	}
+	fprintf(out, "]");
+	if (ex->jrnl.current.fd != -1) {
+		fprintf(out, ",\"journal_committed\":%llu", (unsigned long long)journal_committed_seq(&ex->jrnl));
+	}
+	fprintf(out, ",\"memory\":{");
+	for (int i = 0; i < NUM_ALLOC_TAGS; i++) {
+		fprintf(out, "\"%s\":{\"live\":%ld,\"peak\":%ld,\"allocs\":%ld,\"frees\":%ld},", alloc_tag_names[i],
+			memory[i].live, memory[i].peak, memory[i].allocs, memory[i].frees);
+	}
+	fprintf(out, "\"per_order\":%ld,\"per_trader\":%ld}}\n", per_order, per_trader);
+}
+
+/*
+ * Desc: Answers book <product>: both sides of the product's book and what
+         has traded on it.
+ */
+static void answer_book(control_server *ctl, FILE *out, int json, char *product) {
+	exchange *ex = ctl->ex;
+	int p = product != NULL ? get_product_index(&ex->prods, product) : -1;
+	if (p < 0) {
+		answer_error(out, json, "unknown product");
+		return;
+	}
+	book_stats *stats = &ex->stats[p];
+	long orders[2];
+	long quantity[2];
+	long best[2];
+	for (int side = BUY; side <= SELL; side++) {
+		orders[side] = atomic_load_explicit(&stats->orders[side], memory_order_relaxed);
+		quantity[side] = atomic_load_explicit(&stats->quantity[side], memory_order_relaxed);
+		best[side] = atomic_load_explicit(&stats->best_price[side], memory_order_relaxed);
+	}
+	long trades = atomic_load_explicit(&stats->trades, memory_order_relaxed);
+	long volume = atomic_load_explicit(&stats->volume, memory_order_relaxed);
+	long turnover = atomic_load_explicit(&stats->turnover, memory_order_relaxed);
+
+	if (!json) {
+		fprintf(out, "product: %s\n", ex->prods.product_strings[p]);
+		for (int side = BUY; side <= SELL; side++) {
+			fprintf(out, "%s: orders %ld quantity %ld best ", side_names[side], orders[side], quantity[side]);
+			if (best[side] > 0) {
+				fprintf(out, "%ld\n", best[side]);
+			} else {
+				fprintf(out, "-\n");
+			}
+		}
+		fprintf(out, "trades: %ld volume %ld turnover %ld\n", trades, volume, turnover);
+		return;
+	}
+
+	fprintf(out, "{\"product\":\"%s\"", ex->prods.product_strings[p]);
+	for (int side = BUY; side <= SELL; side++) {
+		fprintf(out, ",\"%s\":{\"orders\":%ld,\"quantity\":%ld,\"best\":", side_names[side], orders[side],
+			quantity[side]);
+		if (best[side] > 0) {
+			fprintf(out, "%ld}", best[side]);
+		} else {
+			fprintf(out, "null}");
+		}
+	}
+	fprintf(out, ",\"trades\":%ld,\"volume\":%ld,\"turnover\":%ld}\n", trades, volume, turnover);
+}
+
+/*
+ * Desc: Answers trader <id>: the commands the trader sent and its fills on
+         every shard.
+ */
+static void answer_trader(control_server *ctl, FILE *out, int json, char *id) {
+	exchange *ex = ctl->ex;
+	char *end = NULL;
+	long trader_id = id != NULL ? strtol(id, &end, 10) : -1;
+	trader *t = NULL;
+	if (id != NULL && *end == '\0' && trader_id >= 0 && trader_id < ex->num_traders) {
+		t = get_trader(-1, (int)trader_id, ex->head);
+	}
+	if (t == NULL) {
+		answer_error(out, json, "unknown trader");
+		return;
+	}
+	long commands[4];
+	for (int i = 0; i < 4; i++) {
+		commands[i] = atomic_load_explicit(&t->commands[i], memory_order_relaxed);
+	}
+	long rejected = atomic_load_explicit(&t->rejected, memory_order_relaxed);
+	long fills = 0;
+	long bought = 0;
+	long sold = 0;
+	int shard_count = ex->num_shards > 0 ? ex->num_shards : 1;
+	for (int i = 0; i < shard_count; i++) {
+		fill_stats *f = &ex->shards[i].fills[t->trader_id];
+		fills += atomic_load_explicit(&f->fills, memory_order_relaxed);
+		bought += atomic_load_explicit(&f->bought, memory_order_relaxed);
+		sold += atomic_load_explicit(&f->sold, memory_order_relaxed);
+	}
+	int connected = !atomic_load_explicit(&t->disconnected, memory_order_relaxed);
+
+	if (!json) {
+		fprintf(out, "trader: %d\n", t->trader_id);
+		fprintf(out, "connected: %s\n", connected ? "yes" : "no");
+		for (int i = 0; i < 4; i++) {
+			fprintf(out, "%s: %ld\n", command_names[i], commands[i]);
+		}
+		fprintf(out, "rejected: %ld\n", rejected);
+		fprintf(out, "fills: %ld bought %ld sold %ld\n", fills, bought, sold);
+		return;
+	}
+
+	fprintf(out, "{\"trader\":%d,\"connected\":%s", t->trader_id, connected ? "true" : "false");
+	for (int i = 0; i < 4; i++) {
+		fprintf(out, ",\"%s\":%ld", command_names[i], commands[i]);
+	}
+	fprintf(out, ",\"rejected\":%ld,\"fills\":%ld,\"bought\":%ld,\"sold\":%ld}\n", rejected, fills, bought, sold);
+}
+
+/*
+ * Desc: Answers one query line. A trailing "json" asks for the answer as one
+         line of JSON; a text answer ends with an empty line.
+ * Params: The control server, the query and the stream to answer into.
+ */
+static void answer_query(control_server *ctl, char *line, FILE *out) {
+	char *words[4];
+	int num_words = 0;
+	char *save = NULL;
+	for (char *word = strtok_r(line, " \t\r", &save); word != NULL && num_words < 4;
+			word = strtok_r(NULL, " \t\r", &save)) {
+		words[num_words++] = word;
+	}
+	int json = num_words > 1 && strcmp(words[num_words - 1], "json") == 0;
+	num_words -= json;
+	char *arg = num_words > 1 ? words[1] : NULL;
+
+	if (num_words == 0) {
+		answer_error(out, json, "empty query");
+	} else if (strcmp(words[0], "stats") == 0) {
+		answer_stats(ctl, out, json);
+	} else if (strcmp(words[0], "book") == 0) {
+		answer_book(ctl, out, json, arg);
+	} else if (strcmp(words[0], "trader") == 0) {
+		answer_trader(ctl, out, json, arg);
+	} else if (strcmp(words[0], "histograms") == 0) {
+		if (ctl->ex->latency == NULL) {
+			answer_error(out, json, "latency isn't recorded, start the exchange with --latency");
+		} else {
+			report_latency(ctl->ex, out, json);
+		}
+	} else if (strcmp(words[0], "help") == 0 && !json) {
+		fprintf(out, "stats | book <product> | trader <id> | histograms, add json for JSON\n");
+	} else {
+		answer_error(out, json, "unknown query, try help");
+	}
+	if (!json) {
+		fprintf(out, "\n");
+	}
+}
+
+/*
+ * Desc: Closes a client's connection and frees its slot.
+ */
+static void drop_client(control_client *c) {
+	close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+}
+
+/*
+ * Desc: Reads what a client sent and answers every complete line in it.
+ * Return: 0 if the client is still connected, 1 if it was dropped.
+ */
+static int serve_client(control_server *ctl, control_client *c) {
+	ssize_t got = recv(c->fd, c->buf + c->len, CONTROL_LINE_SIZE - c->len, MSG_DONTWAIT);
+	if (got < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return 0;
+	} else if (got <= 0) {
+		drop_client(c);
+		return 1;
+	}
+	c->len += got;
+
+	int start = 0;
+	for (int i = 0; i < c->len; i++) {
+		if (c->buf[i] != '\n') {
+			continue;
+		}
+		c->buf[i] = '\0';
+		char *answer = NULL;
+		size_t answer_len = 0;
+		FILE *out = open_memstream(&answer, &answer_len);
+		if (out == NULL) {
+			drop_client(c);
+			return 1;
+		}
+		answer_query(ctl, c->buf + start, out);
+		fclose(out);
+		int res = send_all(c->fd, answer, answer_len);
+		free(answer);
+		if (res) {
+			drop_client(c);
+			return 1;
+		}
+		start = i + 1;
+	}
+	c->len -= start;
+	memmove(c->buf, c->buf + start, c->len);
+	if (c->len == CONTROL_LINE_SIZE) {
+		// a query can't be that long
+		drop_client(c);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Desc: Control thread: accepts clients and answers their queries until
+         stopped, sampling the command rate in between.
+ * Params: The control server, passed as void* by pthread_create.
+ */
+static void *control_main(void *arg) {
+	control_server *ctl = (control_server*)arg;
+	struct timeval timeout = {CONTROL_SEND_TIMEOUT_MS / 1000, (CONTROL_SEND_TIMEOUT_MS % 1000) * 1000};
+	struct pollfd fds[CONTROL_MAX_CLIENTS + 2];
+	while (1) {
+		// the listening socket is only watched while there is a free slot
+		int free_slot = -1;
+		int num_fds = 1;
+		fds[0] = (struct pollfd){ctl->stop_fd, POLLIN, 0};
+		for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+			if (ctl->clients[i].fd == -1) {
+				free_slot = free_slot == -1 ? i : free_slot;
+			} else {
+				fds[num_fds++] = (struct pollfd){ctl->clients[i].fd, POLLIN, 0};
+			}
+		}
+		if (free_slot != -1) {
+			fds[num_fds++] = (struct pollfd){ctl->listen_fd, POLLIN, 0};
+		}
+
+		long wait_ms = CONTROL_SAMPLE_MS - elapsed_ms(&ctl->sampled);
+		int ready = poll(fds, num_fds, wait_ms > 0 ? (int)wait_ms : 0);
+		if (elapsed_ms(&ctl->sampled) >= CONTROL_SAMPLE_MS) {
+			take_sample(ctl);
+		}
+		if (ready <= 0) {
+			continue;
+		}
+		if (fds[0].revents & POLLIN) {
+			break;
+		}
+
+		for (int i = 1; i < num_fds; i++) {
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			if (fds[i].fd == ctl->listen_fd) {
+				int conn = accept4(ctl->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+				if (conn != -1) {
+					setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+					ctl->clients[free_slot].fd = conn;
+					ctl->clients[free_slot].len = 0;
+				}
+				continue;
+			}
+			for (int c = 0; c < CONTROL_MAX_CLIENTS; c++) {
+				if (ctl->clients[c].fd == fds[i].fd) {
+					serve_client(ctl, &ctl->clients[c]);
+					break;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+int start_control(control_server *ctl, char *sock_path, exchange *ex) {
+	if (strlen(sock_path) >= sizeof(ctl->path)) {
+		errno = ENAMETOOLONG;
+		return 1;
+	}
+	strcpy(ctl->path, sock_path);
+	ctl->ex = ex;
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		ctl->clients[i].fd = -1;
+		ctl->clients[i].len = 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ctl->started);
+	ctl->sampled = ctl->started;
+	ctl->sampled_commands = commands_applied(ex);
+	ctl->command_rate = 0;
+	ctl->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ctl->stop_fd == -1) {
+		return 1;
+	}
+
+	ctl->listen_fd = listen_socket(sock_path, CONTROL_MAX_CLIENTS);
+	if (ctl->listen_fd == -1 || pthread_create(&ctl->thread, NULL, control_main, ctl) != 0) {
+		int err = errno;
+		close(ctl->stop_fd);
+		if (ctl->listen_fd != -1) {
+			close(ctl->listen_fd);
+			unlink(sock_path);
+			ctl->listen_fd = -1;
+		}
+		errno = err;
+		return 1;
+	}
+	return 0;
+}
+
+void stop_control(control_server *ctl) {
+	if (ctl->listen_fd == -1) {
+		return;
+	}
+	uint64_t one = 1;
+	write(ctl->stop_fd, &one, sizeof(one));
+	pthread_join(ctl->thread, NULL);
+
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		if (ctl->clients[i].fd != -1) {
+			drop_client(&ctl->clients[i]);
+		}
+	}
+	close(ctl->stop_fd);
+	close(ctl->listen_fd);
+	unlink(ctl->path);
+	ctl->listen_fd = -1;
+}
@@ -0,0 +1,65 @@
+#ifndef PE_CONTROL_H
+#define PE_CONTROL_H
+
+#include "pe_exchange.h"
+#include "pe_socket.h"
+
+#define CONTROL_MAX_CLIENTS 8 // connections served at once, more wait in the backlog
+#define CONTROL_LINE_SIZE 256 // longest query line
+#define CONTROL_SEND_TIMEOUT_MS 1000 // a client that takes longer to read its answer is dropped
+#define CONTROL_SAMPLE_MS 1000 // period the command rate is measured over
+
+/*
+ * Desc: A connection to the control socket.
+ * Fields: Its socket and the part of a query line read so far.
+ */
+typedef struct control_client control_client;
+struct control_client {
+    int fd; // -1 --> slot free
+    char buf[CONTROL_LINE_SIZE];
+    int len;
+};
+
+/*
+ * Desc: Answers queries about the running exchange on a Unix domain socket,
+         one line per query, from its own thread. Every answer is read from
+         counters the threads applying commands keep as they go (atomics
+         with a single writer each) and from the latency histograms, so a
+         query never takes a shard lock or touches a book and matching
+         carries on at full speed while it is served.
+ * Fields: The socket path and listening socket, the eventfd that stops the
+           thread, the exchange, the connected clients, the thread, when it
+           started and the last sample of the command count with the rate
+           measured up to it.
+ */
+typedef struct control_server control_server;
+struct control_server {
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int listen_fd; // -1 --> no control socket
+    int stop_fd;
+    exchange *ex;
+    control_client clients[CONTROL_MAX_CLIENTS];
+    pthread_t thread;
+    struct timespec started;
+    struct timespec sampled;
+    long sampled_commands;
+    double command_rate; // commands per second over the last sample period
+};
+
+/*
+ * Desc: Listens on the control socket and starts the thread answering it.
+         The exchange's live counters must be set up and the trader list
+         complete.
+ * Params: The control server, the socket path and the exchange.
+ * Return: 0 on success, 1 if the socket or thread could not be set up.
+ */
+int start_control(control_server *ctl, char *sock_path, exchange *ex);
+
+/*
+ * Desc: Closes every client, joins the thread and removes the socket. Does
+         nothing if the control socket isn't running.
+ * Params: The control server.
+ */
+void stop_control(control_server *ctl);
+
+#endif
@@ -0,0 +1,72 @@
+#include "pe_cycles.h"
+#include "pe_engine.h"
+
+#ifdef PEX_CYCLES
+#include <pthread.h>
+
+_Thread_local cycle_counters *thread_cycles = NULL;
+
+static cycle_counters *all_threads = NULL;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *stage_names[NUM_CYCLE_STAGES] = {
+	"other", "wait", "read", "log", "decode", "parse", "validate", "route",
+	"book", "match", "journal", "broadcast", "report"
+};
+
+void cycles_thread(const char *kind, int index) {
+	cycle_counters *c = (cycle_counters*)calloc(1, sizeof(cycle_counters));
+	if (c == NULL) {
+		// nothing is recorded for this thread then
+		static _Thread_local cycle_counters fallback;
+		c = &fallback;
+	}
+	if (index >= 0) {
+		snprintf(c->name, sizeof(c->name), "%s %d", kind, index);
+	} else {
+		snprintf(c->name, sizeof(c->name), "%s", kind);
+	}
+	c->stage = CYCLES_OTHER;
+	c->since = cycles_now();
+	thread_cycles = c;
+
+	// appended so the summary lists threads in the order they started
+	pthread_mutex_lock(&threads_lock);
+	cycle_counters **tail = &all_threads;
+	while (*tail != NULL) {
+		tail = &(*tail)->next;
+	}
+	*tail = c;
+	pthread_mutex_unlock(&threads_lock);
+}
+
+void cycles_summary(void) {
+	// close the calling thread's current stage so it is counted too
+	if (thread_cycles != NULL) {
+		cycles_switch(thread_cycles->stage, 0);
+	}
+
+	printf("%s\t--CYCLES--\n", LOG_PREFIX);
+	printf("%s\t%-14s %-10s %12s %16s %12s %7s\n", LOG_PREFIX, "thread", "stage", "entries",
+		"cycles", "cycles/entry", "share");
+	pthread_mutex_lock(&threads_lock);
+	for (cycle_counters *c = all_threads; c != NULL; c = c->next) {
+		uint64_t total = 0;
+		for (int i = 0; i < NUM_CYCLE_STAGES; i++) {
+			total += c->cycles[i];
+		}
+		for (int i = 0; i < NUM_CYCLE_STAGES; i++) {
+			if (c->cycles[i] == 0) {
+				continue;
+			}
+			printf("%s\t%-14s %-10s %12llu %16llu %12.1f %6.2f%%\n", LOG_PREFIX, c->name, stage_names[i],
+				(unsigned long long)c->entries[i], (unsigned long long)c->cycles[i],
+				c->entries[i] > 0 ? (double)c->cycles[i] / c->entries[i] : 0.0,
+				total > 0 ? 100.0 * c->cycles[i] / total : 0.0);
+		}
+	}
+	pthread_mutex_unlock(&threads_lock);
+	fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef PE_CYCLES_H
+#define PE_CYCLES_H
+
+#include "pe_common.h"
+#include <stdint.h>
+
+/*
+ * Per-stage cycle accounting, built in with -DPEX_CYCLES (make CYCLES=1).
+ * Each thread is always in exactly one stage; CYCLES_TIME switches to a
+ * stage around a statement and back, charging the cycles since the last
+ * switch to the stage that was running. Nested stages are charged
+ * exclusively, e.g. the broadcast inside a book update isn't counted twice.
+ * The same switches charge hardware counters to stages when they are turned
+ * on at runtime (see pe_perf.h). Without PEX_CYCLES and with the counters
+ * off, the macros cost a predictable branch around the statement.
+ */
+
+enum cycle_stage {
+	CYCLES_OTHER = 0, // anything not instrumented
+	CYCLES_WAIT, // epoll_wait and queue waits
+	CYCLES_READ, // reading and framing trader fifos
+	CYCLES_LOG, // printing the Parsing command line
+	CYCLES_DECODE, // determine_cmd_type
+	CYCLES_PARSE, // parse_command
+	CYCLES_VALIDATE, // validate_command
+	CYCLES_ROUTE, // pushing a command to a matching thread
+	CYCLES_BOOK, // execute_command: inserting, amending and cancelling orders
+	CYCLES_MATCH, // find_matches
+	CYCLES_JOURNAL, // journal_add and journal_commit
+	CYCLES_BROADCAST, // handing events on, formatting and writing them to traders
+	CYCLES_REPORT, // orderbook and positions reports
+	NUM_CYCLE_STAGES
+};
+
+// hardware counters, see pe_perf.h
+extern int perf_enabled;
+
+/*
+ * Desc: Charges what the calling thread's hardware counters advanced since
+         the last switch to its current stage and moves it to another one.
+ * Params: The stage to switch to.
+ * Return: The stage the thread was in.
+ */
+int perf_switch(int stage);
+
+/*
+ * Desc: Opens the calling thread's hardware counters and registers them
+         under a name. Does nothing when the counters are off.
+ * Params: The kind of thread and its index (-1 --> none).
+ */
+void perf_thread_start(const char *kind, int index);
+
+#ifdef PEX_CYCLES
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles_now() __rdtsc()
+#else
+#include <time.h>
+static inline uint64_t cycles_now(void) {
+	// no TSC, count nanoseconds instead
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+/*
+ * Desc: One thread's cycle counters, linked into a global list so the
+         summary can find every thread's.
+ * Fields: The thread's name, the cycles charged to and the number of
+           switches into each stage, the stage it is in and when it got
+           there.
+ */
+typedef struct cycle_counters cycle_counters;
+struct cycle_counters {
+    char name[32];
+    uint64_t cycles[NUM_CYCLE_STAGES];
+    uint64_t entries[NUM_CYCLE_STAGES];
+    int stage;
+    uint64_t since;
+    cycle_counters *next;
+};
+
+extern _Thread_local cycle_counters *thread_cycles;
+
+/*
+ * Desc: Registers the calling thread's counters under a name.
+ * Params: The kind of thread and its index (-1 --> none).
+ */
+void cycles_thread(const char *kind, int index);
+
+/*
+ * Desc: Prints a table of where every registered thread's cycles went.
+         Other threads must have exited or be idle.
+ */
+void cycles_summary(void);
+
+/*
+ * Desc: Charges the cycles since the last switch to the current stage and
+         moves the thread to another one.
+ * Params: The stage to switch to and whether this counts as an entry into
+           it (returning to an outer stage doesn't).
+ * Return: The stage the thread was in.
+ */
+static inline int cycles_switch(int stage, int entry) {
+	if (thread_cycles == NULL) {
+		cycles_thread("thread", -1);
+	}
+	if (perf_enabled) {
+		perf_switch(stage);
+	}
+	cycle_counters *c = thread_cycles;
+	uint64_t now = cycles_now();
+	int prev = c->stage;
+	c->cycles[prev] += now - c->since;
+	c->entries[stage] += entry;
+	c->stage = stage;
+	c->since = now;
+	return prev;
+}
+
+#define CYCLES_TIME(stage, ...) do { \
+	int cycles_prev_ = cycles_switch(stage, 1); \
+	__VA_ARGS__; \
+	cycles_switch(cycles_prev_, 0); \
+} while (0)
+#define CYCLES_THREAD(kind, index) do { \
+	cycles_thread(kind, index); \
+	perf_thread_start(kind, index); \
+} while (0)
+#define CYCLES_SUMMARY() cycles_summary()
+
+#else
+
+#define CYCLES_TIME(stage, ...) do { \
+	if (perf_enabled) { \
+		int perf_prev_ = perf_switch(stage); \
+		__VA_ARGS__; \
+		perf_switch(perf_prev_); \
+	} else { \
+		__VA_ARGS__; \
+	} \
+} while (0)
+#define CYCLES_THREAD(kind, index) perf_thread_start(kind, index)
+#define CYCLES_SUMMARY() ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,554 @@
+#include "pe_engine.h"
+
+/*
+ * Desc: Hands an event to the shard's sink, stamped with the command's times
+         when latency is recorded.
+ */
+static inline void emit(shard *s, event *ev) {
+	if (s->times.read_ns != 0) {
+		ev->times = s->times;
+		ev->match_ns = latency_now();
+	}
+	CYCLES_TIME(CYCLES_BROADCAST, s->sink.emit(s->sink.ctx, ev));
+}
+
+void init_shard(shard *s, int shard_id, order **buys, order **sells, long ***matches, event_sink sink) {
+	s->shard_id = shard_id;
+	s->buys = buys;
+	s->sells = sells;
+	s->matches = matches;
+	s->total_fees = 0;
+	s->total_order_num = 0;
+	s->sink = sink;
+	pthread_mutex_init(&s->lock, NULL);
+	s->cpu = -1;
+	s->sched_priority = 0;
+	s->inbound.cells = NULL;
+	atomic_init(&s->processed, 0);
+	s->jrnl = NULL;
+	s->journal_seq = 0;
+	memset(&s->batch, 0, sizeof(event_batch));
+	s->out = sink;
+	s->next_order_ids = NULL;
+	memset(&s->times, 0, sizeof(command_times));
+	s->stats = NULL;
+	s->fills = NULL;
+	s->market_detail = 0;
+}
+
+/*
+ * Desc: Publishes the best price on each side of a product's book.
+ */
+static inline void publish_best(shard *s, int product_index) {
+	if (s->stats == NULL) {
+		return;
+	}
+	order *buy = s->buys[product_index];
+	order *sell = s->sells[product_index];
+	book_stats *stats = &s->stats[product_index];
+	atomic_store_explicit(&stats->best_price[BUY], buy != NULL ? buy->price : 0, memory_order_relaxed);
+	atomic_store_explicit(&stats->best_price[SELL], sell != NULL ? sell->price : 0, memory_order_relaxed);
+}
+
+int format_event(char *msg, event *ev, int to_owner, products *prods) {
+	switch (ev->type) {
+	case EVENT_MATCH:
+		return snprintf(msg, BUF_SIZE, "%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n",
+			LOG_PREFIX, ev->resting_order_id, ev->resting_trader_id,
+			ev->order_id, ev->trader_id, ev->price, ev->fee);
+	case EVENT_FILL:
+		return snprintf(msg, BUF_SIZE, "FILL %d %ld;", ev->order_id, ev->quantity);
+	case EVENT_INVALID:
+		return snprintf(msg, BUF_SIZE, "INVALID;");
+	}
+
+	// ACCEPTED / AMENDED / CANCELLED to the owner, MARKET to everyone else
+	if (!to_owner && ev->market_detail) {
+		return snprintf(msg, BUF_SIZE, "MARKET %s %s %ld %ld %ld %ld;",
+			ev->side == BUY ? "BUY" : "SELL", prods->product_strings[ev->product_index],
+			ev->quantity, ev->price, ev->prev_quantity, ev->prev_price);
+	} else if (!to_owner) {
+		return snprintf(msg, BUF_SIZE, "MARKET %s %s %ld %ld;",
+			ev->side == BUY ? "BUY" : "SELL", prods->product_strings[ev->product_index],
+			ev->quantity, ev->price);
+	} else if (ev->type == EVENT_ACCEPTED) {
+		return snprintf(msg, BUF_SIZE, "ACCEPTED %d;", ev->order_id);
+	} else if (ev->type == EVENT_AMENDED) {
+		return snprintf(msg, BUF_SIZE, "AMENDED %d;", ev->order_id);
+	}
+	return snprintf(msg, BUF_SIZE, "CANCELLED %d;", ev->order_id);
+}
+
+void collect_event(void *ctx, event *ev) {
+	event_batch *batch = (event_batch*)ctx;
+	if (batch->len == batch->cap) {
+		int cap = batch->cap > 0 ? batch->cap * 2 : 16;
+		event *grown = (event*)pe_realloc(MEM_BUFFERS, batch->events, cap * sizeof(event));
+		if (grown == NULL) {
+			return;
+		}
+		batch->events = grown;
+		batch->cap = cap;
+	}
+	batch->events[batch->len++] = *ev;
+}
+
+/*
+ * Desc: Folds a value into a 64-bit FNV-1a hash byte by byte.
+ */
+static uint64_t fnv_fold(uint64_t hash, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		hash ^= (value >> (i * 8)) & 0xff;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+uint64_t digest_events(event_batch *batch) {
+	// fields one by one, so padding and journal stamps don't count
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < batch->len; i++) {
+		event *ev = &batch->events[i];
+		hash = fnv_fold(hash, ev->type);
+		hash = fnv_fold(hash, ev->trader_id);
+		hash = fnv_fold(hash, ev->order_id);
+		hash = fnv_fold(hash, ev->side);
+		hash = fnv_fold(hash, ev->product_index);
+		hash = fnv_fold(hash, ev->quantity);
+		hash = fnv_fold(hash, ev->price);
+		hash = fnv_fold(hash, ev->resting_trader_id);
+		hash = fnv_fold(hash, ev->resting_order_id);
+		hash = fnv_fold(hash, ev->fee);
+	}
+	return hash;
+}
+
+/*
+ * Desc: Inserts an order into a price sorted list behind all orders at the
+         same price, so time priority is kept within a level.
+ * Params: A pointer to the head of the list, the order and a flag saying
+           whether the list is a BUY list (descending) or SELL list (ascending).
+ */
+static void insert_order(order **list, order *new_order, int order_type) {
+	order *curr = *list;
+	order *prev = NULL;
+	if (order_type == BUY) {
+		// buy list is sorted in descending order of price
+		while (curr != NULL && curr->price >= new_order->price) {
+			prev = curr;
+			curr = curr->next;
+		}
+	} else {
+		// sell list is sorted in ascending order of price
+		while (curr != NULL && curr->price <= new_order->price) {
+			prev = curr;
+			curr = curr->next;
+		}
+	}
+
+	// insert order into its correct position
+	if (prev == NULL) {
+		// list was empty or it is the best priced order
+		new_order->next = *list;
+		*list = new_order;
+	} else {
+		// insert between prev and current
+		prev->next = new_order;
+		new_order->next = curr;
+	}
+}
+
+/*
+ * Desc: Unlinks the order with the given owner and order ID from a list.
+ * Params: A pointer to the head of the list, the trader and order IDs.
+ * Return: The unlinked order, NULL if it is not in the list.
+ */
+static order *remove_order(order **list, int trader_id, int order_id) {
+	order *curr = *list;
+	order *prev = NULL;
+	while (curr != NULL) {
+		if (curr->trader_id == trader_id && curr->order_id == order_id) {
+			if (prev == NULL) {
+				// order to remove is the head
+				*list = curr->next;
+			} else {
+				prev->next = curr->next;
+			}
+			curr->next = NULL;
+			return curr;
+		}
+		prev = curr;
+		curr = curr->next;
+	}
+	return NULL;
+}
+
+int execute_command(shard *s, command *cmd) {
+	int product_index = cmd->product_index;
+	event ev;
+	memset(&ev, 0, sizeof(event));
+	ev.trader_id = cmd->trader_id;
+	ev.order_id = cmd->order_id;
+	ev.product_index = product_index;
+	ev.market_detail = s->market_detail;
+
+	if (cmd->type == BUY || cmd->type == SELL) {
+		// the exchange already checked the order ID is the trader's next one,
+		// so it cannot be a duplicate of a resting order
+		order *new_order = (order*)pe_malloc(MEM_ORDERS, sizeof(order));
+		new_order->order_id = cmd->order_id;
+		new_order->trader_id = cmd->trader_id;
+		new_order->product = NULL;
+		new_order->product_index = product_index;
+		new_order->quantity = cmd->quantity;
+		new_order->price = cmd->price;
+		new_order->global_order_num = ++(s->total_order_num);
+
+		// add the order to the corresponding list
+		if (cmd->type == BUY) {
+			insert_order(&s->buys[product_index], new_order, BUY);
+		} else {
+			insert_order(&s->sells[product_index], new_order, SELL);
+		}
+
+		if (s->stats != NULL) {
+			counter_add(&s->stats[product_index].orders[cmd->type], 1);
+			counter_add(&s->stats[product_index].quantity[cmd->type], cmd->quantity);
+		}
+
+		ev.type = EVENT_ACCEPTED;
+		ev.side = cmd->type;
+		ev.quantity = cmd->quantity;
+		ev.price = cmd->price;
+
+	} else if (cmd->type == AMEND || cmd->type == CANCEL) {
+		// the order can only rest on the product it was placed on
+		int side = BUY;
+		order *found = remove_order(&s->buys[product_index], cmd->trader_id, cmd->order_id);
+		if (found == NULL) {
+			side = SELL;
+			found = remove_order(&s->sells[product_index], cmd->trader_id, cmd->order_id);
+		}
+		if (found == NULL) {
+			// already filled or cancelled
+			ev.type = EVENT_INVALID;
+			emit(s, &ev);
+			return 1;
+		}
+
+		ev.side = side;
+		ev.prev_quantity = found->quantity;
+		ev.prev_price = found->price;
+		if (s->stats != NULL) {
+			// an amend takes the old quantity off and puts the new one on
+			counter_add(&s->stats[product_index].orders[side], -1);
+			counter_add(&s->stats[product_index].quantity[side], -found->quantity);
+			if (cmd->type == AMEND) {
+				counter_add(&s->stats[product_index].orders[side], 1);
+				counter_add(&s->stats[product_index].quantity[side], cmd->quantity);
+			}
+		}
+		if (cmd->type == AMEND) {
+			// an amended order loses its time priority
+			found->global_order_num = ++(s->total_order_num);
+			found->quantity = cmd->quantity;
+			found->price = cmd->price;
+			if (side == BUY) {
+				insert_order(&s->buys[product_index], found, BUY);
+			} else {
+				insert_order(&s->sells[product_index], found, SELL);
+			}
+
+			ev.type = EVENT_AMENDED;
+			ev.quantity = cmd->quantity;
+			ev.price = cmd->price;
+		} else {
+			pe_free(found);
+			ev.type = EVENT_CANCELLED;
+		}
+
+	} else {
+		ev.type = EVENT_INVALID;
+		emit(s, &ev);
+		return 1;
+	}
+
+	publish_best(s, product_index);
+	emit(s, &ev);
+	return 0;
+}
+
+void find_matches(shard *s, int product_index) {
+	order **buys = &s->buys[product_index];
+	order **sells = &s->sells[product_index];
+	long **buyer_pos;
+	long **seller_pos;
+	event ev;
+	memset(&ev, 0, sizeof(event));
+	ev.product_index = product_index;
+
+	// we match off the top of both lists as long as orders exist
+	while (*buys != NULL && *sells != NULL) {
+		order *buy = *buys;
+		order *sell = *sells;
+		if (buy->price < sell->price) {
+			// no trades possible
+			break;
+		}
+
+		/*
+		 * We have the following 3 cases for a match:
+		 	1. The qty to BUY is less than the qty to SELL
+				--> Delete BUY, keep SELL
+			2. The qty to BUY is equal to the qty to SELL
+				--> Delete both BUY and SELL
+			3. The qty to BUY is greater than the qty to Sell
+				--> Keep BUY, delete SELL
+		 * In every case the smaller of the two quantities is traded.
+		 */
+		long traded = buy->quantity < sell->quantity ? buy->quantity : sell->quantity;
+
+		// price of the trade is based on the older order, the newer pays the fee
+		int buy_is_newer = buy->global_order_num > sell->global_order_num;
+		order *newer = buy_is_newer ? buy : sell;
+		order *older = buy_is_newer ? sell : buy;
+		long trading_sum = older->price * traded;
+
+		// compute fee of the trade, rounded to nearest decimal
+		double trading_fee = trading_sum * FEE_PERCENTAGE;
+		long rounding = (long)(trading_fee + 0.5f);
+		trading_fee = (double)(rounding);
+
+		// update the total trading fees sum
+		s->total_fees += trading_fee;
+
+		// cache the details of the trade
+		buyer_pos = s->matches[buy->trader_id];
+		seller_pos = s->matches[sell->trader_id];
+		buyer_pos[product_index][0] += traded;
+		buyer_pos[product_index][1] -= trading_sum;
+		seller_pos[product_index][0] -= traded;
+		seller_pos[product_index][1] += trading_sum;
+		s->matches[newer->trader_id][product_index][1] -= trading_fee;
+
+		// log the trade, then send fill messages to both traders
+		ev.type = EVENT_MATCH;
+		ev.trader_id = newer->trader_id;
+		ev.order_id = newer->order_id;
+		ev.resting_trader_id = older->trader_id;
+		ev.resting_order_id = older->order_id;
+		ev.side = newer == buy ? BUY : SELL;
+		ev.quantity = traded;
+		ev.price = trading_sum;
+		ev.fee = rounding;
+		emit(s, &ev);
+
+		ev.type = EVENT_FILL;
+		ev.trader_id = buy->trader_id;
+		ev.order_id = buy->order_id;
+		emit(s, &ev);
+		ev.trader_id = sell->trader_id;
+		ev.order_id = sell->order_id;
+		emit(s, &ev);
+
+		if (s->stats != NULL) {
+			book_stats *stats = &s->stats[product_index];
+			counter_add(&stats->quantity[BUY], -traded);
+			counter_add(&stats->quantity[SELL], -traded);
+			counter_add(&stats->orders[BUY], buy->quantity == traded ? -1 : 0);
+			counter_add(&stats->orders[SELL], sell->quantity == traded ? -1 : 0);
+			counter_add(&stats->trades, 1);
+			counter_add(&stats->volume, traded);
+			counter_add(&stats->turnover, trading_sum);
+		}
+		if (s->fills != NULL) {
+			counter_add(&s->fills[buy->trader_id].fills, 1);
+			counter_add(&s->fills[buy->trader_id].bought, traded);
+			counter_add(&s->fills[sell->trader_id].fills, 1);
+			counter_add(&s->fills[sell->trader_id].sold, traded);
+		}
+
+		// remove whichever orders were completely filled
+		buy->quantity -= traded;
+		sell->quantity -= traded;
+		if (buy->quantity == 0) {
+			*buys = buy->next;
+			pe_free(buy);
+		}
+		if (sell->quantity == 0) {
+			*sells = sell->next;
+			pe_free(sell);
+		}
+	}
+	publish_best(s, product_index);
+}
+
+void init_matches(long ****matches, int num_traders, int prods_size) {
+	*matches = (long***)pe_malloc(MEM_LEDGER, num_traders * sizeof(long**));
+	for (int i = 0; i < num_traders; i++) {
+		(*matches)[i] = (long**)pe_calloc(MEM_LEDGER, prods_size, sizeof(long*));
+		for (int j = 0; j < prods_size; j++) {
+			(*matches)[i][j] = (long*)pe_calloc(MEM_LEDGER, 2, sizeof(long));
+		}
+	}
+}
+
+void display_orderbook(products *prods, order **buys, order **sells) {
+	printf("%s\t--ORDERBOOK--\n", LOG_PREFIX);
+	// one scratch for the deepest sell side, reused for every product
+	int max_levels = 0;
+	for (int i = 0; i < prods->size; i++) {
+		int levels = count_order_levels(sells, i);
+		max_levels = levels > max_levels ? levels : max_levels;
+	}
+	book_level *scratch = (book_level*)pe_malloc(MEM_REPORTS, (max_levels + 1) * sizeof(book_level));
+	if (scratch == NULL) {
+		printf("%s\tOrderbook skipped: %s\n", LOG_PREFIX, strerror(ENOMEM));
+		return;
+	}
+	for (int i = 0; i < prods->size; i++) {
+		printf("%s\tProduct: %s; Buy levels: %d; Sell levels: %d\n", LOG_PREFIX,
+				prods->product_strings[i], count_order_levels(buys, i),
+				count_order_levels(sells, i));
+		print_sell_orders_reverse(sells, i, scratch);
+		display_orders(buys, i, BUY);
+	}
+	pe_free(scratch);
+}
+
+void count_books(book_stats *stats, order **buys, order **sells, int num_products) {
+	for (int p = 0; p < num_products; p++) {
+		order *lists[2] = {buys[p], sells[p]};
+		for (int side = BUY; side <= SELL; side++) {
+			long orders = 0;
+			long quantity = 0;
+			for (order *curr = lists[side]; curr != NULL; curr = curr->next) {
+				orders++;
+				quantity += curr->quantity;
+			}
+			atomic_store(&stats[p].orders[side], orders);
+			atomic_store(&stats[p].quantity[side], quantity);
+			atomic_store(&stats[p].best_price[side], lists[side] != NULL ? lists[side]->price : 0);
+		}
+	}
+}
+
+int count_order_levels(order **list, int product_index) {
+	int count = 0;
+	int prev_price = -1;
+	order *curr = list[product_index];
+	while (curr != NULL) {
+		if (curr->price == prev_price) {
+			curr = curr->next;
+			continue;
+		}
+		count++;
+		prev_price = curr->price;
+		curr = curr->next;
+	}
+	return count;
+}
+
+int copy_levels(order *list, book_level *out) {
+	int count = 0;
+	for (order *curr = list; curr != NULL; curr = curr->next) {
+		if (count == 0 || out[count - 1].price != curr->price) {
+			out[count].price = curr->price;
+			out[count].quantity = 0;
+			out[count].orders = 0;
+			count++;
+		}
+		out[count - 1].quantity += curr->quantity;
+		out[count - 1].orders++;
+	}
+	return count;
+}
+
+void print_level(book_level *level, int order_type) {
+	printf("%s\t\t%s %ld @ $%ld (%d %s)\n", LOG_PREFIX, order_type == BUY ? "BUY" : "SELL",
+		level->quantity, level->price, level->orders, level->orders > 1 ? "orders" : "order");
+}
+
+void display_orders(order **list, int product_index, int order_type) {
+	if (order_type == BUY) {
+		order *curr = list[product_index];
+		book_level level; // orders with identical price (same level)
+		while (curr != NULL) {
+			order *runner = curr->next;
+			level.price = curr->price;
+			level.quantity = curr->quantity;
+			level.orders = 1;
+			while (runner != NULL && runner->price == curr->price) {
+				level.orders++;
+				level.quantity += runner->quantity;
+				runner = runner->next;
+			}
+			print_level(&level, BUY);
+			curr = runner;
+		}
+	} else if (order_type == SELL) {
+		book_level *scratch = (book_level*)pe_malloc(MEM_REPORTS,
+			(count_order_levels(list, product_index) + 1) * sizeof(book_level));
+		if (scratch != NULL) {
+			print_sell_orders_reverse(list, product_index, scratch);
+			pe_free(scratch);
+		}
+	}
+}
+
+int get_product_index(products *prods, char *product) {
+	if (product == NULL) {
+		return -1;
+	}
+
+	for (int i = 0; i < prods->size; i++) {
+		if (strcmp(prods->product_strings[i], product) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void print_sell_orders_reverse(order **list, int product_index, book_level *scratch) {
+	// sells are kept lowest first, their levels are printed highest first
+	int count = copy_levels(list[product_index], scratch);
+	for (int k = count - 1; k >= 0; k--) {
+		print_level(&scratch[k], SELL);
+	}
+}
+
+void free_products_list(products *prods) {
+	for (int i = 0; i < prods->size; i++) {
+		pe_free(prods->product_strings[i]);
+	}
+	pe_free(prods->product_strings);
+}
+
+void free_order_list(order **order_list, products *prods) {
+	if (order_list == NULL) {
+		return;
+	}
+	for (int i = 0; i < prods->size; i++) {
+		order *temp;
+		while (order_list[i] != NULL) {
+			temp = order_list[i];
+			order_list[i] = (order_list[i])->next;
+			pe_free(temp);
+		}
+	}
+	pe_free(order_list);
+}
+
+void free_matches(long ***matches, int num_traders, int prods_size) {
+	if (matches == NULL) {
+		return;
+	}
+	for (int i = 0; i < num_traders; i++) {
+		for (int j = 0; j < prods_size; j++) {
+			pe_free(matches[i][j]);
+		}
+		pe_free(matches[i]);
+	}
+	pe_free(matches);
+}
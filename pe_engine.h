@@ -0,0 +1,340 @@
+#ifndef PE_ENGINE_H
+#define PE_ENGINE_H
+
+#include "pe_common.h"
+#include "pe_protocol.h"
+#include "pe_queue.h"
+#include "pe_latency.h"
+#include "pe_cycles.h"
+#include "pe_trace.h"
+#include "pe_alloc.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define LOG_PREFIX "[PEX]"
+
+/*
+ * Desc: Generic order struct.
+ * Fields: string representing the product type of the order, and ints for the
+           quantity of the product and the price per unit. Also has a pointer
+           to the next order in the list.
+ */
+typedef struct order order;
+struct order {
+    int order_id;
+    int trader_id; // trader that made the order
+    int global_order_num; // tracks the total number of orders ever made
+    char *product;
+    int product_index; // index of the product string in the string array
+    long quantity;
+    long price;
+    order *next;
+};
+
+/*
+ * Desc: One price level of a book as the orderbook report prints it.
+ * Fields: The price, the quantity resting at it and the number of orders.
+ */
+typedef struct book_level book_level;
+struct book_level {
+    long price;
+    long quantity;
+    int orders;
+};
+
+/*
+ * Desc: Holds the list of products that the exchange will trade.
+ * Fields: An int representing the number of products that will be traded and
+           a pointer to a list of string pointers, where the strings will be the
+           product names.
+ */
+typedef struct products products;
+struct products {
+    int size;
+    char **product_strings; // pointer to a list of string pointers
+};
+
+enum event_type {
+    EVENT_ACCEPTED = 0, // ACCEPTED to the owner, MARKET to everyone else
+    EVENT_AMENDED, // AMENDED to the owner, MARKET to everyone else
+    EVENT_CANCELLED, // CANCELLED to the owner, MARKET ... 0 0 to everyone else
+    EVENT_FILL, // FILL to trader_id
+    EVENT_MATCH, // Match: log line, nothing is sent to traders
+    EVENT_INVALID // INVALID to trader_id
+};
+
+/*
+ * Desc: Something the engine wants traders (or the log) to know about. The
+         engine never does I/O itself, it hands events to its sink.
+ * Fields: The event type, the trader and order it concerns and the order
+           details. For EVENT_MATCH, trader_id / order_id are the newer order,
+           resting_* the older one, price holds the trade value and fee the fee.
+ */
+typedef struct event event;
+struct event {
+    int type; // enum event_type
+    int trader_id;
+    int order_id;
+    int side; // BUY or SELL
+    int product_index;
+    int market_detail; // MARKET lines also carry prev_quantity and prev_price
+    long quantity;
+    long price;
+    // AMENDED and CANCELLED: what the order had left and its price before
+    long prev_quantity;
+    long prev_price;
+    int resting_trader_id;
+    int resting_order_id;
+    long fee;
+    // set when journaling: the event is held back until the shard's
+    // journal_seq-th command is on disk
+    int shard_id;
+    uint64_t journal_seq;
+    // set when recording latency: when the command causing the event was
+    // read, parsed and applied
+    command_times times;
+    uint64_t match_ns;
+};
+
+/*
+ * Desc: Where the engine sends its events.
+ * Fields: The function called for each event and a context passed to it.
+ */
+typedef struct event_sink event_sink;
+struct event_sink {
+    void (*emit)(void *ctx, event *ev);
+    void *ctx;
+};
+
+/*
+ * Desc: Events collected while a command is applied.
+ * Fields: The events, how many there are and how many fit.
+ */
+typedef struct event_batch event_batch;
+struct event_batch {
+    event *events;
+    int len;
+    int cap;
+};
+
+/*
+ * Desc: Running counters of one product's book, kept by the shard owning the
+         product as it applies commands. Only that shard writes them, any
+         thread may read them without taking the shard lock.
+ * Fields: The resting orders, their total quantity and the best price on
+           each side, indexed by BUY and SELL, and the number of trades and
+           the quantity and value traded.
+ */
+typedef struct book_stats book_stats;
+struct book_stats {
+    _Atomic long orders[2];
+    _Atomic long quantity[2];
+    _Atomic long best_price[2]; // 0 --> nothing rests on that side
+    _Atomic long trades;
+    _Atomic long volume;
+    _Atomic long turnover;
+};
+
+/*
+ * Desc: One trader's fills on one shard, written by that shard only.
+ * Fields: The number of fills and the quantity bought and sold.
+ */
+typedef struct fill_stats fill_stats;
+struct fill_stats {
+    _Atomic long fills;
+    _Atomic long bought;
+    _Atomic long sold;
+};
+
+/*
+ * Desc: Adds to a counter that only the calling thread writes. Readers on
+         other threads see a recent value; a relaxed load and store cost no
+         more than a plain increment.
+ * Params: The counter and what to add.
+ */
+static inline void counter_add(_Atomic long *counter, long delta) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + delta,
+		memory_order_relaxed);
+}
+
+typedef struct journal journal;
+
+/*
+ * Desc: The books and ledger for a subset of the products. Books for
+         different products never interact, so each shard can be matched by
+         its own thread. Product p belongs to shard p % num_shards.
+ * Fields: The product-indexed order lists and match cache (shared arrays, a
+           shard only touches its own products), the shard's fee ledger and
+           time-priority counter, its event sink, the lock that makes
+           snapshots of the books consistent and the live counters of its
+           books and fills.
+ */
+typedef struct shard shard;
+struct shard {
+    int shard_id;
+    order **buys;
+    order **sells;
+    long ***matches;
+    double total_fees; // fees collected on this shard's products
+    int total_order_num; // tracks the total number of orders on this shard
+    event_sink sink;
+    pthread_mutex_t lock; // held while a command is applied to the books
+    // matching thread, unused when matching inline on the main thread
+    pthread_t thread;
+    int cpu; // CPU the matching thread pins itself to, -1 --> unpinned
+    int sched_priority; // SCHED_FIFO priority of the matching thread, 0 --> default
+    mpsc_queue inbound; // commands routed to this shard
+    _Atomic long processed; // commands applied since the shard started
+    // write-ahead journal, NULL --> events go straight to the sink
+    journal *jrnl;
+    uint64_t journal_seq; // commands this shard has journaled
+    event_batch batch; // events of the command being applied
+    event_sink out; // where events go once collected and stamped
+    // per trader: one past the highest order ID placed on this shard, kept
+    // when journaling so snapshots don't depend on the gateways' state
+    int *next_order_ids;
+    command_times times; // of the command being applied, read_ns 0 --> not timed
+    // live counters for the control socket, NULL --> not kept
+    book_stats *stats; // product-indexed, shared like the order lists
+    fill_stats *fills; // trader-indexed, this shard's own
+    int market_detail; // MARKET lines say what an amend or cancel took off the book
+};
+
+/*
+ * Desc: Initializes a shard over the shared books and match cache.
+ * Params: A pointer to the shard, its ID, the shared order lists and match
+           cache and the sink events are sent to.
+ */
+void init_shard(shard *s, int shard_id, order **buys, order **sells, long ***matches, event_sink sink);
+
+/*
+ * Desc: Applies a validated command to the books and emits the response. The
+         command's trader_id and product_index must be filled in, for AMEND
+         and CANCEL the product_index is the product the order was placed on.
+ * Params: The shard owning the product and the command.
+ * Return: 0 on successful execution, 1 if the order to amend or cancel no
+           longer exists (an EVENT_INVALID is emitted).
+ */
+int execute_command(shard *s, command *cmd);
+
+/*
+ * Desc: Matches orders for product at product_index, updating the match cache
+         and fees and emitting EVENT_MATCH and EVENT_FILL for every trade.
+ * Params: The shard owning the product and the index of the product to find
+           matches for.
+ */
+void find_matches(shard *s, int product_index);
+
+/*
+ * Desc: Event sink that appends events to an event_batch, growing it as
+         needed.
+ * Params: The batch (as void*) and the event.
+ */
+void collect_event(void *ctx, event *ev);
+
+/*
+ * Desc: Digests a command's events so a replay can check it produced the
+         same ones (64-bit FNV-1a over the event fields).
+ * Params: The batch of events.
+ * Return: The digest.
+ */
+uint64_t digest_events(event_batch *batch);
+
+/*
+ * Desc: Formats an event the way the exchange reports it: the Match log line
+         for EVENT_MATCH, otherwise the message written to a trader's fifo.
+         That is the response if the trader owns the order (always the case
+         for FILL and INVALID) and a MARKET update if it doesn't.
+ * Params: The buffer to fill (BUF_SIZE bytes), the event, whether the message
+           is for the trader the event concerns, and the products list.
+ * Return: The length of the formatted text.
+ */
+int format_event(char *msg, event *ev, int to_owner, products *prods);
+
+/*
+ * Desc: Initializes the matches matrix and sets all entries to default values.
+ * Params: The matches matrix, the number of traders and the number of products.
+ */
+void init_matches(long ****matches, int num_traders, int prods_size);
+
+/*
+ * Desc: Prints the orderbook to stdout.
+ * Params: Pointers to the products list, buy and sell orders.
+ */
+void display_orderbook(products *prods, order **buys, order **sells);
+
+/*
+ * Desc: Sets the book counters from the orders resting on every product, so
+         books restored from a snapshot or journal are counted. Must run
+         before the shards start keeping the counters.
+ * Params: The product-indexed counters, the order lists and the number of
+           products.
+ */
+void count_books(book_stats *stats, order **buys, order **sells, int num_products);
+
+/*
+ * Desc: Counts the number of orders for a specific product.
+ * Params: A pointer to the list to count orders from, the index of the product
+           to count orders for.
+ * Return: The number of orders in list, -1 otherwise.
+ */
+int count_order_levels(order **list, int product_index);
+
+/*
+ * Desc: Copies the price levels of an order list in list order, so they can
+         be printed once the book may change again.
+ * Params: The head of the list and where to store the levels, with room for
+           count_order_levels of the list.
+ * Return: The number of levels copied.
+ */
+int copy_levels(order *list, book_level *out);
+
+/*
+ * Desc: Prints one price level of the orderbook to stdout.
+ * Params: The level and whether it is a BUY or SELL level.
+ */
+void print_level(book_level *level, int order_type);
+
+/*
+ * Desc: Prints all unique orders for a specific product at product_index to
+         stdout.
+ * Params: A pointer to the order list, the product_index of the product to count
+           and a flag indicating that we are printing buy or sell orders
+ */
+void display_orders(order **list, int product_index, int order_type);
+
+/*
+ * Desc: Gets the index of product in the products string array.
+ * Params: A pointer to the products struct containing the product array, the
+           product string to find.
+ * Return: The index of the product string in the string array, -1 if invalid.
+ */
+int get_product_index(products *prods, char *product);
+
+/*
+ * Desc: Used specifically for printing the sell order list in reverse order.
+         The levels are copied into scratch and walked backwards.
+ * Params: The list to loop through, the product index and the scratch, with
+           room for count_order_levels of the list.
+ */
+void print_sell_orders_reverse(order **list, int product_index, book_level *scratch);
+
+/*
+ * Desc: Frees the memory used by the products struct.
+ * Param: a pointer to the products struct.
+ */
+void free_products_list(products *prods);
+
+/*
+ * Desc: Frees memory used by the order list (buy / sell orders).
+ * Params: A pointer to the order list head and a pointer to the products struct.
+ */
+void free_order_list(order **order_list, products *prods);
+
+/*
+ * Desc: Frees all allocated dimensions used by the matches matrix.
+ * Param: The matches matrix, the number of traders and the number of products.
+ */
+void free_matches(long ***matches, int num_traders, int prods_size);
+
+#endif
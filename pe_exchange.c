@@ -6,50 +6,103 @@
  */
 
 #include "pe_exchange.h"
-
-volatile sig_atomic_t sigusr1 = 0;
-volatile sig_atomic_t sigchld = 0;
-volatile sig_atomic_t pid = -1; // stores the ID of the trader that last signaled
+#include "pe_shard.h"
+#include "pe_placement.h"
+#include "pe_snapshot.h"
+#include "pe_replica.h"
+#include "pe_control.h"
+#include "pe_perf.h"
 
 int main(int argc, char **argv) {
+	exchange_config cfg;
+	int first_arg = parse_config(argc, argv, &cfg);
+	if (first_arg < 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	if (cfg.perf_counters && perf_start()) {
+		printf("Error: no performance counters available.\n");
+		return 1;
+	}
+	CYCLES_THREAD("main", -1);
+	if (cfg.trace_path != NULL && trace_open(cfg.trace_path, cfg.trace_every)) {
+		printf("Error opening trace %s: %s\n", cfg.trace_path, strerror(errno));
+		return 1;
+	}
+	trace_thread("main", -1);
+
+	// drop the options so argv[1] is the product file, as before
+	argv += first_arg - 1;
+	argc -= first_arg - 1;
+
 	if (argc < 3) {
 		printf("Invalid number of arguments provided.\n");
 		return 1;
 	}
 
-	// setup the sigaction struct
-	struct sigaction sa;
-	init_sigaction(&sa);
-	if (sigaction(SIGUSR1, &sa, NULL) == -1 
-		|| sigaction(SIGCHLD, &sa, NULL) == -1) {
-        printf("Error initializing sigaction.\n");
-        return 1;
-    }
+	// the zygote is forked while the exchange is still small and has default
+	// signal dispositions, which the traders it launches inherit
+	launcher launch;
+	init_launcher(&launch);
+	if (cfg.use_zygote && start_zygote(&launch)) {
+		printf("Error starting the launch zygote.\n");
+		return 1;
+	}
+
+	// block the signals we wait on so they are only delivered via the signalfd
+	sigset_t mask;
+	init_signal_mask(&mask);
+	if (cfg.record_latency) {
+		// the latency histograms are printed on demand
+		sigaddset(&mask, SIGUSR2);
+	}
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+		printf("Error blocking signals.\n");
+		return 1;
+	}
+	int sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sig_fd == -1) {
+		printf("Error creating signalfd.\n");
+		return 1;
+	}
+	// a trader can exit before we notice, report EPIPE instead of dying
+	signal(SIGPIPE, SIG_IGN);
 
 	int res = 0; // stores result of init functions for error checking
 	int bytes_written = -1;
-	int num_traders = argc - TRADERS_START;
+	int halted = 0; // the journal failed, trading stopped early
+
+	// everything released in cleanup starts out empty
+	exchange ex;
+	memset(&ex, 0, sizeof(exchange));
+	ex.num_traders = argc - TRADERS_START;
+	ex.num_shards = cfg.num_shards;
+	ex.jrnl.current.fd = -1;
+	ex.jrnl.fail_fd = -1;
+	snapshotter snap;
+	memset(&snap, 0, sizeof(snapshotter));
+	snap.timer_fd = -1;
+	snap.pid_fd = -1;
+	replicator repl;
+	memset(&repl, 0, sizeof(replicator));
+	repl.listen_fd = -1;
+	control_server ctl;
+	memset(&ctl, 0, sizeof(control_server));
+	ctl.listen_fd = -1;
+	int shards_started = 0;
+	int gateways_started = 0;
+	reporter rep = {.timer_fd = -1};
+	int epoll_fd = -1;
 
 	printf("%s Starting\n", LOG_PREFIX);
 
 	// initialize structs and prepare for exchange launch
-	products prods;
-	res = init_product_list(argv[1], &prods);
+	res = init_product_list(argv[1], &ex.prods);
 	if (res) {
 		printf("Error initializing products list using file %s.\n", argv[1]);
 		goto cleanup;
 	}
 
-	trader *head = NULL;
-	res = spawn_and_communicate(num_traders, argv, &head);
-	if (res) {
-		printf("Error: %s\n", strerror(errno));
-		goto cleanup;
-	} else if (head == NULL) {
-		printf("Error connecting to traders.\n");
-		goto cleanup;
-	}
-
 	/*
 	 * Order lists -- each index i stores the head of a linked list for the
 	   product associated with index i.
@@ -58,12 +111,11 @@ int main(int argc, char **argv) {
 	   are [GPU, CPU] then GPU --> 0, CPU --> 1, so buys[0] is the head of
 	   the buy GPU buy orders.
 	 */
-	order **buys = (order**)calloc(prods.size, sizeof(order*));
-	order **sells = (order**)calloc(prods.size, sizeof(order*));
+	ex.buys = (order**)pe_calloc(MEM_PRODUCTS, ex.prods.size, sizeof(order*));
+	ex.sells = (order**)pe_calloc(MEM_PRODUCTS, ex.prods.size, sizeof(order*));
 
 	// initialize the match cache
-	long ***matches = NULL;
-	init_matches(&matches, num_traders, prods.size);
+	init_matches(&ex.matches, ex.num_traders, ex.prods.size);
 
 	/*
 	 * Explanation of how the 'match cache' works:
@@ -80,103 +132,626 @@ int main(int argc, char **argv) {
 			access the amount of APPLES owned by T1.
 	 */
 
+	/*
+	 * Shards -- product i is matched by shard i % num_shards. Each shard only
+	   touches its own products' order lists and match cache entries, so the
+	   shards can run on separate threads without sharing any book state.
+	   With 0 shards, one shard is applied inline by the main loop.
+	 * Gateways -- with matching threads, trader i's fifos are handled by
+	   gateway thread i % num_gateways. Gateways parse commands and push them
+	   to the shards, shards push events back to the gateways, so matching
+	   threads never make a syscall to talk to traders.
+	 */
+	int shard_count = ex.num_shards > 0 ? ex.num_shards : 1;
+	ex.shards = (shard*)calloc(shard_count, sizeof(shard));
+	if (ex.shards == NULL) {
+		printf("Error: %s\n", strerror(errno));
+		goto cleanup;
+	}
+	event_sink sink = {deliver_event, &ex};
+	if (cfg.journal_path != NULL) {
+		sink = (event_sink){hold_event, &ex};
+	}
+	if (ex.num_shards > 0) {
+		sink = (event_sink){route_event, &ex.gateways};
+	}
+	for (int i = 0; i < shard_count; i++) {
+		init_shard(&ex.shards[i], i, ex.buys, ex.sells, ex.matches, sink);
+		ex.shards[i].cpu = pick_cpu(&cfg.pin_shards, i);
+		ex.shards[i].sched_priority = cfg.sched_priority;
+		ex.shards[i].market_detail = cfg.market_detail;
+	}
+
+	/*
+	 * Journal -- every command is journaled after it is applied and before
+	   any of its responses are sent. Inline, the main loop commits once per
+	   event loop iteration; threaded, a journal thread commits whatever the
+	   shards queued and the gateways hold events until they are durable.
+	 * Snapshots -- the state is periodically written next to the journal by
+	   a forked child. An existing journal means the last run didn't finish:
+	   the latest snapshot is loaded and only the journal after it replayed.
+	 * Replication -- a primary streams its journal to a standby, which
+	   applies it before launching any traders and only launches them if
+	   the primary dies.
+	 */
+	if (cfg.journal_path != NULL) {
+		for (int i = 0; i < shard_count; i++) {
+			ex.shards[i].next_order_ids = (int*)calloc(ex.num_traders, sizeof(int));
+			if (ex.shards[i].next_order_ids == NULL) {
+				goto cleanup;
+			}
+		}
+		if (init_snapshotter(&snap, cfg.journal_path, cfg.snapshot_interval_ms, shard_count)) {
+			printf("Error: %s\n", strerror(errno));
+			goto cleanup;
+		}
+
+		journal_position end;
+		uint64_t shard_seqs[MAX_SHARDS];
+		size_t segment_size = (size_t)cfg.journal_segment_kb * 1024;
+		if (access(cfg.journal_path, F_OK) == 0) {
+			if (recover_exchange(&ex, &snap, cfg.journal_path, &end)) {
+				printf("Error recovering from journal %s.\n", cfg.journal_path);
+				goto cleanup;
+			}
+			for (int i = 0; i < shard_count; i++) {
+				shard_seqs[i] = ex.shards[i].journal_seq;
+			}
+			res = journal_reopen(&ex.jrnl, cfg.journal_path, cfg.fsync_policy, segment_size, shard_count,
+				&end, shard_seqs);
+		} else {
+			res = journal_open(&ex.jrnl, cfg.journal_path, cfg.fsync_policy, segment_size, &ex.prods,
+				ex.num_traders, shard_count);
+		}
+		if (res) {
+			printf("Error opening journal %s: %s\n", cfg.journal_path, strerror(errno));
+			goto cleanup;
+		}
+
+		// a standby follows the primary and only launches traders to take over
+		if (cfg.standby_path != NULL) {
+			int take_over = 0;
+			if (follow_primary(&ex, cfg.standby_path, shard_count, &take_over)) {
+				goto cleanup;
+			}
+			if (!take_over) {
+				goto shutdown;
+			}
+		}
+		if (cfg.replicate_path != NULL
+				&& start_replicator(&repl, cfg.replicate_path, &ex.jrnl, cfg.journal_path)) {
+			printf("Error replicating on %s: %s\n", cfg.replicate_path, strerror(errno));
+			goto cleanup;
+		}
+	}
+
+	// live counters for the control socket, starting from the restored books
+	if (cfg.control_path != NULL) {
+		ex.stats = (book_stats*)calloc(ex.prods.size, sizeof(book_stats));
+		int failed = ex.stats == NULL;
+		for (int i = 0; i < shard_count; i++) {
+			ex.shards[i].fills = (fill_stats*)calloc(ex.num_traders, sizeof(fill_stats));
+			failed |= ex.shards[i].fills == NULL;
+		}
+		if (failed) {
+			printf("Error: %s\n", strerror(errno));
+			goto cleanup;
+		}
+		count_books(ex.stats, ex.buys, ex.sells, ex.prods.size);
+		for (int i = 0; i < shard_count; i++) {
+			ex.shards[i].stats = ex.stats;
+		}
+	}
+
+	res = spawn_and_communicate(ex.num_traders, argv, &ex.head, &launch, &cfg.pin_traders, cfg.connect_timeout_ms);
+	if (res) {
+		printf("Error: %s\n", strerror(errno));
+		goto cleanup;
+	} else if (ex.head == NULL) {
+		printf("Error connecting to traders.\n");
+		goto cleanup;
+	}
+	for (trader *cursor = ex.head; cursor != NULL; cursor = cursor->next) {
+		ex.num_connected++;
+	}
+
+	// traders continue with the order IDs of the state they were restored to
+	if (cfg.journal_path != NULL && restore_traders(&ex, shard_count)) {
+		printf("Error: %s\n", strerror(errno));
+		goto cleanup;
+	}
+	if (ex.num_shards > 0
+			&& init_gateways(&ex.gateways, cfg.num_gateways, ex.head, &ex.prods, ex.shards, ex.num_shards)) {
+		printf("Error creating gateways.\n");
+		goto cleanup;
+	}
+	for (int i = 0; i < ex.gateways.size; i++) {
+		ex.gateways.list[i].cpu = pick_cpu(&cfg.pin_gateways, i);
+		ex.gateways.list[i].sched_priority = cfg.sched_priority;
+	}
+
+	// every thread writing responses records into its own histograms
+	if (cfg.record_latency) {
+		ex.latency = new_latency_recorder();
+		int failed = ex.latency == NULL;
+		for (int i = 0; i < ex.gateways.size; i++) {
+			ex.gateways.list[i].latency = new_latency_recorder();
+			failed |= ex.gateways.list[i].latency == NULL;
+		}
+		if (failed) {
+			printf("Error: %s\n", strerror(errno));
+			goto cleanup;
+		}
+	}
+	if (cfg.journal_path != NULL) {
+		for (int i = 0; i < shard_count; i++) {
+			attach_journal(&ex.shards[i], &ex.jrnl);
+		}
+		for (int i = 0; i < ex.gateways.size; i++) {
+			ex.gateways.list[i].jrnl = &ex.jrnl;
+		}
+		if (ex.num_shards > 0 && journal_start(&ex.jrnl, gateways_committed, &ex.gateways)) {
+			printf("Error starting the journal thread.\n");
+			goto cleanup;
+		}
+	}
+
+	// pin the main thread only now so the traders didn't inherit its placement
+	if (placement_configured(&cfg)) {
+		set_placement(0, "main thread", pick_cpu(&cfg.pin_main, 0), cfg.sched_priority);
+		log_placement(0, "main thread");
+	}
+	for (; shards_started < ex.num_shards; shards_started++) {
+		if (start_shard(&ex.shards[shards_started])) {
+			printf("Error starting matching thread %d.\n", shards_started);
+			goto cleanup;
+		}
+	}
+	if (ex.num_shards > 0) {
+		printf("%s Matching on %d threads, %d gateway threads\n", LOG_PREFIX, ex.num_shards, ex.gateways.size);
+	}
+
+	// set up the event loop: the signalfd and the optional snapshot timer
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1 || init_reporter(&rep, &cfg)) {
+		printf("Error: %s\n", strerror(errno));
+		goto cleanup;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = sig_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sig_fd, &ev);
+	if (rep.timer_fd != -1) {
+		ev.data.fd = rep.timer_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rep.timer_fd, &ev);
+	}
+	if (snap.timer_fd != -1) {
+		ev.data.fd = snap.timer_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, snap.timer_fd, &ev);
+	}
+	if (ex.jrnl.fail_fd != -1) {
+		// wakes the loop to stop trading once the journal can't be written
+		ev.data.fd = ex.jrnl.fail_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ex.jrnl.fail_fd, &ev);
+	}
+	// a trader's pidfd becomes readable when it exits
+	for (trader *cursor = ex.head; cursor != NULL; cursor = cursor->next) {
+		ev.data.fd = cursor->pid_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cursor->pid_fd, &ev);
+	}
+
 	// send MARKET OPEN; to all traders and signal SIGUSR1
-	trader *current = head;
+	trader *current = ex.head;
 	while (current != NULL) {
 		bytes_written = write(current->fd[1], "MARKET OPEN;", strlen("MARKET OPEN;"));
 		if (bytes_written < 0) {
 			printf("Error: %s\n", strerror(errno));
 		}
-		kill(current->process_id, SIGUSR1);
+		signal_trader(current);
 		current = current->next;
 	}
 
+	// from here on the gateways own trader I/O when matching is threaded
+	gateways_started = start_gateways(&ex.gateways);
+	if (gateways_started < ex.gateways.size) {
+		printf("Error starting gateway thread %d.\n", gateways_started);
+		goto cleanup;
+	}
+	if (cfg.control_path != NULL && start_control(&ctl, cfg.control_path, &ex)) {
+		printf("Error listening for queries on %s: %s\n", cfg.control_path, strerror(errno));
+		goto cleanup;
+	}
+
 	// event loop
-	double total_fees = 0;
-	int total_order_num = 0;
 	int trader_disconnect = 0; // counts number of traders disconnected
 	int cmd_type = -1;
-	// position of the most recently added product in the product strings array
-	int product_index = -1;
 	char message_in[BUF_SIZE];
+	command cmd;
 	trader *curr_trader = NULL; // tracks the last trader that signalled
-	while (trader_disconnect < num_traders) {
-		if (!sigchld && !sigusr1) {
-			// wait for either signal
-			pause();
+	struct epoll_event events[MAX_EVENTS];
+	struct signalfd_siginfo info;
+	while (trader_disconnect < ex.num_connected && !journal_failed(&ex.jrnl)) {
+		int ready = 0;
+		CYCLES_TIME(CYCLES_WAIT, ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1));
+		if (ready == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("Error: %s\n", strerror(errno));
+			break;
 		}
-		if (sigusr1) {
-			sigusr1 = 0; // reset flag
-
-			// parse input of trader that sent sigusr1 and return corresponding output
-			curr_trader = get_trader(pid, -1, head);
-			res = read_and_format_message(curr_trader, message_in);
-			if (res) {
-				// notify trader of invalid message
-				write(curr_trader->fd[1], "INVALID;", strlen("INVALID;"));
-				kill(curr_trader->process_id, SIGUSR1);
+
+		for (int i = 0; i < ready; i++) {
+			if (events[i].data.fd == rep.timer_fd) {
+				// periodic snapshot, only printed if something changed
+				long applied = shards_processed(ex.shards, ex.num_shards);
+				if (ex.num_shards > 0) {
+					rep.pending = applied - rep.applied;
+				}
+				if (reporter_timer_expired(&rep)) {
+					CYCLES_TIME(CYCLES_REPORT, report_snapshot(&rep, &ex));
+					rep.applied = applied;
+				}
 				continue;
 			}
-			printf("%s [T%d] Parsing command: <%s>\n", LOG_PREFIX, curr_trader->trader_id, message_in);
-			cmd_type = determine_cmd_type(message_in);
-			res = execute_command(curr_trader, message_in, cmd_type, &prods, &product_index, &total_order_num, &buys, &sells, head);
-			if (res) {
-				// notify trader of invalid message
-				write(curr_trader->fd[1], "INVALID;", strlen("INVALID;"));
-				kill(curr_trader->process_id, SIGUSR1);
+			if (events[i].data.fd == snap.timer_fd) {
+				uint64_t expirations;
+				if (read(snap.timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+					// a snapshot still waiting on the journal goes out first
+					publish_snapshot(&snap, &ex.jrnl);
+					if (snap.pid == 0 && start_snapshot(&snap, &ex) == 0) {
+						ev.data.fd = snap.pid_fd;
+						epoll_ctl(epoll_fd, EPOLL_CTL_ADD, snap.pid_fd, &ev);
+					}
+				}
+				continue;
+			}
+
+			if (events[i].data.fd != sig_fd) {
+				// trader exits are handled after the signals, see below, and a
+				// failed journal by the loop condition
 				continue;
 			}
-			find_matches(&matches, &buys, &sells, head, &total_fees, product_index);
-			display_orderbook(&prods, buys, sells);
-			display_positions(head, matches, &prods);
 
-		} else if (sigchld) {
-			sigchld = 0; // reset flag
+			// drain every pending signal, each carries the sender's PID
+			while (read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+				if (info.ssi_signo == SIGUSR2) {
+					report_latency(&ex, stdout, 0);
+					continue;
+				}
+				curr_trader = get_trader(info.ssi_pid, -1, ex.head);
+				if (curr_trader == NULL) {
+					// signal from a process that is not one of our traders
+					continue;
+				}
+
+				if (info.ssi_signo == SIGUSR1 && ex.num_shards > 0) {
+					// the gateways watch the fifos themselves
+					continue;
+				} else if (info.ssi_signo == SIGUSR1) {
+					// a trader signalling again for a command that was already
+					// read finds its fifo empty, and the read would block
+					int pending = 0;
+					if (ioctl(curr_trader->fd[0], FIONREAD, &pending) == -1 || pending == 0) {
+						continue;
+					}
 
-			// perform disconnection and cleanup of terminated trader
-			curr_trader = get_trader(pid, -1, head);
+					// parse input of trader that sent sigusr1 and return corresponding output
+					uint32_t trace_id = trace_sample_command();
+					uint64_t trace_ns = trace_id != 0 ? latency_now() : 0;
+					uint64_t read_ns = ex.latency != NULL ? latency_now() : 0;
+					CYCLES_TIME(CYCLES_READ, res = read_and_format_message(curr_trader, message_in));
+					if (res) {
+						// notify trader of invalid message
+						CYCLES_TIME(CYCLES_BROADCAST, reject_message(&ex, curr_trader));
+						continue;
+					}
+					CYCLES_TIME(CYCLES_LOG, printf("%s [T%d] Parsing command: <%s>\n", LOG_PREFIX,
+						curr_trader->trader_id, message_in));
+					CYCLES_TIME(CYCLES_DECODE, cmd_type = determine_cmd_type(message_in));
+					CYCLES_TIME(CYCLES_PARSE, res = parse_command(message_in, cmd_type, &cmd));
+					if (!res) {
+						CYCLES_TIME(CYCLES_VALIDATE, res = validate_command(curr_trader, &cmd, &ex.prods));
+					}
+					if (res) {
+						// notify trader of invalid message
+						CYCLES_TIME(CYCLES_BROADCAST, reject_message(&ex, curr_trader));
+						continue;
+					}
+
+					counter_add(&curr_trader->commands[cmd.type], 1);
+					ex.shards[0].times.cmd_type = cmd.type;
+					ex.shards[0].times.read_ns = read_ns;
+					ex.shards[0].times.parse_ns = read_ns != 0 ? latency_now() : 0;
+					ex.shards[0].times.trace_id = trace_id;
+					res = apply_command(&ex.shards[0], &cmd);
+					counter_add(&ex.shards[0].processed, 1);
+					if (ex.jrnl.current.fd != -1 && cfg.fsync_policy == FSYNC_EVERY
+							&& release_responses(&ex)) {
+						break;
+					}
+					if (trace_id != 0) {
+						trace_span_end("command", "cmd", trace_id, trace_ns);
+					}
+					if (res) {
+						// order was no longer on the book, INVALID already sent
+						continue;
+					}
+					if (reporter_note_command(&rep)) {
+						CYCLES_TIME(CYCLES_REPORT, report_snapshot(&rep, &ex));
+					}
+
+				}
+			}
+		}
+
+		// group commit: one journal write for the commands of this iteration
+		if (ex.jrnl.current.fd != -1 && ex.num_shards == 0) {
+			release_responses(&ex);
+		}
+
+		// trader exits last, so commands a trader sent just before exiting
+		// are handled first
+		for (int i = 0; i < ready; i++) {
+			if (events[i].data.fd == sig_fd || events[i].data.fd == rep.timer_fd
+					|| events[i].data.fd == snap.timer_fd || events[i].data.fd == ex.jrnl.fail_fd) {
+				continue;
+			}
+			if (events[i].data.fd == snap.pid_fd) {
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, snap.pid_fd, NULL);
+				finish_snapshot(&snap);
+				publish_snapshot(&snap, &ex.jrnl);
+				continue;
+			}
+			curr_trader = ex.head;
+			while (curr_trader != NULL && curr_trader->pid_fd != events[i].data.fd) {
+				curr_trader = curr_trader->next;
+			}
+			if (curr_trader == NULL || curr_trader->disconnected || reap_trader(curr_trader)) {
+				continue;
+			}
+
+			// perform disconnection of terminated trader
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, curr_trader->pid_fd, NULL);
 			curr_trader->disconnected = 1; // disconnect trader
 			printf("%s Trader %d disconnected\n", LOG_PREFIX, curr_trader->trader_id);
+			log_trader_exit(curr_trader);
 			trader_disconnect++;
 		}
 	}
 
-	printf("%s Trading completed\n", LOG_PREFIX);
+	stop_control(&ctl);
+
+	// the responses held for the journal can never be released, so the
+	// traders waiting on them are stopped
+	halted = journal_failed(&ex.jrnl);
+	if (halted) {
+		printf("%s Journal failed, stopping trading\n", LOG_PREFIX);
+		stop_traders(ex.head);
+	}
+
+	/*
+	 * Threaded shutdown: every command the traders sent is read by the
+	   gateways, then applied by the shards and journaled, then the resulting
+	   events are written out before the gateways exit.
+	 */
+	if (gateways_started > 0) {
+		wait_gateways_input(&ex.gateways);
+	}
+	for (; shards_started > 0; shards_started--) {
+		stop_shard(&ex.shards[shards_started - 1]);
+	}
+	journal_stop(&ex.jrnl);
+	stop_gateways(&ex.gateways, gateways_started);
+	stop_replicator(&repl);
+	shutdown:
+	if (ex.jrnl.current.fd != -1 && !journal_failed(&ex.jrnl)) {
+		// a final snapshot lets the next start skip the whole journal
+		stop_snapshotter(&snap, &ex.jrnl);
+		start_snapshot(&snap, &ex);
+	}
+	stop_snapshotter(&snap, &ex.jrnl);
+	halted = halted || journal_failed(&ex.jrnl);
+	journal_close(&ex.jrnl);
+	if (ex.num_shards > 0) {
+		rep.pending = shards_processed(ex.shards, ex.num_shards) - rep.applied;
+	}
+
+	// flush whatever changed since the last periodic snapshot
+	if (rep.pending > 0) {
+		report_snapshot(&rep, &ex);
+	}
+
+	// merge the per-shard fee ledgers
+	double total_fees = 0;
+	for (int i = 0; i < shard_count; i++) {
+		total_fees += ex.shards[i].total_fees;
+	}
+
+	printf("%s Trading %s\n", LOG_PREFIX, halted ? "halted" : "completed");
 	printf("%s Exchange fees collected: $%.0f\n", LOG_PREFIX, total_fees);
+	if (ex.latency != NULL) {
+		report_latency(&ex, stdout, 0);
+	}
+	if (cfg.report_memory) {
+		alloc_summary(ex.num_traders);
+	}
+	CYCLES_SUMMARY();
+	perf_close(shards_processed(ex.shards, shard_count));
+	trace_close();
 
 
 	// clean-up after successful execution
-	cleanup_fifos(num_traders);
-	free_structs(&prods, head, buys, sells);
-	free_matches(matches, num_traders, prods.size);
-	return 0;
+	stop_zygote(&launch);
+	close_event_fds(epoll_fd, sig_fd, &rep);
+	cleanup_fifos(ex.num_traders);
+	free_exchange(&ex);
+	return halted;
 
 	cleanup:
 		// free all allocated memory and return 1 as an error code
-		cleanup_fifos(num_traders);
-		free_structs(&prods, head, buys, sells);
-		free_matches(matches, num_traders, prods.size);
+		stop_control(&ctl);
+		for (; shards_started > 0; shards_started--) {
+			stop_shard(&ex.shards[shards_started - 1]);
+		}
+		journal_stop(&ex.jrnl);
+		stop_gateways(&ex.gateways, gateways_started);
+		stop_replicator(&repl);
+		stop_snapshotter(&snap, &ex.jrnl);
+		journal_close(&ex.jrnl);
+		stop_zygote(&launch);
+		close_event_fds(epoll_fd, sig_fd, &rep);
+		cleanup_fifos(ex.num_traders);
+		free_exchange(&ex);
+		trace_close();
+		return 1;
+}
+
+void init_signal_mask(sigset_t *mask) {
+	sigemptyset(mask);
+	sigaddset(mask, SIGUSR1);
+}
+
+int init_reporter(reporter *rep, exchange_config *cfg) {
+	rep->every = cfg->report_every;
+	rep->pending = 0;
+	rep->applied = 0;
+	rep->timer_fd = -1;
+	if (cfg->report_interval_ms <= 0) {
+		// no timer, snapshots are only driven by the command count
+		return 0;
+	}
+
+	rep->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (rep->timer_fd == -1) {
 		return 1;
+	}
+
+	// first expiry after one interval, then periodically
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = cfg->report_interval_ms / 1000;
+	spec.it_interval.tv_nsec = (cfg->report_interval_ms % 1000) * 1000000L;
+	spec.it_value = spec.it_interval;
+	if (timerfd_settime(rep->timer_fd, 0, &spec, NULL) == -1) {
+		close(rep->timer_fd);
+		rep->timer_fd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+int reporter_note_command(reporter *rep) {
+	rep->pending++;
+	return rep->every > 0 && rep->pending >= rep->every;
+}
+
+int reporter_timer_expired(reporter *rep) {
+	// consume the expiration count so the timerfd stops being readable
+	uint64_t expirations;
+	if (read(rep->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+		return 0;
+	}
+	return rep->pending > 0;
+}
+
+void report_snapshot(reporter *rep, exchange *ex) {
+	// with matching threads running, hold every shard so the picture is
+	// consistent, but only while it is copied, not while it is printed
+	int shard_count = ex->num_shards > 0 ? ex->num_shards : 1;
+	lock_shards(ex->shards, shard_count);
+	int res = copy_report(rep, ex);
+	unlock_shards(ex->shards, shard_count);
+	if (res) {
+		printf("%s Report skipped: %s\n", LOG_PREFIX, strerror(ENOMEM));
+	} else {
+		print_report(rep, ex);
+	}
+	fflush(stdout);
+	rep->pending = 0;
+}
+
+int copy_report(reporter *rep, exchange *ex) {
+	int num_products = ex->prods.size;
+	if (rep->num_levels == NULL) {
+		rep->num_levels = (int*)pe_calloc(MEM_REPORTS, 2 * num_products, sizeof(int));
+		rep->ledger = (long*)pe_calloc(MEM_REPORTS, (size_t)ex->num_traders * num_products * 2, sizeof(long));
+		if (rep->num_levels == NULL || rep->ledger == NULL) {
+			return 1;
+		}
+	}
+
+	long total = 0;
+	for (int i = 0; i < num_products; i++) {
+		rep->num_levels[2 * i + BUY] = count_order_levels(ex->buys, i);
+		rep->num_levels[2 * i + SELL] = count_order_levels(ex->sells, i);
+		total += rep->num_levels[2 * i + BUY] + rep->num_levels[2 * i + SELL];
+	}
+	if (total > rep->levels_size) {
+		book_level *grown = (book_level*)pe_realloc(MEM_REPORTS, rep->levels, total * sizeof(book_level));
+		if (grown == NULL) {
+			return 1;
+		}
+		rep->levels = grown;
+		rep->levels_size = total;
+	}
+
+	book_level *next = rep->levels;
+	for (int i = 0; i < num_products; i++) {
+		next += copy_levels(ex->buys[i], next);
+		next += copy_levels(ex->sells[i], next);
+	}
+	for (int t = 0; t < ex->num_traders; t++) {
+		for (int i = 0; i < num_products; i++) {
+			memcpy(&rep->ledger[((long)t * num_products + i) * 2], ex->matches[t][i], 2 * sizeof(long));
+		}
+	}
+	return 0;
 }
 
-void signal_handle(int signum, siginfo_t *info, void *context) {
-	if (signum == SIGUSR1) {
-		// handle SIGUSR1
-		sigusr1 = 1;
-		usleep(1);
-	} else if (signum == SIGCHLD) {
-		// handle SIGCHLD
-		sigchld = 1;
-		usleep(1);
+void print_report(reporter *rep, exchange *ex) {
+	int num_products = ex->prods.size;
+	printf("%s\t--ORDERBOOK--\n", LOG_PREFIX);
+	book_level *levels = rep->levels;
+	for (int i = 0; i < num_products; i++) {
+		int buys = rep->num_levels[2 * i + BUY];
+		int sells = rep->num_levels[2 * i + SELL];
+		printf("%s\tProduct: %s; Buy levels: %d; Sell levels: %d\n", LOG_PREFIX,
+				ex->prods.product_strings[i], buys, sells);
+		// sells are kept best (lowest) first but printed highest first
+		for (int k = buys + sells - 1; k >= buys; k--) {
+			print_level(&levels[k], SELL);
+		}
+		for (int k = 0; k < buys; k++) {
+			print_level(&levels[k], BUY);
+		}
+		levels += buys + sells;
 	}
 
-	pid = info->si_pid;
+	printf("%s\t--POSITIONS--\n", LOG_PREFIX);
+	for (trader *curr = ex->head; curr != NULL; curr = curr->next) {
+		printf("%s\tTrader %d: ", LOG_PREFIX, curr->trader_id);
+		for (int i = 0; i < num_products; i++) {
+			long *position = &rep->ledger[((long)curr->trader_id * num_products + i) * 2];
+			printf("%s %ld ($%ld)", ex->prods.product_strings[i], position[0], position[1]);
+			if (i != num_products - 1) {
+				printf(", ");
+			}
+		}
+		printf("\n");
+	}
 }
 
-void init_sigaction(struct sigaction *sa) {
-	sa->sa_sigaction = signal_handle;
-	sigemptyset(&sa->sa_mask);
-    sa->sa_flags = SA_SIGINFO;
+void close_event_fds(int epoll_fd, int sig_fd, reporter *rep) {
+	if (rep->timer_fd != -1) {
+		close(rep->timer_fd);
+	}
+	pe_free(rep->num_levels);
+	pe_free(rep->levels);
+	pe_free(rep->ledger);
+	if (epoll_fd != -1) {
+		close(epoll_fd);
+	}
+	close(sig_fd);
 }
 
 int init_product_list(char products_file[], products *prods) {
@@ -193,15 +768,15 @@ int init_product_list(char products_file[], products *prods) {
 
 	char line[PRODUCT_STR_LEN + 1]; // holds a single product string
 	int count = 0;
-	prods->product_strings = malloc(prods->size * sizeof(char*));
+	prods->product_strings = pe_malloc(MEM_PRODUCTS, prods->size * sizeof(char*));
 	// read each product string into array
 	while (fgets(line, PRODUCT_STR_LEN + 1, fp) != NULL) {
 		line[strcspn(line, "\n")] = '\0'; // remove trailing newline
 
-		char *new_line = malloc(strlen(line) + 1);
+		char *new_line = pe_malloc(MEM_PRODUCTS, strlen(line) + 1);
 		strcpy(new_line, line);
 
-		prods->product_strings = realloc(prods->product_strings, (count + 1) * sizeof(char*));
+		prods->product_strings = pe_realloc(MEM_PRODUCTS, prods->product_strings, (count + 1) * sizeof(char*));
 		prods->product_strings[count] = new_line;
 		count++;
 	}
@@ -217,945 +792,432 @@ int init_product_list(char products_file[], products *prods) {
 	return 0;
 }
 
-void init_matches(long ****matches, int num_traders, int prods_size) {
-	*matches = (long***)malloc(num_traders * sizeof(long**));
-	for (int i = 0; i < num_traders; i++) {
-		(*matches)[i] = (long**)calloc(prods_size, sizeof(long*));
-		for (int j = 0; j < prods_size; j++) {
-			(*matches)[i][j] = (long*)calloc(2, sizeof(long));
-		}
+int spawn_and_communicate(int num_traders, char **argv, trader **head, launcher *launch, cpu_list *pin_traders, long connect_timeout_ms) {
+	int res = 1;
+	int num_connected = 0;
+	int num_launched = 0;
+	int num_exited = 0;
+	handshake *hs = (handshake*)calloc(num_traders, sizeof(handshake));
+	int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (hs == NULL || inotify_fd == -1 || epoll_fd == -1) {
+		goto done;
 	}
-}
 
-int spawn_and_communicate(int num_traders, char **argv, trader **head) {
-	int trader_id = 0;
-	int exchange_path_len = 0;
-	int trader_path_len = 0;
-	char *exchange_fifo_path = NULL;
-	char *trader_fifo_path = NULL;
-	trader *prev = *head; // tracks the last trader added to the list
-	pid_t forked_pid = -1;
-	for (trader_id = 0; trader_id < num_traders; trader_id++) {
+	/*
+	 * 1. Create every fifo up front and open the exchange's ends without
+	      blocking. The exchange fifo is opened read-write for now so the
+	      trader's read-only open returns straight away; inotify tells us when
+	      the trader has opened each fifo.
+	 */
+	for (int trader_id = 0; trader_id < num_traders; trader_id++) {
+		handshake *h = &hs[trader_id];
+		h->exchange_wd = -1;
+		h->trader_wd = -1;
+
 		// get the length of each path
-		exchange_path_len = snprintf(NULL, 0, FIFO_EXCHANGE, trader_id);
-		trader_path_len = snprintf(NULL, 0, FIFO_TRADER, trader_id);
+		int exchange_path_len = snprintf(NULL, 0, FIFO_EXCHANGE, trader_id);
+		int trader_path_len = snprintf(NULL, 0, FIFO_TRADER, trader_id);
 
 		// allocate memory based on the len we got above
-		exchange_fifo_path = malloc(exchange_path_len + 1);
-		trader_fifo_path = malloc(trader_path_len + 1);
+		h->exchange_path = malloc(exchange_path_len + 1);
+		h->trader_path = malloc(trader_path_len + 1);
 
 		// format strings and store in correspondingly labelled areas
-		snprintf(exchange_fifo_path, exchange_path_len + 1, FIFO_EXCHANGE, trader_id);
-		snprintf(trader_fifo_path, trader_path_len + 1, FIFO_TRADER, trader_id);
+		snprintf(h->exchange_path, exchange_path_len + 1, FIFO_EXCHANGE, trader_id);
+		snprintf(h->trader_path, trader_path_len + 1, FIFO_TRADER, trader_id);
 
 		// delete existing fifos
-		unlink(exchange_fifo_path);
-		unlink(trader_fifo_path);
-
-		// create the fifos and print corresponding creation notification
-		int res = mkfifo(exchange_fifo_path, 0666);
-		if (res < 0) {
-			free(exchange_fifo_path);
-			free(trader_fifo_path);
-			return 1;
-		}
-		printf("%s Created FIFO %s\n", LOG_PREFIX, exchange_fifo_path);
+		unlink(h->exchange_path);
+		unlink(h->trader_path);
 
-		res = mkfifo(trader_fifo_path, 0666);
-		if (res < 0) {
-			free(exchange_fifo_path);
-			free(trader_fifo_path);
-			return 1;
-		}
-		printf("%s Created FIFO %s\n", LOG_PREFIX, trader_fifo_path);
-
-		// fork and exec the trader after creating its fifos
-		printf("%s Starting trader %d ", LOG_PREFIX, trader_id);
-		printf("(%s)\n", argv[TRADERS_START + trader_id]);
-		forked_pid = fork();
-		if (forked_pid < 0) {
-			return 1;
-		} else if (forked_pid == 0) {
-			// exec trader binaries from child process
-			// first, convert trader ID into a string
-			int tid_len = snprintf(NULL, 0, "%d", trader_id);
-			char *tid_str = malloc(tid_len + 1); // no need to free
-			snprintf(tid_str, tid_len + 1, "%d", trader_id);
-			char *args[] = {argv[TRADERS_START + trader_id], tid_str, NULL};
-			execv(args[0], args);
-			return 1; // should never reach here, so return error code if we do
+		// create the fifos
+		if (mkfifo(h->exchange_path, 0666) < 0 || mkfifo(h->trader_path, 0666) < 0) {
+			goto done;
 		}
 
-		// connect to named pipes, create a new trader and add it to list
-		trader *new_trader = malloc(sizeof(trader));
-		new_trader->fd[1] = open(exchange_fifo_path, O_WRONLY);
-		printf("%s Connected to %s\n", LOG_PREFIX, exchange_fifo_path);
-		new_trader->fd[0] = open(trader_fifo_path, O_RDONLY);
-		printf("%s Connected to %s\n", LOG_PREFIX, trader_fifo_path);
-		if (new_trader->fd[0] < 0 || new_trader->fd[1] < 0) {
-			return 1;
+		h->t = (trader*)pe_calloc(MEM_TRADERS, 1, sizeof(trader));
+		h->t->trader_id = trader_id;
+		h->t->fd[0] = -1;
+		h->t->fd[1] = -1;
+		h->t->pid_fd = -1;
+		h->t->fd[1] = open(h->exchange_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		h->t->fd[0] = open(h->trader_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (h->t->fd[0] < 0 || h->t->fd[1] < 0) {
+			goto done;
 		}
-		// initialize trader data fields
-		new_trader->trader_id = trader_id;
-		new_trader->process_id = forked_pid;
-		new_trader->max_order_id = 0;
-		new_trader->disconnected = 0;
-
-		// add the newly opened trader to the head of the list
-		new_trader->next = NULL;
-		if (*head == NULL) {
-			// empty list -- make new trader the head
-			*head = new_trader;
-		} else {
-			prev->next = new_trader;
+		h->exchange_wd = inotify_add_watch(inotify_fd, h->exchange_path, IN_OPEN);
+		h->trader_wd = inotify_add_watch(inotify_fd, h->trader_path, IN_OPEN);
+		if (h->exchange_wd == -1 || h->trader_wd == -1) {
+			goto done;
 		}
-		prev = new_trader;
-
-		free(exchange_fifo_path);
-		free(trader_fifo_path);
 	}
 
-	return 0;
-}
-
-int read_and_format_message(trader *curr_trader, char *message_in) {
-	int bytes_read = read(curr_trader->fd[0], message_in, BUF_SIZE);
-	if (bytes_read < 0) {
-		return 1;
-	}
-
-	// put the string into proper format
-	int delim_index = 0;
-    for (int i = 0; i < BUF_SIZE; i++) {
-        // look for the ; delimiter
-        if (message_in[i] == ';') {
-            delim_index = i;
-            break;
-        } else if (i == 255) {
-            // reached end of data without finding delimiter
-            return 1;
-        }
-    }
-	message_in[delim_index] = '\0';
-	return 0;
-}
-
-int determine_cmd_type(char *message_in) {
-	// extract the command type from the incomming message
-	char type[CMD_LEN];
-	int res = sscanf(message_in, "%s", type);
-	if (res != 1) {
-		return -1;
-	}
-
-	// return the corresponding flag
-	if (strcmp(type, "BUY") == 0) {
-		return BUY;
-	} else if (strcmp(type, "SELL") == 0) {
-		return SELL;
-	} else if (strcmp(type, "AMEND") == 0) {
-		return AMEND;
-	} else if (strcmp(type, "CANCEL") == 0) {
-		return CANCEL;
-	}
-
-	return -1;
-}
-
-int execute_command(trader *curr_trader, char *message_in, int cmd_type, products* prods, int *product_index, int *total_order_num, order ***buys, order ***sells, trader *head) {
-	if (curr_trader == NULL) {
-		return 1;
-	} else if (cmd_type == -1) {
-		return 1;
-	}
-
-	if (cmd_type == BUY || cmd_type == SELL) {
-		// make a new order and add to its respective list
-		char cmd[CMD_LEN]; // buy, sell, amend, cancel strings
-		char product[PRODUCT_STR_LEN];
-		int order_id;
-		long quantity;
-		long price;
-		int res = sscanf(message_in, "%s %d %s %ld %ld", cmd, &order_id, product, &quantity, &price);
-		if (res < 5) {
-			return 1;
+	// 2. launch every trader without waiting for any of them
+	for (int trader_id = 0; trader_id < num_traders; trader_id++) {
+		pid_t launched_pid = launch_trader(launch, argv[TRADERS_START + trader_id], trader_id);
+		if (launched_pid < 0) {
+			// e.g. a missing binary, the trader is left out below
+			hs[trader_id].launch_error = errno;
+			continue;
 		}
-
-		// hacky way to ignore trailing arguments
-		char qty_buf[BUF_SIZE];
-		char price_buf[BUF_SIZE];
-		char oid_buf[BUF_SIZE];
-		sprintf(qty_buf, "%ld", quantity);
-		sprintf(price_buf, "%ld", price);
-		sprintf(oid_buf, "%d", order_id);
-		long total_len = strlen(cmd) + strlen(product) + strlen(qty_buf) + strlen(price_buf) + strlen(oid_buf) + 4;
-		if (total_len < strlen(message_in)) {
-			return 1;
+		hs[trader_id].t->process_id = launched_pid;
+		hs[trader_id].t->pid_fd = pidfd_open(launched_pid, 0);
+		if (hs[trader_id].t->pid_fd == -1) {
+			goto done;
 		}
-
-		// validate order
-		*product_index = get_product_index(prods, product);
-		if (*product_index == -1) {
-			return 1;
-		} else if (order_id < OID_MIN || order_id > OID_MAX) {
-			return 1;
-		} else if (quantity < ORDER_MIN || quantity > ORDER_MAX) {
-			return 1;
-		} else if (price < ORDER_MIN || price > ORDER_MAX) {
-			return 1;
-		} else if (order_id != curr_trader->max_order_id) {
-			// non-consecutive order ID
-			return 1;
+		num_launched++;
+
+		// affinity survives the exec, so the trader can be pinned from here
+		int cpu = pick_cpu(pin_traders, trader_id);
+		if (cpu >= 0) {
+			char label[BUF_SIZE];
+			snprintf(label, BUF_SIZE, "trader %d", trader_id);
+			set_placement(launched_pid, label, cpu, 0);
 		}
+	}
 
-		// check that OID is not a duplicate
-		if (cmd_type == BUY) {
-			order *curr = (*buys)[*product_index];
-			while (curr != NULL) {
-				if (curr->order_id == order_id && curr->trader_id == curr_trader->trader_id) {
-					return 1;
-				}
-				curr = curr->next;
+	// 3. complete connections as the traders open their fifos
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = inotify_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev);
+	// a trader that dies during startup is noticed straight away
+	for (int trader_id = 0; trader_id < num_traders; trader_id++) {
+		if (hs[trader_id].t->pid_fd != -1) {
+			ev.data.fd = hs[trader_id].t->pid_fd;
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+		}
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long deadline_ms = now.tv_sec * 1000L + now.tv_nsec / 1000000L + connect_timeout_ms;
+	// inotify events are variable length, keep the buffer aligned for them
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (num_connected + num_exited < num_launched) {
+		int wait_ms = -1;
+		if (connect_timeout_ms > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait_ms = (int)(deadline_ms - (now.tv_sec * 1000L + now.tv_nsec / 1000000L));
+			if (wait_ms <= 0) {
+				break;
 			}
-
-		} else if (cmd_type == SELL) {
-			order *curr = (*sells)[*product_index];
-			while (curr != NULL) {
-				if (curr->order_id == order_id && curr->trader_id == curr_trader->trader_id) {
-					return 1;
+		}
+		int ready = epoll_wait(epoll_fd, &ev, 1, wait_ms);
+		if (ready == -1 && errno != EINTR) {
+			goto done;
+		} else if (ready <= 0) {
+			continue;
+		} else if (ev.data.fd != inotify_fd) {
+			for (int i = 0; i < num_traders; i++) {
+				if (hs[i].t->pid_fd == ev.data.fd && !hs[i].exited && !reap_trader(hs[i].t)) {
+					epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ev.data.fd, NULL);
+					hs[i].exited = 1;
+					if (!hs[i].connected) {
+						num_exited++;
+					}
 				}
-				curr = curr->next;
 			}
+			continue;
 		}
 
-		// send appropriate message to all traders
-		int msg_len;
-		char *msg;
-		trader *cursor = head;
-		while (cursor != NULL) {
-			if (cursor->process_id == curr_trader->process_id && !(curr_trader->disconnected)) {
-				// write accepted to trader that made the order
-				msg_len = snprintf(NULL, 0 , "ACCEPTED %d;", order_id);
-				msg = malloc(msg_len + 1);
-				snprintf(msg, msg_len + 1, "ACCEPTED %d;", order_id);
-				write(curr_trader->fd[1], msg, strlen(msg));
-				free(msg);
-			} else if (!(cursor->disconnected)) {
-				// let the other traders now about the new order
-				if (cmd_type == BUY) {
-					// send MARKET BUY
-					msg_len = snprintf(NULL, 0, "MARKET BUY %s %ld %ld;", product, quantity, price);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "MARKET BUY %s %ld %ld;", product, quantity, price);
-					write(cursor->fd[1], msg, strlen(msg));
-					free(msg);
-				} else if (cmd_type == SELL) {
-					// send MARKET SELL
-					msg_len = snprintf(NULL, 0, "MARKET SELL %s %ld %ld;", product, quantity, price);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "MARKET SELL %s %ld %ld;", product, quantity, price);
-					write(cursor->fd[1], msg, strlen(msg));
-					free(msg);
+		ssize_t len;
+		while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+			for (char *cursor = buf; cursor < buf + len; ) {
+				struct inotify_event *iev = (struct inotify_event*)cursor;
+				cursor += sizeof(struct inotify_event) + iev->len;
+				for (int i = 0; i < num_traders; i++) {
+					if (iev->wd == hs[i].exchange_wd) {
+						hs[i].opened |= HANDSHAKE_EXCHANGE_OPEN;
+					} else if (iev->wd == hs[i].trader_wd) {
+						hs[i].opened |= HANDSHAKE_TRADER_OPEN;
+					} else {
+						continue;
+					}
+					if (hs[i].opened == HANDSHAKE_DONE && !hs[i].connected) {
+						if (finish_handshake(&hs[i])) {
+							goto done;
+						}
+						num_connected++;
+					}
+					break;
 				}
 			}
-			kill(cursor->process_id, SIGUSR1);
-			cursor = cursor->next;
 		}
+	}
 
-		// make the new order
-		order *new_order = (order*)malloc(sizeof(order));
-		new_order->order_id = order_id;
-		new_order->trader_id = curr_trader->trader_id;
-		new_order->product = product;
-		new_order->product_index = *product_index;
-		new_order->quantity = quantity;
-		new_order->price = price;
-		new_order->global_order_num = ++(*total_order_num);
-
-		// update the maximum order ID tracker
-		curr_trader->max_order_id++;
-
-		// add the order to the corresponding list
-		if (cmd_type == BUY) {
-			// buy list is sorted in descending order of price
-			order *curr = (*buys)[*product_index];
-			order *prev = NULL;
-			while (curr != NULL && curr->price >= new_order->price) {
-				prev = curr;
-				curr = curr->next;
-			}
-
-			// insert order into its correct position
-			if (prev == NULL) {
-				// list was empty or it is the highest priced order
-				new_order->next = (*buys)[*product_index];
-				(*buys)[*product_index] = new_order;
-			} else {
-				// insert between prev and current
-				prev->next = new_order;
-				new_order->next = curr;
-			}
-
-		} else if (cmd_type == SELL) {
-			// sell list is sorted in ascending order of price
-			order *curr = (*sells)[*product_index];
-			order *prev = NULL;
-			while (curr != NULL && curr->price < new_order->price) {
-				prev = curr;
-				curr = curr->next;
-			}
-
-			// insert order into its correct position
-			if (prev == NULL) {
-				new_order->next = (*sells)[*product_index];
-				(*sells)[*product_index] = new_order;
-			} else {
-				// insert between prev and current
-				prev->next = new_order;
-				new_order->next = curr;
-			}
+	// 4. log each trader's startup in order and link up the ones that connected
+	trader *prev = NULL; // tracks the last trader added to the list
+	for (int trader_id = 0; trader_id < num_traders; trader_id++) {
+		handshake *h = &hs[trader_id];
+		printf("%s Created FIFO %s\n", LOG_PREFIX, h->exchange_path);
+		printf("%s Created FIFO %s\n", LOG_PREFIX, h->trader_path);
+		printf("%s Starting trader %d ", LOG_PREFIX, trader_id);
+		printf("(%s)\n", argv[TRADERS_START + trader_id]);
+		if (h->launch_error != 0) {
+			printf("%s Trader %d could not be started: %s, excluded\n", LOG_PREFIX, trader_id, strerror(h->launch_error));
+			continue;
 		}
-
-	} else if (cmd_type == AMEND) {
-		char cmd[CMD_LEN];
-		int order_id;
-		long quantity;
-		long price;
-		int res = sscanf(message_in, "%s %d %ld %ld", cmd, &order_id, &quantity, &price);
-		if (res < 4) {
-			return 1;
+		if (pick_cpu(pin_traders, trader_id) >= 0) {
+			char label[BUF_SIZE];
+			snprintf(label, BUF_SIZE, "trader %d", trader_id);
+			log_placement(h->t->process_id, label);
 		}
 
-		// hacky way to ignore trailing arguments
-		char qty_buf[BUF_SIZE];
-		char price_buf[BUF_SIZE];
-		char oid_buf[BUF_SIZE];
-		sprintf(qty_buf, "%ld", quantity);
-		sprintf(price_buf, "%ld", price);
-		sprintf(oid_buf, "%d", order_id);
-		long total_len = strlen(cmd) + strlen(qty_buf) + strlen(price_buf) + strlen(oid_buf) + 3;
-		if (total_len < strlen(message_in)) {
-			return 1;
+		if (h->exited && !h->connected) {
+			printf("%s Trader %d exited before connecting, excluded\n", LOG_PREFIX, trader_id);
+			log_trader_exit(h->t);
+			continue;
+		} else if (!h->connected) {
+			// a straggler doesn't hold up the market, it is left out
+			printf("%s Trader %d did not connect within %ld ms, excluded\n", LOG_PREFIX, trader_id, connect_timeout_ms);
+			pidfd_send_signal(h->t->pid_fd, SIGKILL, NULL, 0);
+			siginfo_t info;
+			waitid(P_PIDFD, h->t->pid_fd, &info, WEXITED);
+			continue;
 		}
+		printf("%s Connected to %s\n", LOG_PREFIX, h->exchange_path);
+		printf("%s Connected to %s\n", LOG_PREFIX, h->trader_path);
 
-		if (order_id < OID_MIN || order_id > OID_MAX) {
-			return 1;
-		} else if (quantity < ORDER_MIN || quantity > ORDER_MAX) {
-			return 1;
-		} else if (price < ORDER_MIN || price > ORDER_MAX) {
-			return 1;
+		// add the connected trader to the end of the list
+		if (*head == NULL) {
+			// empty list -- make new trader the head
+			*head = h->t;
+		} else {
+			prev->next = h->t;
 		}
-
-		// check BUY and SELL orders for every product
-		int break_flag = 0;
-		int order_flag = -1; // 0 --> BUY, 1 --> SELL
-		char product[PRODUCT_STR_LEN];
-		memset(product, 0, sizeof(product));
-		for (int i = 0; i < prods->size; i++) {
-			order *curr = (*buys)[i];
-			while (curr != NULL) {
-				if (curr->trader_id == curr_trader->trader_id && curr->order_id == order_id) {
-					// update the qty and price
-					curr->global_order_num = ++(*total_order_num);
-					curr->quantity = quantity;
-					curr->price = price;
-					
-					// remove the updated order from the list
-					if (curr == (*buys)[i]) {
-						(*buys)[i] = curr->next;
-					} else {
-						order *prev = (*buys)[i];
-						while (prev->next != curr) {
-							prev = prev->next;
-						}
-						prev->next = curr->next;
-					}
-
-					// find correct position after updating and remove order
-					order *insert_after = NULL;
-					order *insert_before = (*buys)[i];
-					while (insert_before != NULL && insert_before->price >= price) {
-						insert_after = insert_before;
-						insert_before = insert_before->next;
-					}
-
-					// insert the order at its new position
-					if (insert_after == NULL) {
-						curr->next = (*buys)[i];
-						(*buys)[i] = curr;
-					} else {
-						curr->next = insert_before;
-						insert_after->next = curr;
-					}
-
-					strcpy(product, prods->product_strings[i]);
-					break_flag = 1;
-					order_flag = 0;
-					break;
+		prev = h->t;
+		h->t = NULL;
+	}
+	res = 0;
+
+	done:
+		// free whatever didn't make it into the trader list
+		for (int trader_id = 0; hs != NULL && trader_id < num_traders; trader_id++) {
+			if (hs[trader_id].t != NULL) {
+				if (hs[trader_id].t->fd[0] >= 0) {
+					close(hs[trader_id].t->fd[0]);
 				}
-				curr = curr->next;
-			}
-
-			if (break_flag) {
-				break;
+				if (hs[trader_id].t->fd[1] >= 0) {
+					close(hs[trader_id].t->fd[1]);
+				}
+				if (hs[trader_id].t->pid_fd >= 0) {
+					close(hs[trader_id].t->pid_fd);
+				}
+				pe_free(hs[trader_id].t);
 			}
+			free(hs[trader_id].exchange_path);
+			free(hs[trader_id].trader_path);
+		}
+		free(hs);
+		if (inotify_fd != -1) {
+			close(inotify_fd);
+		}
+		if (epoll_fd != -1) {
+			close(epoll_fd);
+		}
+		return res;
+}
 
-			curr = (*sells)[i];
-			while (curr != NULL) {
-				if (curr->trader_id == curr_trader->trader_id && curr->order_id == order_id) {
-					// update qty and price
-					curr->global_order_num = ++(*total_order_num);
-					curr->quantity = quantity;
-					curr->price = price;
-
-					// remove the updated order from the list
-					if (curr == (*sells)[i]) {
-						(*sells)[i] = curr->next;
-					} else {
-						order *prev = (*sells)[i];
-						while (prev->next != curr) {
-							prev = prev->next;
-						}
-						prev->next = curr->next;
-					}
+int finish_handshake(handshake *h) {
+	// the trader is reading now, swap the placeholder for a plain write end
+	int write_fd = open(h->exchange_path, O_WRONLY | O_CLOEXEC | O_NONBLOCK);
+	if (write_fd < 0) {
+		return 1;
+	}
+	close(h->t->fd[1]);
+	h->t->fd[1] = write_fd;
 
-					// find correct position after updating and remove order
-					order *insert_after = NULL;
-					order *insert_before = (*sells)[i];
-					while (insert_before != NULL && insert_before->price <= price) {
-						insert_after = insert_before;
-						insert_before = insert_before->next;
-					}
+	// from here on the fifos behave like blocking opens did
+	fcntl(h->t->fd[1], F_SETFL, fcntl(h->t->fd[1], F_GETFL) & ~O_NONBLOCK);
+	fcntl(h->t->fd[0], F_SETFL, fcntl(h->t->fd[0], F_GETFL) & ~O_NONBLOCK);
+	h->connected = 1;
+	return 0;
+}
 
-					// insert the order at its new position
-					if (insert_after == NULL) {
-						curr->next = (*sells)[i];
-						(*sells)[i] = curr;
-					} else {
-						curr->next = insert_before;
-						insert_after->next = curr;
-					}
+int read_and_format_message(trader *curr_trader, char *message_in) {
+	int bytes_read = read(curr_trader->fd[0], message_in, BUF_SIZE);
+	if (bytes_read < 0) {
+		return 1;
+	}
 
-					strcpy(product, prods->product_strings[i]);
-					break_flag = 1;
-					order_flag = 1;
-					break;
-				}
-				curr = curr->next;
-			}
+	// put the string into proper format
+	return format_message(message_in, bytes_read);
+}
 
-			if (break_flag) {
-				break;
-			}
-		}
+int validate_command(trader *curr_trader, command *cmd, products *prods) {
+	cmd->trader_id = curr_trader->trader_id;
 
-		if (!break_flag) {
+	if (cmd->type == BUY || cmd->type == SELL) {
+		cmd->product_index = get_product_index(prods, cmd->product);
+		if (cmd->product_index == -1) {
+			return 1;
+		} else if (cmd->order_id != curr_trader->max_order_id) {
+			// non-consecutive order ID
 			return 1;
 		}
 
-		// send appropriate message to all traders
-		int msg_len;
-		char *msg;
-		trader *cursor = head;
-		while (cursor != NULL) {
-			if (cursor->process_id == curr_trader->process_id && !(curr_trader->disconnected)) {
-				// write accepted to trader that made the order
-				msg_len = snprintf(NULL, 0 , "AMENDED %d;", order_id);
-				msg = malloc(msg_len + 1);
-				snprintf(msg, msg_len + 1, "AMENDED %d;", order_id);
-				write(curr_trader->fd[1], msg, strlen(msg));
-				free(msg);
-			} else if (!(cursor->disconnected)) {
-				// let the other traders now about the new order
-				if (!order_flag) {
-					// send MARKET BUY
-					msg_len = snprintf(NULL, 0, "MARKET BUY %s %ld %ld;", product, quantity, price);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "MARKET BUY %s %ld %ld;", product, quantity, price);
-					write(cursor->fd[1], msg, strlen(msg));
-					free(msg);
-				} else if (order_flag) {
-					// send MARKET SELL
-					msg_len = snprintf(NULL, 0, "MARKET SELL %s %ld %ld;", product, quantity, price);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "MARKET SELL %s %ld %ld;", product, quantity, price);
-					write(cursor->fd[1], msg, strlen(msg));
-					free(msg);
-				}
+		// remember the order's product so AMEND and CANCEL go to the right book
+		if (cmd->order_id >= curr_trader->order_products_size) {
+			int new_size = curr_trader->order_products_size ? curr_trader->order_products_size * 2 : 64;
+			int *resized = pe_realloc(MEM_TRADERS, curr_trader->order_products, new_size * sizeof(int));
+			if (resized == NULL) {
+				return 1;
 			}
-			kill(cursor->process_id, SIGUSR1);
-			cursor = cursor->next;
+			curr_trader->order_products = resized;
+			curr_trader->order_products_size = new_size;
 		}
+		curr_trader->order_products[cmd->order_id] = cmd->product_index;
 
-	} else if (cmd_type == CANCEL) {
-		char cmd[CMD_LEN];
-		int order_id;
-		int res = sscanf(message_in, "%s %d", cmd, &order_id);
-		if (order_id < OID_MIN || order_id > OID_MAX) {
-			return 1;
-		} else if (res < 2) {
-			return 1;
-		}
+		// update the maximum order ID tracker
+		curr_trader->max_order_id++;
 
-		// hacky way to ignore trailing arguments
-		char oid_buf[BUF_SIZE];
-		sprintf(oid_buf, "%d", order_id);
-		long total_len = strlen(cmd) + strlen(oid_buf) + 1;
-		if (total_len < strlen(message_in)) {
+	} else if (cmd->type == AMEND || cmd->type == CANCEL) {
+		if (cmd->order_id >= curr_trader->max_order_id) {
+			// the trader never placed this order
 			return 1;
 		}
+		cmd->product_index = curr_trader->order_products[cmd->order_id];
 
-		// check BUY and SELL orders for every product
-		int break_flag = 0;
-		int order_flag = -1; // 0 --> BUY, 1 --> SELL
-		char product[PRODUCT_STR_LEN];
-		memset(product, 0, sizeof(product));
-		for (int i = 0; i < prods->size; i++) {
-			// search the BUY orders
-			order *curr = (*buys)[i];
-			order *prev = NULL;
-			order *temp = (*buys)[i];
-			while (curr != NULL) {
-				if (curr->trader_id == curr_trader->trader_id && curr->order_id == order_id) {
-					// delete the matching buy order
-					if (curr == (*buys)[i]) {
-						// order to remove is the head
-						(*buys)[i] = curr->next;
-						strcpy(product, prods->product_strings[i]);
-						free(temp);
-						break_flag = 1;
-						order_flag = 0;
-						break;
-					} else {
-						// order is not head of list
-						prev->next = curr->next;
-						strcpy(product, prods->product_strings[i]);
-						free(curr);
-						break_flag = 1;
-						order_flag = 0;
-						break;
-					}
-				}
-				prev = curr;
-				curr = curr->next;
-			}
-
-			if (break_flag) {
-				break;
-			}
+	} else {
+		return 1;
+	}
 
-			// search the SELL orders
-			curr = (*sells)[i];
-			prev = NULL;
-			temp = (*sells)[i];
-			while (curr != NULL) {
-				if (curr->trader_id == curr_trader->trader_id && curr->order_id == order_id) {
-					// delete matching sell order
-					if (curr == (*sells)[i]) {
-						// order to remove is the head
-						(*sells)[i] = curr->next;
-						strcpy(product, prods->product_strings[i]);
-						free(temp);
-						break_flag = 1;
-						order_flag = 1;
-						break;
-					} else {
-						// order is not head of list
-						prev->next = curr->next;
-						strcpy(product, prods->product_strings[i]);
-						free(curr);
-						break_flag = 1;
-						order_flag = 1;
-						break;
-					}
-				}
-				prev = curr;
-				curr = curr->next;
-			}
+	return 0;
+}
 
-			if (break_flag) {
-				break;
-			}
-		}
-		if (!break_flag) {
-			// no matching order was found
-			return 1;
+void deliver_event(void *ctx, event *ev) {
+	exchange *ex = (exchange*)ctx;
+
+	if (ev->type == EVENT_MATCH) {
+		char line[BUF_SIZE];
+		format_event(line, ev, 0, &ex->prods);
+		fputs(line, stdout);
+	} else if (ev->type == EVENT_FILL || ev->type == EVENT_INVALID) {
+		// only the trader the event concerns is told
+		trader *target = get_trader(-1, ev->trader_id, ex->head);
+		if (target != NULL) {
+			send_event(target, ev, &ex->prods);
 		}
-
-		// send appropriate message to all traders
-		int msg_len;
-		char *msg;
-		trader *cursor = head;
+	} else {
+		trader *cursor = ex->head;
 		while (cursor != NULL) {
-			if (cursor->process_id == curr_trader->process_id && !(curr_trader->disconnected)) {
-				// write accepted to trader that made the order
-				msg_len = snprintf(NULL, 0 , "CANCELLED %d;", order_id);
-				msg = malloc(msg_len + 1);
-				snprintf(msg, msg_len + 1, "CANCELLED %d;", order_id);
-				write(curr_trader->fd[1], msg, strlen(msg));
-				free(msg);
-			} else if (!(cursor->disconnected)) {
-				// let the other traders now about the new order
-				if (!order_flag) {
-					// send MARKET BUY
-					msg_len = snprintf(NULL, 0, "MARKET BUY %s 0 0;", product);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "MARKET BUY %s 0 0;", product);
-					write(cursor->fd[1], msg, strlen(msg));
-					free(msg);
-				} else if (order_flag) {
-					// send MARKET SELL
-					msg_len = snprintf(NULL, 0, "MARKET SELL %s 0 0;", product);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "MARKET SELL %s 0 0;", product);
-					write(cursor->fd[1], msg, strlen(msg));
-					free(msg);
-				}
-			}
-			kill(cursor->process_id, SIGUSR1);
+			send_event(cursor, ev, &ex->prods);
 			cursor = cursor->next;
 		}
 	}
-	return 0;
+	latency_record_event(ex->latency, ev->type, &ev->times, ev->match_ns);
 }
 
-void display_orderbook(products *prods, order **buys, order **sells) {
-	printf("%s\t--ORDERBOOK--\n", LOG_PREFIX);
-	for (int i = 0; i < prods->size; i++) {
-		printf("%s\tProduct: %s; Buy levels: %d; Sell levels: %d\n", LOG_PREFIX,
-				prods->product_strings[i], count_order_levels(buys, i),
-				count_order_levels(sells, i));
-		display_orders(sells, i, SELL);
-		display_orders(buys, i, BUY);
+void hold_event(void *ctx, event *ev) {
+	exchange *ex = (exchange*)ctx;
+	if (ev->type == EVENT_MATCH) {
+		// the log isn't a response, it doesn't wait for the journal
+		deliver_event(ex, ev);
+		return;
 	}
+	collect_event(&ex->outbox, ev);
 }
 
-int count_order_levels(order **list, int product_index) {
-	int count = 0;
-	int prev_price = -1;
-	order *curr = list[product_index];
-	while (curr != NULL) {
-		if (curr->price == prev_price) {
-			curr = curr->next;
-			continue;
-		}
-		count++;
-		prev_price = curr->price;
-		curr = curr->next;
+int release_responses(exchange *ex) {
+	uint64_t flush_ns = trace_sample_flush() ? latency_now() : 0;
+	int res = 0;
+	CYCLES_TIME(CYCLES_JOURNAL, res = journal_commit(&ex->jrnl));
+	if (res) {
+		// their commands aren't on disk, the traders must never see them
+		return 1;
 	}
-	return count;
-}
-
-void display_orders(order **list, int product_index, int order_type) {
-	if (order_type == BUY) {
-		order *curr = list[product_index];
-		int count = 1; // orders with identical quantity and price (same level)
-		long total_qty;
-		while (curr != NULL) {
-			order *runner = curr->next;
-			count = 1;
-			total_qty = curr->quantity;
-			while (runner != NULL && runner->price == curr->price) {
-				count++;
-				total_qty += runner->quantity;
-				runner = runner->next;
-			}
-			if (count > 1) {
-				printf("%s\t\tBUY %ld @ $%ld (%d orders)\n", LOG_PREFIX, total_qty, curr->price, count);
-			} else if (count == 1) {
-				printf("%s\t\tBUY %ld @ $%ld (%d order)\n", LOG_PREFIX, total_qty, curr->price, count);
-			}
-			curr = runner;
-		}
-	} else if (order_type == SELL) {
-		print_sell_orders_reverse(list, product_index);
+	for (int i = 0; i < ex->outbox.len; i++) {
+		CYCLES_TIME(CYCLES_BROADCAST, deliver_event(ex, &ex->outbox.events[i]));
 	}
+	if (flush_ns != 0 && ex->outbox.len > 0) {
+		trace_span_end("flush", "events", ex->outbox.len, flush_ns);
+	}
+	ex->outbox.len = 0;
+	return 0;
 }
 
-void display_positions(trader *head, long ***matches, products *prods) {
-	// loop through and print each trader's positions for each product
-	printf("%s\t--POSITIONS--\n", LOG_PREFIX);
-	trader *curr = head;
-	while (curr != NULL) {
-		printf("%s\tTrader %d: ", LOG_PREFIX, curr->trader_id);
-		for (int i = 0; i < prods->size; i++) {
-			printf("%s %ld ($%ld)", prods->product_strings[i], matches[curr->trader_id][i][0], matches[curr->trader_id][i][1]);
-			if (i != prods->size - 1) {
-				printf(", ");
-			}
-		}
-		printf("\n");
-		curr = curr->next;
+void report_latency(exchange *ex, FILE *out, int json) {
+	latency_recorder *recs[MAX_GATEWAYS + 1];
+	int num_recs = 0;
+	recs[num_recs++] = ex->latency;
+	for (int i = 0; i < ex->gateways.size; i++) {
+		recs[num_recs++] = ex->gateways.list[i].latency;
 	}
+	print_latency(out, recs, num_recs, json);
 }
 
-void find_matches(long ****matches, order ***buys, order ***sells, trader *head, double *total_trading_fees, int product_index) {
-	// store the head of the BUY and SELL lists for the most recently added prod
-	order *prod_buys = (*buys)[product_index];
-	order *prod_sells = (*sells)[product_index];
-
-	if (prod_buys == NULL || prod_sells == NULL) {
-		// empty BUY or SELL list for this product
+void reject_message(exchange *ex, trader *t) {
+	counter_add(&t->rejected, 1);
+	if (ex->jrnl.current.fd != -1) {
+		event invalid;
+		memset(&invalid, 0, sizeof(event));
+		invalid.type = EVENT_INVALID;
+		invalid.trader_id = t->trader_id;
+		collect_event(&ex->outbox, &invalid);
 		return;
 	}
+	write(t->fd[1], "INVALID;", strlen("INVALID;"));
+	signal_trader(t);
+}
 
-	// variables used for writing to the traders
+void send_event(trader *t, event *ev, products *prods) {
+	char msg[BUF_SIZE];
 	int msg_len;
-	char *msg;
-
-	double trading_fee = 0;
-	long trading_sum = 0; // tracks the total value of the trade
-	while (prod_buys != NULL && prod_sells != NULL) {
-		// we match off the top of both lists as long as orders exist
-		trading_fee = 0;
-		trading_sum = 0;
-		if (prod_buys->price >= prod_sells->price) {
-			// match if the price of BUY was greater than the price of the SELL
-
-			/*
-			 * We have the following 3 cases for a match:
-			 	1. The qty to BUY is less than the qty to SELL
-					--> Delete BUY, keep SELL
-				2. The qty to BUY is equal to the qty to SELL
-					--> Delete both BUY and SELL
-				3. The qty to BUY is greater than the qty to Sell
-					--> Keep BUY, delete SELL
-			 */
-		
-			if (prod_buys->quantity < prod_sells->quantity) {
-				// compute price of the trade, this is based on the older order
-				if (prod_buys->global_order_num > prod_sells->global_order_num) {
-					trading_sum = prod_sells->price * prod_buys->quantity;
-				} else {
-					trading_sum = prod_buys->price * prod_buys->quantity;
-				}
-
-				// compute fee of the trade
-				trading_fee = trading_sum * FEE_PERCENTAGE;
-				long rounding = (long)(trading_fee + 0.5f);
-				trading_fee = (double)(rounding); // rounded to nearest decimal
-
-				// update the total trading fees sum
-				*total_trading_fees += trading_fee;
-
-				// reduce the amount of product avaliable for this sell order
-				prod_sells->quantity -= prod_buys->quantity;
-
-				// cache the details of the trade
-				(*matches)[prod_buys->trader_id][product_index][0] += prod_buys->quantity;
-				(*matches)[prod_buys->trader_id][product_index][1] -= trading_sum;
-				(*matches)[prod_sells->trader_id][product_index][0] -= prod_buys->quantity;
-				(*matches)[prod_sells->trader_id][product_index][1] += (long)(trading_sum);
-
-				// charge trader that made the newer with fees
-				if (prod_buys->global_order_num > prod_sells->global_order_num) {
-					(*matches)[prod_buys->trader_id][product_index][1] -= trading_fee;
-				} else {
-					(*matches)[prod_sells->trader_id][product_index][1] -= trading_fee;
-				}
-
-				// get the traders involved in the match
-				trader *buyer = get_trader(-1, prod_buys->trader_id, head);
-				trader *seller = get_trader(-1, prod_sells->trader_id, head);
-
-				// print the results of the trade to stdout
-				if (prod_buys->global_order_num > prod_sells->global_order_num) {
-					printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%.0f.\n",
-				 		LOG_PREFIX, prod_sells->order_id, prod_sells->trader_id, 
-						prod_buys->order_id, prod_buys->trader_id, 
-						trading_sum, trading_fee);
-				} else {
-					printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%.0f.\n",
-				 		LOG_PREFIX, prod_buys->order_id, prod_buys->trader_id, 
-						prod_sells->order_id, prod_sells->trader_id, 
-						trading_sum, trading_fee);
-				}
-
-				// send fill messages to traders involved
-				if (!(buyer->disconnected)) {
-					// send FILL only if buyer has not disconnected
-					msg_len = snprintf(NULL, 0, "FILL %d %ld;", prod_buys->order_id, prod_buys->quantity);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "FILL %d %ld;", prod_buys->order_id, prod_buys->quantity);
-					write(buyer->fd[1], msg, strlen(msg));
-					kill(buyer->process_id, SIGUSR1);
-					free(msg);
-				} 
-				
-				if (!(seller->disconnected)) {
-					// send FILL only if seller has not disconnected
-					msg_len = snprintf(NULL, 0, "FILL %d %ld;", prod_sells->order_id, prod_buys->quantity);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "FILL %d %ld;", prod_sells->order_id, prod_buys->quantity);
-					write(seller->fd[1], msg, strlen(msg));
-					kill(seller->process_id, SIGUSR1);
-					free(msg);
-				}
-
-				// remove the BUY order from the list
-				order *to_delete = (*buys)[product_index];
-				(*buys)[product_index] = ((*buys)[product_index])->next;
-				free(to_delete);
-				prod_buys = (*buys)[product_index]; // move to the next order
-
-			} else if (prod_buys->quantity == prod_sells->quantity) {
-				// compute price of the trade, this is based on the older order
-				if (prod_buys->global_order_num > prod_sells->global_order_num) {
-					trading_sum = prod_sells->price * prod_sells->quantity;
-				} else {
-					trading_sum = prod_buys->price * prod_sells->quantity;
-				}
-
-				// compute fee of the trade
-				trading_fee = trading_sum * FEE_PERCENTAGE;
-				long rounding = (long)(trading_fee + 0.5f);
-				trading_fee = (double)(rounding);
-
-				// update the total trading fees sum
-				*total_trading_fees += trading_fee;
-
-				// cache the details of the trade
-				(*matches)[prod_buys->trader_id][product_index][0] += prod_buys->quantity;
-				(*matches)[prod_buys->trader_id][product_index][1] -= trading_sum;
-				(*matches)[prod_sells->trader_id][product_index][0] -= prod_sells->quantity;
-				(*matches)[prod_sells->trader_id][product_index][1] += (long)(trading_sum);
-
-				// charge trader that made the newer with fees
-				if (prod_buys->global_order_num > prod_sells->global_order_num) {
-					(*matches)[prod_buys->trader_id][product_index][1] -= trading_fee;
-				} else {
-					(*matches)[prod_sells->trader_id][product_index][1] -= trading_fee;
-				}
-
-				// get the traders involved in the match
-				trader *buyer = get_trader(-1, prod_buys->trader_id, head);
-				trader *seller = get_trader(-1, prod_sells->trader_id, head);
-
-				// print the results of the trade to stdout
-				if (prod_buys->global_order_num > prod_sells->global_order_num) {
-					printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%.0f.\n",
-				 		LOG_PREFIX, prod_sells->order_id, prod_sells->trader_id, 
-						prod_buys->order_id, prod_buys->trader_id, 
-						trading_sum, trading_fee);
-				} else {
-					printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%.0f.\n",
-				 		LOG_PREFIX, prod_buys->order_id, prod_buys->trader_id, 
-						prod_sells->order_id, prod_sells->trader_id, 
-						trading_sum, trading_fee);
-				}
-
-				// send fill messages to traders involved
-				if (!(buyer->disconnected)) {
-					// send FILL only if buyer has not disconnected
-					msg_len = snprintf(NULL, 0, "FILL %d %ld;", prod_buys->order_id, prod_buys->quantity);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "FILL %d %ld;", prod_buys->order_id, prod_buys->quantity);
-					write(buyer->fd[1], msg, strlen(msg));
-					kill(buyer->process_id, SIGUSR1);
-					free(msg);
-				}
-				
-				if (!(seller->disconnected)) {
-					// send FILL only if seller has not disconnected
-					msg_len = snprintf(NULL, 0, "FILL %d %ld;", prod_sells->order_id, prod_sells->quantity);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "FILL %d %ld;", prod_sells->order_id, prod_sells->quantity);
-					write(seller->fd[1], msg, strlen(msg));
-					kill(seller->process_id, SIGUSR1);
-					free(msg);
-				}
-
-				// remove both orders from their respective lists
-				order *to_delete = (*buys)[product_index];
-				(*buys)[product_index] = ((*buys)[product_index])->next;
-				free(to_delete);
-				prod_buys = (*buys)[product_index]; // move to the next order
-
-				to_delete = (*sells)[product_index];
-				(*sells)[product_index] = ((*sells)[product_index])->next;
-				free(to_delete);
-				prod_sells = (*sells)[product_index]; // move to the next order
-
-			} else if (prod_buys->quantity > prod_sells->quantity) {
-				// compute price of the trade, this is based on the older order
-				if (prod_buys->global_order_num > prod_sells->global_order_num) {
-					trading_sum = prod_sells->price * prod_sells->quantity;
-				} else {
-					trading_sum = prod_buys->price * prod_sells->quantity;
-				}
-
-				// reduce the amount of product avaliable for this buy order
-				prod_buys->quantity -= prod_sells->quantity;
-
-				// compute fee of the trade
-				trading_fee = trading_sum * FEE_PERCENTAGE;
-				long rounding = (long)(trading_fee + 0.5f);
-				trading_fee = (double)(rounding);
-
-				// update the total trading fees sum
-				*total_trading_fees += trading_fee;
 
-				// cache the details of the trade
-				(*matches)[prod_buys->trader_id][product_index][0] += prod_sells->quantity;
-				(*matches)[prod_buys->trader_id][product_index][1] -= trading_sum;
-				(*matches)[prod_sells->trader_id][product_index][0] -= prod_sells->quantity;
-				(*matches)[prod_sells->trader_id][product_index][1] += (long)(trading_sum);
+	if (ev->type == EVENT_FILL || ev->type == EVENT_INVALID) {
+		if (t->trader_id != ev->trader_id || t->disconnected) {
+			return;
+		}
+		msg_len = format_event(msg, ev, 1, prods);
+		write(t->fd[1], msg, msg_len);
+		signal_trader(t);
+		return;
+	}
 
-				// charge trader that made the newer with fees
-				if (prod_buys->global_order_num > prod_sells->global_order_num) {
-					(*matches)[prod_buys->trader_id][product_index][1] -= trading_fee;
-				} else {
-					(*matches)[prod_sells->trader_id][product_index][1] -= trading_fee;
-				}
+	// the response to the trader that made the order, MARKET to everyone else
+	if (!(t->disconnected)) {
+		msg_len = format_event(msg, ev, t->trader_id == ev->trader_id, prods);
+		write(t->fd[1], msg, msg_len);
+	}
+	signal_trader(t);
+}
 
-				// get the traders involved in the match
-				trader *buyer = get_trader(-1, prod_buys->trader_id, head);
-				trader *seller = get_trader(-1, prod_sells->trader_id, head);
-
-				// print the results of the trade to stdout
-				if (prod_buys->global_order_num > prod_sells->global_order_num) {
-					printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%.0f.\n",
-				 		LOG_PREFIX, prod_sells->order_id, prod_sells->trader_id, 
-						prod_buys->order_id, prod_buys->trader_id, 
-						trading_sum, trading_fee);
-				} else {
-					printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%.0f.\n",
-				 		LOG_PREFIX, prod_buys->order_id, prod_buys->trader_id, 
-						prod_sells->order_id, prod_sells->trader_id, 
-						trading_sum, trading_fee);
-				}
+void signal_trader(trader *t) {
+	// the pidfd can't hit a recycled PID once the trader has been reaped
+	pidfd_send_signal(t->pid_fd, SIGUSR1, NULL, 0);
+}
 
-				// send fill messages to traders involved
-				if (!(buyer->disconnected)) {
-					// send FILL only if buyer has not disconnected
-					msg_len = snprintf(NULL, 0, "FILL %d %ld;", prod_buys->order_id, prod_sells->quantity);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "FILL %d %ld;", prod_buys->order_id, prod_sells->quantity);
-					write(buyer->fd[1], msg, strlen(msg));
-					kill(buyer->process_id, SIGUSR1);
-					free(msg);
-				}
-				
-				if (!(seller->disconnected)) {
-					// send FILL only if seller has not disconnected
-					msg_len = snprintf(NULL, 0, "FILL %d %ld;", prod_sells->order_id, prod_sells->quantity);
-					msg = malloc(msg_len + 1);
-					snprintf(msg, msg_len + 1, "FILL %d %ld;", prod_sells->order_id, prod_sells->quantity);
-					write(seller->fd[1], msg, strlen(msg));
-					kill(seller->process_id, SIGUSR1);
-					free(msg);
-				}
+int reap_trader(trader *t) {
+	siginfo_t info;
+	memset(&info, 0, sizeof(siginfo_t));
+	if (waitid(P_PIDFD, t->pid_fd, &info, WEXITED | WNOHANG) == -1 || info.si_pid == 0) {
+		return 1;
+	}
+	t->exit_code = info.si_code;
+	t->exit_status = info.si_status;
+	return 0;
+}
 
-				// remove SELL order from the list
-				order *to_delete = (*sells)[product_index];
-				(*sells)[product_index] = ((*sells)[product_index])->next;
-				free(to_delete);
-				prod_sells = (*sells)[product_index]; // move to the next order
-			}
-		} else {
-			// no trades possible
-			break;
+void stop_traders(trader *head) {
+	for (trader *t = head; t != NULL; t = t->next) {
+		if (t->disconnected) {
+			continue;
 		}
+		pidfd_send_signal(t->pid_fd, SIGKILL, NULL, 0);
+		siginfo_t info;
+		waitid(P_PIDFD, t->pid_fd, &info, WEXITED);
+		t->disconnected = 1;
+		printf("%s Trader %d disconnected\n", LOG_PREFIX, t->trader_id);
+	}
+}
+
+void log_trader_exit(trader *t) {
+	if (t->exit_code == CLD_EXITED && t->exit_status != 0) {
+		printf("%s Trader %d exited with status %d\n", LOG_PREFIX, t->trader_id, t->exit_status);
+	} else if (t->exit_code == CLD_KILLED || t->exit_code == CLD_DUMPED) {
+		printf("%s Trader %d was killed by signal %d (%s)\n", LOG_PREFIX, t->trader_id,
+			t->exit_status, strsignal(t->exit_status));
 	}
 }
 
@@ -1170,85 +1232,30 @@ trader *get_trader(pid_t pid, int trader_id, trader *head) {
 	return current;
 }
 
-int get_product_index(products *prods, char *product) {
-	if (product == NULL) {
-		return -1;
-	}
-
-	for (int i = 0; i < prods->size; i++) {
-		if (strcmp(prods->product_strings[i], product) == 0) {
-			return i;
-		}
-	}
-
-	return -1;
-}
-
-void print_sell_orders_reverse(order **list, int product_index) {
-	order *reversed_head = NULL;
-
-	// reverse the sell orders
-	order *current = list[product_index];
-	while (current != NULL) {
-		// make a new node for the reversed list and copy all data fields
-		order *new = (order*)malloc(sizeof(order));
-		new->order_id = current->order_id;
-		new->trader_id = current->trader_id;
-		new->global_order_num = current->global_order_num;
-		new->product = current->product;
-		new->product_index = current->product_index;
-		new->quantity = current->quantity;
-		new->price = current->price;
-	
-		// update next and head pointers so reversed order is ensure
-		new->next = reversed_head;
-		reversed_head = new;
-
-		current = current->next;
-	}
-
-	// print the sell orders to stdout
-	order *reversed_curr = reversed_head;
-	int count;
-	long total_qty;
-	while (reversed_curr != NULL) {
-		order *runner = reversed_curr->next;
-		count = 1;
-		total_qty = reversed_curr->quantity;
-		while (runner != NULL && runner->price == reversed_curr->price) {
-			count++;
-			total_qty += runner->quantity;
-			runner = runner->next;
-		}
-		if (count > 1) {
-			printf("%s\t\tSELL %ld @ $%ld (%d orders)\n", LOG_PREFIX, total_qty, reversed_curr->price, count);
-		} else if (count == 1) {
-			printf("%s\t\tSELL %ld @ $%ld (%d order)\n", LOG_PREFIX, total_qty, reversed_curr->price, count);
-		}
-		reversed_curr = runner;
-	}
-
-	// delete the reversed clone
-	order *temp;
-	while (reversed_head != NULL) {
-		temp = reversed_head;
-		reversed_head = reversed_head->next;
-		free(temp);
-	}
-}
-
 void free_structs(products *prods, trader *head, order **buys, order **sells) {
-	free_products_list(prods);
-	free_trader_list(head);
 	free_order_list(buys, prods);
 	free_order_list(sells, prods);
+	free_products_list(prods);
+	free_trader_list(head);
 }
 
-void free_products_list(products *prods) {
-	for (int i = 0; i < prods->size; i++) {
-		free(prods->product_strings[i]);
+void free_exchange(exchange *ex) {
+	pe_free(ex->outbox.events);
+	free(ex->latency);
+	free(ex->stats);
+	free_gateways(&ex->gateways);
+	free_structs(&ex->prods, ex->head, ex->buys, ex->sells);
+	free_matches(ex->matches, ex->num_traders, ex->prods.size);
+	if (ex->shards != NULL) {
+		int shard_count = ex->num_shards > 0 ? ex->num_shards : 1;
+		for (int i = 0; i < shard_count; i++) {
+			pthread_mutex_destroy(&ex->shards[i].lock);
+			pe_free(ex->shards[i].batch.events);
+			free(ex->shards[i].next_order_ids);
+			free(ex->shards[i].fills);
+		}
+		free(ex->shards);
 	}
-	free(prods->product_strings);
 }
 
 void free_trader_list(trader *head) {
@@ -1256,31 +1263,13 @@ void free_trader_list(trader *head) {
 	trader *next;
 	while (current != NULL) {
 		next = current->next;
-		free(current); // free the memory used for the trader struct itself
-		current = next; // move to next trader in list
-	}
-}
-
-void free_order_list(order **order_list, products *prods) {
-	for (int i = 0; i < prods->size; i++) {
-		order *temp;
-		while (order_list[i] != NULL) {
-			temp = order_list[i];
-			order_list[i] = (order_list[i])->next;
-			free(temp);
+		if (current->pid_fd >= 0) {
+			close(current->pid_fd);
 		}
+		pe_free(current->order_products);
+		pe_free(current); // free the memory used for the trader struct itself
+		current = next; // move to next trader in list
 	}
-	free(order_list);
-}
-
-void free_matches(long ***matches, int num_traders, int prods_size) {
-	for (int i = 0; i < num_traders; i++) {
-		for (int j = 0; j < prods_size; j++) {
-			free(matches[i][j]);
-		}
-		free(matches[i]);
-	}
-	free(matches);
 }
 
 void cleanup_trader(pid_t pid, trader **head) {
@@ -1331,7 +1320,8 @@ void cleanup_trader(pid_t pid, trader **head) {
 		previous->next = current->next;
 	}
 
-	free(current);
+	pe_free(current->order_products);
+	pe_free(current);
 }
 
 void cleanup_fifos(int number_of_traders) {
@@ -2,43 +2,27 @@
 #define PE_EXCHANGE_H
 
 #include "pe_common.h"
+#include "pe_config.h"
+#include "pe_protocol.h"
+#include "pe_engine.h"
+#include "pe_gateway.h"
+#include "pe_journal.h"
+#include "pe_launch.h"
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
-
-#define LOG_PREFIX "[PEX]"
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <sys/pidfd.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
 
 #define TRADERS_START 2
-#define BUF_SIZE 256 // temporary storage for message strings
-#define CMD_LEN 7 // longest possible command type a trader can send
-#define OID_MIN 0
-#define OID_MAX 999999
-#define ORDER_MIN 1
-#define ORDER_MAX 999999
-
-enum cmd_type {
-    BUY = 0,
-    SELL,
-    AMEND,
-    CANCEL
-};
-
-/*
- * Desc: Generic order struct.
- * Fields: string representing the product type of the order, and ints for the
-           quantity of the product and the price per unit. Also has a pointer
-           to the next order in the list.
- */
-typedef struct order order;
-struct order {
-    int order_id;
-    int trader_id; // trader that made the order
-    int global_order_num; // tracks the total number of orders ever made
-    char *product;
-    int product_index; // index of the product string in the string array
-    long quantity;
-    long price;
-    order *next;
-};
+#define MAX_EVENTS 16 // events handled per epoll_wait call
+#define HANDSHAKE_EXCHANGE_OPEN 1 // trader opened the exchange fifo for reading
+#define HANDSHAKE_TRADER_OPEN 2 // trader opened the trader fifo for writing
+#define HANDSHAKE_DONE (HANDSHAKE_EXCHANGE_OPEN | HANDSHAKE_TRADER_OPEN)
 
 /*
  * Desc: All-encompassing trader struct.
@@ -49,35 +33,149 @@ typedef struct trader trader;
 struct trader {
     int trader_id; // main identifier
     int max_order_id; // ensures OIDs are consecutive
-    int disconnected; // flag set when trader disconnects
+    int *order_products; // product index of each order ID placed so far
+    int order_products_size; // allocated length of order_products
+    _Atomic int disconnected; // flag set when trader disconnects, read by matching threads
     pid_t process_id; // get this from the fork() call
+    int pid_fd; // pidfd of the trader process, readable once it exits
+    int exit_code; // si_code of the exit once reaped: CLD_EXITED, CLD_KILLED, ...
+    int exit_status; // exit status or signal number, depending on exit_code
     int fd[2]; // fd[0] = trader fifo, fd[1] = exchange fifo
+    char rx_buf[BUF_SIZE]; // bytes read by a gateway that aren't a full message yet
+    int rx_len;
+    // counted by the thread reading the trader's fifo, readable from any thread
+    _Atomic long commands[4]; // accepted commands, indexed by enum cmd_type
+    _Atomic long rejected; // messages answered with INVALID before reaching the books
     trader *next; // has a linked-list structure
 };
 
 /*
- * Desc: Holds the list of products that the exchange will trade.
- * Fields: An int representing the number of products that will be traded and
-           a pointer to a list of string pointers, where the strings will be the
-           product names.
+ * Desc: Startup state of one trader while the exchange waits for it to open
+         its fifos.
+ * Fields: The trader being connected, the fifo paths, the inotify watches on
+           them, which fifos the trader has opened so far and whether the
+           connection is complete.
+ */
+typedef struct handshake handshake;
+struct handshake {
+    trader *t; // NULL once handed over to the trader list
+    char *exchange_path;
+    char *trader_path;
+    int exchange_wd;
+    int trader_wd;
+    int opened; // HANDSHAKE_* flags
+    int connected;
+    int launch_error; // errno if the trader could not be started, 0 otherwise
+    int exited; // the trader exited (and was reaped) during the handshake
+};
+
+/*
+ * Desc: Everything the exchange trades on, shared by the main loop and the
+         matching threads.
+ * Fields: The products, the trader list, the product-indexed order lists and
+           match cache, the shards the products are split across, the
+           gateways doing trader I/O when matching is threaded, the journal
+           with, when matching inline, the responses waiting for it, the
+           inline latency histograms and the live book counters.
+ */
+typedef struct exchange exchange;
+struct exchange {
+    products prods;
+    trader *head;
+    int num_traders; // traders launched, trader IDs are 0 to num_traders - 1
+    int num_connected; // traders in the list, stragglers are left out
+    order **buys;
+    order **sells;
+    long ***matches;
+    int num_shards; // matching threads, 0 --> match inline on the main thread
+    shard *shards; // num_shards entries, one inline shard if num_shards is 0
+    gateway_set gateways; // empty when matching inline
+    journal jrnl; // fd is -1 when not journaling
+    event_batch outbox; // inline responses held until the journal commits
+    latency_recorder *latency; // responses written by the main thread, NULL --> not recorded
+    book_stats *stats; // product-indexed counters for the control socket, NULL --> not kept
+};
+
+/*
+ * Desc: Decides when the orderbook and positions snapshot is printed.
+ * Fields: The number of commands between reports, the number of commands
+           executed since the last report and the periodic timer's fd. When
+           matching is threaded, pending is derived from the shards' counters.
+           The scratch copy of the books and positions the report is printed
+           from, kept between reports.
  */
-typedef struct products products;
-struct products {
-    int size;
-    char **product_strings; // pointer to a list of string pointers
+typedef struct reporter reporter;
+struct reporter {
+    long every; // report after this many commands, 0 --> timer only
+    long pending; // commands executed since the last report
+    long applied; // shard commands covered by the last report (threaded only)
+    int timer_fd; // -1 when no report interval was configured
+    int *num_levels; // per product: buy levels, then sell levels
+    book_level *levels; // every product's buy then sell levels, in list order
+    long levels_size; // book_level slots in levels
+    long *ledger; // per trader and product: quantity, then value
 };
 
 /*
- * Desc: SIGUSR1 and SIGCHLD handler, used by pe_exchange
- * Params: The signal, a pointer to the siginfo_t struct and a context pointer
+ * Desc: Fills the signal set with the signals pe_exchange receives through
+         its signalfd (SIGUSR1). Trader exits come from pidfds instead.
+         SIGUSR2 is added when latency is recorded.
+ * Params: a pointer to the signal set to fill
+ */
+void init_signal_mask(sigset_t *mask);
+
+/*
+ * Desc: Initializes the reporter from the config, creating and arming the
+         snapshot timer if a report interval was given.
+ * Params: A pointer to the reporter and a pointer to the exchange config.
+ * Return: 0 on success, 1 if the timer could not be created.
+ */
+int init_reporter(reporter *rep, exchange_config *cfg);
+
+/*
+ * Desc: Records that a command changed the books or positions.
+ * Params: A pointer to the reporter.
+ * Return: 1 if a snapshot is due now, 0 otherwise.
+ */
+int reporter_note_command(reporter *rep);
+
+/*
+ * Desc: Handles an expiry of the snapshot timer. A snapshot is only printed
+         if a command was executed since the last one.
+ * Return: 1 if a snapshot is due now, 0 otherwise.
+ */
+int reporter_timer_expired(reporter *rep);
+
+/*
+ * Desc: Prints the orderbook and positions snapshot and resets the count of
+         pending commands. The shards are only held while it is copied.
+ * Params: A pointer to the reporter and the structs to print.
+ */
+void report_snapshot(reporter *rep, exchange *ex);
+
+/*
+ * Desc: Copies the price levels of every book and the positions into the
+         reporter's scratch, growing it as needed. With matching threads the
+         caller holds every shard.
+ * Params: A pointer to the reporter and the exchange to copy.
+ * Return: 0 on success, 1 if the scratch could not be allocated.
  */
-void signal_handle(int signum, siginfo_t *info, void *context);
+int copy_report(reporter *rep, exchange *ex);
 
 /*
- * Desc: Initializes the sigaction struct
- * Params: a pointer to a sigaction struct
+ * Desc: Prints the orderbook and positions from the reporter's scratch, in
+         the format of display_orderbook and display_positions.
+ * Params: A pointer to the reporter and the exchange the copy was made of.
  */
-void init_sigaction(struct sigaction *sa);
+void print_report(reporter *rep, exchange *ex);
+
+/*
+ * Desc: Closes the epoll instance, the signalfd and the snapshot timer, and
+         frees the reporter's scratch.
+ * Params: The epoll fd (-1 if never created), the signalfd and a pointer to
+           the reporter owning the timer.
+ */
+void close_event_fds(int epoll_fd, int sig_fd, reporter *rep);
 
 /*
  * Desc: Reads the provided product file and initializes a products struct
@@ -89,22 +187,29 @@ void init_sigaction(struct sigaction *sa);
 int init_product_list(char product_file[], products *prods);
 
 /*
- * Desc: Initializes the matches matrix and sets all entries to default values.
- * Params: The matches matrix, the number of traders and the number of products.
+ * Desc: Creates every trader's named pipes up front, launches all trader
+         processes at once through the launcher and connects to them as they open their pipes.
+         Traders that haven't connected when the timeout expires are killed
+         and left out. Creates and initializes a trader struct for each
+         connected trader and adds it to the list. Prints the startup
+         messages to stdout in trader order once the handshake is over.
+ * Params: The number of traders to spawn, the list of command line args given
+           to pe_exchange, a pointer to a pointer to the head of the 
+           trader list, the launcher, the CPUs to pin traders to (may be
+           empty) and the connect timeout in milliseconds (0 waits forever).
+ * Return: 0 if all traders were launched (even if some didn't connect),
+           1 otherwise
  */
-void init_matches(long ****matches, int num_traders, int prods_size);
+int spawn_and_communicate(int num_traders, char **argv, trader **head, launcher *launch, cpu_list *pin_traders, long connect_timeout_ms);
 
 /*
- * Desc: Creates named pipes, launches trader process and connects to the
-         corresponding named pipes, based on trader ID. Creates and initializes
-         a new trader struct and adds it to the list. Also prints the 
-         necessary messages to stdout.
- * Params: The number of traders to spawn, the list of command line args given
-           to pe_exchange and a pointer to a pointer to the head of the 
-           trader list.
- * Return: 0 if all traders where successfully set up and exec'd, 1 otherwise
+ * Desc: Completes a trader's connection once it has opened both fifos:
+         replaces the placeholder read-write end of the exchange fifo with a
+         write-only one and makes both ends blocking again.
+ * Params: A pointer to the trader's handshake.
+ * Return: 0 on success, 1 if the exchange fifo could not be reopened.
  */
-int spawn_and_communicate(int num_traders, char **argv, trader **head);
+int finish_handshake(handshake *h);
 
 /*
  * Desc: Reads and formats message from trader_fifo of trader with matching PID.
@@ -114,78 +219,93 @@ int spawn_and_communicate(int num_traders, char **argv, trader **head);
 int read_and_format_message(trader *curr_trader, char *message_in);
 
 /*
- * Desc: Determines the type of command to execute specified by the message.
- * Params: The message to parse.
- * Returns: A flag representing the command type
-*/
-int determine_cmd_type(char *message_in);
+ * Desc: Checks a parsed command against the sending trader's state and fills
+         in its trader_id and product_index. BUY and SELL must name a traded
+         product and use the trader's next order ID, AMEND and CANCEL must
+         refer to an order ID the trader has placed. Accepted BUY and SELL
+         orders advance the trader's order ID.
+ * Params: The trader that sent the command, the command and the products.
+ * Return: 0 if the command can be executed, 1 otherwise
+ */
+int validate_command(trader *curr_trader, command *cmd, products *prods);
 
 /*
- * Desc: Acts on the command sent via a fifo and responds accordingly to the
-         corresponding trader.
- * Params: The PID to match, a pointer to the head of trader list,
-           the command to parse and execute.
- * Return: 0 on successful parsing and execution of the command, 1 otherwise
+ * Desc: Event sink used when matching inline: writes responses and MARKET
+         updates to the traders' fifos, signals them and prints match log lines.
+ * Params: The exchange (as the sink context) and the event to deliver.
  */
-int execute_command(trader *curr_trader, char *message_in, int cmd_type, products *prods, int *product_index, int *total_order_num, order ***buys, order ***sells, trader *head);
+void deliver_event(void *ctx, event *ev);
 
 /*
- * Desc: Finds matching orders for product at product_index, prints the 
-         corresponding match message to stdout and notifies involved traders of
-         the trader.
- * Params: Pointers to the match, buy, sell and trader lists the index of the product
-           to find matches for.
+ * Desc: Event sink used when matching inline with a journal: prints match log
+         lines straight away and holds everything else in the outbox until
+         release_responses.
+ * Params: The exchange (as the sink context) and the event to hold.
  */
-void find_matches(long ****matches, order ***buys, order ***sells, trader *head, double *total_trading_fees, int product_index);
+void hold_event(void *ctx, event *ev);
 
 /*
- * Desc: Prints the orderbook to stdout.
- * Params: Pointers to the products list, buy and sell orders.
+ * Desc: Commits the journal, then delivers the responses held in the outbox.
+         If the journal failed they stay held.
+ * Params: The exchange.
+ * Return: 0 on success, 1 if the journal failed.
  */
-void display_orderbook(products *prods, order **buys, order **sells);
+int release_responses(exchange *ex);
 
 /*
- * Desc: Counts the number of orders for a specific product.
- * Params: A pointer to the list to count orders from, the index of the product
-           to count orders for.
- * Return: The number of orders in list, -1 otherwise.
+ * Desc: Prints the latency histograms of the main thread and every gateway
+         merged. Gateways keep recording while it runs.
+ * Params: The exchange, the stream to print to and whether to print JSON.
  */
-int count_order_levels(order **list, int product_index);
+void report_latency(exchange *ex, FILE *out, int json);
 
 /*
- * Desc: Prints all unique orders for a specific product at product_index to
-         stdout.
- * Params: A pointer to the order list, the product_index of the product to count
-           and a flag indicating that we are printing buy or sell orders
+ * Desc: Tells a trader its message was invalid. When journaling the INVALID
+         is held behind the responses to its earlier commands.
+ * Params: The exchange and the trader.
  */
-void display_orders(order **list, int product_index, int order_type);
+void reject_message(exchange *ex, trader *t);
 
 /*
- * Desc: Prints the positions of all traders to stdout.
- * Params: A pointer to the head of the traders list, the matches matrix and 
-           a pointer to the products struct.
+ * Desc: Writes what an event means for one trader to its fifo and signals it:
+         the response if the trader owns the order, a MARKET update otherwise.
+         FILL and INVALID events are only sent to the trader they concern.
+ * Params: The trader, the event and the products list.
  */
-void display_positions(trader *head, long ***matches, products *prods);
+void send_event(trader *t, event *ev, products *prods);
 
 /*
- * Desc: Gets the trader with matching PID or trader ID.
- * Params: the PID / TID to match, a pointer the head of the trader list
+ * Desc: Sends SIGUSR1 to a trader through its pidfd, which is safe even after
+         the trader has exited and its PID was reused.
+ * Params: The trader to signal.
  */
-trader *get_trader(pid_t pid, int trader_id, trader *head);
+void signal_trader(trader *t);
+
+/*
+ * Desc: Reaps a trader whose pidfd became readable and records how it exited.
+ * Params: The trader.
+ * Return: 0 if the trader was reaped, 1 if it hasn't exited yet.
+ */
+int reap_trader(trader *t);
 
 /*
- * Desc: Gets the index of product in the products string array.
- * Params: A pointer to the products struct containing the product array, the
-           product string to find.
- * Return: The index of the product string in the string array, -1 if invalid.
+ * Desc: Kills and reaps the traders still connected, when trading stops
+         before they are done.
+ * Params: The head of the trader list.
  */
-int get_product_index(products *prods, char *product);
+void stop_traders(trader *head);
 
 /*
- * Desc: Used specifically for printing the sell order list in reverse order.
- * Params: The list to loop through, the product index
+ * Desc: Prints how a reaped trader exited, if it didn't exit cleanly.
+ * Params: The reaped trader.
  */
-void print_sell_orders_reverse(order **list, int product_index);
+void log_trader_exit(trader *t);
+
+/*
+ * Desc: Gets the trader with matching PID or trader ID.
+ * Params: the PID / TID to match, a pointer the head of the trader list
+ */
+trader *get_trader(pid_t pid, int trader_id, trader *head);
 
 /*
  * Desc: calls all free functions to free allocated memory used for the 
@@ -195,10 +315,11 @@ void print_sell_orders_reverse(order **list, int product_index);
 void free_structs(products *prods, trader *head, order **buys, order **sells);
 
 /*
- * Desc: Frees the memory used by the products struct.
- * Param: a pointer to the products struct.
+ * Desc: Frees everything owned by the exchange struct: products, traders,
+         order lists, match cache and shards.
+ * Params: A pointer to the exchange struct.
  */
-void free_products_list(products *prods);
+void free_exchange(exchange *ex);
 
 /*
  * Desc: Frees memory used by the trader list, and frees memory used by each
@@ -207,18 +328,6 @@ void free_products_list(products *prods);
  */
 void free_trader_list(trader *head);
 
-/*
- * Desc: Frees memory used by the order list (buy / sell orders).
- * Params: A pointer to the order list head and a pointer to the products struct.
- */
-void free_order_list(order **order_list, products *prods);
-
-/*
- * Desc: Frees all allocated dimensions used by the matches matrix.
- * Param: The matches matrix, the number of traders and the number of products.
- */
-void free_matches(long ***matches, int num_traders, int prods_size);
-
 /*
  * Desc: Closes and deletes FIFOs, frees memory used by the trader with matching
          PID.
@@ -0,0 +1,375 @@
+#include "pe_exchange.h"
+#include "pe_shard.h"
+#include "pe_placement.h"
+#include <sched.h>
+#include <time.h>
+
+/*
+ * Desc: Writes an event to the traders it concerns. The latency of a
+         response is recorded by the gateway owning the trader it answers.
+ * Params: A pointer to the gateway and the event.
+ */
+static void dispatch_event(gateway *g, event *ev) {
+	if (ev->type == EVENT_FILL || ev->type == EVENT_INVALID) {
+		trader *target = g->traders[ev->trader_id / g->num_gateways];
+		if (target != NULL) {
+			CYCLES_TIME(CYCLES_BROADCAST, send_event(target, ev, g->prods));
+		}
+	} else {
+		// market updates go to every trader this gateway owns, slots of
+		// traders left out at startup are NULL
+		for (int i = 0; i < g->num_traders; i++) {
+			if (g->traders[i] != NULL) {
+				CYCLES_TIME(CYCLES_BROADCAST, send_event(g->traders[i], ev, g->prods));
+			}
+		}
+	}
+	if (ev->trader_id % g->num_gateways == g->gateway_id) {
+		latency_record_event(g->latency, ev->type, &ev->times, ev->match_ns);
+	}
+}
+
+/*
+ * Desc: Writes the held events whose commands are journaled, stopping at the
+         first one that isn't so traders see events in order.
+ * Params: A pointer to the gateway.
+ */
+static void release_held(gateway *g) {
+	int released = 0;
+	while (released < g->held.len) {
+		event *ev = &g->held.events[released];
+		// journal_seq 0: a gateway INVALID that only waited for its turn
+		if (ev->journal_seq > 0 && !journal_committed(g->jrnl, ev->shard_id, ev->journal_seq)) {
+			break;
+		}
+		dispatch_event(g, ev);
+		released++;
+	}
+	g->held.len -= released;
+	memmove(g->held.events, g->held.events + released, g->held.len * sizeof(event));
+}
+
+/*
+ * Desc: Writes every event queued for the gateway to its traders. When
+         journaling, events of commands not yet on disk are held back.
+ * Params: A pointer to the gateway.
+ * Return: 1 if the stop event was popped, 0 once the queue is empty.
+ */
+static int drain_outbound(gateway *g) {
+	event ev;
+	int stop = 0;
+	uint64_t flush_ns = trace_sample_flush() ? latency_now() : 0;
+	long popped = 0;
+	while (!stop && mpsc_pop(&g->outbound, &ev)) {
+		popped++;
+		if (ev.type == EVENT_STOP) {
+			stop = 1;
+		} else if (ev.type == EVENT_DURABLE) {
+			continue; // released below
+		} else if (ev.type == EVENT_MATCH) {
+			// the log isn't a response, it doesn't wait for the journal
+			char line[BUF_SIZE];
+			CYCLES_TIME(CYCLES_LOG, format_event(line, &ev, 0, g->prods); fputs(line, stdout));
+		} else if (g->jrnl != NULL && (g->held.len > 0
+				|| !journal_committed(g->jrnl, ev.shard_id, ev.journal_seq))) {
+			collect_event(&g->held, &ev);
+		} else {
+			dispatch_event(g, &ev);
+		}
+	}
+	if (g->held.len > 0) {
+		release_held(g);
+	}
+	if (flush_ns != 0 && popped > 0) {
+		trace_span_end("flush", "events", popped, flush_ns);
+	}
+	return stop;
+}
+
+/*
+ * Desc: Tells a trader its message was invalid, behind any events still held
+         for it so responses stay in order.
+ * Params: A pointer to the gateway and the trader.
+ */
+static void respond_invalid(gateway *g, trader *t) {
+	event invalid;
+	memset(&invalid, 0, sizeof(event));
+	invalid.type = EVENT_INVALID;
+	invalid.trader_id = t->trader_id;
+	counter_add(&t->rejected, 1);
+	if (g->held.len > 0) {
+		collect_event(&g->held, &invalid);
+	} else {
+		send_event(t, &invalid, g->prods);
+	}
+}
+
+/*
+ * Desc: Queues a validated command on the shard owning its product. While the
+         shard's queue is full the gateway keeps writing its own events, so a
+         shard waiting on this gateway can always make progress.
+ * Params: A pointer to the gateway and the command with its times.
+ */
+static void submit_from_gateway(gateway *g, routed_command *routed) {
+	shard *s = &g->shards[routed->cmd.product_index % g->num_shards];
+	int full = 0;
+	CYCLES_TIME(CYCLES_ROUTE, full = mpsc_push(&s->inbound, routed));
+	while (full) {
+		drain_outbound(g);
+		sched_yield();
+		CYCLES_TIME(CYCLES_ROUTE, full = mpsc_push(&s->inbound, routed));
+	}
+}
+
+/*
+ * Desc: Parses and validates one framed message and routes it to its shard.
+ * Params: A pointer to the gateway, the trader that sent it, the message and
+           when it was read (0 --> latency isn't recorded).
+ */
+static void handle_message(gateway *g, trader *t, char *message_in, uint64_t read_ns) {
+	routed_command routed;
+	uint32_t trace_id = trace_sample_command();
+	uint64_t trace_ns = trace_id != 0 ? latency_now() : 0;
+	CYCLES_TIME(CYCLES_LOG, printf("%s [T%d] Parsing command: <%s>\n", LOG_PREFIX, t->trader_id, message_in));
+	int cmd_type = -1;
+	int res = 0;
+	CYCLES_TIME(CYCLES_DECODE, cmd_type = determine_cmd_type(message_in));
+	CYCLES_TIME(CYCLES_PARSE, res = parse_command(message_in, cmd_type, &routed.cmd));
+	if (!res) {
+		CYCLES_TIME(CYCLES_VALIDATE, res = validate_command(t, &routed.cmd, g->prods));
+	}
+	if (res) {
+		respond_invalid(g, t);
+		return;
+	}
+	counter_add(&t->commands[routed.cmd.type], 1);
+	routed.times.cmd_type = routed.cmd.type;
+	routed.times.read_ns = read_ns;
+	routed.times.parse_ns = read_ns != 0 ? latency_now() : 0;
+	routed.times.trace_id = trace_id;
+	submit_from_gateway(g, &routed);
+	if (trace_id != 0) {
+		trace_span_end("command", "cmd", trace_id, trace_ns);
+	}
+}
+
+/*
+ * Desc: Reads what is available on a trader's fifo and handles every complete
+         ;-delimited message in it. A partial message stays buffered until the
+         rest arrives.
+ * Params: A pointer to the gateway and the readable trader.
+ */
+static void read_trader(gateway *g, trader *t) {
+	// commands are timed from the moment the fifo is found readable
+	uint64_t read_ns = g->latency != NULL ? latency_now() : 0;
+	int bytes_read = 0;
+	CYCLES_TIME(CYCLES_READ, bytes_read = read(t->fd[0], t->rx_buf + t->rx_len, BUF_SIZE - t->rx_len));
+	if (bytes_read < 0) {
+		return; // EAGAIN, nothing to read after all
+	} else if (bytes_read == 0) {
+		// the trader closed its end, nothing more will arrive
+		epoll_ctl(g->epoll_fd, EPOLL_CTL_DEL, t->fd[0], NULL);
+		g->open_fifos--;
+		if (g->open_fifos == 0) {
+			atomic_store_explicit(&g->input_closed, 1, memory_order_release);
+		}
+		return;
+	}
+	t->rx_len += bytes_read;
+
+	// frame messages out of the buffer
+	char message_in[BUF_SIZE];
+	int start = 0;
+	for (int i = 0; i < t->rx_len; i++) {
+		if (t->rx_buf[i] == ';') {
+			int len = i - start;
+			memcpy(message_in, t->rx_buf + start, len);
+			message_in[len] = '\0';
+			handle_message(g, t, message_in, read_ns);
+			start = i + 1;
+		}
+	}
+	t->rx_len -= start;
+	memmove(t->rx_buf, t->rx_buf + start, t->rx_len);
+
+	if (t->rx_len == BUF_SIZE) {
+		// a whole buffer without a delimiter can't be a valid message
+		respond_invalid(g, t);
+		t->rx_len = 0;
+	}
+}
+
+/*
+ * Desc: Gateway thread: alternates between writing queued events and reading
+         the trader fifos, sleeping in epoll when there is neither.
+ * Params: The gateway, passed as void* by pthread_create.
+ */
+static void *gateway_main(void *arg) {
+	gateway *g = (gateway*)arg;
+	struct epoll_event events[MAX_EVENTS];
+	CYCLES_THREAD("gateway", g->gateway_id);
+	trace_thread("gateway", g->gateway_id);
+	if (g->cpu >= 0 || g->sched_priority > 0) {
+		char label[BUF_SIZE];
+		snprintf(label, BUF_SIZE, "gateway thread %d", g->gateway_id);
+		set_placement(0, label, g->cpu, g->sched_priority);
+		log_placement(0, label);
+	}
+	while (!drain_outbound(g)) {
+		// only sleep if the shards will wake us for new events
+		int sleeping = mpsc_prepare_sleep(&g->outbound);
+		int ready = 0;
+		CYCLES_TIME(CYCLES_WAIT, ready = epoll_wait(g->epoll_fd, events, MAX_EVENTS, sleeping ? -1 : 0));
+		if (sleeping) {
+			mpsc_woken(&g->outbound);
+		}
+
+		for (int i = 0; i < ready; i++) {
+			if (events[i].data.ptr != NULL) {
+				read_trader(g, (trader*)events[i].data.ptr);
+			}
+		}
+	}
+	return NULL;
+}
+
+int init_gateways(gateway_set *set, int num_gateways, trader *head, products *prods, shard *shards, int num_shards) {
+	set->list = (gateway*)calloc(num_gateways, sizeof(gateway));
+	set->size = 0;
+	if (set->list == NULL) {
+		return 1;
+	}
+
+	// traders left out at startup aren't in the list, so size by the IDs
+	int max_trader_id = 0;
+	for (trader *cursor = head; cursor != NULL; cursor = cursor->next) {
+		if (cursor->trader_id > max_trader_id) {
+			max_trader_id = cursor->trader_id;
+		}
+	}
+
+	for (int i = 0; i < num_gateways; i++) {
+		gateway *g = &set->list[i];
+		g->gateway_id = i;
+		g->num_gateways = num_gateways;
+		g->prods = prods;
+		g->shards = shards;
+		g->num_shards = num_shards;
+		g->cpu = -1;
+		g->sched_priority = 0;
+		g->traders = (trader**)calloc(max_trader_id / num_gateways + 1, sizeof(trader*));
+		g->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		atomic_init(&g->input_closed, 0);
+		set->size++;
+		if (g->traders == NULL || g->epoll_fd == -1) {
+			return 1;
+		}
+		if (mpsc_init(&g->outbound, GATEWAY_QUEUE_SIZE, sizeof(event))) {
+			return 1;
+		}
+
+		// a NULL pointer marks the queue's wakeup fd
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(g->epoll_fd, EPOLL_CTL_ADD, g->outbound.wake_fd, &ev);
+	}
+
+	// trader i goes to gateway i % num_gateways, at slot i / num_gateways
+	for (trader *cursor = head; cursor != NULL; cursor = cursor->next) {
+		gateway *g = &set->list[cursor->trader_id % num_gateways];
+		int slot = cursor->trader_id / num_gateways;
+		g->traders[slot] = cursor;
+		if (slot >= g->num_traders) {
+			g->num_traders = slot + 1;
+		}
+		g->open_fifos++;
+
+		// the gateway reads whatever is there instead of waiting on SIGUSR1
+		fcntl(cursor->fd[0], F_SETFL, fcntl(cursor->fd[0], F_GETFL) | O_NONBLOCK);
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = cursor;
+		if (epoll_ctl(g->epoll_fd, EPOLL_CTL_ADD, cursor->fd[0], &ev) == -1) {
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < num_gateways; i++) {
+		if (set->list[i].open_fifos == 0) {
+			atomic_store(&set->list[i].input_closed, 1);
+		}
+	}
+	return 0;
+}
+
+int start_gateways(gateway_set *set) {
+	for (int i = 0; i < set->size; i++) {
+		if (pthread_create(&set->list[i].thread, NULL, gateway_main, &set->list[i]) != 0) {
+			return i;
+		}
+	}
+	return set->size;
+}
+
+void route_event(void *ctx, event *ev) {
+	gateway_set *set = (gateway_set*)ctx;
+	if (ev->type == EVENT_MATCH || ev->type == EVENT_FILL || ev->type == EVENT_INVALID) {
+		// the match is logged by the gateway of the newer order's trader
+		mpsc_push_wait(&set->list[ev->trader_id % set->size].outbound, ev);
+		return;
+	}
+	for (int i = 0; i < set->size; i++) {
+		mpsc_push_wait(&set->list[i].outbound, ev);
+	}
+}
+
+void gateways_committed(void *ctx) {
+	gateway_set *set = (gateway_set*)ctx;
+	event durable;
+	memset(&durable, 0, sizeof(event));
+	durable.type = EVENT_DURABLE;
+	for (int i = 0; i < set->size; i++) {
+		// a full queue means the gateway is busy and will check anyway
+		mpsc_push(&set->list[i].outbound, &durable);
+	}
+}
+
+void wait_gateways_input(gateway_set *set) {
+	struct timespec pause_time = {0, 1000000}; // 1ms
+	for (int i = 0; i < set->size; i++) {
+		while (!atomic_load_explicit(&set->list[i].input_closed, memory_order_acquire)) {
+			nanosleep(&pause_time, NULL);
+		}
+	}
+}
+
+void stop_gateways(gateway_set *set, int count) {
+	event stop;
+	memset(&stop, 0, sizeof(event));
+	stop.type = EVENT_STOP;
+	for (int i = 0; i < count; i++) {
+		mpsc_push_wait(&set->list[i].outbound, &stop);
+	}
+	for (int i = 0; i < count; i++) {
+		pthread_join(set->list[i].thread, NULL);
+	}
+}
+
+void free_gateways(gateway_set *set) {
+	if (set->list == NULL) {
+		return;
+	}
+	for (int i = 0; i < set->size; i++) {
+		mpsc_free(&set->list[i].outbound);
+		if (set->list[i].epoll_fd != -1) {
+			close(set->list[i].epoll_fd);
+		}
+		free(set->list[i].traders);
+		pe_free(set->list[i].held.events);
+		free(set->list[i].latency);
+	}
+	free(set->list);
+	set->list = NULL;
+	set->size = 0;
+}
@@ -0,0 +1,107 @@
+#ifndef PE_GATEWAY_H
+#define PE_GATEWAY_H
+
+#include "pe_engine.h"
+
+#define GATEWAY_QUEUE_SIZE 8192 // events buffered per gateway
+#define EVENT_STOP -1 // event type that tells a gateway thread to exit
+#define EVENT_DURABLE -2 // event type that tells a gateway the journal advanced
+
+typedef struct trader trader;
+
+/*
+ * Desc: An I/O thread owning a group of trader connections. It reads and
+         frames the trader fifos, parses and validates commands and pushes
+         them to the shard owning the product. Events coming back from the
+         shards are written to its traders, so matching threads never touch
+         a file descriptor. Trader i belongs to gateway i % num_gateways.
+ * Fields: The gateway's traders, what it needs to validate and route
+           commands, the queue of events the shards send it, its epoll
+           instance and thread, a flag set once every trader fifo hit EOF,
+           when journaling, the events held back until they are durable, and
+           the latency histograms of the responses it writes.
+ */
+typedef struct gateway gateway;
+struct gateway {
+    int gateway_id;
+    int num_gateways;
+    trader **traders; // traders owned by this gateway, trader i at slot i / num_gateways
+    int num_traders; // slots in traders, NULL where a trader was left out at startup
+    int open_fifos; // owned trader fifos that haven't hit EOF yet
+    products *prods;
+    shard *shards;
+    int num_shards;
+    mpsc_queue outbound; // events for this gateway's traders
+    int epoll_fd;
+    pthread_t thread;
+    int cpu; // CPU the gateway thread pins itself to, -1 --> unpinned
+    int sched_priority; // SCHED_FIFO priority of the gateway thread, 0 --> default
+    _Atomic int input_closed; // set once every owned trader fifo hit EOF
+    journal *jrnl; // NULL --> events are written as soon as they arrive
+    event_batch held; // events waiting for their command to be journaled, in order
+    latency_recorder *latency; // NULL --> latency isn't recorded
+};
+
+/*
+ * Desc: The gateways, used as the event sink context of threaded shards.
+ * Fields: The array of gateways and its length.
+ */
+typedef struct gateway_set gateway_set;
+struct gateway_set {
+    gateway *list;
+    int size;
+};
+
+/*
+ * Desc: Creates the gateways, hands out the traders between them and makes
+         their fifos non-blocking. Threads are started with start_gateways.
+ * Params: The set to fill, the number of gateways, the trader list, the
+           products and the shards commands are routed to.
+ * Return: 0 on success, 1 if memory, a queue or an epoll instance could not
+           be created.
+ */
+int init_gateways(gateway_set *set, int num_gateways, trader *head, products *prods, shard *shards, int num_shards);
+
+/*
+ * Desc: Starts one thread per gateway.
+ * Params: A pointer to the initialized set.
+ * Return: The number of threads started, set->size on success.
+ */
+int start_gateways(gateway_set *set);
+
+/*
+ * Desc: Event sink for threaded shards: queues the event on the gateway owning
+         the trader it concerns, or on every gateway for market updates.
+ * Params: The gateway set (as void*) and the event.
+ */
+void route_event(void *ctx, event *ev);
+
+/*
+ * Desc: Journal commit callback: wakes every gateway so it writes the events
+         that are now durable. Never blocks, a gateway with a full queue is
+         busy and checks the journal when it is done.
+ * Params: The gateway set (as void*).
+ */
+void gateways_committed(void *ctx);
+
+/*
+ * Desc: Blocks until every gateway has read its trader fifos to EOF, so all
+         commands traders sent have been pushed to the shards.
+ * Params: A pointer to the running set.
+ */
+void wait_gateways_input(gateway_set *set);
+
+/*
+ * Desc: Tells the first count gateways to exit once they have written the
+         events already queued, then joins them.
+ * Params: A pointer to the set and the number of started gateway threads.
+ */
+void stop_gateways(gateway_set *set, int count);
+
+/*
+ * Desc: Frees the gateways' queues, epoll instances and trader arrays.
+ * Params: A pointer to the set.
+ */
+void free_gateways(gateway_set *set);
+
+#endif
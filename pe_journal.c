@@ -0,0 +1,650 @@
+#include "pe_journal.h"
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+/*
+ * Desc: Builds the file name of a journal segment: the journal path for
+         segment 0, PATH.%06d after that.
+ * Params: The buffer (PATH_MAX bytes), the journal path and the index.
+ */
+static void segment_path(char *out, char *path, int index) {
+	if (index == 0) {
+		snprintf(out, PATH_MAX, "%s", path);
+	} else {
+		snprintf(out, PATH_MAX, "%s.%06d", path, index);
+	}
+}
+
+/*
+ * Desc: Offset of the first record in a segment of a journal with this
+         many products.
+ */
+static size_t records_offset(int num_products) {
+	size_t len = sizeof(journal_header) + (size_t)num_products * PRODUCT_STR_LEN;
+	return (len + JOURNAL_ALIGN - 1) / JOURNAL_ALIGN * JOURNAL_ALIGN;
+}
+
+/*
+ * Desc: Points a mapped segment's header, names and records into its mapping.
+ * Params: The segment, with map and size set and a checked header.
+ */
+static void layout_segment(journal_segment *seg) {
+	seg->header = (journal_header*)seg->map;
+	seg->names = seg->map + sizeof(journal_header);
+	size_t offset = records_offset(seg->header->num_products);
+	seg->records = (journal_record*)(seg->map + offset);
+	seg->capacity = (seg->size - offset) / sizeof(journal_record);
+}
+
+/*
+ * Desc: Syncs a range of records of a mapped segment with one msync.
+ * Params: The segment and the range of record slots [from, to).
+ * Return: 0 on success, 1 if the sync failed.
+ */
+static int sync_records(journal_segment *seg, long from, long to) {
+	if (from >= to) {
+		return 0;
+	}
+	// msync wants a page aligned start, the records before it are synced again
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t start = ((char*)&seg->records[from] - seg->map) / page * page;
+	size_t end = (char*)&seg->records[to] - seg->map;
+	if (msync(seg->map + start, end - start, MS_SYNC) == -1) {
+		printf("%s Journal write failed: %s\n", LOG_PREFIX, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Desc: Stops the journal after a failed write or sync and wakes whoever
+         watches fail_fd.
+ * Params: The journal.
+ * Return: 1, for the caller to return.
+ */
+static int fail_journal(journal *j) {
+	if (atomic_exchange_explicit(&j->failed, 1, memory_order_acq_rel) == 0) {
+		uint64_t one = 1;
+		write(j->fail_fd, &one, sizeof(one));
+	}
+	return 1;
+}
+
+/*
+ * Desc: Syncs the directory holding the journal so a new segment's name
+         survives a crash.
+ * Params: The journal path.
+ * Return: 0 on success, 1 on error.
+ */
+static int sync_directory(char *path) {
+	char dir[PATH_MAX];
+	snprintf(dir, PATH_MAX, "%s", path);
+	char *slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		snprintf(dir, PATH_MAX, ".");
+	} else if (slash == dir) {
+		dir[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return 1;
+	}
+	int res = fsync(fd) == -1;
+	close(fd);
+	return res;
+}
+
+/*
+ * Desc: Creates a segment file at its full size, maps it and writes its
+         header. The blocks are reserved up front so appends never allocate
+         and the pages are faulted in before the writer gets to them.
+ * Params: The journal, the segment index, the segment to fill and whether an
+           existing file is an error (segment 0) or replaced.
+ * Return: 0 on success, 1 on error with errno set.
+ */
+static int create_segment(journal *j, int index, journal_segment *seg, int exclusive) {
+	char seg_path[PATH_MAX];
+	segment_path(seg_path, j->path, index);
+	memset(seg, 0, sizeof(journal_segment));
+	seg->index = index;
+	seg->fd = open(seg_path, O_RDWR | O_CREAT | O_CLOEXEC | (exclusive ? O_EXCL : O_TRUNC), 0644);
+	if (seg->fd == -1) {
+		return 1;
+	}
+
+	// file systems without fallocate get a sparse file instead
+	int res = fallocate(seg->fd, 0, 0, j->segment_size) == -1
+		&& (errno != EOPNOTSUPP || ftruncate(seg->fd, j->segment_size) == -1);
+	if (!res) {
+		seg->map = (char*)mmap(NULL, j->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, seg->fd, 0);
+		res = seg->map == MAP_FAILED;
+	}
+	if (!res) {
+		seg->size = j->segment_size;
+		memcpy(seg->map, &j->template, sizeof(journal_header));
+		((journal_header*)seg->map)->segment = index;
+		memcpy(seg->map + sizeof(journal_header), j->names, (size_t)j->template.num_products * PRODUCT_STR_LEN);
+		layout_segment(seg);
+		res = msync(seg->map, (char*)seg->records - seg->map, MS_SYNC) == -1
+			|| (j->policy != FSYNC_NONE && sync_directory(j->path));
+	}
+	if (res) {
+		int err = errno;
+		if (seg->map == MAP_FAILED) {
+			seg->map = NULL;
+		}
+		journal_unmap_segment(seg);
+		unlink(seg_path);
+		errno = err;
+	}
+	return res;
+}
+
+/*
+ * Desc: Removes the segment files from index first on, left behind by a run
+         whose journal ends earlier.
+ * Params: The journal path and the first index to remove.
+ */
+static void remove_segments(char *path, int first) {
+	char seg_path[PATH_MAX];
+	for (int i = first; ; i++) {
+		segment_path(seg_path, path, i);
+		if (unlink(seg_path) == -1) {
+			break;
+		}
+	}
+}
+
+/*
+ * Desc: Roller thread: creates the segment after the current one ahead of
+         time and unmaps the ones the writer is done with.
+ * Params: The journal, passed as void* by pthread_create.
+ */
+static void *roller_main(void *arg) {
+	journal *j = (journal*)arg;
+	pthread_mutex_lock(&j->roll_lock);
+	while (!j->roll_stop) {
+		if (j->retired.fd != -1) {
+			journal_segment retired = j->retired;
+			j->retired.fd = -1;
+			pthread_mutex_unlock(&j->roll_lock);
+			journal_unmap_segment(&retired);
+			pthread_mutex_lock(&j->roll_lock);
+		} else if (j->next.fd == -1 && !j->roll_failed) {
+			int index = j->current.index + 1;
+			pthread_mutex_unlock(&j->roll_lock);
+			journal_segment next;
+			int res = create_segment(j, index, &next, 0);
+			int err = errno;
+			pthread_mutex_lock(&j->roll_lock);
+			if (res) {
+				j->roll_failed = err;
+			} else {
+				j->next = next;
+			}
+			pthread_cond_broadcast(&j->roll_cond);
+		} else {
+			pthread_cond_wait(&j->roll_cond, &j->roll_lock);
+		}
+	}
+	pthread_mutex_unlock(&j->roll_lock);
+	return NULL;
+}
+
+/*
+ * Desc: Moves the writer to the next segment once the current one is full.
+         Only waits if the roller hasn't finished creating it yet.
+ * Params: The journal.
+ * Return: 0 on success, 1 if the full segment could not be synced or there
+           is no next segment.
+ */
+static int roll_segment(journal *j) {
+	if (j->policy == FSYNC_BATCH && sync_records(&j->current, j->synced, j->cursor)) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&j->roll_lock);
+	while (j->next.fd == -1 && !j->roll_failed) {
+		pthread_cond_wait(&j->roll_cond, &j->roll_lock);
+	}
+	if (j->next.fd == -1) {
+		printf("%s Journal write failed: %s\n", LOG_PREFIX, strerror(j->roll_failed));
+		pthread_mutex_unlock(&j->roll_lock);
+		return 1;
+	}
+	j->retired = j->current;
+	j->current = j->next;
+	j->next.fd = -1;
+	j->cursor = 0;
+	j->synced = 0;
+	pthread_cond_signal(&j->roll_cond);
+	pthread_mutex_unlock(&j->roll_lock);
+	return 0;
+}
+
+/*
+ * Desc: Appends a record to the current segment: a copy into the mapping and
+         a cursor bump. With --fsync=every it is synced right away. Once the
+         journal has failed nothing is appended, so it never has a gap.
+ * Params: The journal and the record, its seq and checksum are filled in.
+ * Return: 0 on success, 1 if the record could not be written.
+ */
+static int append_record(journal *j, journal_record *entry) {
+	if (atomic_load_explicit(&j->failed, memory_order_relaxed)) {
+		return 1;
+	}
+	if (j->cursor == j->current.capacity && roll_segment(j)) {
+		return fail_journal(j);
+	}
+	entry->seq = j->next_seq++;
+	entry->checksum = journal_checksum(entry, offsetof(journal_record, checksum));
+	memcpy(&j->current.records[j->cursor++], entry, sizeof(journal_record));
+	if (j->policy == FSYNC_EVERY) {
+		if (sync_records(&j->current, j->cursor - 1, j->cursor)) {
+			return fail_journal(j);
+		}
+		j->synced = j->cursor;
+	}
+	// only a written record lets the next commit release the shard's responses
+	j->appended[entry->shard_id] = entry->shard_seq;
+	return 0;
+}
+
+/*
+ * Desc: Syncs the records appended since the last commit per the fsync
+         policy and advances the commit watermarks of the shards they cover.
+         A failed journal keeps its watermarks where they are.
+ * Params: The journal.
+ * Return: 0 on success, 1 if the journal failed.
+ */
+static int commit_records(journal *j) {
+	if (atomic_load_explicit(&j->failed, memory_order_relaxed)) {
+		return 1;
+	}
+	if (j->policy == FSYNC_BATCH && sync_records(&j->current, j->synced, j->cursor)) {
+		return fail_journal(j);
+	}
+	j->synced = j->cursor;
+	for (int i = 0; i < j->num_shards; i++) {
+		atomic_store_explicit(&j->committed[i], j->appended[i], memory_order_release);
+	}
+	atomic_store_explicit(&j->committed_seq, j->next_seq - 1, memory_order_release);
+	if (j->notify_fd != -1) {
+		uint64_t one = 1;
+		write(j->notify_fd, &one, sizeof(one));
+	}
+	return 0;
+}
+
+/*
+ * Desc: Journal thread: group commits whatever the shards queued since the
+         last commit, then tells the gateways.
+ * Params: The journal, passed as void* by pthread_create.
+ */
+static void *journal_main(void *arg) {
+	journal *j = (journal*)arg;
+	journal_record entry;
+	int stopping = 0;
+	while (!stopping) {
+		// sleep until there is at least one record, then take all that's there
+		mpsc_pop_wait(&j->inbound, &entry);
+		int count = 0;
+		do {
+			if (entry.shard_id == JOURNAL_STOP) {
+				stopping = 1;
+				break;
+			}
+			// a failed journal keeps draining the queue so the shards can
+			// stop, but never writes or commits again
+			append_record(j, &entry);
+			count++;
+		} while (count < JOURNAL_BATCH && mpsc_pop(&j->inbound, &entry));
+
+		if (commit_records(j)) {
+			continue;
+		}
+		if (j->on_commit != NULL) {
+			j->on_commit(j->ctx);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Desc: Sets up everything but the segments for journal_open and
+         journal_reopen.
+ * Return: 0 on success, 1 if memory could not be allocated.
+ */
+static int init_journal(journal *j, char *path, int policy, size_t segment_size, int num_shards) {
+	memset(j, 0, sizeof(journal));
+	j->current.fd = -1;
+	j->next.fd = -1;
+	j->retired.fd = -1;
+	j->notify_fd = -1;
+	j->fail_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	j->policy = policy;
+	j->next_seq = 1;
+	j->num_shards = num_shards;
+	j->segment_size = segment_size;
+	pthread_mutex_init(&j->roll_lock, NULL);
+	pthread_cond_init(&j->roll_cond, NULL);
+	j->path = strdup(path);
+	j->appended = (uint64_t*)calloc(num_shards, sizeof(uint64_t));
+	j->committed = (_Atomic uint64_t*)calloc(num_shards, sizeof(_Atomic uint64_t));
+	return j->fail_fd == -1 || j->path == NULL || j->appended == NULL || j->committed == NULL;
+}
+
+/*
+ * Desc: Starts the roller thread once the current segment is mapped.
+ * Return: 0 on success, 1 if the thread could not be created.
+ */
+static int start_roller(journal *j) {
+	if (pthread_create(&j->roller, NULL, roller_main, j) != 0) {
+		return 1;
+	}
+	j->rolling = 1;
+	return 0;
+}
+
+uint32_t checksum_extend(uint32_t hash, const void *data, size_t len) {
+	const unsigned char *bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+uint32_t journal_checksum(const void *data, size_t len) {
+	return checksum_extend(JOURNAL_CHECKSUM_INIT, data, len);
+}
+
+int journal_open(journal *j, char *path, int policy, size_t segment_size, products *prods,
+		int num_traders, int num_shards) {
+	if (init_journal(j, path, policy, segment_size, num_shards)) {
+		return 1;
+	}
+	if (records_offset(prods->size) + sizeof(journal_record) > segment_size) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	// every segment carries the header, so each one describes the market
+	journal_header *header = &j->template;
+	memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+	header->version = JOURNAL_VERSION;
+	header->num_traders = num_traders;
+	header->num_products = prods->size;
+	header->num_shards = num_shards;
+	header->record_size = sizeof(journal_record);
+	j->names = (char*)calloc(prods->size, PRODUCT_STR_LEN);
+	if (j->names == NULL) {
+		return 1;
+	}
+	for (int i = 0; i < prods->size; i++) {
+		strncpy(j->names + i * PRODUCT_STR_LEN, prods->product_strings[i], PRODUCT_STR_LEN - 1);
+	}
+	return create_segment(j, 0, &j->current, 1) || start_roller(j);
+}
+
+int journal_reopen(journal *j, char *path, int policy, size_t segment_size, int num_shards,
+		journal_position *end, uint64_t *shard_seqs) {
+	if (init_journal(j, path, policy, segment_size, num_shards)
+			|| journal_map_segment(path, end->segment, 1, &j->current)) {
+		return 1;
+	}
+	memcpy(&j->template, j->current.header, sizeof(journal_header));
+	size_t names_len = (size_t)j->template.num_products * PRODUCT_STR_LEN;
+	j->names = (char*)malloc(names_len);
+	if (j->names == NULL) {
+		return 1;
+	}
+	memcpy(j->names, j->current.names, names_len);
+	if (records_offset(j->template.num_products) + sizeof(journal_record) > segment_size) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	j->cursor = end->records;
+	j->synced = end->records;
+	j->next_seq = end->last_seq + 1;
+	atomic_init(&j->committed_seq, end->last_seq);
+	for (int i = 0; i < num_shards; i++) {
+		j->appended[i] = shard_seqs[i];
+		atomic_init(&j->committed[i], shard_seqs[i]);
+	}
+	return start_roller(j);
+}
+
+int journal_map_segment(char *path, int index, int writable, journal_segment *seg) {
+	char seg_path[PATH_MAX];
+	segment_path(seg_path, path, index);
+	memset(seg, 0, sizeof(journal_segment));
+	seg->index = index;
+	seg->fd = open(seg_path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (seg->fd == -1) {
+		return 1;
+	}
+
+	struct stat st;
+	if (fstat(seg->fd, &st) == -1 || st.st_size < (off_t)sizeof(journal_header)) {
+		journal_unmap_segment(seg);
+		return 1;
+	}
+	seg->map = (char*)mmap(NULL, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, seg->fd, 0);
+	if (seg->map == MAP_FAILED) {
+		seg->map = NULL;
+		journal_unmap_segment(seg);
+		return 1;
+	}
+	seg->size = st.st_size;
+
+	// a segment cut short while it was created has no valid header
+	journal_header *header = (journal_header*)seg->map;
+	if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0
+			|| header->version != JOURNAL_VERSION || header->record_size != sizeof(journal_record)
+			|| header->num_products <= 0 || header->num_traders <= 0 || header->num_shards <= 0
+			|| header->segment != index
+			|| records_offset(header->num_products) > seg->size) {
+		journal_unmap_segment(seg);
+		return 1;
+	}
+	layout_segment(seg);
+	return 0;
+}
+
+void journal_unmap_segment(journal_segment *seg) {
+	if (seg->fd == -1) {
+		return;
+	}
+	if (seg->map != NULL) {
+		munmap(seg->map, seg->size);
+		seg->map = NULL;
+	}
+	close(seg->fd);
+	seg->fd = -1;
+}
+
+int journal_matches(journal_header *header, char *names, products *prods, int num_traders, int num_shards) {
+	if (header->num_traders != num_traders || header->num_products != prods->size
+			|| header->num_shards != num_shards) {
+		return 0;
+	}
+	for (int i = 0; i < prods->size; i++) {
+		if (strncmp(names + i * PRODUCT_STR_LEN, prods->product_strings[i], PRODUCT_STR_LEN - 1) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+long journal_valid_records(journal_segment *seg, uint64_t first_seq) {
+	long count = 0;
+	while (count < seg->capacity) {
+		journal_record *rec = &seg->records[count];
+		if (rec->seq != first_seq + count
+				|| rec->checksum != journal_checksum(rec, offsetof(journal_record, checksum))) {
+			break;
+		}
+		count++;
+	}
+	return count;
+}
+
+int journal_replay(char *path, products *prods, int num_traders, int num_shards,
+		void (*apply)(void *ctx, journal_record *rec), void *ctx, journal_position *end) {
+	// the journal must describe the market we are restarting
+	journal_segment seg;
+	if (journal_map_segment(path, 0, 1, &seg) || !journal_matches(seg.header, seg.names, prods, num_traders, num_shards)) {
+		printf("%s Journal %s was not written by an exchange with these products, traders and --shards\n",
+			LOG_PREFIX, path);
+		journal_unmap_segment(&seg);
+		return 1;
+	}
+
+	memset(end, 0, sizeof(journal_position));
+	int res = 0;
+	while (1) {
+		long count = journal_valid_records(&seg, end->last_seq + 1);
+		for (long i = 0; i < count; i++) {
+			apply(ctx, &seg.records[i]);
+		}
+		end->segment = seg.index;
+		end->records = count;
+		end->last_seq += count;
+		if (count < seg.capacity) {
+			break;
+		}
+
+		// a full segment, the journal goes on in the next one if there is one
+		journal_segment next;
+		if (journal_map_segment(path, seg.index + 1, 1, &next)
+				|| !journal_matches(next.header, next.names, prods, num_traders, num_shards)) {
+			journal_unmap_segment(&next);
+			break;
+		}
+		journal_unmap_segment(&seg);
+		seg = next;
+	}
+
+	// a record cut short by a crash was never committed, drop it; later slots
+	// are cleared too so a stale record can't pass for a new one
+	long used = end->records;
+	for (long i = end->records; i < seg.capacity; i++) {
+		if (seg.records[i].seq != 0 || seg.records[i].checksum != 0) {
+			used = i + 1;
+		}
+	}
+	if (used > end->records) {
+		printf("%s Journal %s: dropping a torn tail after record %llu\n", LOG_PREFIX, path,
+			(unsigned long long)end->last_seq);
+		memset(&seg.records[end->records], 0, (used - end->records) * sizeof(journal_record));
+		res = sync_records(&seg, end->records, used);
+	}
+	journal_unmap_segment(&seg);
+	remove_segments(path, end->segment + 1);
+	return res;
+}
+
+void journal_add(journal *j, int shard_id, uint64_t shard_seq, command *cmd, uint64_t digest) {
+	journal_record entry;
+	memset(&entry, 0, sizeof(journal_record));
+	entry.digest = digest;
+	// memcpy keeps the zeroed padding, the checksum covers it
+	memcpy(&entry.cmd, cmd, sizeof(command));
+	entry.shard_id = shard_id;
+	entry.shard_seq = shard_seq;
+
+	if (j->threaded) {
+		mpsc_push_wait(&j->inbound, &entry);
+		return;
+	}
+	append_record(j, &entry);
+}
+
+int journal_commit(journal *j) {
+	return commit_records(j);
+}
+
+int journal_committed(journal *j, int shard_id, uint64_t shard_seq) {
+	return atomic_load_explicit(&j->committed[shard_id], memory_order_acquire) >= shard_seq;
+}
+
+uint64_t journal_committed_seq(journal *j) {
+	return atomic_load_explicit(&j->committed_seq, memory_order_acquire);
+}
+
+int journal_failed(journal *j) {
+	return atomic_load_explicit(&j->failed, memory_order_acquire);
+}
+
+int journal_start(journal *j, void (*on_commit)(void *ctx), void *ctx) {
+	if (mpsc_init(&j->inbound, JOURNAL_QUEUE_SIZE, sizeof(journal_record))) {
+		return 1;
+	}
+	j->on_commit = on_commit;
+	j->ctx = ctx;
+	j->threaded = 1;
+	if (pthread_create(&j->thread, NULL, journal_main, j) != 0) {
+		j->threaded = 0;
+		mpsc_free(&j->inbound);
+		return 1;
+	}
+	return 0;
+}
+
+void journal_stop(journal *j) {
+	if (!j->threaded) {
+		return;
+	}
+	journal_record stop;
+	memset(&stop, 0, sizeof(journal_record));
+	stop.shard_id = JOURNAL_STOP;
+	mpsc_push_wait(&j->inbound, &stop);
+	pthread_join(j->thread, NULL);
+	mpsc_free(&j->inbound);
+	j->threaded = 0;
+}
+
+void journal_close(journal *j) {
+	if (j->path == NULL) {
+		return;
+	}
+	if (j->current.fd != -1) {
+		commit_records(j);
+	}
+	if (j->rolling) {
+		pthread_mutex_lock(&j->roll_lock);
+		j->roll_stop = 1;
+		pthread_cond_signal(&j->roll_cond);
+		pthread_mutex_unlock(&j->roll_lock);
+		pthread_join(j->roller, NULL);
+		j->rolling = 0;
+	}
+	journal_unmap_segment(&j->current);
+	journal_unmap_segment(&j->retired);
+	if (j->next.fd != -1) {
+		// made ahead of time and never written to
+		char seg_path[PATH_MAX];
+		segment_path(seg_path, j->path, j->next.index);
+		journal_unmap_segment(&j->next);
+		unlink(seg_path);
+	}
+	pthread_mutex_destroy(&j->roll_lock);
+	pthread_cond_destroy(&j->roll_cond);
+	if (j->fail_fd != -1) {
+		close(j->fail_fd);
+		j->fail_fd = -1;
+	}
+	free(j->appended);
+	free(j->committed);
+	free(j->names);
+	free(j->path);
+	j->appended = NULL;
+	j->committed = NULL;
+	j->names = NULL;
+	j->path = NULL;
+}
@@ -0,0 +1,281 @@
+#ifndef PE_JOURNAL_H
+#define PE_JOURNAL_H
+
+#include "pe_engine.h"
+#include "pe_config.h"
+#include <stdint.h>
+
+#define JOURNAL_MAGIC "PEXJRNL1"
+#define JOURNAL_VERSION 2
+#define JOURNAL_QUEUE_SIZE 8192 // records buffered between the shards and the journal thread
+#define JOURNAL_BATCH 512 // records the journal thread commits together at most
+#define JOURNAL_STOP -1 // shard ID of the entry that stops the journal thread
+#define JOURNAL_CHECKSUM_INIT 2166136261u
+#define JOURNAL_ALIGN 64 // records start at a multiple of this in a segment
+
+/*
+ * Desc: Start of every journal segment, followed by num_products product
+         names of PRODUCT_STR_LEN bytes each. Records start at the next
+         multiple of JOURNAL_ALIGN and fill the rest of the segment.
+ * Fields: The magic string and version, the trader, product and shard
+           counts the exchange was started with, and the segment's index.
+ */
+typedef struct journal_header journal_header;
+struct journal_header {
+    char magic[8];
+    uint32_t version;
+    int32_t num_traders;
+    int32_t num_products;
+    int32_t num_shards; // shard IDs in the records are only valid with this many
+    uint32_t record_size; // sizeof(journal_record) of the writer
+    int32_t segment; // 0 is the file at the journal path, i is PATH.%06d
+};
+
+/*
+ * Desc: One accepted command as written to the journal.
+ * Fields: The record's position in the journal, the shard that applied the
+           command with the shard's own count of journaled commands, a digest
+           of the events the command produced, the validated command and a
+           checksum of all of the above to spot torn writes.
+ */
+typedef struct journal_record journal_record;
+struct journal_record {
+    uint64_t seq; // 1 for the first record, assigned when appended, 0 --> unused slot
+    uint64_t shard_seq; // orders records of one shard, snapshots refer to it
+    uint64_t digest; // digest_events() of the command's events
+    command cmd;
+    int32_t shard_id; // JOURNAL_STOP on the queue entry that stops the thread
+    uint32_t checksum;
+};
+
+/*
+ * Desc: A journal segment mapped into memory. Segments are preallocated to
+         their full size, unused record slots are zero.
+ * Fields: The segment's index and file, the mapping, and where the header,
+           product names and records are in it.
+ */
+typedef struct journal_segment journal_segment;
+struct journal_segment {
+    int index;
+    int fd; // -1 --> not mapped
+    char *map;
+    size_t size;
+    journal_header *header;
+    char *names;
+    journal_record *records;
+    long capacity; // record slots in the segment
+};
+
+/*
+ * Desc: Where the valid part of a journal ends, found by journal_replay.
+ * Fields: The seq of the last valid record, the segment it ends in and the
+           number of valid records in that segment.
+ */
+typedef struct journal_position journal_position;
+struct journal_position {
+    uint64_t last_seq;
+    int segment;
+    long records;
+};
+
+/*
+ * Desc: Write-ahead journal of accepted commands, kept in fixed-size segment
+         files that are preallocated and written through mmap: appending a
+         record is a copy into the mapping and a cursor bump. Records are
+         added after a command is applied but before any of its responses
+         are released, and synced in groups with one msync of the range they
+         cover. Inline, the main loop commits once per event loop iteration;
+         with matching threads a journal thread commits whatever the shards
+         queued since its last commit. A roller thread creates the next
+         segment ahead of time and unmaps full ones, so the writer never
+         waits on the file system unless a segment fills before the next is
+         ready. Once a write or sync fails the journal stops: nothing more is
+         written or committed, so the responses behind it are never released.
+ * Fields: The current segment and cursor, the fsync policy, the next
+           sequence number, the commit watermarks, what the roller
+           works on and, when threaded, the queue from the shards, the thread
+           and the commit callback.
+ */
+typedef struct journal journal;
+struct journal {
+    journal_segment current; // current.fd == -1 --> no journal
+    long cursor; // next free record slot in the current segment
+    long synced; // records of the current segment before this are synced
+    int policy; // enum fsync_policy
+    uint64_t next_seq;
+    int num_shards;
+    uint64_t *appended; // per shard: last shard_seq appended, committed on the next commit
+    _Atomic uint64_t *committed; // per shard: last shard_seq that is on disk
+    _Atomic uint64_t committed_seq; // seq of the last committed record
+    int notify_fd; // eventfd written after every commit, -1 --> none
+    _Atomic int failed; // a write or sync failed, nothing is committed after it
+    int fail_fd; // eventfd written once the journal fails
+    char *path;
+    size_t segment_size; // bytes of each new segment
+    journal_header template; // header of new segments, only the index differs
+    char *names; // product names of new segments
+    journal_segment next; // made by the roller, next.fd == -1 until it is ready
+    journal_segment retired; // full segment the roller unmaps
+    pthread_t roller;
+    pthread_mutex_t roll_lock;
+    pthread_cond_t roll_cond;
+    int rolling; // the roller thread is running
+    int roll_stop;
+    int roll_failed;
+    mpsc_queue inbound; // threaded only
+    pthread_t thread;
+    int threaded;
+    void (*on_commit)(void *ctx); // called after every commit, threaded only
+    void *ctx;
+};
+
+/*
+ * Desc: Creates a new journal, maps its first segment and starts the roller.
+         An existing journal is never overwritten.
+ * Params: The journal to initialize, the file path, the fsync policy, the
+           size of each segment in bytes, the products, the number of traders
+           and the number of shards.
+ * Return: 0 on success, 1 if the file exists or could not be created.
+ */
+int journal_open(journal *j, char *path, int policy, size_t segment_size, products *prods,
+	int num_traders, int num_shards);
+
+/*
+ * Desc: Opens a journal that recovery has replayed so new records are
+         appended after the last valid one.
+ * Params: The journal to initialize, the file path, the fsync policy, the
+           size of new segments in bytes, the number of shards, where
+           journal_replay found the end and each shard's last journaled
+           shard_seq.
+ * Return: 0 on success, 1 if the segment could not be mapped.
+ */
+int journal_reopen(journal *j, char *path, int policy, size_t segment_size, int num_shards,
+	journal_position *end, uint64_t *shard_seqs);
+
+/*
+ * Desc: Reads a journal's segments in order, checks that it was written for
+         the same products, number of traders and number of shards, and
+         passes every valid record to apply in order. A torn or corrupt tail
+         is zeroed and later segments removed so the journal can be appended
+         to.
+ * Params: The file path, the products and numbers of traders and shards
+           the exchange was started with, the function called for each record
+           with its context, and where to store the end of the valid records.
+ * Return: 0 on success, 1 if the journal can't be read or doesn't match.
+ */
+int journal_replay(char *path, products *prods, int num_traders, int num_shards,
+	void (*apply)(void *ctx, journal_record *rec), void *ctx, journal_position *end);
+
+/*
+ * Desc: Maps one segment of a journal and checks its header.
+ * Params: The journal path, the segment index, whether to map it writable,
+           and the segment to fill.
+ * Return: 0 on success, 1 if the segment doesn't exist or isn't a segment
+           of a journal.
+ */
+int journal_map_segment(char *path, int index, int writable, journal_segment *seg);
+
+/*
+ * Desc: Unmaps a segment mapped by journal_map_segment. Does nothing if it
+         isn't mapped.
+ * Params: The segment.
+ */
+void journal_unmap_segment(journal_segment *seg);
+
+/*
+ * Desc: Checks that a journal header and its product names were written for
+         this market.
+ * Params: The header, the names following it, and the products and numbers
+           of traders and shards the exchange was started with.
+ * Return: 1 if they match, 0 otherwise.
+ */
+int journal_matches(journal_header *header, char *names, products *prods, int num_traders, int num_shards);
+
+/*
+ * Desc: Counts the valid records at the start of a segment: consecutive seqs
+         from first_seq on, each with a correct checksum.
+ * Params: The segment and the seq its first record should have.
+ * Return: The number of valid records.
+ */
+long journal_valid_records(journal_segment *seg, uint64_t first_seq);
+
+/*
+ * Desc: Adds an applied command to the journal. Inline it is appended to the
+         current segment and synced by the next journal_commit, threaded it
+         is queued for the journal thread.
+ * Params: The journal, the shard that applied the command and its count of
+           journaled commands, the command and the digest of its events.
+ */
+void journal_add(journal *j, int shard_id, uint64_t shard_seq, command *cmd, uint64_t digest);
+
+/*
+ * Desc: Syncs the records added since the last commit according to the
+         fsync policy. Inline use only.
+ * Params: The journal.
+ * Return: 0 on success, 1 if the write or sync failed.
+ */
+int journal_commit(journal *j);
+
+/*
+ * Desc: Tells whether the command a shard journaled as shard_seq is committed.
+ * Params: The journal, the shard ID and the shard's sequence number.
+ * Return: 1 if it is committed, 0 otherwise.
+ */
+int journal_committed(journal *j, int shard_id, uint64_t shard_seq);
+
+/*
+ * Desc: Gives the seq of the last committed record, for readers of the
+         segments such as replication.
+ * Params: The journal.
+ * Return: The seq, 0 if nothing was committed yet.
+ */
+uint64_t journal_committed_seq(journal *j);
+
+/*
+ * Desc: Tells whether a write or sync of the journal failed. Commands
+         applied since its last commit are not journaled and their responses
+         must never be released.
+ * Params: The journal.
+ * Return: 1 if it failed, 0 otherwise.
+ */
+int journal_failed(journal *j);
+
+/*
+ * Desc: Starts the journal thread for use with matching threads.
+ * Params: The journal, and the function called after every commit with its
+           context (used to wake whoever holds back responses).
+ * Return: 0 on success, 1 if the queue or thread could not be created.
+ */
+int journal_start(journal *j, void (*on_commit)(void *ctx), void *ctx);
+
+/*
+ * Desc: Commits everything queued so far and joins the journal thread. Must
+         be called after the matching threads have stopped.
+ * Params: The journal.
+ */
+void journal_stop(journal *j);
+
+/*
+ * Desc: Commits anything still pending, stops the roller and unmaps the
+         segments. A segment made ahead of time but never used is removed.
+ * Params: The journal.
+ */
+void journal_close(journal *j);
+
+/*
+ * Desc: Checksum used for journal records and snapshots (32-bit FNV-1a).
+ * Params: The bytes and their length.
+ * Return: The checksum.
+ */
+uint32_t journal_checksum(const void *data, size_t len);
+
+/*
+ * Desc: Extends a checksum with more bytes, for data written in pieces.
+         journal_checksum(data, len) is checksum_extend(JOURNAL_CHECKSUM_INIT,
+         data, len).
+ * Params: The checksum so far, the bytes and their length.
+ * Return: The extended checksum.
+ */
+uint32_t checksum_extend(uint32_t hash, const void *data, size_t len);
+
+#endif
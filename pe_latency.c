@@ -0,0 +1,136 @@
+#include "pe_latency.h"
+#include "pe_engine.h"
+
+static const char *command_names[NUM_TIMED_COMMANDS] = {"BUY", "SELL", "AMEND", "CANCEL"};
+static const char *stage_names[NUM_STAGES] = {"parse", "match", "respond", "total"};
+
+latency_recorder *new_latency_recorder(void) {
+	// all zero bits is an empty histogram
+	return (latency_recorder*)calloc(1, sizeof(latency_recorder));
+}
+
+void latency_record_event(latency_recorder *rec, int event_type, command_times *times, uint64_t match_ns) {
+	if (rec == NULL || times->read_ns == 0) {
+		return;
+	}
+	uint64_t now = latency_now();
+	if (event_type == EVENT_FILL) {
+		latency_record(&rec->fills, now - times->read_ns);
+		return;
+	}
+	if (event_type == EVENT_MATCH || times->cmd_type < 0 || times->cmd_type >= NUM_TIMED_COMMANDS) {
+		return;
+	}
+	latency_histogram *stages = rec->commands[times->cmd_type];
+	latency_record(&stages[STAGE_PARSE], times->parse_ns - times->read_ns);
+	latency_record(&stages[STAGE_MATCH], match_ns - times->parse_ns);
+	latency_record(&stages[STAGE_RESPOND], now - match_ns);
+	latency_record(&stages[STAGE_TOTAL], now - times->read_ns);
+}
+
+/*
+ * Desc: The largest value that falls in a bucket.
+ */
+static uint64_t bucket_value(int bucket) {
+	if (bucket < 2 * LATENCY_SUB_BUCKETS) {
+		return bucket;
+	}
+	int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+	uint64_t mantissa = bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+/*
+ * Desc: Prints one line of percentiles for the same histogram of every
+         recorder, merged: a table row in us, or a JSON object in ns.
+ * Params: The stream, the merged bucket counts, their total and the largest
+           value, the command and stage names, whether to print JSON and how
+           many histograms were printed before this one.
+ */
+static void print_histogram(FILE *out, uint64_t *counts, uint64_t total, uint64_t max, const char *command,
+		const char *stage, int json, int printed) {
+	static const double percentiles[] = {50, 90, 99, 99.9};
+	uint64_t values[4];
+	int next = 0;
+	uint64_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS && next < 4; i++) {
+		seen += counts[i];
+		// a percentile is in the first bucket that reaches its rank
+		while (next < 4 && seen > 0 && seen >= (uint64_t)(percentiles[next] / 100 * total + 0.5)) {
+			uint64_t value = bucket_value(i);
+			values[next++] = value < max ? value : max;
+		}
+	}
+	if (json) {
+		fprintf(out, "%s{\"cmd\":\"%s\",\"stage\":\"%s\",\"count\":%llu,\"p50\":%llu,\"p90\":%llu,"
+			"\"p99\":%llu,\"p99.9\":%llu,\"max\":%llu}", printed > 0 ? "," : "", command, stage,
+			(unsigned long long)total, (unsigned long long)values[0], (unsigned long long)values[1],
+			(unsigned long long)values[2], (unsigned long long)values[3], (unsigned long long)max);
+		return;
+	}
+	fprintf(out, "%s\t%-6s %-7s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", LOG_PREFIX, command, stage,
+		(unsigned long long)total, values[0] / 1e3, values[1] / 1e3, values[2] / 1e3, values[3] / 1e3, max / 1e3);
+}
+
+/*
+ * Desc: Finds a histogram of a recorder by index: command c's stage s is at
+         c * NUM_STAGES + s, the fills come after the last command.
+ */
+static latency_histogram *histogram_at(latency_recorder *rec, int index) {
+	if (index == NUM_TIMED_COMMANDS * NUM_STAGES) {
+		return &rec->fills;
+	}
+	return &rec->commands[index / NUM_STAGES][index % NUM_STAGES];
+}
+
+/*
+ * Desc: Merges one histogram of every recorder and prints it. Nothing is
+         printed if no values were recorded.
+ * Params: The stream, the recorders and their number, the histogram's
+           index, the names to print it under, whether to print JSON and
+           the number of histograms printed so far, updated.
+ */
+static void merge_and_print(FILE *out, latency_recorder **recs, int num_recs, int index, const char *command,
+		const char *stage, int json, int *printed) {
+	uint64_t counts[LATENCY_BUCKETS];
+	memset(counts, 0, sizeof(counts));
+	uint64_t total = 0;
+	uint64_t max = 0;
+	for (int r = 0; r < num_recs; r++) {
+		if (recs[r] == NULL) {
+			continue;
+		}
+		latency_histogram *h = histogram_at(recs[r], index);
+		for (int i = 0; i < LATENCY_BUCKETS; i++) {
+			uint64_t count = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+			counts[i] += count;
+			total += count;
+		}
+		uint64_t h_max = atomic_load_explicit(&h->max, memory_order_relaxed);
+		max = h_max > max ? h_max : max;
+	}
+	if (total > 0) {
+		print_histogram(out, counts, total, max, command, stage, json, (*printed)++);
+	}
+}
+
+void print_latency(FILE *out, latency_recorder **recs, int num_recs, int json) {
+	if (json) {
+		fprintf(out, "{\"unit\":\"ns\",\"histograms\":[");
+	} else {
+		fprintf(out, "%s\t--LATENCY-- (us)\n", LOG_PREFIX);
+		fprintf(out, "%s\t%-6s %-7s %10s %10s %10s %10s %10s %10s\n", LOG_PREFIX, "cmd", "stage", "count",
+			"p50", "p90", "p99", "p99.9", "max");
+	}
+	int printed = 0;
+	for (int c = 0; c < NUM_TIMED_COMMANDS; c++) {
+		for (int s = 0; s < NUM_STAGES; s++) {
+			merge_and_print(out, recs, num_recs, c * NUM_STAGES + s, command_names[c], stage_names[s], json, &printed);
+		}
+	}
+	merge_and_print(out, recs, num_recs, NUM_TIMED_COMMANDS * NUM_STAGES, "FILL", "total", json, &printed);
+	if (json) {
+		fprintf(out, "]}\n");
+	}
+	fflush(out);
+}
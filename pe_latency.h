@@ -0,0 +1,123 @@
+#ifndef PE_LATENCY_H
+#define PE_LATENCY_H
+
+#include "pe_common.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Log-linear buckets: values below 2 * LATENCY_SUB_BUCKETS ns get a bucket
+ * each, above that every power of two is split into LATENCY_SUB_BUCKETS
+ * buckets, so a value is off by at most 1 / LATENCY_SUB_BUCKETS (about 3%).
+ */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_MAGNITUDE 40 // values from 2^41 ns (about 36 minutes) go in the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_MAGNITUDE - LATENCY_SUB_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+enum latency_stage {
+	STAGE_PARSE = 0, // read --> parsed and validated
+	STAGE_MATCH, // parsed --> applied to the book
+	STAGE_RESPOND, // applied --> response written
+	STAGE_TOTAL, // read --> response written
+	NUM_STAGES
+};
+
+#define NUM_TIMED_COMMANDS 4 // BUY, SELL, AMEND, CANCEL
+
+/*
+ * Desc: When a command was read and parsed, carried along with it so the
+         latency of its responses can be recorded when they are written.
+ * Fields: The command type, the CLOCK_MONOTONIC times in ns and the ID the
+           spans of a traced command are recorded under.
+ */
+typedef struct command_times command_times;
+struct command_times {
+    int cmd_type;
+    uint64_t read_ns; // 0 --> the command isn't timed
+    uint64_t parse_ns;
+    uint32_t trace_id; // 0 --> the command isn't traced
+};
+
+/*
+ * Desc: Counts of recorded values per bucket. Only one thread records into a
+         histogram, others may read it at any time.
+ * Fields: The bucket counts and the largest value recorded.
+ */
+typedef struct latency_histogram latency_histogram;
+struct latency_histogram {
+    _Atomic uint64_t counts[LATENCY_BUCKETS];
+    _Atomic uint64_t max;
+};
+
+/*
+ * Desc: The histograms one thread writing responses records into.
+ * Fields: One histogram per command type and stage, and one for the time
+           from reading an order to writing each FILL it caused.
+ */
+typedef struct latency_recorder latency_recorder;
+struct latency_recorder {
+    latency_histogram commands[NUM_TIMED_COMMANDS][NUM_STAGES];
+    latency_histogram fills;
+};
+
+static inline uint64_t latency_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Desc: Maps a value in ns to its bucket.
+ */
+static inline int latency_bucket(uint64_t ns) {
+	if (ns < 2 * LATENCY_SUB_BUCKETS) {
+		return (int)ns;
+	}
+	int magnitude = 63 - __builtin_clzll(ns);
+	if (magnitude > LATENCY_MAX_MAGNITUDE) {
+		return LATENCY_BUCKETS - 1;
+	}
+	int shift = magnitude - LATENCY_SUB_BITS;
+	return (shift + 1) * LATENCY_SUB_BUCKETS + (int)(ns >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+/*
+ * Desc: Records a value. Never allocates or locks; the owning thread is the
+         only writer, so plain relaxed loads and stores are enough.
+ * Params: The histogram and the value in ns.
+ */
+static inline void latency_record(latency_histogram *h, uint64_t ns) {
+	_Atomic uint64_t *count = &h->counts[latency_bucket(ns)];
+	atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+	if (ns > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+		atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+	}
+}
+
+/*
+ * Desc: Allocates a recorder with empty histograms.
+ * Return: The recorder, NULL if memory could not be allocated.
+ */
+latency_recorder *new_latency_recorder(void);
+
+/*
+ * Desc: Records the latency of an event that was just written to the
+         traders: every stage of the command it answers for a response, the
+         whole path for a FILL. Events of untimed commands are ignored.
+ * Params: The recorder (NULL --> nothing is recorded), the event type and
+           the command's times and when it was applied.
+ */
+void latency_record_event(latency_recorder *rec, int event_type, command_times *times, uint64_t match_ns);
+
+/*
+ * Desc: Prints percentiles of the recorders' histograms merged together, as
+         a table in us or as one line of JSON in ns. Readable while other
+         threads keep recording.
+ * Params: The stream to print to, the recorders and their number (NULL
+           entries are skipped) and whether to print JSON.
+ */
+void print_latency(FILE *out, latency_recorder **recs, int num_recs, int json);
+
+#endif
@@ -0,0 +1,146 @@
+#include "pe_launch.h"
+#include <spawn.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/*
+ * Desc: What a vfork-style zygote child needs to exec the trader. The child
+         shares the zygote's memory, so it reports a failed exec through it.
+ */
+typedef struct zygote_child zygote_child;
+struct zygote_child {
+    char *path;
+    char tid_str[16];
+    int exec_error;
+};
+
+/*
+ * Desc: Runs in the clone()d child: execs the trader. Not instrumented, the
+         sanitizer doesn't know the borrowed stack this runs on.
+ * Params: The zygote_child, passed as void* by clone.
+ * Return: Never returns if the exec succeeds.
+ */
+__attribute__((no_sanitize_address))
+static int zygote_exec(void *arg) {
+	zygote_child *child = (zygote_child*)arg;
+	char *args[] = {child->path, child->tid_str, NULL};
+	execve(child->path, args, environ);
+	child->exec_error = errno;
+	_exit(127);
+}
+
+/*
+ * Desc: The zygote's loop: starts a trader for every request until the
+         exchange closes the socket.
+ * Params: The zygote's end of the socket.
+ */
+static void zygote_main(int sock) {
+	static char stack[ZYGOTE_STACK_SIZE] __attribute__((aligned(16)));
+	launch_request req;
+	launch_reply reply;
+	zygote_child child;
+	while (recv(sock, &req, sizeof(req), 0) == sizeof(req)) {
+		req.path[PATH_MAX - 1] = '\0';
+		child.path = req.path;
+		snprintf(child.tid_str, sizeof(child.tid_str), "%d", req.trader_id);
+		child.exec_error = 0;
+
+		// the exchange becomes the parent, the zygote is suspended until the exec
+		reply.pid = clone(zygote_exec, stack + ZYGOTE_STACK_SIZE,
+			CLONE_PARENT | CLONE_VM | CLONE_VFORK | SIGCHLD, &child);
+		reply.error = reply.pid == -1 ? errno : child.exec_error;
+		if (send(sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
+			break;
+		}
+	}
+	_exit(0);
+}
+
+void init_launcher(launcher *l) {
+	l->sock = -1;
+	l->zygote_pid = -1;
+}
+
+int start_zygote(launcher *l) {
+	int socks[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) == -1) {
+		return 1;
+	}
+
+	fflush(stdout); // don't let the zygote inherit buffered output
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(socks[0]);
+		close(socks[1]);
+		return 1;
+	} else if (pid == 0) {
+		close(socks[0]);
+		zygote_main(socks[1]);
+	}
+
+	close(socks[1]);
+	l->sock = socks[0];
+	l->zygote_pid = pid;
+	return 0;
+}
+
+pid_t launch_trader(launcher *l, char *path, int trader_id) {
+	if (l->sock != -1) {
+		launch_request req;
+		launch_reply reply;
+		memset(&req, 0, sizeof(req));
+		req.trader_id = trader_id;
+		snprintf(req.path, PATH_MAX, "%s", path);
+		if (send(l->sock, &req, sizeof(req), 0) != sizeof(req)
+				|| recv(l->sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
+			return -1;
+		}
+		if (reply.error != 0) {
+			// the child already exited, it is ours to reap
+			if (reply.pid > 0) {
+				waitpid(reply.pid, NULL, 0);
+			}
+			errno = reply.error;
+			return -1;
+		}
+		return reply.pid;
+	}
+
+	// the trader waits on SIGUSR1, so undo the exchange's signal mask and
+	// give it back the default SIGPIPE the exchange ignores
+	posix_spawnattr_t attr;
+	sigset_t empty_mask;
+	sigset_t default_signals;
+	sigemptyset(&empty_mask);
+	sigemptyset(&default_signals);
+	sigaddset(&default_signals, SIGPIPE);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &empty_mask);
+	posix_spawnattr_setsigdefault(&attr, &default_signals);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	char tid_str[16];
+	snprintf(tid_str, sizeof(tid_str), "%d", trader_id);
+	char *args[] = {path, tid_str, NULL};
+	pid_t pid = -1;
+	int res = posix_spawn(&pid, path, NULL, &attr, args, environ);
+	posix_spawnattr_destroy(&attr);
+	if (res != 0) {
+		errno = res;
+		return -1;
+	}
+	return pid;
+}
+
+void stop_zygote(launcher *l) {
+	if (l->sock == -1) {
+		return;
+	}
+	close(l->sock);
+	waitpid(l->zygote_pid, NULL, 0);
+	l->sock = -1;
+	l->zygote_pid = -1;
+}
@@ -0,0 +1,73 @@
+#ifndef PE_LAUNCH_H
+#define PE_LAUNCH_H
+
+#include "pe_common.h"
+#include <limits.h>
+
+#define ZYGOTE_STACK_SIZE 65536 // stack the zygote's vfork-style children exec from
+
+/*
+ * Desc: How trader processes are started. Without a zygote, traders are
+         started with posix_spawn from the exchange. With one, a small helper
+         forked before the exchange allocated anything starts them on request,
+         so the cost doesn't grow with the exchange's memory.
+ * Fields: The socket to the zygote and its process ID, -1 when not in use.
+ */
+typedef struct launcher launcher;
+struct launcher {
+    int sock;
+    pid_t zygote_pid;
+};
+
+/*
+ * Desc: A launch request sent to the zygote.
+ * Fields: The trader ID to pass as the trader's argument and its binary.
+ */
+typedef struct launch_request launch_request;
+struct launch_request {
+    int trader_id;
+    char path[PATH_MAX];
+};
+
+/*
+ * Desc: The zygote's reply to a launch request.
+ * Fields: The new trader's process ID and 0, or the errno of the failed
+           clone or exec (with the exited child's ID, or -1 if clone failed).
+ */
+typedef struct launch_reply launch_reply;
+struct launch_reply {
+    pid_t pid;
+    int error;
+};
+
+/*
+ * Desc: Sets the launcher up to use posix_spawn.
+ * Params: A pointer to the launcher.
+ */
+void init_launcher(launcher *l);
+
+/*
+ * Desc: Forks the zygote. Must be called before the exchange blocks signals
+         or ignores SIGPIPE, traders inherit the zygote's dispositions. The
+         zygote starts traders with CLONE_PARENT so they are children of the
+         exchange, exactly like traders started directly.
+ * Params: A pointer to the launcher.
+ * Return: 0 on success, 1 if the socket or the zygote could not be created.
+ */
+int start_zygote(launcher *l);
+
+/*
+ * Desc: Starts a trader binary with its trader ID as the only argument, with
+         an empty signal mask and SIGPIPE at its default.
+ * Params: A pointer to the launcher, the binary and the trader ID.
+ * Return: The trader's process ID, -1 with errno set if it could not be started.
+ */
+pid_t launch_trader(launcher *l, char *path, int trader_id);
+
+/*
+ * Desc: Tells the zygote to exit and reaps it. Does nothing without a zygote.
+ * Params: A pointer to the launcher.
+ */
+void stop_zygote(launcher *l);
+
+#endif
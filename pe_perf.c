@@ -0,0 +1,233 @@
+#include "pe_perf.h"
+#include "pe_engine.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+int perf_enabled = 0;
+static _Thread_local perf_thread *thread_perf = NULL;
+
+static perf_thread *all_threads = NULL;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static int available[NUM_PERF_COUNTERS]; // set by perf_start
+
+static const char *counter_names[NUM_PERF_COUNTERS] = {
+	"cycles", "instructions", "cache-misses", "branch-misses", "task-ms"
+};
+static const char *stage_names[NUM_CYCLE_STAGES] = {
+	"other", "wait", "read", "log", "decode", "parse", "validate", "route",
+	"book", "match", "journal", "broadcast", "report"
+};
+
+/*
+ * Desc: Opens one counter on the calling thread, counting user space only.
+ * Return: The fd, -1 if the counter can't be opened.
+ */
+static int open_counter(int counter) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(struct perf_event_attr));
+	attr.size = sizeof(struct perf_event_attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	switch (counter) {
+	case PERF_CYCLES:
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case PERF_INSTRUCTIONS:
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case PERF_CACHE_MISSES:
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		break;
+	case PERF_BRANCH_MISSES:
+		attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+		break;
+	default:
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_TASK_CLOCK;
+	}
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/*
+ * Desc: Reads a counter, from user space with rdpmc when the kernel allows
+         it, with a read() otherwise.
+ */
+static uint64_t read_counter(perf_thread *p, int counter) {
+#if defined(__x86_64__) || defined(__i386__)
+	struct perf_event_mmap_page *page = p->pages[counter];
+	if (page != NULL && page->cap_user_rdpmc) {
+		// the kernel bumps lock whenever it moves the counter, retry then
+		uint32_t seq;
+		uint64_t value;
+		int ok;
+		do {
+			seq = page->lock;
+			__sync_synchronize();
+			uint32_t index = page->index;
+			value = page->offset;
+			ok = index != 0;
+			if (ok) {
+				int64_t pmc = (int64_t)__rdpmc(index - 1);
+				int shift = 64 - page->pmc_width;
+				value += (uint64_t)((pmc << shift) >> shift);
+			}
+			__sync_synchronize();
+		} while (page->lock != seq);
+		if (ok) {
+			return value;
+		}
+	}
+#endif
+	uint64_t value = 0;
+	if (read(p->fds[counter], &value, sizeof(value)) != sizeof(value)) {
+		return p->last[counter];
+	}
+	return value;
+}
+
+int perf_start(void) {
+	int any = 0;
+	for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+		int fd = open_counter(i);
+		available[i] = fd != -1;
+		if (fd == -1) {
+			printf("%s Counter %s unavailable: %s\n", LOG_PREFIX, counter_names[i], strerror(errno));
+		} else {
+			close(fd);
+			any = 1;
+		}
+	}
+	perf_enabled = any;
+	return !any;
+}
+
+void perf_thread_start(const char *kind, int index) {
+	if (!perf_enabled) {
+		return;
+	}
+	perf_thread *p = (perf_thread*)calloc(1, sizeof(perf_thread));
+	if (p == NULL) {
+		// nothing is counted on this thread then
+		return;
+	}
+	if (index >= 0) {
+		snprintf(p->name, sizeof(p->name), "%s %d", kind, index);
+	} else {
+		snprintf(p->name, sizeof(p->name), "%s", kind);
+	}
+	long page_size = sysconf(_SC_PAGESIZE);
+	for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+		p->fds[i] = available[i] ? open_counter(i) : -1;
+		p->pages[i] = NULL;
+		if (p->fds[i] != -1 && i != PERF_TASK_CLOCK) {
+			void *page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, p->fds[i], 0);
+			p->pages[i] = page != MAP_FAILED ? (struct perf_event_mmap_page*)page : NULL;
+		}
+	}
+	for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+		p->last[i] = p->fds[i] != -1 ? read_counter(p, i) : 0;
+	}
+	p->stage = CYCLES_OTHER;
+	thread_perf = p;
+
+	pthread_mutex_lock(&threads_lock);
+	p->next = all_threads;
+	all_threads = p;
+	pthread_mutex_unlock(&threads_lock);
+}
+
+int perf_switch(int stage) {
+	perf_thread *p = thread_perf;
+	if (p == NULL) {
+		// a thread that doesn't count, e.g. the journal thread
+		return CYCLES_OTHER;
+	}
+	for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+		if (p->fds[i] == -1) {
+			continue;
+		}
+		uint64_t now = read_counter(p, i);
+		p->counts[p->stage][i] += now - p->last[i];
+		p->last[i] = now;
+	}
+	int prev = p->stage;
+	p->stage = stage;
+	return prev;
+}
+
+void perf_close(long commands) {
+	if (!perf_enabled) {
+		return;
+	}
+	// close the calling thread's current stage so it is counted too
+	if (thread_perf != NULL) {
+		perf_switch(thread_perf->stage);
+	}
+
+	uint64_t totals[NUM_CYCLE_STAGES][NUM_PERF_COUNTERS];
+	memset(totals, 0, sizeof(totals));
+	pthread_mutex_lock(&threads_lock);
+	for (perf_thread *p = all_threads; p != NULL; p = p->next) {
+		for (int s = 0; s < NUM_CYCLE_STAGES; s++) {
+			for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+				totals[s][i] += p->counts[s][i];
+			}
+		}
+	}
+
+	printf("%s\t--COUNTERS-- (per million commands, %ld commands)\n", LOG_PREFIX, commands);
+	printf("%s\t%-10s", LOG_PREFIX, "stage");
+	for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+		printf(" %15s", counter_names[i]);
+	}
+	printf(" %6s\n", "IPC");
+	double scale = commands > 0 ? 1e6 / commands : 0;
+	for (int s = 0; s < NUM_CYCLE_STAGES; s++) {
+		int counted = 0;
+		for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+			counted |= totals[s][i] != 0;
+		}
+		if (!counted) {
+			continue;
+		}
+		printf("%s\t%-10s", LOG_PREFIX, stage_names[s]);
+		for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+			if (!available[i]) {
+				printf(" %15s", "n/a");
+			} else if (i == PERF_TASK_CLOCK) {
+				printf(" %15.1f", totals[s][i] * scale / 1e6);
+			} else {
+				printf(" %15.0f", totals[s][i] * scale);
+			}
+		}
+		if (available[PERF_CYCLES] && available[PERF_INSTRUCTIONS] && totals[s][PERF_CYCLES] > 0) {
+			printf(" %6.2f\n", (double)totals[s][PERF_INSTRUCTIONS] / totals[s][PERF_CYCLES]);
+		} else {
+			printf(" %6s\n", "n/a");
+		}
+	}
+	fflush(stdout);
+
+	long page_size = sysconf(_SC_PAGESIZE);
+	while (all_threads != NULL) {
+		perf_thread *next = all_threads->next;
+		for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+			if (all_threads->pages[i] != NULL) {
+				munmap(all_threads->pages[i], page_size);
+			}
+			if (all_threads->fds[i] != -1) {
+				close(all_threads->fds[i]);
+			}
+		}
+		free(all_threads);
+		all_threads = next;
+	}
+	pthread_mutex_unlock(&threads_lock);
+	thread_perf = NULL;
+	perf_enabled = 0;
+}
@@ -0,0 +1,59 @@
+#ifndef PE_PERF_H
+#define PE_PERF_H
+
+#include "pe_cycles.h"
+#include <linux/perf_event.h>
+
+/*
+ * Hardware performance counters read through perf_event_open on the
+ * exchange's own threads (--perf-counters). Every CYCLES_TIME stage switch
+ * reads the calling thread's counters and charges what they advanced to the
+ * stage it leaves, so counts are attributed to parsing, book updates,
+ * matching, fan-out, reporting and the rest. Counters the kernel allows
+ * user space to read are read with rdpmc, the others cost a read() per
+ * switch. Counters the machine doesn't have (e.g. in a VM) are left out.
+ */
+
+enum perf_counter {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_TASK_CLOCK, // software, ns on the CPU; works where there is no PMU
+    NUM_PERF_COUNTERS
+};
+
+/*
+ * Desc: One thread's counters, linked into a global list so the summary can
+         find every thread's.
+ * Fields: The thread's name, the counter fds and their mapped pages, the
+           counts charged to each stage, the values at the last switch and
+           the stage the thread is in.
+ */
+typedef struct perf_thread perf_thread;
+struct perf_thread {
+    char name[32];
+    int fds[NUM_PERF_COUNTERS]; // -1 --> counter unavailable
+    struct perf_event_mmap_page *pages[NUM_PERF_COUNTERS]; // NULL --> read() the fd
+    uint64_t counts[NUM_CYCLE_STAGES][NUM_PERF_COUNTERS];
+    uint64_t last[NUM_PERF_COUNTERS];
+    int stage;
+    perf_thread *next;
+};
+
+/*
+ * Desc: Checks which counters the machine has and turns counting on. Each
+         thread then opens its own with perf_thread_start.
+ * Return: 0 if at least one counter can be counted, 1 otherwise.
+ */
+int perf_start(void);
+
+/*
+ * Desc: Prints the counts of every thread summed per stage and scaled to a
+         million commands, then closes every counter. Threads that counted
+         must have exited or be idle. Does nothing when not counting.
+ * Params: The number of commands applied while counting.
+ */
+void perf_close(long commands);
+
+#endif
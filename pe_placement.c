@@ -0,0 +1,74 @@
+#include "pe_placement.h"
+#include "pe_engine.h"
+
+/*
+ * Desc: Writes a CPU set as a compact list of ranges, e.g. "0-3,6".
+ * Params: The set, the output buffer and its size.
+ */
+static void format_cpu_set(cpu_set_t *set, char *out, int size) {
+	int len = 0;
+	out[0] = '\0';
+	for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+		if (!CPU_ISSET(cpu, set)) {
+			continue;
+		}
+		int last = cpu;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+			last++;
+		}
+		if (last == cpu) {
+			len += snprintf(out + len, size - len, "%s%d", len ? "," : "", cpu);
+		} else {
+			len += snprintf(out + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+		}
+		cpu = last;
+	}
+}
+
+int pick_cpu(cpu_list *list, int index) {
+	if (list->size == 0) {
+		return -1;
+	}
+	return list->cpus[index % list->size];
+}
+
+int set_placement(pid_t tid, char *label, int cpu, int sched_priority) {
+	int res = 0;
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(tid, sizeof(cpu_set_t), &set) == -1) {
+			printf("%s Placement: %s could not be pinned to CPU %d: %s\n", LOG_PREFIX, label, cpu, strerror(errno));
+			res = 1;
+		}
+	}
+	if (sched_priority > 0) {
+		struct sched_param param;
+		param.sched_priority = sched_priority;
+		if (sched_setscheduler(tid, SCHED_FIFO, &param) == -1) {
+			printf("%s Placement: %s could not use SCHED_FIFO %d: %s\n", LOG_PREFIX, label, sched_priority, strerror(errno));
+			res = 1;
+		}
+	}
+	return res;
+}
+
+void log_placement(pid_t tid, char *label) {
+	cpu_set_t set;
+	char cpus[BUF_SIZE];
+	if (sched_getaffinity(tid, sizeof(cpu_set_t), &set) == -1) {
+		snprintf(cpus, BUF_SIZE, "unknown CPUs");
+	} else {
+		format_cpu_set(&set, cpus, BUF_SIZE);
+	}
+
+	struct sched_param param;
+	int policy = sched_getscheduler(tid);
+	if (policy == SCHED_FIFO && sched_getparam(tid, &param) == 0) {
+		printf("%s Placement: %s on CPUs %s, SCHED_FIFO %d\n", LOG_PREFIX, label, cpus, param.sched_priority);
+	} else {
+		printf("%s Placement: %s on CPUs %s, %s\n", LOG_PREFIX, label, cpus,
+			policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_OTHER");
+	}
+}
@@ -0,0 +1,33 @@
+#ifndef PE_PLACEMENT_H
+#define PE_PLACEMENT_H
+
+#include "pe_common.h"
+#include "pe_config.h"
+#include <sched.h>
+
+/*
+ * Desc: Picks the CPU for the index-th thread or process of a role: CPUs are
+         handed out round-robin from the role's list.
+ * Params: The role's CPU list and the index of the thread or process.
+ * Return: The CPU number, -1 if the list is empty (leave it unpinned).
+ */
+int pick_cpu(cpu_list *list, int index);
+
+/*
+ * Desc: Pins a thread or process to a single CPU and optionally switches it to
+         SCHED_FIFO. Failures are printed but not fatal.
+ * Params: The thread or process ID (0 for the calling thread), a label for
+           error messages, the CPU (-1 to leave the affinity alone) and the
+           SCHED_FIFO priority (0 to leave the policy alone).
+ * Return: 0 if everything requested was applied, 1 otherwise.
+ */
+int set_placement(pid_t tid, char *label, int cpu, int sched_priority);
+
+/*
+ * Desc: Prints the effective CPU set and scheduling policy of a thread or
+         process, read back from the kernel.
+ * Params: The thread or process ID (0 for the calling thread) and its label.
+ */
+void log_placement(pid_t tid, char *label);
+
+#endif
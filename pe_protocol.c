@@ -0,0 +1,113 @@
+#include "pe_protocol.h"
+
+int format_message(char *message_in, int bytes_read) {
+	if (bytes_read <= 0) {
+		// nothing new was read, don't re-parse what is left in the buffer
+		return 1;
+	} else if (bytes_read > BUF_SIZE) {
+		bytes_read = BUF_SIZE;
+	}
+
+	// put the string into proper format
+	int delim_index = 0;
+	for (int i = 0; i < bytes_read; i++) {
+		// look for the ; delimiter
+		if (message_in[i] == ';') {
+			delim_index = i;
+			break;
+		} else if (i == bytes_read - 1) {
+			// reached end of data without finding delimiter
+			return 1;
+		}
+	}
+	message_in[delim_index] = '\0';
+	return 0;
+}
+
+int determine_cmd_type(char *message_in) {
+	// extract the command type from the incomming message
+	char type[CMD_LEN];
+	int res = sscanf(message_in, "%6s", type);
+	if (res != 1) {
+		return -1;
+	}
+
+	// return the corresponding flag
+	if (strcmp(type, "BUY") == 0) {
+		return BUY;
+	} else if (strcmp(type, "SELL") == 0) {
+		return SELL;
+	} else if (strcmp(type, "AMEND") == 0) {
+		return AMEND;
+	} else if (strcmp(type, "CANCEL") == 0) {
+		return CANCEL;
+	}
+
+	return -1;
+}
+
+int parse_command(char *message_in, int cmd_type, command *cmd) {
+	memset(cmd, 0, sizeof(command));
+	cmd->type = cmd_type;
+
+	char type[CMD_LEN]; // buy, sell, amend, cancel strings
+	char qty_buf[BUF_SIZE];
+	char price_buf[BUF_SIZE];
+	char oid_buf[BUF_SIZE];
+	long total_len = 0;
+	if (cmd_type == BUY || cmd_type == SELL) {
+		int res = sscanf(message_in, "%6s %d %16s %ld %ld", type, &cmd->order_id,
+						 cmd->product, &cmd->quantity, &cmd->price);
+		if (res < 5) {
+			return 1;
+		}
+
+		// hacky way to ignore trailing arguments
+		sprintf(qty_buf, "%ld", cmd->quantity);
+		sprintf(price_buf, "%ld", cmd->price);
+		sprintf(oid_buf, "%d", cmd->order_id);
+		total_len = strlen(type) + strlen(cmd->product) + strlen(qty_buf) + strlen(price_buf) + strlen(oid_buf) + 4;
+
+	} else if (cmd_type == AMEND) {
+		int res = sscanf(message_in, "%6s %d %ld %ld", type, &cmd->order_id, &cmd->quantity, &cmd->price);
+		if (res < 4) {
+			return 1;
+		}
+
+		// hacky way to ignore trailing arguments
+		sprintf(qty_buf, "%ld", cmd->quantity);
+		sprintf(price_buf, "%ld", cmd->price);
+		sprintf(oid_buf, "%d", cmd->order_id);
+		total_len = strlen(type) + strlen(qty_buf) + strlen(price_buf) + strlen(oid_buf) + 3;
+
+	} else if (cmd_type == CANCEL) {
+		int res = sscanf(message_in, "%6s %d", type, &cmd->order_id);
+		if (res < 2) {
+			return 1;
+		}
+
+		// hacky way to ignore trailing arguments
+		sprintf(oid_buf, "%d", cmd->order_id);
+		total_len = strlen(type) + strlen(oid_buf) + 1;
+
+	} else {
+		return 1;
+	}
+
+	if (total_len < strlen(message_in)) {
+		return 1;
+	}
+
+	// validate the ranges, CANCEL only carries an order ID
+	if (cmd->order_id < OID_MIN || cmd->order_id > OID_MAX) {
+		return 1;
+	} else if (cmd_type == CANCEL) {
+		return 0;
+	} else if (cmd->quantity < ORDER_MIN || cmd->quantity > ORDER_MAX) {
+		return 1;
+	} else if (cmd->price < ORDER_MIN || cmd->price > ORDER_MAX) {
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef PE_PROTOCOL_H
+#define PE_PROTOCOL_H
+
+#include "pe_common.h"
+
+#define BUF_SIZE 256 // temporary storage for message strings
+#define CMD_LEN 7 // longest possible command type a trader can send
+#define OID_MIN 0
+#define OID_MAX 999999
+#define ORDER_MIN 1
+#define ORDER_MAX 999999
+
+enum cmd_type {
+    BUY = 0,
+    SELL,
+    AMEND,
+    CANCEL
+};
+
+/*
+ * Desc: A decoded trader command.
+ * Fields: The command type and its arguments. Fields that the command type
+           does not carry are left zeroed (e.g. product for AMEND and CANCEL).
+           trader_id and product_index are filled in by the exchange once it
+           knows who sent the command and which book it applies to.
+ */
+typedef struct command command;
+struct command {
+    int type; // enum cmd_type
+    int order_id;
+    char product[PRODUCT_STR_LEN];
+    long quantity;
+    long price;
+    int trader_id;
+    int product_index;
+};
+
+/*
+ * Desc: Frames a raw message read from a trader fifo: finds the ; delimiter
+         within the bytes read and replaces it with a null terminator.
+ * Params: The buffer holding the message (BUF_SIZE bytes), the number of
+           bytes read into it.
+ * Return: 0 if a delimited message was found, 1 otherwise
+ */
+int format_message(char *message_in, int bytes_read);
+
+/*
+ * Desc: Determines the type of command to execute specified by the message.
+ * Params: The message to parse.
+ * Returns: A flag representing the command type
+*/
+int determine_cmd_type(char *message_in);
+
+/*
+ * Desc: Parses the arguments of a framed message and checks everything that
+         does not depend on exchange state: argument count, trailing
+         arguments and the ranges of the order ID, quantity and price.
+ * Params: The framed message, its command type and the command to fill.
+ * Return: 0 if the message is a well-formed command, 1 otherwise
+ */
+int parse_command(char *message_in, int cmd_type, command *cmd);
+
+#endif
@@ -0,0 +1,164 @@
+#include "pe_queue.h"
+#include "pe_alloc.h"
+#include <stdint.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define SPIN_LIMIT 1024 // empty polls before the consumer goes to sleep
+#define CELL_ALIGN 8
+
+/*
+ * Desc: Gets the sequence number stored at the start of a cell.
+ */
+static inline _Atomic size_t *cell_seq(mpsc_queue *q, size_t pos) {
+	return (_Atomic size_t*)(q->cells + (pos & q->mask) * q->cell_size);
+}
+
+/*
+ * Desc: Gets the element stored after a cell's sequence number.
+ */
+static inline void *cell_data(mpsc_queue *q, size_t pos) {
+	return q->cells + (pos & q->mask) * q->cell_size + sizeof(_Atomic size_t);
+}
+
+int mpsc_init(mpsc_queue *q, size_t capacity, size_t elem_size) {
+	// round the capacity up to a power of two so positions can be masked
+	size_t cap = 2;
+	while (cap < capacity) {
+		cap <<= 1;
+	}
+
+	q->capacity = cap;
+	q->mask = cap - 1;
+	q->elem_size = elem_size;
+	q->cell_size = (sizeof(_Atomic size_t) + elem_size + CELL_ALIGN - 1) & ~(size_t)(CELL_ALIGN - 1);
+	q->cells = pe_malloc(MEM_BUFFERS, cap * q->cell_size);
+	if (q->cells == NULL) {
+		return 1;
+	}
+	q->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (q->wake_fd == -1) {
+		pe_free(q->cells);
+		q->cells = NULL;
+		return 1;
+	}
+
+	// cell i is free for the producer that claims position i
+	for (size_t i = 0; i < cap; i++) {
+		atomic_init(cell_seq(q, i), i);
+	}
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->sleeping, 0);
+	atomic_init(&q->head, 0);
+	return 0;
+}
+
+int mpsc_push(mpsc_queue *q, const void *elem) {
+	size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	while (1) {
+		size_t seq = atomic_load_explicit(cell_seq(q, pos), memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			// cell is free, try to claim the position
+			if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// consumer hasn't freed this cell yet, the queue is full
+			return 1;
+		} else {
+			// another producer claimed it first
+			pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+		}
+	}
+
+	memcpy(cell_data(q, pos), elem, q->elem_size);
+	atomic_store_explicit(cell_seq(q, pos), pos + 1, memory_order_release);
+
+	// publish before checking whether the consumer went to sleep
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&q->sleeping, memory_order_relaxed)) {
+		uint64_t one = 1;
+		if (write(q->wake_fd, &one, sizeof(one)) < 0) {
+			// counter saturated, the consumer is awake anyway
+		}
+	}
+	return 0;
+}
+
+void mpsc_push_wait(mpsc_queue *q, const void *elem) {
+	while (mpsc_push(q, elem)) {
+		sched_yield();
+	}
+}
+
+int mpsc_pop(mpsc_queue *q, void *out) {
+	// only this thread writes head, relaxed is enough for mpsc_length readers
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t seq = atomic_load_explicit(cell_seq(q, head), memory_order_acquire);
+	if (seq != head + 1) {
+		return 0;
+	}
+
+	memcpy(out, cell_data(q, head), q->elem_size);
+	// hand the cell back to producers one lap later
+	atomic_store_explicit(cell_seq(q, head), head + q->capacity, memory_order_release);
+	atomic_store_explicit(&q->head, head + 1, memory_order_relaxed);
+	return 1;
+}
+
+int mpsc_prepare_sleep(mpsc_queue *q) {
+	atomic_store_explicit(&q->sleeping, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	// re-check after announcing the sleep, a producer may have just pushed
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t seq = atomic_load_explicit(cell_seq(q, head), memory_order_acquire);
+	if (seq == head + 1) {
+		atomic_store_explicit(&q->sleeping, 0, memory_order_relaxed);
+		return 0;
+	}
+	return 1;
+}
+
+void mpsc_woken(mpsc_queue *q) {
+	uint64_t count;
+	if (read(q->wake_fd, &count, sizeof(count)) < 0) {
+		// spurious wakeup, nothing to drain
+	}
+	atomic_store_explicit(&q->sleeping, 0, memory_order_relaxed);
+}
+
+void mpsc_pop_wait(mpsc_queue *q, void *out) {
+	while (1) {
+		for (int i = 0; i < SPIN_LIMIT; i++) {
+			if (mpsc_pop(q, out)) {
+				return;
+			}
+		}
+
+		if (mpsc_prepare_sleep(q)) {
+			struct pollfd pfd = {q->wake_fd, POLLIN, 0};
+			poll(&pfd, 1, -1);
+			mpsc_woken(q);
+		}
+	}
+}
+
+size_t mpsc_length(mpsc_queue *q) {
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	// the two loads aren't ordered, a stale tail may be behind head
+	return tail > head ? tail - head : 0;
+}
+
+void mpsc_free(mpsc_queue *q) {
+	if (q->cells == NULL) {
+		return;
+	}
+	pe_free(q->cells);
+	q->cells = NULL;
+	close(q->wake_fd);
+}
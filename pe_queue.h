@@ -0,0 +1,89 @@
+#ifndef PE_QUEUE_H
+#define PE_QUEUE_H
+
+#include "pe_common.h"
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * Desc: Bounded lock-free multi-producer / single-consumer queue of fixed
+         size elements (Vyukov's array queue). Elements are copied in and out
+         so producers never allocate.
+ * Fields: The ring of cells, its capacity (a power of two), the size of each
+           element, the producer and consumer positions, and the wakeup
+           eventfd plus a flag saying whether the consumer is asleep on it.
+ */
+typedef struct mpsc_queue mpsc_queue;
+struct mpsc_queue {
+    char *cells; // capacity cells of cell_size bytes: sequence + element
+    size_t capacity;
+    size_t mask;
+    size_t elem_size;
+    size_t cell_size;
+    _Atomic size_t tail; // next position producers claim
+    _Atomic size_t head; // next position the consumer reads, only the consumer writes it
+    _Atomic int sleeping; // set while the consumer waits on wake_fd
+    int wake_fd; // eventfd used to wake a sleeping consumer
+};
+
+/*
+ * Desc: Initializes a queue.
+ * Params: A pointer to the queue, the minimum capacity (rounded up to a power
+           of two) and the size of one element.
+ * Return: 0 on success, 1 if memory or the eventfd could not be allocated.
+ */
+int mpsc_init(mpsc_queue *q, size_t capacity, size_t elem_size);
+
+/*
+ * Desc: Copies an element into the queue. Safe to call from many threads.
+         Only makes a syscall if the consumer is asleep.
+ * Params: A pointer to the queue and the element to copy in.
+ * Return: 0 on success, 1 if the queue is full.
+ */
+int mpsc_push(mpsc_queue *q, const void *elem);
+
+/*
+ * Desc: Like mpsc_push, but yields until there is room instead of failing.
+ */
+void mpsc_push_wait(mpsc_queue *q, const void *elem);
+
+/*
+ * Desc: Copies the oldest element out of the queue. Consumer thread only.
+ * Params: A pointer to the queue and where to copy the element to.
+ * Return: 1 if an element was popped, 0 if the queue was empty.
+ */
+int mpsc_pop(mpsc_queue *q, void *out);
+
+/*
+ * Desc: Blocks the consumer until an element is available. Spins briefly
+         before falling back to sleeping on the eventfd.
+ * Params: A pointer to the queue and where to copy the element to.
+ */
+void mpsc_pop_wait(mpsc_queue *q, void *out);
+
+/*
+ * Desc: Prepares the consumer to sleep on wake_fd from its own event loop.
+ * Return: 1 if the queue is empty and producers will now write wake_fd,
+           0 if elements arrived and the consumer should keep popping.
+ */
+int mpsc_prepare_sleep(mpsc_queue *q);
+
+/*
+ * Desc: Called by the consumer after it woke up from wake_fd.
+ */
+void mpsc_woken(mpsc_queue *q);
+
+/*
+ * Desc: Counts the elements waiting in the queue. Safe to call from any
+         thread, the answer may be stale by the time it is used.
+ * Params: A pointer to the queue.
+ * Return: The number of elements pushed but not yet popped.
+ */
+size_t mpsc_length(mpsc_queue *q);
+
+/*
+ * Desc: Frees the queue's cells and closes its eventfd.
+ */
+void mpsc_free(mpsc_queue *q);
+
+#endif
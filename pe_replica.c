@@ -0,0 +1,389 @@
+#include "pe_replica.h"
+#include "pe_snapshot.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/*
+ * Desc: Sends a frame that isn't a record: a heartbeat or the end of the
+         stream, carrying the primary's committed seq.
+ * Return: 0 on success, 1 on error.
+ */
+static int send_frame(int fd, int kind, uint64_t seq) {
+	journal_record frame;
+	memset(&frame, 0, sizeof(journal_record));
+	frame.seq = seq;
+	frame.shard_id = kind;
+	return send_all(fd, &frame, sizeof(journal_record));
+}
+
+/*
+ * Desc: Milliseconds elapsed on CLOCK_MONOTONIC since a point in time.
+ */
+static long elapsed_ms(struct timespec *since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/*
+ * Desc: Maps the segment holding a record.
+ * Params: The replicator, the record's seq, the segment to fill and where
+           to store the seq of the segment's first record.
+ * Return: 0 on success, 1 if the segment can't be mapped.
+ */
+static int seek_segment(replicator *rep, uint64_t seq, journal_segment *seg, uint64_t *first) {
+	*first = 1;
+	for (int i = 0; ; i++) {
+		if (journal_map_segment(rep->journal_path, i, 0, seg)) {
+			return 1;
+		}
+		if (seq < *first + seg->capacity) {
+			return 0;
+		}
+		*first += seg->capacity;
+		journal_unmap_segment(seg);
+	}
+}
+
+/*
+ * Desc: Streams the journal to a connected standby until the exchange stops
+         or the standby goes away. Records are sent straight from the mapped
+         segments, in runs of up to REPLICA_BATCH.
+ * Params: The replicator, the standby's socket and where to store the seq of
+           the last record sent.
+ * Return: 0 if the whole stream and its end were sent, 1 otherwise.
+ */
+static int serve_standby(replicator *rep, int conn, uint64_t *sent) {
+	replica_hello hello;
+	if (recv_all(conn, &hello, sizeof(replica_hello))) {
+		return 1;
+	}
+	uint64_t committed = journal_committed_seq(rep->jrnl);
+	*sent = hello.next_seq - 1;
+	if (hello.next_seq < 1 || hello.next_seq > committed + 1) {
+		printf("%s Standby asked for record %llu, the journal ends at %llu\n", LOG_PREFIX,
+			(unsigned long long)hello.next_seq, (unsigned long long)committed);
+		return 1;
+	}
+
+	// the header lets the standby check it runs the same market
+	journal_segment seg;
+	if (journal_map_segment(rep->journal_path, 0, 0, &seg)) {
+		return 1;
+	}
+	int res = send_all(conn, seg.map, sizeof(journal_header) + (size_t)seg.header->num_products * PRODUCT_STR_LEN);
+	journal_unmap_segment(&seg);
+	printf("%s Standby connected, sending from record %llu\n", LOG_PREFIX, (unsigned long long)hello.next_seq);
+
+	uint64_t next = hello.next_seq;
+	uint64_t first = 0; // seq of the first record of the mapped segment
+	struct timespec beat;
+	clock_gettime(CLOCK_MONOTONIC, &beat);
+	while (!res) {
+		// the flag is read before the seq so the last commit goes out before the end
+		int stopping = atomic_load(&rep->stopping);
+		committed = journal_committed_seq(rep->jrnl);
+		while (!res && next <= committed) {
+			if (seg.fd == -1) {
+				res = seek_segment(rep, next, &seg, &first);
+			} else if (next == first + seg.capacity) {
+				int index = seg.index + 1;
+				first += seg.capacity;
+				journal_unmap_segment(&seg);
+				res = journal_map_segment(rep->journal_path, index, 0, &seg);
+			}
+			if (res) {
+				break;
+			}
+			long pos = next - first;
+			long count = seg.capacity - pos;
+			if ((uint64_t)count > committed - next + 1) {
+				count = committed - next + 1;
+			}
+			if (count > REPLICA_BATCH) {
+				count = REPLICA_BATCH;
+			}
+			res = send_all(conn, &seg.records[pos], count * sizeof(journal_record));
+			if (!res) {
+				next += count;
+				*sent = next - 1;
+			}
+		}
+		if (res) {
+			break;
+		}
+		if (stopping) {
+			res = send_frame(conn, REPLICA_END, committed);
+			break;
+		}
+		if (elapsed_ms(&beat) >= REPLICA_HEARTBEAT_MS) {
+			res = send_frame(conn, REPLICA_HEARTBEAT, committed);
+			clock_gettime(CLOCK_MONOTONIC, &beat);
+		}
+
+		// sleep until the next commit or heartbeat; the standby never writes
+		// after its hello, so its socket is only readable once it hangs up
+		struct pollfd fds[2] = {{rep->wake_fd, POLLIN, 0}, {conn, POLLIN, 0}};
+		if (poll(fds, 2, REPLICA_HEARTBEAT_MS) > 0) {
+			uint64_t commits;
+			if (fds[0].revents & POLLIN) {
+				read(rep->wake_fd, &commits, sizeof(commits));
+			}
+			if (fds[1].revents != 0) {
+				res = 1;
+			}
+		}
+	}
+	journal_unmap_segment(&seg);
+	return res;
+}
+
+/*
+ * Desc: Replication thread: serves one standby at a time until stopped.
+ * Params: The replicator, passed as void* by pthread_create.
+ */
+static void *replicator_main(void *arg) {
+	replicator *rep = (replicator*)arg;
+	struct timeval timeout = {REPLICA_SEND_TIMEOUT_MS / 1000, (REPLICA_SEND_TIMEOUT_MS % 1000) * 1000};
+	while (!atomic_load(&rep->stopping)) {
+		struct pollfd fds[2] = {{rep->wake_fd, POLLIN, 0}, {rep->listen_fd, POLLIN, 0}};
+		if (poll(fds, 2, -1) <= 0) {
+			continue;
+		}
+		if (fds[0].revents & POLLIN) {
+			uint64_t commits;
+			read(rep->wake_fd, &commits, sizeof(commits));
+		}
+		if (!(fds[1].revents & POLLIN)) {
+			continue;
+		}
+
+		int conn = accept4(rep->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn == -1) {
+			continue;
+		}
+		setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		uint64_t sent = 0;
+		if (serve_standby(rep, conn, &sent)) {
+			printf("%s Standby disconnected after record %llu\n", LOG_PREFIX, (unsigned long long)sent);
+		}
+		close(conn);
+	}
+	return NULL;
+}
+
+int start_replicator(replicator *rep, char *sock_path, journal *j, char *journal_path) {
+	if (strlen(sock_path) >= sizeof(rep->path)) {
+		errno = ENAMETOOLONG;
+		return 1;
+	}
+	strcpy(rep->path, sock_path);
+	rep->jrnl = j;
+	rep->journal_path = journal_path;
+	atomic_init(&rep->stopping, 0);
+	rep->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rep->wake_fd == -1) {
+		return 1;
+	}
+
+	rep->listen_fd = listen_socket(sock_path, 1);
+	if (rep->listen_fd == -1) {
+		int err = errno;
+		close(rep->wake_fd);
+		errno = err;
+		return 1;
+	}
+
+	j->notify_fd = rep->wake_fd;
+	if (pthread_create(&rep->thread, NULL, replicator_main, rep) != 0) {
+		j->notify_fd = -1;
+		close(rep->wake_fd);
+		close(rep->listen_fd);
+		unlink(rep->path);
+		rep->listen_fd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+void stop_replicator(replicator *rep) {
+	if (rep->listen_fd == -1) {
+		return;
+	}
+	atomic_store(&rep->stopping, 1);
+	uint64_t one = 1;
+	write(rep->wake_fd, &one, sizeof(one));
+	pthread_join(rep->thread, NULL);
+
+	rep->jrnl->notify_fd = -1;
+	close(rep->wake_fd);
+	close(rep->listen_fd);
+	unlink(rep->path);
+	rep->listen_fd = -1;
+}
+
+/*
+ * Desc: Connects to the primary, waiting for it to come up.
+ * Params: The socket path.
+ * Return: The connected socket, -1 on error.
+ */
+static int connect_primary(char *sock_path) {
+	struct sockaddr_un addr;
+	if (socket_address(&addr, sock_path)) {
+		return -1;
+	}
+	int waiting = 0;
+	while (1) {
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd == -1) {
+			return -1;
+		}
+		if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+			return fd;
+		}
+		int err = errno;
+		close(fd);
+		if (err != ENOENT && err != ECONNREFUSED) {
+			errno = err;
+			return -1;
+		}
+		if (!waiting) {
+			printf("%s Standby: waiting for the primary on %s\n", LOG_PREFIX, sock_path);
+			fflush(stdout);
+			waiting = 1;
+		}
+		struct timespec retry = {0, REPLICA_RETRY_MS * 1000000L};
+		nanosleep(&retry, NULL);
+	}
+}
+
+/*
+ * Desc: Reads the primary's journal header and checks it describes the
+         market this standby was started with.
+ * Return: 0 if it matches, 1 otherwise.
+ */
+static int check_primary(int fd, exchange *ex, int num_shards) {
+	journal_header header;
+	if (recv_all(fd, &header, sizeof(journal_header))
+			|| memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != JOURNAL_VERSION || header.record_size != sizeof(journal_record)
+			|| header.num_products != ex->prods.size) {
+		return 1;
+	}
+	char *names = (char*)malloc((size_t)header.num_products * PRODUCT_STR_LEN);
+	int res = names == NULL || recv_all(fd, names, (size_t)header.num_products * PRODUCT_STR_LEN)
+		|| !journal_matches(&header, names, &ex->prods, ex->num_traders, num_shards);
+	free(names);
+	return res;
+}
+
+int follow_primary(exchange *ex, char *sock_path, int num_shards, int *take_over) {
+	*take_over = 0;
+	journal *j = &ex->jrnl;
+	int fd = connect_primary(sock_path);
+	if (fd == -1) {
+		printf("%s Standby: can't reach the primary on %s: %s\n", LOG_PREFIX, sock_path, strerror(errno));
+		return 1;
+	}
+	replica_hello hello = {j->next_seq};
+	if (send_all(fd, &hello, sizeof(replica_hello)) || check_primary(fd, ex, num_shards)) {
+		printf("%s Standby: the primary on %s doesn't run this market\n", LOG_PREFIX, sock_path);
+		close(fd);
+		return 1;
+	}
+	printf("%s Standby: following the primary from record %llu\n", LOG_PREFIX, (unsigned long long)hello.next_seq);
+	fflush(stdout);
+
+	char buf[REPLICA_BATCH * sizeof(journal_record)];
+	size_t len = 0;
+	uint64_t applied = hello.next_seq - 1;
+	uint64_t primary = applied; // the primary's committed seq as of its last frame
+	uint64_t reported[2] = {applied, primary};
+	long mismatched = 0;
+	int ended = 0;
+	int res = 0;
+	struct timespec report;
+	clock_gettime(CLOCK_MONOTONIC, &report);
+	while (!ended && !res) {
+		struct pollfd pfd = {fd, POLLIN, 0};
+		if (poll(&pfd, 1, REPLICA_REPORT_MS) > 0) {
+			ssize_t got = recv(fd, buf + len, sizeof(buf) - len, 0);
+			if (got < 0 && errno == EINTR) {
+				continue;
+			} else if (got <= 0) {
+				break; // the primary is gone
+			}
+			len += got;
+
+			size_t used = 0;
+			for (; used + sizeof(journal_record) <= len && !ended && !res; used += sizeof(journal_record)) {
+				journal_record rec;
+				memcpy(&rec, buf + used, sizeof(journal_record));
+				if (rec.shard_id == REPLICA_HEARTBEAT || rec.shard_id == REPLICA_END) {
+					primary = rec.seq > primary ? rec.seq : primary;
+					ended = rec.shard_id == REPLICA_END;
+					continue;
+				}
+				if (rec.seq != applied + 1
+						|| rec.checksum != journal_checksum(&rec, offsetof(journal_record, checksum))) {
+					printf("%s Standby: record %llu from the primary is corrupt\n", LOG_PREFIX,
+						(unsigned long long)(applied + 1));
+					res = 1;
+					break;
+				}
+
+				int result = apply_record(ex, num_shards, &rec);
+				if (result == RECORD_INVALID) {
+					printf("%s Standby: record %llu from the primary can't be applied\n", LOG_PREFIX,
+						(unsigned long long)rec.seq);
+					res = 1;
+					break;
+				}
+				mismatched += result == RECORD_MISMATCHED;
+				// the standby's journal gets the same seqs, it can be promoted as is
+				journal_add(j, rec.shard_id, rec.shard_seq, &rec.cmd, rec.digest);
+				applied = rec.seq;
+				primary = applied > primary ? applied : primary;
+			}
+			memmove(buf, buf + used, len - used);
+			len -= used;
+			if (journal_commit(j)) {
+				// a standby with a gap in its journal must not take over
+				printf("%s Standby: the journal failed at record %llu\n", LOG_PREFIX,
+					(unsigned long long)journal_committed_seq(j));
+				res = 1;
+			}
+		}
+
+		if (elapsed_ms(&report) >= REPLICA_REPORT_MS) {
+			if (applied != reported[0] || primary != reported[1]) {
+				printf("%s Standby: applied record %llu, primary at %llu, lag %llu\n", LOG_PREFIX,
+					(unsigned long long)applied, (unsigned long long)primary,
+					(unsigned long long)(primary - applied));
+				fflush(stdout);
+				reported[0] = applied;
+				reported[1] = primary;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &report);
+		}
+	}
+	close(fd);
+	if (res) {
+		return 1;
+	}
+
+	if (mismatched > 0) {
+		printf("%s Warning: %ld replicated commands did not match the primary\n", LOG_PREFIX, mismatched);
+	}
+	if (ended) {
+		printf("%s Standby: the primary completed trading at record %llu\n", LOG_PREFIX,
+			(unsigned long long)applied);
+		return 0;
+	}
+	printf("%s Standby: lost the primary at record %llu, taking over\n", LOG_PREFIX, (unsigned long long)applied);
+	*take_over = 1;
+	return 0;
+}
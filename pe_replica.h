@@ -0,0 +1,78 @@
+#ifndef PE_REPLICA_H
+#define PE_REPLICA_H
+
+#include "pe_exchange.h"
+#include "pe_journal.h"
+#include "pe_socket.h"
+
+#define REPLICA_HEARTBEAT -2 // shard ID of a frame carrying the primary's committed seq
+#define REPLICA_END -3 // shard ID of the frame a primary sends when trading completes
+#define REPLICA_BATCH 256 // records sent or read with one call at most
+#define REPLICA_HEARTBEAT_MS 100 // how often the primary tells the standby where it is
+#define REPLICA_SEND_TIMEOUT_MS 1000 // a standby that takes longer to read is dropped
+#define REPLICA_RETRY_MS 100 // how often a standby tries to reach the primary
+#define REPLICA_REPORT_MS 1000 // how often a standby logs its lag
+
+/*
+ * Desc: Sent by a standby when it connects.
+ * Fields: The seq of the first record the standby doesn't have yet.
+ */
+typedef struct replica_hello replica_hello;
+struct replica_hello {
+    uint64_t next_seq;
+};
+
+/*
+ * Desc: Primary side of replication. A thread accepts one standby at a time
+         on a Unix domain socket, sends it the journal header and then every
+         committed record from the seq it asks for, read straight out of the
+         mapped journal segments. The journal only stores a seq and writes an
+         eventfd per commit, so a slow or stuck standby never holds up
+         matching: the thread falls behind and catches up from the segments,
+         and a standby that stops reading is dropped.
+ * Fields: The socket path and listening socket, the journal and its path,
+           the eventfd the journal wakes the thread with, and the thread.
+ */
+typedef struct replicator replicator;
+struct replicator {
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int listen_fd; // -1 --> not replicating
+    journal *jrnl;
+    char *journal_path;
+    int wake_fd;
+    pthread_t thread;
+    _Atomic int stopping;
+};
+
+/*
+ * Desc: Listens for a standby and starts the replication thread.
+ * Params: The replicator, the socket path, the journal and its path. The
+           journal must not have started its thread yet.
+ * Return: 0 on success, 1 if the socket or thread could not be set up.
+ */
+int start_replicator(replicator *rep, char *sock_path, journal *j, char *journal_path);
+
+/*
+ * Desc: Sends a connected standby everything committed so far and the end
+         of the stream, then joins the thread and removes the socket. Does
+         nothing if replication isn't running.
+ * Params: The replicator.
+ */
+void stop_replicator(replicator *rep);
+
+/*
+ * Desc: Runs the exchange as a hot standby: connects to the primary, applies
+         every record it streams on the original shard as recovery does,
+         journals it and logs how far behind the primary it is. Returns once
+         the primary is gone, with the traders' order IDs restored so the
+         standby can take over, or once the primary completed trading.
+ * Params: The exchange with its shards initialized and its journal open but
+           not attached, the socket path, the number of shards and where to
+           store whether the standby should take over (1) or the primary
+           completed (0).
+ * Return: 0 on success, 1 if the primary's market doesn't match or its
+           stream is corrupt.
+ */
+int follow_primary(exchange *ex, char *sock_path, int num_shards, int *take_over);
+
+#endif
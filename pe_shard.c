@@ -0,0 +1,113 @@
+#include "pe_shard.h"
+#include "pe_placement.h"
+
+/*
+ * Desc: Matching thread: applies the shard's commands in arrival order.
+ * Params: The shard, passed as void* by pthread_create.
+ */
+static void *shard_main(void *arg) {
+	shard *s = (shard*)arg;
+	routed_command routed;
+	CYCLES_THREAD("matching", s->shard_id);
+	trace_thread("matching", s->shard_id);
+	if (s->cpu >= 0 || s->sched_priority > 0) {
+		char label[BUF_SIZE];
+		snprintf(label, BUF_SIZE, "matching thread %d", s->shard_id);
+		set_placement(0, label, s->cpu, s->sched_priority);
+		log_placement(0, label);
+	}
+	while (1) {
+		CYCLES_TIME(CYCLES_WAIT, mpsc_pop_wait(&s->inbound, &routed));
+		if (routed.cmd.type == CMD_STOP) {
+			break;
+		}
+
+		uint64_t apply_ns = routed.times.trace_id != 0 ? latency_now() : 0;
+		pthread_mutex_lock(&s->lock);
+		s->times = routed.times;
+		apply_command(s, &routed.cmd);
+		pthread_mutex_unlock(&s->lock);
+		if (apply_ns != 0) {
+			trace_span_end("apply", "cmd", routed.times.trace_id, apply_ns);
+		}
+		atomic_fetch_add_explicit(&s->processed, 1, memory_order_relaxed);
+	}
+	return NULL;
+}
+
+void attach_journal(shard *s, journal *j) {
+	s->jrnl = j;
+	s->out = s->sink;
+	s->sink = (event_sink){collect_event, &s->batch};
+}
+
+int apply_command(shard *s, command *cmd) {
+	int res = 0;
+	CYCLES_TIME(CYCLES_BOOK, res = execute_command(s, cmd));
+	if (res == 0) {
+		uint64_t match_ns = s->times.trace_id != 0 ? latency_now() : 0;
+		CYCLES_TIME(CYCLES_MATCH, find_matches(s, cmd->product_index));
+		if (match_ns != 0) {
+			trace_span_end("match", "cmd", s->times.trace_id, match_ns);
+		}
+	}
+	if (s->next_order_ids != NULL && (cmd->type == BUY || cmd->type == SELL)
+			&& cmd->order_id >= s->next_order_ids[cmd->trader_id]) {
+		s->next_order_ids[cmd->trader_id] = cmd->order_id + 1;
+	}
+	if (s->jrnl == NULL) {
+		return res;
+	}
+
+	// journal first, the events are only released once the record is on disk
+	s->journal_seq++;
+	CYCLES_TIME(CYCLES_JOURNAL, journal_add(s->jrnl, s->shard_id, s->journal_seq, cmd, digest_events(&s->batch)));
+	for (int i = 0; i < s->batch.len; i++) {
+		event *ev = &s->batch.events[i];
+		ev->shard_id = s->shard_id;
+		ev->journal_seq = s->journal_seq;
+		CYCLES_TIME(CYCLES_BROADCAST, s->out.emit(s->out.ctx, ev));
+	}
+	s->batch.len = 0;
+	return res;
+}
+
+int start_shard(shard *s) {
+	if (mpsc_init(&s->inbound, SHARD_QUEUE_SIZE, sizeof(routed_command))) {
+		return 1;
+	}
+	if (pthread_create(&s->thread, NULL, shard_main, s) != 0) {
+		mpsc_free(&s->inbound);
+		return 1;
+	}
+	return 0;
+}
+
+long shards_processed(shard *shards, int num_shards) {
+	long total = 0;
+	for (int i = 0; i < num_shards; i++) {
+		total += atomic_load_explicit(&shards[i].processed, memory_order_relaxed);
+	}
+	return total;
+}
+
+void stop_shard(shard *s) {
+	routed_command stop;
+	memset(&stop, 0, sizeof(routed_command));
+	stop.cmd.type = CMD_STOP;
+	mpsc_push_wait(&s->inbound, &stop);
+	pthread_join(s->thread, NULL);
+	mpsc_free(&s->inbound);
+}
+
+void lock_shards(shard *shards, int num_shards) {
+	for (int i = 0; i < num_shards; i++) {
+		pthread_mutex_lock(&shards[i].lock);
+	}
+}
+
+void unlock_shards(shard *shards, int num_shards) {
+	for (int i = num_shards - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+}
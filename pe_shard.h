@@ -0,0 +1,74 @@
+#ifndef PE_SHARD_H
+#define PE_SHARD_H
+
+#include "pe_engine.h"
+#include "pe_journal.h"
+
+#define SHARD_QUEUE_SIZE 4096 // commands buffered per matching thread
+#define CMD_STOP -2 // command type that tells a matching thread to exit
+
+/*
+ * Desc: A command on its way to a matching thread.
+ * Fields: The validated command and when it was read and parsed.
+ */
+typedef struct routed_command routed_command;
+struct routed_command {
+    command cmd;
+    command_times times;
+};
+
+/*
+ * Desc: Makes the shard journal every command it applies. Events are then
+         collected per command, stamped with the command's journal position
+         and passed on to the shard's original sink.
+ * Params: A pointer to an initialized shard and the open journal.
+ */
+void attach_journal(shard *s, journal *j);
+
+/*
+ * Desc: Applies a validated command to the shard's books and finds the
+         matches it causes. With a journal attached the command is added to
+         it before any of its events leave the shard.
+ * Params: The shard owning the product and the command.
+ * Return: 0 if the command was executed, 1 if the order to amend or cancel
+           no longer exists (an EVENT_INVALID is emitted).
+ */
+int apply_command(shard *s, command *cmd);
+
+/*
+ * Desc: Creates the shard's inbound queue of routed_command and starts its
+         matching thread. The thread applies every command routed to it under
+         the shard lock.
+ * Params: A pointer to an initialized shard.
+ * Return: 0 on success, 1 if the queue or thread could not be created.
+ */
+int start_shard(shard *s);
+
+/*
+ * Desc: Sums the number of commands the shards have applied so far.
+ * Params: The array of shards and its length.
+ * Return: The total, read without stopping the matching threads.
+ */
+long shards_processed(shard *shards, int num_shards);
+
+/*
+ * Desc: Lets the matching thread finish the commands already queued, then
+         joins it and frees the queue.
+ * Params: A pointer to a started shard.
+ */
+void stop_shard(shard *s);
+
+/*
+ * Desc: Locks every shard in index order, giving a consistent view of all
+         books and positions until unlock_shards is called.
+ * Params: The array of shards and its length.
+ */
+void lock_shards(shard *shards, int num_shards);
+
+/*
+ * Desc: Releases the locks taken by lock_shards.
+ * Params: The array of shards and its length.
+ */
+void unlock_shards(shard *shards, int num_shards);
+
+#endif
@@ -0,0 +1,501 @@
+#include "pe_snapshot.h"
+#include "pe_shard.h"
+
+/*
+ * Desc: Buffered writer used by the snapshot child, which must not allocate:
+         another thread may have held the allocator's lock at fork time.
+ * Fields: The file, the buffer, the running checksum and a sticky error flag.
+ */
+typedef struct snapshot_writer snapshot_writer;
+struct snapshot_writer {
+    int fd;
+    char buf[SNAPSHOT_BUF_SIZE];
+    size_t len;
+    uint32_t checksum;
+    int failed;
+};
+
+/*
+ * Desc: Cursor over a snapshot file read into memory.
+ * Fields: The data, its length and the read position.
+ */
+typedef struct snapshot_reader snapshot_reader;
+struct snapshot_reader {
+    char *data;
+    size_t len;
+    size_t pos;
+};
+
+/*
+ * Desc: What journal replay needs to know, passed as the replay context.
+ * Fields: The exchange, the number of shards and counters for the log.
+ */
+typedef struct replay_state replay_state;
+struct replay_state {
+    exchange *ex;
+    int num_shards;
+    long replayed;
+    long mismatched;
+};
+
+/*
+ * Desc: Writes the writer's buffer to its file.
+ */
+static void flush_writer(snapshot_writer *w) {
+	size_t done = 0;
+	while (done < w->len && !w->failed) {
+		ssize_t written = write(w->fd, w->buf + done, w->len - done);
+		if (written < 0 && errno != EINTR) {
+			w->failed = 1;
+		} else if (written > 0) {
+			done += written;
+		}
+	}
+	w->len = 0;
+}
+
+/*
+ * Desc: Appends bytes to the snapshot, flushing the buffer when it fills up.
+ */
+static void put(snapshot_writer *w, const void *data, size_t len) {
+	w->checksum = checksum_extend(w->checksum, data, len);
+	const char *cursor = (const char*)data;
+	while (len > 0) {
+		if (w->len == SNAPSHOT_BUF_SIZE) {
+			flush_writer(w);
+		}
+		size_t chunk = SNAPSHOT_BUF_SIZE - w->len;
+		if (chunk > len) {
+			chunk = len;
+		}
+		memcpy(w->buf + w->len, cursor, chunk);
+		w->len += chunk;
+		cursor += chunk;
+		len -= chunk;
+	}
+}
+
+/*
+ * Desc: Counts the orders in a list.
+ */
+static int32_t count_orders(order *list) {
+	int32_t count = 0;
+	for (; list != NULL; list = list->next) {
+		count++;
+	}
+	return count;
+}
+
+/*
+ * Desc: Writes the orders of a list in list order.
+ */
+static void put_orders(snapshot_writer *w, order *list) {
+	snapshot_order rec;
+	memset(&rec, 0, sizeof(snapshot_order));
+	for (; list != NULL; list = list->next) {
+		rec.order_id = list->order_id;
+		rec.trader_id = list->trader_id;
+		rec.global_order_num = list->global_order_num;
+		rec.quantity = list->quantity;
+		rec.price = list->price;
+		put(w, &rec, sizeof(snapshot_order));
+	}
+}
+
+/*
+ * Desc: Body of the snapshot child: writes the exchange state as it was at
+         fork time to the temporary snapshot file.
+ * Params: The snapshotter and the exchange.
+ * Return: 0 if the snapshot was written and synced, 1 otherwise.
+ */
+static int write_snapshot(snapshotter *snap, exchange *ex) {
+	snapshot_writer w;
+	w.fd = open(snap->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	w.len = 0;
+	w.checksum = JOURNAL_CHECKSUM_INIT;
+	w.failed = w.fd == -1;
+	if (w.failed) {
+		return 1;
+	}
+
+	snapshot_header header;
+	memset(&header, 0, sizeof(snapshot_header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.num_traders = ex->num_traders;
+	header.num_products = ex->prods.size;
+	header.num_shards = snap->num_shards;
+	put(&w, &header, sizeof(snapshot_header));
+
+	snapshot_shard counters;
+	memset(&counters, 0, sizeof(snapshot_shard));
+	for (int i = 0; i < snap->num_shards; i++) {
+		counters.journal_seq = snap->shard_seqs[i];
+		counters.total_fees = ex->shards[i].total_fees;
+		counters.total_order_num = ex->shards[i].total_order_num;
+		put(&w, &counters, sizeof(snapshot_shard));
+	}
+
+	// a trader's orders can be on any shard, keep the highest ID seen
+	for (int t = 0; t < ex->num_traders; t++) {
+		int32_t next_id = 0;
+		for (int i = 0; i < snap->num_shards; i++) {
+			if (ex->shards[i].next_order_ids[t] > next_id) {
+				next_id = ex->shards[i].next_order_ids[t];
+			}
+		}
+		put(&w, &next_id, sizeof(int32_t));
+	}
+
+	for (int t = 0; t < ex->num_traders; t++) {
+		for (int p = 0; p < ex->prods.size; p++) {
+			int64_t position[2] = {ex->matches[t][p][0], ex->matches[t][p][1]};
+			put(&w, position, sizeof(position));
+		}
+	}
+
+	for (int p = 0; p < ex->prods.size; p++) {
+		int32_t counts[2] = {count_orders(ex->buys[p]), count_orders(ex->sells[p])};
+		put(&w, counts, sizeof(counts));
+		put_orders(&w, ex->buys[p]);
+		put_orders(&w, ex->sells[p]);
+	}
+
+	uint32_t checksum = w.checksum;
+	put(&w, &checksum, sizeof(uint32_t));
+	flush_writer(&w);
+	if (fdatasync(w.fd) == -1) {
+		w.failed = 1;
+	}
+	close(w.fd);
+	return w.failed;
+}
+
+/*
+ * Desc: Copies the next len bytes of the snapshot to out.
+ * Return: 0 on success, 1 if the snapshot is too short.
+ */
+static int take(snapshot_reader *r, void *out, size_t len) {
+	if (r->len - r->pos < len) {
+		return 1;
+	}
+	memcpy(out, r->data + r->pos, len);
+	r->pos += len;
+	return 0;
+}
+
+/*
+ * Desc: Reads count orders of a product's list from the snapshot and links
+         them in the same order.
+ * Return: 0 on success, 1 if the snapshot is malformed.
+ */
+static int take_orders(snapshot_reader *r, exchange *ex, order **list, int product_index, int32_t count) {
+	order **tail = list;
+	snapshot_order rec;
+	for (int32_t i = 0; i < count; i++) {
+		if (take(r, &rec, sizeof(snapshot_order)) || rec.trader_id < 0 || rec.trader_id >= ex->num_traders) {
+			return 1;
+		}
+		order *restored = (order*)pe_malloc(MEM_ORDERS, sizeof(order));
+		if (restored == NULL) {
+			return 1;
+		}
+		restored->order_id = rec.order_id;
+		restored->trader_id = rec.trader_id;
+		restored->global_order_num = rec.global_order_num;
+		restored->product = NULL;
+		restored->product_index = product_index;
+		restored->quantity = rec.quantity;
+		restored->price = rec.price;
+		restored->next = NULL;
+		*tail = restored;
+		tail = &restored->next;
+	}
+	return 0;
+}
+
+/*
+ * Desc: Loads the snapshot into the exchange's empty books, ledger and shards.
+ * Params: The snapshot path, the exchange, each shard's last included
+           shard_seq to fill, and where to store the number of resting orders
+           loaded (-1 if there is no snapshot).
+ * Return: 0 on success or if there is no snapshot, 1 if it can't be used.
+ */
+static int load_snapshot(char *path, exchange *ex, int num_shards, uint64_t *shard_seqs, long *num_orders) {
+	*num_orders = -1;
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		return errno != ENOENT;
+	}
+
+	// snapshots are written whole and renamed into place, read it in one go
+	snapshot_reader r = {NULL, 0, 0};
+	struct stat st;
+	int res = fstat(fileno(file), &st) == -1 || st.st_size < (off_t)sizeof(uint32_t);
+	if (!res) {
+		r.len = st.st_size;
+		r.data = (char*)malloc(r.len);
+		res = r.data == NULL || fread(r.data, 1, r.len, file) != r.len;
+	}
+	fclose(file);
+
+	uint32_t checksum = 0;
+	if (!res) {
+		r.len -= sizeof(uint32_t);
+		memcpy(&checksum, r.data + r.len, sizeof(uint32_t));
+		res = checksum != journal_checksum(r.data, r.len);
+	}
+
+	snapshot_header header;
+	if (!res) {
+		res = take(&r, &header, sizeof(snapshot_header))
+			|| memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != SNAPSHOT_VERSION || header.num_traders != ex->num_traders
+			|| header.num_products != ex->prods.size || header.num_shards != num_shards;
+	}
+
+	snapshot_shard counters;
+	for (int i = 0; i < num_shards && !res; i++) {
+		res = take(&r, &counters, sizeof(snapshot_shard));
+		shard_seqs[i] = counters.journal_seq;
+		ex->shards[i].journal_seq = counters.journal_seq;
+		ex->shards[i].total_fees = counters.total_fees;
+		ex->shards[i].total_order_num = counters.total_order_num;
+	}
+
+	int32_t next_id = 0;
+	for (int t = 0; t < ex->num_traders && !res; t++) {
+		res = take(&r, &next_id, sizeof(int32_t));
+		for (int i = 0; i < num_shards; i++) {
+			ex->shards[i].next_order_ids[t] = next_id;
+		}
+	}
+
+	int64_t position[2];
+	for (int t = 0; t < ex->num_traders && !res; t++) {
+		for (int p = 0; p < ex->prods.size && !res; p++) {
+			res = take(&r, position, sizeof(position));
+			ex->matches[t][p][0] = position[0];
+			ex->matches[t][p][1] = position[1];
+		}
+	}
+
+	int32_t counts[2];
+	*num_orders = 0;
+	for (int p = 0; p < ex->prods.size && !res; p++) {
+		res = take(&r, counts, sizeof(counts))
+			|| take_orders(&r, ex, &ex->buys[p], p, counts[0])
+			|| take_orders(&r, ex, &ex->sells[p], p, counts[1]);
+		*num_orders += counts[0] + counts[1];
+	}
+	if (!res) {
+		res = r.pos != r.len;
+	}
+	free(r.data);
+
+	if (res) {
+		printf("%s Snapshot %s is corrupt or was not written by an exchange with these products, traders and --shards\n",
+			LOG_PREFIX, path);
+	}
+	return res;
+}
+
+int apply_record(exchange *ex, int num_shards, journal_record *rec) {
+	command *cmd = &rec->cmd;
+	if (rec->shard_id < 0 || rec->shard_id >= num_shards
+			|| cmd->trader_id < 0 || cmd->trader_id >= ex->num_traders
+			|| cmd->product_index < 0 || cmd->product_index >= ex->prods.size) {
+		return RECORD_INVALID;
+	}
+	shard *s = &ex->shards[rec->shard_id];
+	if (rec->shard_seq <= s->journal_seq) {
+		return RECORD_SKIPPED; // already in the snapshot
+	}
+
+	// nobody is listening yet, collect the events only to check them
+	event_sink sink = s->sink;
+	s->sink = (event_sink){collect_event, &s->batch};
+	apply_command(s, cmd);
+	int res = digest_events(&s->batch) == rec->digest ? RECORD_APPLIED : RECORD_MISMATCHED;
+	s->batch.len = 0;
+	s->sink = sink;
+	s->journal_seq = rec->shard_seq;
+	return res;
+}
+
+/*
+ * Desc: journal_replay callback: applies a record the snapshot doesn't
+         include and counts it.
+ * Params: The replay state (as void*) and the record.
+ */
+static void replay_record(void *ctx, journal_record *rec) {
+	replay_state *state = (replay_state*)ctx;
+	int res = apply_record(state->ex, state->num_shards, rec);
+	if (res == RECORD_MISMATCHED || res == RECORD_INVALID) {
+		state->mismatched++;
+	}
+	if (res == RECORD_APPLIED || res == RECORD_MISMATCHED) {
+		state->replayed++;
+	}
+}
+
+int restore_traders(exchange *ex, int num_shards) {
+	for (trader *t = ex->head; t != NULL; t = t->next) {
+		int next_id = 0;
+		for (int i = 0; i < num_shards; i++) {
+			if (ex->shards[i].next_order_ids[t->trader_id] > next_id) {
+				next_id = ex->shards[i].next_order_ids[t->trader_id];
+			}
+		}
+		t->max_order_id = next_id;
+
+		int size = 64;
+		while (size <= next_id) {
+			size *= 2;
+		}
+		pe_free(t->order_products);
+		t->order_products = (int*)pe_calloc(MEM_TRADERS, size, sizeof(int));
+		if (t->order_products == NULL) {
+			t->order_products_size = 0;
+			return 1;
+		}
+		t->order_products_size = size;
+	}
+
+	for (int p = 0; p < ex->prods.size; p++) {
+		order *lists[2] = {ex->buys[p], ex->sells[p]};
+		for (int side = 0; side < 2; side++) {
+			for (order *cursor = lists[side]; cursor != NULL; cursor = cursor->next) {
+				trader *owner = get_trader(-1, cursor->trader_id, ex->head);
+				if (owner != NULL && cursor->order_id < owner->order_products_size) {
+					owner->order_products[cursor->order_id] = p;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+int init_snapshotter(snapshotter *snap, char *journal_path, long interval_ms, int num_shards) {
+	snap->timer_fd = -1;
+	snap->pid = 0;
+	snap->pid_fd = -1;
+	snap->written = 0;
+	snap->num_shards = num_shards;
+	if (snprintf(snap->path, PATH_MAX, "%s%s", journal_path, SNAPSHOT_SUFFIX) >= PATH_MAX
+			|| snprintf(snap->tmp_path, PATH_MAX, "%s%s.tmp", journal_path, SNAPSHOT_SUFFIX) >= PATH_MAX) {
+		return 1;
+	}
+	if (interval_ms <= 0) {
+		return 0;
+	}
+
+	snap->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (snap->timer_fd == -1) {
+		return 1;
+	}
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = interval_ms / 1000;
+	spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+	spec.it_value = spec.it_interval;
+	return timerfd_settime(snap->timer_fd, 0, &spec, NULL) == -1;
+}
+
+int start_snapshot(snapshotter *snap, exchange *ex) {
+	if (snap->pid != 0) {
+		// one snapshot at a time, the next tick tries again
+		return 0;
+	}
+
+	// the child's copy of memory is the snapshot, matching only waits for fork
+	lock_shards(ex->shards, snap->num_shards);
+	for (int i = 0; i < snap->num_shards; i++) {
+		snap->shard_seqs[i] = ex->shards[i].journal_seq;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		_exit(write_snapshot(snap, ex));
+	}
+	unlock_shards(ex->shards, snap->num_shards);
+	if (pid == -1) {
+		return 1;
+	}
+
+	snap->pid = pid;
+	snap->written = 0;
+	snap->pid_fd = pidfd_open(pid, 0);
+	if (snap->pid_fd == -1) {
+		// can't watch it, wait for it instead
+		waitpid(pid, NULL, 0);
+		snap->pid = 0;
+		return 1;
+	}
+	return 0;
+}
+
+void finish_snapshot(snapshotter *snap) {
+	siginfo_t info;
+	memset(&info, 0, sizeof(siginfo_t));
+	if (snap->pid_fd == -1 || waitid(P_PIDFD, snap->pid_fd, &info, WEXITED) == -1) {
+		return;
+	}
+	close(snap->pid_fd);
+	snap->pid_fd = -1;
+
+	snap->written = info.si_code == CLD_EXITED && info.si_status == 0;
+	if (!snap->written) {
+		printf("%s Snapshot %s could not be written\n", LOG_PREFIX, snap->tmp_path);
+		unlink(snap->tmp_path);
+		snap->pid = 0;
+	}
+}
+
+void publish_snapshot(snapshotter *snap, journal *j) {
+	if (!snap->written) {
+		return;
+	}
+	// a snapshot must never include commands the journal could lose
+	for (int i = 0; i < snap->num_shards; i++) {
+		if (!journal_committed(j, i, snap->shard_seqs[i])) {
+			return;
+		}
+	}
+	if (rename(snap->tmp_path, snap->path) == -1) {
+		printf("%s Snapshot %s could not be written\n", LOG_PREFIX, snap->path);
+	}
+	snap->written = 0;
+	snap->pid = 0;
+}
+
+void stop_snapshotter(snapshotter *snap, journal *j) {
+	finish_snapshot(snap);
+	publish_snapshot(snap, j);
+	if (snap->timer_fd != -1) {
+		close(snap->timer_fd);
+		snap->timer_fd = -1;
+	}
+}
+
+int recover_exchange(exchange *ex, snapshotter *snap, char *journal_path, journal_position *end) {
+	uint64_t shard_seqs[MAX_SHARDS];
+	memset(shard_seqs, 0, sizeof(shard_seqs));
+	long num_orders = -1;
+	if (load_snapshot(snap->path, ex, snap->num_shards, shard_seqs, &num_orders)) {
+		return 1;
+	}
+
+	replay_state state = {ex, snap->num_shards, 0, 0};
+	if (journal_replay(journal_path, &ex->prods, ex->num_traders, snap->num_shards,
+			replay_record, &state, end)) {
+		return 1;
+	}
+	if (num_orders >= 0) {
+		printf("%s Recovered %ld resting orders from snapshot %s\n", LOG_PREFIX, num_orders, snap->path);
+	}
+	printf("%s Replayed %ld of %llu journal records\n", LOG_PREFIX, state.replayed,
+		(unsigned long long)end->last_seq);
+	if (state.mismatched > 0) {
+		printf("%s Warning: %ld replayed commands did not match the journal\n", LOG_PREFIX, state.mismatched);
+	}
+	return 0;
+}
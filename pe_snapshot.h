@@ -0,0 +1,155 @@
+#ifndef PE_SNAPSHOT_H
+#define PE_SNAPSHOT_H
+
+#include "pe_exchange.h"
+#include "pe_journal.h"
+#include <limits.h>
+
+#define SNAPSHOT_MAGIC "PEXSNAP1"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_SUFFIX ".snap" // the snapshot lives next to the journal
+#define SNAPSHOT_BUF_SIZE 65536 // bytes the snapshot child writes at a time
+
+enum record_result {
+    RECORD_APPLIED = 0, // applied, same events as journaled
+    RECORD_SKIPPED, // the shard already has it
+    RECORD_MISMATCHED, // applied, but the events differ from the journal
+    RECORD_INVALID // names a shard, trader or product that doesn't exist
+};
+
+/*
+ * Desc: Start of a snapshot file. It is followed by one snapshot_shard per
+         shard, each trader's next order ID (int32), the match cache (int64
+         quantity and value per trader and product), and per product the
+         buy count, sell count (int32) and the orders of both lists in list
+         order. A checksum of everything before it ends the file.
+ * Fields: The magic string and version, and the trader, product and shard
+           counts of the exchange that wrote it.
+ */
+typedef struct snapshot_header snapshot_header;
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    int32_t num_traders;
+    int32_t num_products;
+    int32_t num_shards;
+};
+
+/*
+ * Desc: A shard's counters in a snapshot.
+ * Fields: The last shard_seq the snapshot includes, the fees collected and
+           the time-priority counter.
+ */
+typedef struct snapshot_shard snapshot_shard;
+struct snapshot_shard {
+    uint64_t journal_seq; // journal records of this shard up to here are in the snapshot
+    double total_fees;
+    int64_t total_order_num;
+};
+
+/*
+ * Desc: A resting order in a snapshot.
+ * Fields: The order fields that aren't implied by the list it is in.
+ */
+typedef struct snapshot_order snapshot_order;
+struct snapshot_order {
+    int32_t order_id;
+    int32_t trader_id;
+    int32_t global_order_num;
+    int32_t padding; // zeroed, keeps the layout free of holes
+    int64_t quantity;
+    int64_t price;
+};
+
+/*
+ * Desc: Periodic snapshots of the exchange state. A child forked with the
+         shards locked writes the snapshot from its copy of memory, so
+         matching only pauses for the fork. The snapshot is written to a
+         temporary file and renamed over the previous one once the child is
+         done and the journal has every command it includes.
+ * Fields: The snapshot and temporary paths, the timer driving snapshots, the
+           running child and what its snapshot covers.
+ */
+typedef struct snapshotter snapshotter;
+struct snapshotter {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    int timer_fd; // -1 --> no periodic snapshots
+    pid_t pid; // running or finished child, 0 --> none
+    int pid_fd; // -1 when there is no running child
+    int written; // the child exited successfully, the snapshot waits on the journal
+    int num_shards;
+    uint64_t shard_seqs[MAX_SHARDS]; // per shard, what the child's snapshot includes
+};
+
+/*
+ * Desc: Sets up snapshots for a journal and starts the snapshot timer.
+ * Params: The snapshotter, the journal path, the snapshot period (0 --> only
+           used for recovery) and the number of shards.
+ * Return: 0 on success, 1 if the path is too long or the timer failed.
+ */
+int init_snapshotter(snapshotter *snap, char *journal_path, long interval_ms, int num_shards);
+
+/*
+ * Desc: Forks a child that writes a snapshot of the exchange. Does nothing
+         while the previous snapshot is still being written or published.
+ * Params: The snapshotter and the exchange.
+ * Return: 0 on success, 1 if the child could not be started.
+ */
+int start_snapshot(snapshotter *snap, exchange *ex);
+
+/*
+ * Desc: Reaps the snapshot child once its pidfd is readable.
+ * Params: The snapshotter.
+ */
+void finish_snapshot(snapshotter *snap);
+
+/*
+ * Desc: Renames a written snapshot over the previous one, provided the
+         journal has committed every command the snapshot includes.
+ * Params: The snapshotter and the journal.
+ */
+void publish_snapshot(snapshotter *snap, journal *j);
+
+/*
+ * Desc: Waits for a running snapshot child, publishes its snapshot and closes
+         the timer. The journal must be fully committed.
+ * Params: The snapshotter and the journal.
+ */
+void stop_snapshotter(snapshotter *snap, journal *j);
+
+/*
+ * Desc: Restores the exchange from the latest snapshot, if there is one, and
+         replays the journal records it doesn't include. Replayed commands go
+         through apply_command on their original shard, no events are sent,
+         and each command's events are checked against the journaled digest.
+         Runs before the traders are launched, restore_traders then gives
+         them their order IDs back.
+ * Params: The exchange with its shards initialized but no journal attached,
+           the snapshotter (for the snapshot path) and where to store the
+           end of the journal.
+ * Return: 0 on success, 1 if the snapshot or journal can't be used.
+ */
+int recover_exchange(exchange *ex, snapshotter *snap, char *journal_path, journal_position *end);
+
+/*
+ * Desc: Applies a journaled command on the shard that originally applied it,
+         unless the shard already has it, and checks that it produced the
+         same events. Nothing is sent to traders.
+ * Params: The exchange with no journal attached, the number of shards and
+           the record.
+ * Return: An enum record_result value.
+ */
+int apply_record(exchange *ex, int num_shards, journal_record *rec);
+
+/*
+ * Desc: Gives every trader its next order ID back and rebuilds the order ID
+         to product map AMEND and CANCEL are routed with from the books.
+         Orders no longer on a book map to product 0, where they aren't
+         found either, so amending them is still INVALID.
+ * Params: The exchange after its state was restored, the number of shards.
+ * Return: 0 on success, 1 if memory could not be allocated.
+ */
+int restore_traders(exchange *ex, int num_shards);
+
+#endif
@@ -0,0 +1,63 @@
+#include "pe_socket.h"
+
+int socket_address(struct sockaddr_un *addr, char *path) {
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return 1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int listen_socket(char *path, int backlog) {
+	struct sockaddr_un addr;
+	if (socket_address(&addr, path)) {
+		return -1;
+	}
+	unlink(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, backlog) == -1) {
+		int err = errno;
+		close(fd);
+		unlink(path);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+int send_all(int fd, const void *buf, size_t len) {
+	const char *cursor = (const char*)buf;
+	while (len > 0) {
+		ssize_t sent = send(fd, cursor, len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		cursor += sent;
+		len -= sent;
+	}
+	return 0;
+}
+
+int recv_all(int fd, void *buf, size_t len) {
+	char *cursor = (char*)buf;
+	while (len > 0) {
+		ssize_t got = recv(fd, cursor, len, 0);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		} else if (got <= 0) {
+			return 1;
+		}
+		cursor += got;
+		len -= got;
+	}
+	return 0;
+}
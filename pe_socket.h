@@ -0,0 +1,41 @@
+#ifndef PE_SOCKET_H
+#define PE_SOCKET_H
+
+#include "pe_common.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Unix domain socket helpers shared by the control socket and replication.
+ */
+
+/*
+ * Desc: Fills in a Unix socket address.
+ * Params: The address to fill and the socket path.
+ * Return: 0 on success, 1 if the path is too long.
+ */
+int socket_address(struct sockaddr_un *addr, char *path);
+
+/*
+ * Desc: Listens on a Unix socket path. A socket left behind by an exchange
+         that didn't stop cleanly is replaced.
+ * Params: The socket path and the listen backlog.
+ * Return: The listening socket, -1 on error with errno set.
+ */
+int listen_socket(char *path, int backlog);
+
+/*
+ * Desc: Writes all of buf to a socket, retrying short writes.
+ * Params: The socket, the buffer and its length.
+ * Return: 0 on success, 1 on error (including the send timeout).
+ */
+int send_all(int fd, const void *buf, size_t len);
+
+/*
+ * Desc: Reads exactly len bytes from a socket.
+ * Params: The socket, the buffer and the number of bytes to read.
+ * Return: 0 on success, 1 on error or if the peer hung up first.
+ */
+int recv_all(int fd, void *buf, size_t len);
+
+#endif
@@ -0,0 +1,121 @@
+#include "pe_trace.h"
+#include "pe_engine.h"
+#include <pthread.h>
+
+long trace_every = 0;
+_Thread_local trace_buffer *thread_trace = NULL;
+
+static FILE *trace_file = NULL;
+static char trace_path[BUF_SIZE];
+static trace_buffer *all_buffers = NULL;
+static int num_buffers = 0;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic uint32_t next_trace_id = 1;
+
+int trace_open(const char *path, long every) {
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL) {
+		return 1;
+	}
+	snprintf(trace_path, sizeof(trace_path), "%s", path);
+	trace_every = every > 0 ? every : 1;
+	return 0;
+}
+
+void trace_thread(const char *kind, int index) {
+	if (trace_every == 0) {
+		return;
+	}
+	trace_buffer *b = (trace_buffer*)calloc(1, sizeof(trace_buffer));
+	if (b != NULL) {
+		b->spans = (trace_span*)malloc(TRACE_BUFFER_SPANS * sizeof(trace_span));
+	}
+	if (b == NULL || b->spans == NULL) {
+		// this thread's spans are left out
+		free(b);
+		return;
+	}
+	if (index >= 0) {
+		snprintf(b->name, sizeof(b->name), "%s %d", kind, index);
+	} else {
+		snprintf(b->name, sizeof(b->name), "%s", kind);
+	}
+
+	// appended so the threads are listed in the order they started
+	pthread_mutex_lock(&buffers_lock);
+	b->tid = ++num_buffers;
+	trace_buffer **tail = &all_buffers;
+	while (*tail != NULL) {
+		tail = &(*tail)->next;
+	}
+	*tail = b;
+	pthread_mutex_unlock(&buffers_lock);
+	thread_trace = b;
+}
+
+uint32_t trace_sample_command(void) {
+	trace_buffer *b = thread_trace;
+	if (b == NULL || b->commands++ % trace_every != 0) {
+		return 0;
+	}
+	uint32_t id = atomic_fetch_add_explicit(&next_trace_id, 1, memory_order_relaxed);
+	// 0 means untraced, skip it when the IDs wrap
+	return id != 0 ? id : atomic_fetch_add_explicit(&next_trace_id, 1, memory_order_relaxed);
+}
+
+int trace_sample_flush(void) {
+	trace_buffer *b = thread_trace;
+	return b != NULL && b->flushes++ % trace_every == 0;
+}
+
+void trace_close(void) {
+	if (trace_file == NULL) {
+		return;
+	}
+
+	// timestamps are relative to the first span so the viewer starts at 0
+	uint64_t origin = UINT64_MAX;
+	for (trace_buffer *b = all_buffers; b != NULL; b = b->next) {
+		for (int i = 0; i < b->len; i++) {
+			origin = b->spans[i].begin_ns < origin ? b->spans[i].begin_ns : origin;
+		}
+	}
+
+	long spans = 0;
+	long dropped = 0;
+	int pid = (int)getpid();
+	int first = 1;
+	fprintf(trace_file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (trace_buffer *b = all_buffers; b != NULL; b = b->next) {
+		fprintf(trace_file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", pid, b->tid, b->name);
+		first = 0;
+		for (int i = 0; i < b->len; i++) {
+			trace_span *span = &b->spans[i];
+			fprintf(trace_file, ",\n{\"name\":\"%s\",\"cat\":\"pex\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+				"\"pid\":%d,\"tid\":%d,\"args\":{\"%s\":%llu}}", span->name,
+				(span->begin_ns - origin) / 1e3, (span->end_ns - span->begin_ns) / 1e3, pid, b->tid,
+				span->arg_name, (unsigned long long)span->arg);
+		}
+		spans += b->len;
+		dropped += b->dropped;
+	}
+	fprintf(trace_file, "\n]}\n");
+	fclose(trace_file);
+	trace_file = NULL;
+
+	printf("%s Trace of %ld spans written to %s", LOG_PREFIX, spans, trace_path);
+	if (dropped > 0) {
+		printf(", %ld dropped with full buffers", dropped);
+	}
+	printf("\n");
+
+	while (all_buffers != NULL) {
+		trace_buffer *next = all_buffers->next;
+		free(all_buffers->spans);
+		free(all_buffers);
+		all_buffers = next;
+	}
+	trace_every = 0;
+	thread_trace = NULL;
+}
@@ -0,0 +1,114 @@
+#ifndef PE_TRACE_H
+#define PE_TRACE_H
+
+#include "pe_common.h"
+#include "pe_latency.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define TRACE_BUFFER_SPANS 262144 // spans kept per thread, later ones are counted as dropped
+#define DEFAULT_TRACE_EVERY 1 // trace every command unless told otherwise
+
+/*
+ * Spans of engine activity written as Chrome trace-event JSON, viewable in
+ * Perfetto or chrome://tracing. Each thread records into its own buffer
+ * without locks or allocation; the buffers are only read once every thread
+ * has been joined. Only every Nth command and every Nth outbound flush of a
+ * thread is traced, so the overhead stays bounded in long runs.
+ */
+
+/*
+ * Desc: One traced interval of a thread.
+ * Fields: The span's name, the name and value of its argument (the command
+           it belongs to, or the number of events flushed) and its begin and
+           end on CLOCK_MONOTONIC in ns.
+ */
+typedef struct trace_span trace_span;
+struct trace_span {
+    const char *name;
+    const char *arg_name;
+    uint64_t arg;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+};
+
+/*
+ * Desc: One thread's spans, linked into a global list so they can be
+         written at shutdown.
+ * Fields: The thread's name and trace tid, its spans, how many were
+           recorded and dropped, its command and flush counters for
+           sampling, and the next buffer.
+ */
+typedef struct trace_buffer trace_buffer;
+struct trace_buffer {
+    char name[32];
+    int tid;
+    trace_span *spans;
+    int len;
+    long dropped;
+    long commands;
+    long flushes;
+    trace_buffer *next;
+};
+
+extern long trace_every; // 0 --> not tracing
+extern _Thread_local trace_buffer *thread_trace;
+
+/*
+ * Desc: Starts tracing: opens the output file so a bad path is reported up
+         front. Threads register their buffers with trace_thread.
+ * Params: The path of the JSON file and N, the sampling period.
+ * Return: 0 on success, 1 if the file could not be opened.
+ */
+int trace_open(const char *path, long every);
+
+/*
+ * Desc: Gives the calling thread a span buffer under a name. Does nothing
+         when not tracing.
+ * Params: The kind of thread and its index (-1 --> none).
+ */
+void trace_thread(const char *kind, int index);
+
+/*
+ * Desc: Counts a command read by the calling thread and decides whether it
+         is traced.
+ * Return: The trace ID to carry with the command, 0 if it isn't traced.
+ */
+uint32_t trace_sample_command(void);
+
+/*
+ * Desc: Counts an outbound flush of the calling thread and decides whether
+         it is traced.
+ * Return: 1 if it is traced, 0 otherwise.
+ */
+int trace_sample_flush(void);
+
+/*
+ * Desc: Writes every buffer to the trace file as Chrome trace-event JSON,
+         frees them and prints where the trace went. Every other thread that
+         recorded spans must have been joined. Does nothing when not tracing.
+ */
+void trace_close(void);
+
+/*
+ * Desc: Records a span from begin_ns until now on the calling thread.
+ * Params: The span's name, its argument's name and value, and its begin.
+ */
+static inline void trace_span_end(const char *name, const char *arg_name, uint64_t arg, uint64_t begin_ns) {
+	trace_buffer *b = thread_trace;
+	if (b == NULL) {
+		return;
+	}
+	if (b->len == TRACE_BUFFER_SPANS) {
+		b->dropped++;
+		return;
+	}
+	trace_span *span = &b->spans[b->len++];
+	span->name = name;
+	span->arg_name = arg_name;
+	span->arg = arg;
+	span->begin_ns = begin_ns;
+	span->end_ns = latency_now();
+}
+
+#endif
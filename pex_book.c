@@ -0,0 +1,117 @@
+#include "pex_book.h"
+#include "pex_client.h"
+
+#define INITIAL_LEVELS 16
+
+void pex_book_init(pex_book *b, const char *product) {
+	memset(b, 0, sizeof(pex_book));
+	snprintf(b->product, PRODUCT_STR_LEN, "%s", product);
+	b->exact = 1;
+}
+
+void pex_book_free(pex_book *b) {
+	free(b->sides[PEX_BUY].levels);
+	free(b->sides[PEX_SELL].levels);
+	memset(b->sides, 0, sizeof(b->sides));
+}
+
+/*
+ * Desc: Whether price a is worse than price b on a side: lower for BUY,
+         higher for SELL.
+ */
+static inline int worse(int side, long a, long b) {
+	return side == PEX_BUY ? a < b : a > b;
+}
+
+/*
+ * Desc: Binary search for where a price goes on a side.
+ * Return: The index of the first level not worse than the price. The level
+           is at that index if it exists.
+ */
+static int find_slot(pex_book_side *s, int side, long price) {
+	int low = 0;
+	int high = s->len;
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+		if (worse(side, s->levels[mid].price, price)) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/*
+ * Desc: Adds quantity at a price on one side, creating the level if needed.
+ * Return: 0 on success, 1 if the level couldn't be allocated.
+ */
+static int rest(pex_book_side *s, int side, long quantity, long price) {
+	int slot = find_slot(s, side, price);
+	if (slot < s->len && s->levels[slot].price == price) {
+		s->levels[slot].quantity += quantity;
+		s->quantity += quantity;
+		return 0;
+	}
+	if (s->len == s->cap) {
+		int cap = s->cap > 0 ? s->cap * 2 : INITIAL_LEVELS;
+		pex_level *grown = (pex_level*)realloc(s->levels, cap * sizeof(pex_level));
+		if (grown == NULL) {
+			return 1;
+		}
+		s->levels = grown;
+		s->cap = cap;
+	}
+	// only the levels better than the new one move
+	memmove(&s->levels[slot + 1], &s->levels[slot], (s->len - slot) * sizeof(pex_level));
+	s->levels[slot].price = price;
+	s->levels[slot].quantity = quantity;
+	s->len++;
+	s->quantity += quantity;
+	return 0;
+}
+
+long pex_book_add(pex_book *b, int side, long quantity, long price) {
+	int other_side = side == PEX_BUY ? PEX_SELL : PEX_BUY;
+	pex_book_side *other = &b->sides[other_side];
+	long traded = 0;
+
+	// trade with the best opposite level while the order crosses it
+	while (quantity > 0 && other->len > 0 && !worse(side, price, other->levels[other->len - 1].price)) {
+		pex_level *best = &other->levels[other->len - 1];
+		long fill = quantity < best->quantity ? quantity : best->quantity;
+		best->quantity -= fill;
+		other->quantity -= fill;
+		quantity -= fill;
+		traded += fill;
+		if (best->quantity == 0) {
+			other->len--;
+		}
+	}
+	b->volume += traded;
+
+	if (quantity > 0 && rest(&b->sides[side], side, quantity, price)) {
+		b->exact = 0;
+	}
+	return traded;
+}
+
+void pex_book_remove(pex_book *b, int side, long quantity, long price) {
+	pex_book_side *s = &b->sides[side];
+	int slot = find_slot(s, side, price);
+	if (slot == s->len || s->levels[slot].price != price) {
+		b->exact = 0;
+		return;
+	}
+	pex_level *level = &s->levels[slot];
+	if (quantity > level->quantity) {
+		b->exact = 0;
+		quantity = level->quantity;
+	}
+	level->quantity -= quantity;
+	s->quantity -= quantity;
+	if (level->quantity == 0) {
+		memmove(&s->levels[slot], &s->levels[slot + 1], (s->len - slot - 1) * sizeof(pex_level));
+		s->len--;
+	}
+}
@@ -0,0 +1,122 @@
+#ifndef PEX_BOOK_H
+#define PEX_BOOK_H
+
+/*
+ * A trader-side replica of one product's book as aggregated price levels:
+ * the quantity resting at each price, not the orders behind it.
+ *
+ * Each side keeps its levels in an array sorted worst first, so the best
+ * level is the last one. The best price, the quantity behind it and the
+ * level at any depth are array reads. Orders arrive near the best price, so
+ * adding or removing a level moves only the few levels better than it, and
+ * an order trading through the best levels pops them off the end.
+ *
+ * The exchange matches an order against the opposite side as soon as it is
+ * placed or amended, best price first, until it no longer crosses. Which
+ * orders within a level trade doesn't change the level's total, so
+ * pex_book_add replays that matching on the levels and the replica ends up
+ * with the exchange's levels.
+ */
+
+#include "pe_common.h"
+
+/*
+ * Desc: One price level.
+ * Fields: The price and the total quantity resting at it.
+ */
+typedef struct pex_level pex_level;
+struct pex_level {
+    long price;
+    long quantity;
+};
+
+/*
+ * Desc: The levels of one side of a book.
+ * Fields: The levels sorted worst first, how many there are and how many
+           fit, and the quantity over all of them.
+ */
+typedef struct pex_book_side pex_book_side;
+struct pex_book_side {
+    pex_level *levels; // the best level is levels[len - 1]
+    int len;
+    int cap;
+    long quantity;
+};
+
+/*
+ * Desc: The replica of one product's book.
+ * Fields: The product, its BUY and SELL sides, the quantity seen to trade,
+           and whether the replica is known to match the exchange.
+ */
+typedef struct pex_book pex_book;
+struct pex_book {
+    char product[PRODUCT_STR_LEN];
+    pex_book_side sides[2]; // indexed by PEX_BUY and PEX_SELL
+    long volume;
+    // cleared when an update couldn't be applied exactly: a MARKET line
+    // without --market-detail, a removal of more than rests, no memory
+    int exact;
+};
+
+/*
+ * Desc: The best price on one side, the quantity behind it, the number of
+         levels and the quantity over all of them.
+ * Params: The book and PEX_BUY or PEX_SELL.
+ * Return: The value, 0 when the side is empty.
+ */
+static inline long pex_best_price(const pex_book *b, int side) {
+	const pex_book_side *s = &b->sides[side];
+	return s->len > 0 ? s->levels[s->len - 1].price : 0;
+}
+
+static inline long pex_best_quantity(const pex_book *b, int side) {
+	const pex_book_side *s = &b->sides[side];
+	return s->len > 0 ? s->levels[s->len - 1].quantity : 0;
+}
+
+static inline int pex_depth(const pex_book *b, int side) {
+	return b->sides[side].len;
+}
+
+static inline long pex_side_quantity(const pex_book *b, int side) {
+	return b->sides[side].quantity;
+}
+
+/*
+ * Desc: The level at a depth, 0 being the best.
+ * Params: The book, PEX_BUY or PEX_SELL, and the depth.
+ * Return: The level, NULL if the side has no level that deep. Valid until
+           the book next changes.
+ */
+static inline const pex_level *pex_level_at(const pex_book *b, int side, int depth) {
+	const pex_book_side *s = &b->sides[side];
+	return depth >= 0 && depth < s->len ? &s->levels[s->len - 1 - depth] : NULL;
+}
+
+/*
+ * Desc: Sets up an empty, exact book for a product.
+ */
+void pex_book_init(pex_book *b, const char *product);
+
+/*
+ * Desc: Frees a book's levels.
+ */
+void pex_book_free(pex_book *b);
+
+/*
+ * Desc: Adds a newly placed or amended order: it trades against the
+         opposite side while it crosses, at the resting levels' prices, and
+         what is left rests at its price.
+ * Params: The book, the order's side, quantity and price.
+ * Return: The quantity traded.
+ */
+long pex_book_add(pex_book *b, int side, long quantity, long price);
+
+/*
+ * Desc: Takes quantity off a level, for a cancelled order or the old state
+         of an amended one. The level goes once it is empty.
+ * Params: The book, the order's side, the quantity it had left and its price.
+ */
+void pex_book_remove(pex_book *b, int side, long quantity, long price);
+
+#endif
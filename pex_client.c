@@ -0,0 +1,418 @@
+#include "pex_client.h"
+#include <limits.h>
+#include <poll.h>
+
+static const char *side_names[2] = {"BUY", "SELL"};
+
+int pex_connect(pex_client *c, int trader_id, void *ctx) {
+	// the exchange signals as soon as the fifos are open, SIGUSR1's default
+	// action would kill us
+	signal(SIGUSR1, SIG_IGN);
+
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, FIFO_EXCHANGE, trader_id);
+	int read_fd = open(path, O_RDONLY | O_NONBLOCK);
+	snprintf(path, PATH_MAX, FIFO_TRADER, trader_id);
+	int write_fd = open(path, O_WRONLY);
+	if (read_fd == -1 || write_fd == -1) {
+		if (read_fd != -1) {
+			close(read_fd);
+		}
+		if (write_fd != -1) {
+			close(write_fd);
+		}
+		return 1;
+	}
+
+	// traders are children of the exchange, even when a zygote starts them
+	pex_attach(c, trader_id, read_fd, write_fd, getppid(), ctx);
+	return 0;
+}
+
+void pex_attach(pex_client *c, int trader_id, int read_fd, int write_fd, pid_t exchange_pid, void *ctx) {
+	memset(c, 0, sizeof(pex_client));
+	c->trader_id = trader_id;
+	c->read_fd = read_fd;
+	c->write_fd = write_fd;
+	c->exchange_pid = exchange_pid;
+	c->ctx = ctx;
+	c->max_in_flight = 1;
+	fcntl(read_fd, F_SETFL, fcntl(read_fd, F_GETFL) | O_NONBLOCK);
+	fcntl(write_fd, F_SETFL, fcntl(write_fd, F_GETFL) | O_NONBLOCK);
+	signal(SIGUSR1, SIG_IGN);
+}
+
+void pex_on(pex_client *c, int type, pex_callback cb) {
+	if (type >= 0 && type < NUM_PEX_EVENTS) {
+		c->callbacks[type] = cb;
+	}
+}
+
+/*
+ * Desc: Appends a formatted command to the send queue and remembers it until
+         the exchange answers.
+ * Return: 0 on success, 1 if it doesn't fit a message or the queue.
+ */
+static int queue_message(pex_client *c, const char *msg, int len, pex_pending *cmd) {
+	if (len <= 0 || len >= PEX_MSG_LEN || c->tx_len + len > PEX_TX_BUF_SIZE ||
+		c->pending_len == PEX_MAX_PENDING) {
+		return 1;
+	}
+	memcpy(c->tx_buf + c->tx_len, msg, len);
+	c->tx_len += len;
+	c->pending[(c->pending_head + c->pending_len) % PEX_MAX_PENDING] = *cmd;
+	c->pending_len++;
+	return 0;
+}
+
+static int queue_order(pex_client *c, int side, const char *product, long quantity, long price) {
+	int order_id = c->next_order_id;
+	if (order_id > PEX_OID_MAX || strlen(product) >= PRODUCT_STR_LEN) {
+		return -1;
+	}
+	if (order_id == c->own_cap) {
+		int cap = c->own_cap > 0 ? c->own_cap * 2 : 64;
+		pex_own_order *grown = (pex_own_order*)realloc(c->own, cap * sizeof(pex_own_order));
+		if (grown == NULL) {
+			return -1;
+		}
+		c->own = grown;
+		c->own_cap = cap;
+	}
+
+	char msg[PEX_MSG_LEN];
+	int len = snprintf(msg, PEX_MSG_LEN, "%s %d %s %ld %ld;", side_names[side], order_id,
+		product, quantity, price);
+	pex_pending cmd = {side == PEX_BUY ? PEX_CMD_BUY : PEX_CMD_SELL, order_id, quantity, price};
+	if (queue_message(c, msg, len, &cmd)) {
+		return -1;
+	}
+	pex_own_order *own = &c->own[order_id];
+	memset(own, 0, sizeof(pex_own_order));
+	snprintf(own->product, PRODUCT_STR_LEN, "%s", product);
+	own->side = side;
+	own->price = price;
+	return c->next_order_id++;
+}
+
+int pex_buy(pex_client *c, const char *product, long quantity, long price) {
+	return queue_order(c, PEX_BUY, product, quantity, price);
+}
+
+int pex_sell(pex_client *c, const char *product, long quantity, long price) {
+	return queue_order(c, PEX_SELL, product, quantity, price);
+}
+
+int pex_amend(pex_client *c, int order_id, long quantity, long price) {
+	char msg[PEX_MSG_LEN];
+	int len = snprintf(msg, PEX_MSG_LEN, "AMEND %d %ld %ld;", order_id, quantity, price);
+	pex_pending cmd = {PEX_CMD_AMEND, order_id, quantity, price};
+	return queue_message(c, msg, len, &cmd);
+}
+
+int pex_cancel(pex_client *c, int order_id) {
+	char msg[PEX_MSG_LEN];
+	int len = snprintf(msg, PEX_MSG_LEN, "CANCEL %d;", order_id);
+	pex_pending cmd = {PEX_CMD_CANCEL, order_id, 0, 0};
+	return queue_message(c, msg, len, &cmd);
+}
+
+/*
+ * Desc: Whether a queued order may be sent now.
+ */
+static int can_send(pex_client *c) {
+	return c->tx_len > 0 && c->market_open && !c->closed &&
+		(c->max_in_flight == 0 || c->in_flight < c->max_in_flight);
+}
+
+int pex_flush(pex_client *c) {
+	int sent = 0;
+	while (can_send(c)) {
+		// whole messages up to the in-flight limit, at most PIPE_BUF bytes
+		int end = 0;
+		int count = 0;
+		for (int i = 0; i < c->tx_len && i < PIPE_BUF; i++) {
+			if (c->tx_buf[i] != ';') {
+				continue;
+			}
+			end = i + 1;
+			count++;
+			if (c->max_in_flight > 0 && c->in_flight + count == c->max_in_flight) {
+				break;
+			}
+		}
+		ssize_t written = write(c->write_fd, c->tx_buf, end);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		} else if (written < 0 && errno == EAGAIN) {
+			break; // pex_poll waits for room
+		} else if (written < 0) {
+			c->closed = 1;
+			return 1;
+		}
+
+		// a pipe takes all of it, a stream socket may take part of the last
+		// message and the rest follows in the next write
+		for (int i = 0; i < written; i++) {
+			c->in_flight += c->tx_buf[i] == ';';
+		}
+		c->tx_len -= written;
+		memmove(c->tx_buf, c->tx_buf + written, c->tx_len);
+		sent += written;
+	}
+
+	if (sent > 0) {
+		c->flushes++;
+		kill(c->exchange_pid, SIGUSR1);
+	}
+	return c->closed;
+}
+
+int pex_parse_event(const char *msg, pex_event *ev) {
+	memset(ev, 0, sizeof(pex_event));
+	char side[5];
+	int end = -1;
+	if (strcmp(msg, "MARKET OPEN") == 0) {
+		ev->type = PEX_MARKET_OPEN;
+		return 0;
+	} else if (sscanf(msg, "MARKET %4s %16s %ld %ld%n", side, ev->product, &ev->quantity, &ev->price, &end) == 4) {
+		ev->type = PEX_MARKET;
+		// --market-detail appends what the order was before
+		int detail_end = -1;
+		if (sscanf(msg + end, " %ld %ld%n", &ev->prev_quantity, &ev->prev_price, &detail_end) == 2) {
+			ev->detailed = 1;
+			end += detail_end;
+		}
+		if (strcmp(side, "BUY") == 0) {
+			ev->side = PEX_BUY;
+		} else if (strcmp(side, "SELL") == 0) {
+			ev->side = PEX_SELL;
+		} else {
+			return 1;
+		}
+	} else if (sscanf(msg, "ACCEPTED %d%n", &ev->order_id, &end) == 1) {
+		ev->type = PEX_ACCEPTED;
+	} else if (sscanf(msg, "AMENDED %d%n", &ev->order_id, &end) == 1) {
+		ev->type = PEX_AMENDED;
+	} else if (sscanf(msg, "CANCELLED %d%n", &ev->order_id, &end) == 1) {
+		ev->type = PEX_CANCELLED;
+	} else if (sscanf(msg, "FILL %d %ld%n", &ev->order_id, &ev->quantity, &end) == 2) {
+		ev->type = PEX_FILL;
+	} else if (strcmp(msg, "INVALID") == 0) {
+		ev->type = PEX_INVALID;
+		return 0;
+	}
+
+	// anything left over means it wasn't the message it started like
+	return end == -1 || msg[end] != '\0';
+}
+
+pex_book *pex_book_for(pex_client *c, const char *product) {
+	for (int i = 0; i < c->num_books; i++) {
+		if (strcmp(c->books[i]->product, product) == 0) {
+			return c->books[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Desc: Finds a product's book, creating it the first time it is seen.
+ * Return: The book, NULL if it couldn't be allocated.
+ */
+static pex_book *book_for(pex_client *c, const char *product) {
+	pex_book *b = pex_book_for(c, product);
+	if (b != NULL) {
+		return b;
+	}
+	if (c->num_books == c->books_cap) {
+		int cap = c->books_cap > 0 ? c->books_cap * 2 : 8;
+		pex_book **grown = (pex_book**)realloc(c->books, cap * sizeof(pex_book*));
+		if (grown == NULL) {
+			return NULL;
+		}
+		c->books = grown;
+		c->books_cap = cap;
+	}
+	b = (pex_book*)malloc(sizeof(pex_book));
+	if (b == NULL) {
+		return NULL;
+	}
+	pex_book_init(b, product);
+	c->books[c->num_books++] = b;
+	return b;
+}
+
+/*
+ * Desc: Applies the answer to the oldest pending command to the client's own
+         order and its book.
+ */
+static void apply_answer(pex_client *c, int type) {
+	if (c->pending_len == 0) {
+		return;
+	}
+	pex_pending cmd = c->pending[c->pending_head];
+	c->pending_head = (c->pending_head + 1) % PEX_MAX_PENDING;
+	c->pending_len--;
+	if (type == PEX_INVALID || cmd.order_id < 0 || cmd.order_id >= c->next_order_id) {
+		return;
+	}
+
+	pex_own_order *own = &c->own[cmd.order_id];
+	if (type == PEX_ACCEPTED && (cmd.type == PEX_CMD_BUY || cmd.type == PEX_CMD_SELL)) {
+		own->book = book_for(c, own->product);
+		own->remaining = cmd.quantity;
+		if (own->book != NULL) {
+			// what trades now comes back as FILLs, which take it off remaining
+			pex_book_add(own->book, own->side, cmd.quantity, cmd.price);
+		}
+	} else if (own->book != NULL && (type == PEX_AMENDED || type == PEX_CANCELLED)) {
+		pex_book_remove(own->book, own->side, own->remaining, own->price);
+		own->remaining = 0;
+		if (type == PEX_AMENDED) {
+			own->remaining = cmd.quantity;
+			own->price = cmd.price;
+			pex_book_add(own->book, own->side, cmd.quantity, cmd.price);
+		}
+	}
+}
+
+/*
+ * Desc: Applies another trader's order to its product's book.
+ */
+static void apply_market(pex_client *c, pex_event *ev) {
+	pex_book *b = book_for(c, ev->product);
+	if (b == NULL) {
+		return;
+	}
+	if (!ev->detailed) {
+		// an amend looks like a new order and a cancel doesn't say what went
+		b->exact = 0;
+	} else if (ev->prev_quantity > 0) {
+		pex_book_remove(b, ev->side, ev->prev_quantity, ev->prev_price);
+	}
+	if (ev->quantity > 0) {
+		pex_book_add(b, ev->side, ev->quantity, ev->price);
+	}
+}
+
+/*
+ * Desc: Decodes a framed message, updates the client and calls its callback.
+ * Return: 1 if it was an event, 0 if it couldn't be decoded.
+ */
+static int dispatch(pex_client *c, const char *msg) {
+	pex_event ev;
+	if (pex_parse_event(msg, &ev)) {
+		c->unknown++;
+		return 0;
+	}
+	if (ev.type == PEX_MARKET_OPEN) {
+		c->market_open = 1;
+	} else if (ev.type == PEX_MARKET) {
+		apply_market(c, &ev);
+	} else if (ev.type == PEX_FILL) {
+		if (ev.order_id >= 0 && ev.order_id < c->next_order_id) {
+			pex_own_order *own = &c->own[ev.order_id];
+			own->remaining = own->remaining > ev.quantity ? own->remaining - ev.quantity : 0;
+		}
+	} else {
+		// every command gets exactly one of these, in the order sent
+		if (c->in_flight > 0) {
+			c->in_flight--;
+		}
+		apply_answer(c, ev.type);
+	}
+	c->events[ev.type]++;
+	if (c->callbacks[ev.type] != NULL) {
+		c->callbacks[ev.type](c, &ev);
+	}
+	return 1;
+}
+
+/*
+ * Desc: Reads until the connection is empty and dispatches every complete
+         message. A partial message stays buffered until the rest arrives.
+ * Return: The number of events handled.
+ */
+static int read_events(pex_client *c) {
+	int handled = 0;
+	while (!c->closed) {
+		ssize_t got = read(c->read_fd, c->rx_buf + c->rx_len, PEX_RX_BUF_SIZE - c->rx_len);
+		if (got == 0) {
+			c->closed = 1;
+			break;
+		} else if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			c->closed = errno != EAGAIN;
+			break;
+		}
+		c->rx_len += got;
+
+		int start = 0;
+		for (int i = 0; i < c->rx_len; i++) {
+			if (c->rx_buf[i] == ';') {
+				c->rx_buf[i] = '\0';
+				handled += dispatch(c, c->rx_buf + start);
+				start = i + 1;
+			}
+		}
+		c->rx_len -= start;
+		memmove(c->rx_buf, c->rx_buf + start, c->rx_len);
+
+		if (c->rx_len == PEX_RX_BUF_SIZE) {
+			// a whole buffer without a delimiter can't be a message, drop it
+			c->unknown++;
+			c->rx_len = 0;
+		}
+	}
+	return handled;
+}
+
+int pex_poll(pex_client *c, int timeout_ms) {
+	if (c->closed || pex_flush(c)) {
+		return -1;
+	}
+
+	// waiting for room to write only when a flush was cut short
+	struct pollfd pfds[2] = {{c->read_fd, POLLIN, 0}, {c->write_fd, POLLOUT, 0}};
+	int ready = poll(pfds, can_send(c) ? 2 : 1, timeout_ms);
+	if (ready < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	int handled = 0;
+	if (pfds[0].revents != 0) {
+		handled = read_events(c);
+	}
+	pex_flush(c);
+	// events read before the exchange closed the connection are still handled
+	return handled == 0 && c->closed ? -1 : handled;
+}
+
+void pex_close(pex_client *c) {
+	if (c->read_fd != -1) {
+		close(c->read_fd);
+	}
+	if (c->write_fd != -1) {
+		close(c->write_fd);
+	}
+	c->read_fd = -1;
+	c->write_fd = -1;
+	c->closed = 1;
+	c->tx_len = 0;
+	c->pending_len = 0;
+
+	for (int i = 0; i < c->num_books; i++) {
+		pex_book_free(c->books[i]);
+		free(c->books[i]);
+	}
+	free(c->books);
+	free(c->own);
+	c->books = NULL;
+	c->num_books = 0;
+	c->books_cap = 0;
+	c->own = NULL;
+	c->own_cap = 0;
+}
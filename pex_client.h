@@ -0,0 +1,242 @@
+#ifndef PEX_CLIENT_H
+#define PEX_CLIENT_H
+
+/*
+ * libpex: the trader side of the exchange protocol, for writing strategies.
+ *
+ * The client owns the connection to the exchange, frames the ;-delimited
+ * messages it sends and hands each one to a callback as a decoded event.
+ * Nothing runs in a signal handler: the exchange's SIGUSR1s are ignored and
+ * the connection is polled instead, so a strategy is an ordinary loop around
+ * pex_poll (or the client's fd in its own poll loop).
+ *
+ * Orders are queued by pex_buy, pex_sell, pex_amend and pex_cancel without
+ * blocking and sent by the next pex_flush or pex_poll, as many as fit in one
+ * write and with one SIGUSR1. The exchange answers every command in order
+ * (ACCEPTED, AMENDED, CANCELLED or INVALID), which is how the client counts
+ * the commands in flight. An exchange started without --shards reads one
+ * message per SIGUSR1, so by default only one command is in flight at once;
+ * with --shards the gateways frame what they read and max_in_flight can be
+ * raised, or set to 0 for no limit.
+ *
+ * The client keeps a replica of every product's book (see pex_book.h) from
+ * the MARKET lines and its own orders, which the exchange answers without a
+ * MARKET line. It is updated before the event's callback runs. MARKET lines
+ * only say what an amend or cancel removed when the exchange runs with
+ * --market-detail; without it amends are taken as new orders, cancels can't
+ * be applied and the book's exact flag is cleared.
+ */
+
+#include "pe_common.h"
+#include "pex_book.h"
+
+#define PEX_RX_BUF_SIZE 4096 // received bytes that aren't a full message yet
+#define PEX_TX_BUF_SIZE 65536 // queued messages not yet written
+#define PEX_MSG_LEN 64 // longest message the client sends, with its ;
+#define PEX_OID_MAX 999999
+#define PEX_MAX_PENDING 8192 // commands queued or in flight
+
+enum pex_event_type {
+	PEX_MARKET_OPEN = 0,
+	PEX_ACCEPTED,
+	PEX_AMENDED,
+	PEX_CANCELLED,
+	PEX_INVALID,
+	PEX_FILL,
+	PEX_MARKET, // another trader's order was placed, amended or cancelled
+	NUM_PEX_EVENTS
+};
+
+enum pex_side {
+	PEX_BUY = 0,
+	PEX_SELL
+};
+
+enum pex_command_type {
+	PEX_CMD_BUY = 0,
+	PEX_CMD_SELL,
+	PEX_CMD_AMEND,
+	PEX_CMD_CANCEL
+};
+
+/*
+ * Desc: A message from the exchange, decoded.
+ * Fields: The event type and what its message carries: the order ID for
+           ACCEPTED, AMENDED, CANCELLED and FILL, the quantity for FILL, and
+           the side, product, quantity and price for MARKET (0 and 0 when the
+           order was cancelled). With --market-detail MARKET also carries what
+           the order had left and its price before (0 and 0 for a new order).
+           Fields a message doesn't carry are zeroed.
+ */
+typedef struct pex_event pex_event;
+struct pex_event {
+    int type; // enum pex_event_type
+    int order_id;
+    int side; // enum pex_side
+    char product[PRODUCT_STR_LEN];
+    long quantity;
+    long price;
+    int detailed; // MARKET carried prev_quantity and prev_price
+    long prev_quantity;
+    long prev_price;
+};
+
+/*
+ * Desc: A command queued or in flight, kept until the exchange answers it.
+ * Fields: The enum pex_command_type, the order ID, and the quantity and
+           price it sets.
+ */
+typedef struct pex_pending pex_pending;
+struct pex_pending {
+    int type;
+    int order_id;
+    long quantity;
+    long price;
+};
+
+/*
+ * Desc: One of the client's own orders, indexed by order ID.
+ * Fields: The product, side and price, the quantity left on the book and
+           the book it rests in, NULL until the exchange accepts it.
+ */
+typedef struct pex_own_order pex_own_order;
+struct pex_own_order {
+    char product[PRODUCT_STR_LEN];
+    int side;
+    long remaining;
+    long price;
+    pex_book *book;
+};
+
+typedef struct pex_client pex_client;
+
+/*
+ * Desc: Called for every event of the type it was registered for, after the
+         books took the event in. It may queue orders, they are sent once the
+         events read so far are handled.
+ * Params: The client and the event, valid only during the call.
+ */
+typedef void (*pex_callback)(pex_client *c, pex_event *ev);
+
+/*
+ * Desc: A connection to the exchange.
+ * Fields: The trader ID, the fds read from and written to and the process
+           signalled after writing, the callbacks and a pointer passed along
+           for the strategy's own state, the framing and send buffers, the
+           commands in flight and the limit on them, the next order ID, the
+           commands waiting for an answer, the client's own orders, the book
+           replicas, and counters of the messages handled.
+ */
+struct pex_client {
+    int trader_id;
+    int read_fd;
+    int write_fd;
+    pid_t exchange_pid;
+    int market_open; // MARKET OPEN received, orders are only sent after it
+    int closed; // the exchange closed the connection
+    pex_callback callbacks[NUM_PEX_EVENTS];
+    void *ctx;
+    char rx_buf[PEX_RX_BUF_SIZE];
+    int rx_len;
+    char tx_buf[PEX_TX_BUF_SIZE];
+    int tx_len;
+    int in_flight; // commands written and not answered yet
+    int max_in_flight; // 0 --> no limit
+    int next_order_id;
+    pex_pending pending[PEX_MAX_PENDING]; // ring, oldest at pending_head
+    int pending_head;
+    int pending_len;
+    pex_own_order *own; // next_order_id entries
+    int own_cap;
+    pex_book **books; // one per product seen, the pointers stay valid
+    int num_books;
+    int books_cap;
+    long events[NUM_PEX_EVENTS];
+    long unknown; // messages that couldn't be decoded
+    long flushes; // flushes that sent orders, one SIGUSR1 each
+};
+
+/*
+ * Desc: Opens the trader's fifos, /tmp/pe_exchange_<id> to read and
+         /tmp/pe_trader_<id> to write, and attaches the client to them. The
+         exchange is the parent process.
+ * Params: The client, the trader ID (the trader's only argument) and a
+           pointer for the callbacks, stored as c->ctx.
+ * Return: 0 on success, 1 if the fifos can't be opened.
+ */
+int pex_connect(pex_client *c, int trader_id, void *ctx);
+
+/*
+ * Desc: Sets the client up on an open connection: any pair of fds that carry
+         the protocol, e.g. the fifos or a socket. Both are made non-blocking
+         and SIGUSR1 is ignored.
+ * Params: The client, the trader ID, the fds to read from and write to, the
+           process to signal after writing, and the callbacks' pointer.
+ */
+void pex_attach(pex_client *c, int trader_id, int read_fd, int write_fd, pid_t exchange_pid, void *ctx);
+
+/*
+ * Desc: Registers the callback for one event type, replacing any before it.
+         Events without a callback are only counted.
+ * Params: The client, the enum pex_event_type and the callback (NULL to
+           remove it).
+ */
+void pex_on(pex_client *c, int type, pex_callback cb);
+
+/*
+ * Desc: Queues an order. Nothing is written until pex_flush or pex_poll.
+         BUY and SELL are given the next order ID.
+ * Params: The client and the order's fields.
+ * Return: pex_buy and pex_sell: the order ID, -1 if the queue is full, the
+           order IDs ran out or the product name is too long.
+           pex_amend and pex_cancel: 0 on success, 1 if the queue is full.
+ */
+int pex_buy(pex_client *c, const char *product, long quantity, long price);
+int pex_sell(pex_client *c, const char *product, long quantity, long price);
+int pex_amend(pex_client *c, int order_id, long quantity, long price);
+int pex_cancel(pex_client *c, int order_id);
+
+/*
+ * Desc: Writes as many queued orders as the in-flight limit allows, whole
+         messages only and at most PIPE_BUF bytes so the write is atomic,
+         then signals the exchange once. Doesn't block: what the connection
+         can't take stays queued.
+ * Params: The client.
+ * Return: 0 on success (including nothing sent), 1 if the connection failed.
+ */
+int pex_flush(pex_client *c);
+
+/*
+ * Desc: Sends what is queued, waits up to timeout_ms for messages, reads
+         everything available and calls the callback of every complete
+         message in order, then sends what the callbacks queued.
+ * Params: The client, the longest wait in ms (-1 --> until something
+           arrives, 0 --> don't wait).
+ * Return: The number of events handled, -1 once the exchange closed the
+           connection or it failed.
+ */
+int pex_poll(pex_client *c, int timeout_ms);
+
+/*
+ * Desc: Decodes one exchange message, without its ;.
+ * Params: The message and the event to fill.
+ * Return: 0 on success, 1 if it isn't a message the exchange sends.
+ */
+int pex_parse_event(const char *msg, pex_event *ev);
+
+/*
+ * Desc: Finds the replica of a product's book.
+ * Params: The client and the product.
+ * Return: The book, NULL if nothing was seen on the product yet. The pointer
+           stays valid until pex_close.
+ */
+pex_book *pex_book_for(pex_client *c, const char *product);
+
+/*
+ * Desc: Closes the connection and frees the books. Queued orders are
+         dropped.
+ * Params: The client.
+ */
+void pex_close(pex_client *c);
+
+#endif
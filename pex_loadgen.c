@@ -0,0 +1,808 @@
+/*
+ * Synthetic load generator trader for pe_exchange.
+ *
+ * Speaks the same text protocol as pe_trader over the trader fifos and sends
+ * a configurable mix of BUY, SELL, AMEND and CANCEL orders at a given rate,
+ * with prices drawn around a mid that drifts as a random walk. Up to --depth
+ * orders are in flight at once; the exchange answers every order in turn, so
+ * responses are matched to orders in the order they were sent. The send and
+ * response time of every order can be written out for latency analysis.
+ *
+ * Without --shards the exchange reads one message per SIGUSR1, and SIGUSR1s
+ * from several traders can arrive as one, leaving an order unread. An order
+ * not answered within RESIGNAL_MS is signalled again; the exchange ignores a
+ * SIGUSR1 when the fifo is empty. Orders written together are read as one
+ * message there, so --depth above 1 needs --shards. A run that gets no
+ * response for STALL_MS gives up instead of waiting forever.
+ *
+ * The exchange launches traders with their trader ID as the only argument,
+ * so options are also read from the PEX_LOADGEN environment variable, e.g.
+ *   PEX_LOADGEN="--rate=5000 --orders=100000" ./pe_exchange products.txt ./pex_loadgen
+ *
+ * Usage: pex_loadgen [options] <trader id>
+ */
+
+#include "pe_common.h"
+#include "pe_protocol.h"
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LOADGEN_ENV "PEX_LOADGEN"
+#define MAX_ENV_ARGS 64
+#define MAX_LOADGEN_PRODUCTS 1024
+#define DRAIN_MS 1000 // how long to wait for responses after the last order
+#define RESIGNAL_MS 50 // signal the exchange again when an answer is this late
+#define STALL_MS 5000 // give up when nothing was answered for this long
+#define READ_BUF_SIZE 65536
+
+enum order_kind {
+	KIND_BUY = 0,
+	KIND_SELL,
+	KIND_AMEND,
+	KIND_CANCEL,
+	NUM_KINDS
+};
+
+static const char *kind_names[NUM_KINDS] = {"BUY", "SELL", "AMEND", "CANCEL"};
+
+enum qty_dist {
+	QTY_UNIFORM = 0, // uniform between --qty-min and --qty-max
+	QTY_EXP // exponential from --qty-min with mean --qty-mean, capped at --qty-max
+};
+
+enum option_flag {
+	OPT_RATE = 256,
+	OPT_MIX,
+	OPT_MID,
+	OPT_SPREAD,
+	OPT_DRIFT,
+	OPT_QTY_MIN,
+	OPT_QTY_MAX,
+	OPT_QTY_DIST,
+	OPT_QTY_MEAN,
+	OPT_PRODUCTS,
+	OPT_NUM_PRODUCTS,
+	OPT_DEPTH,
+	OPT_ORDERS,
+	OPT_SECONDS,
+	OPT_SEED,
+	OPT_TIMESTAMPS
+};
+
+static struct option long_options[] = {
+	{"rate", required_argument, NULL, OPT_RATE},
+	{"mix", required_argument, NULL, OPT_MIX},
+	{"mid", required_argument, NULL, OPT_MID},
+	{"spread", required_argument, NULL, OPT_SPREAD},
+	{"drift", required_argument, NULL, OPT_DRIFT},
+	{"qty-min", required_argument, NULL, OPT_QTY_MIN},
+	{"qty-max", required_argument, NULL, OPT_QTY_MAX},
+	{"qty-dist", required_argument, NULL, OPT_QTY_DIST},
+	{"qty-mean", required_argument, NULL, OPT_QTY_MEAN},
+	{"products", required_argument, NULL, OPT_PRODUCTS},
+	{"num-products", required_argument, NULL, OPT_NUM_PRODUCTS},
+	{"depth", required_argument, NULL, OPT_DEPTH},
+	{"orders", required_argument, NULL, OPT_ORDERS},
+	{"seconds", required_argument, NULL, OPT_SECONDS},
+	{"seed", required_argument, NULL, OPT_SEED},
+	{"timestamps", required_argument, NULL, OPT_TIMESTAMPS},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
+
+/*
+ * Desc: What the load generator sends and when it stops.
+ * Fields: The order rate and mix, the price and quantity distributions, the
+           products traded, the pipelining depth, the stop conditions, the
+           random seed and where to write timestamps.
+ */
+typedef struct loadgen_config loadgen_config;
+struct loadgen_config {
+    double rate; // orders per second, 0 --> as fast as --depth allows
+    long mix[NUM_KINDS]; // relative weights of BUY, SELL, AMEND, CANCEL
+    long mid; // starting mid price
+    long spread; // prices are drawn within mid +- spread
+    long drift; // the mid moves by up to +- drift after every order
+    long qty_min;
+    long qty_max;
+    int qty_dist; // enum qty_dist
+    long qty_mean;
+    char *product_file;
+    int num_products; // 0 --> all products in the file
+    int depth; // orders in flight at most
+    long max_orders; // 0 --> no limit
+    double max_seconds; // 0 --> no limit
+    uint64_t seed; // 0 --> derived from the trader ID
+    char *timestamps; // file for per-order timestamps, %d is the trader ID, NULL --> none
+};
+
+/*
+ * Desc: An order sent to the exchange, kept until its response arrives and
+         then, if timestamps are written, until exit.
+ * Fields: The order kind, the order ID it names, the quantity it sets, and
+           the send and response times.
+ */
+typedef struct sent_order sent_order;
+struct sent_order {
+    int kind;
+    int order_id;
+    long qty;
+    uint64_t send_ns;
+    uint64_t recv_ns; // 0 --> no response yet
+    int invalid;
+};
+
+/*
+ * Desc: State of a running load generator.
+ * Fields: The fifos, the products, the random state and mid price, the
+           orders sent so far and the oldest one still waiting for its
+           response, when the exchange last answered or was signalled, this
+           trader's resting orders and counters.
+ */
+typedef struct loadgen loadgen;
+struct loadgen {
+    loadgen_config cfg;
+    int trader_id;
+    int read_fd;
+    int write_fd;
+    char **products;
+    int num_products;
+    uint64_t rng;
+    long mid;
+    sent_order *orders; // every order sent, in order
+    long sent;
+    long capacity;
+    long answered; // orders[answered] is the oldest order without a response
+    uint64_t progress_ns; // last order sent or answered
+    uint64_t signal_ns; // last SIGUSR1 sent to the exchange
+    int next_order_id;
+    long *remaining; // per order ID: quantity still resting, 0 --> not on the book
+    int *live; // IDs of resting orders, for picking AMEND and CANCEL targets
+    int *live_pos; // per order ID: index in live, -1 --> not in it
+    int num_live;
+    long kinds_sent[NUM_KINDS];
+    long invalid;
+    long fills;
+    long market;
+    long resignals; // SIGUSR1s repeated for late answers
+};
+
+static void print_loadgen_usage(char *prog) {
+	printf("Usage: %s [options] <trader id>\n", prog);
+	printf("Options (also read from $%s):\n", LOADGEN_ENV);
+	printf("  --rate=N          orders per second (default 0: as fast as --depth allows)\n");
+	printf("  --mix=B,S,A,C     relative weights of BUY, SELL, AMEND, CANCEL (default 40,40,10,10)\n");
+	printf("  --mid=P           starting mid price (default 100)\n");
+	printf("  --spread=S        prices are drawn within mid +- S (default 10)\n");
+	printf("  --drift=D         the mid moves by up to +- D after every order (default 1)\n");
+	printf("  --qty-min=N       smallest quantity (default 1)\n");
+	printf("  --qty-max=N       largest quantity (default 100)\n");
+	printf("  --qty-dist=DIST   uniform (default) or exp: --qty-min plus an exponential\n");
+	printf("                    with mean --qty-mean, capped at --qty-max\n");
+	printf("  --qty-mean=N      mean above --qty-min for --qty-dist=exp (default 10)\n");
+	printf("  --products=FILE   product file the exchange was started with (default products.txt)\n");
+	printf("  --num-products=N  trade the first N products only (default all)\n");
+	printf("  --depth=N         orders in flight at most (default 1); above 1 the exchange\n");
+	printf("                    must run with --shards, which reads every queued message\n");
+	printf("  --orders=N        stop after N orders (default 1000, 0 for no limit)\n");
+	printf("  --seconds=T       stop after T seconds (default 0: no limit)\n");
+	printf("  --seed=N          random seed (default derived from the trader ID)\n");
+	printf("  --timestamps=FILE write one line per order: kind, order ID, send and response\n");
+	printf("                    time in ns on CLOCK_MONOTONIC; %%d is replaced by the trader ID\n");
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Desc: xorshift64* generator, reproducible for a given seed.
+ * Return: The next random number.
+ */
+static uint64_t next_random(loadgen *lg) {
+	lg->rng ^= lg->rng >> 12;
+	lg->rng ^= lg->rng << 25;
+	lg->rng ^= lg->rng >> 27;
+	return lg->rng * 2685821657736338717ull;
+}
+
+/*
+ * Desc: Draws a number uniformly from [low, high].
+ */
+static long uniform(loadgen *lg, long low, long high) {
+	return low + (long)(next_random(lg) % (uint64_t)(high - low + 1));
+}
+
+/*
+ * Desc: Converts an option argument to a long within [low, high].
+ * Return: 0 on success, 1 if it isn't a number in range.
+ */
+static int parse_long(char *str, long low, long high, long *out) {
+	char *end = NULL;
+	errno = 0;
+	long value = strtol(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || value < low || value > high) {
+		return 1;
+	}
+	*out = value;
+	return 0;
+}
+
+static int parse_double(char *str, double *out) {
+	char *end = NULL;
+	errno = 0;
+	double value = strtod(str, &end);
+	if (errno != 0 || end == str || *end != '\0' || value < 0) {
+		return 1;
+	}
+	*out = value;
+	return 0;
+}
+
+/*
+ * Desc: Parses --mix=B,S,A,C.
+ * Return: 0 on success, 1 if it isn't four non-negative weights, one of
+           BUY or SELL non-zero.
+ */
+static int parse_mix(char *str, long *mix) {
+	char *cursor = str;
+	for (int i = 0; i < NUM_KINDS; i++) {
+		char *end = NULL;
+		mix[i] = strtol(cursor, &end, 10);
+		if (end == cursor || mix[i] < 0 || (i < NUM_KINDS - 1 && *end != ',') || (i == NUM_KINDS - 1 && *end != '\0')) {
+			return 1;
+		}
+		cursor = end + 1;
+	}
+	return mix[KIND_BUY] + mix[KIND_SELL] == 0;
+}
+
+/*
+ * Desc: Parses options into the config, from the environment first and then
+         the command line so the command line wins.
+ * Params: The config, the argument vector and its length.
+ * Return: The index of the trader ID in argv, -1 on invalid options.
+ */
+static int parse_options(loadgen_config *cfg, int argc, char **argv) {
+	// the environment variable is split on whitespace into a second argv
+	char *env_argv[MAX_ENV_ARGS + 2];
+	int env_argc = 0;
+	char *env = getenv(LOADGEN_ENV);
+	char *env_copy = env != NULL ? strdup(env) : NULL;
+	env_argv[env_argc++] = argv[0];
+	if (env_copy != NULL) {
+		for (char *arg = strtok(env_copy, " \t\n"); arg != NULL && env_argc <= MAX_ENV_ARGS; arg = strtok(NULL, " \t\n")) {
+			env_argv[env_argc++] = arg;
+		}
+	}
+	env_argv[env_argc] = NULL;
+
+	char **vectors[2] = {env_argv, argv};
+	int counts[2] = {env_argc, argc};
+	int res = 0;
+	for (int v = 0; v < 2 && !res; v++) {
+		optind = 1;
+		int opt;
+		long value = 0;
+		while (!res && (opt = getopt_long(counts[v], vectors[v], "+h", long_options, NULL)) != -1) {
+			switch (opt) {
+			case OPT_RATE:
+				res = parse_double(optarg, &cfg->rate);
+				break;
+			case OPT_MIX:
+				res = parse_mix(optarg, cfg->mix);
+				break;
+			case OPT_MID:
+				res = parse_long(optarg, ORDER_MIN, ORDER_MAX, &cfg->mid);
+				break;
+			case OPT_SPREAD:
+				res = parse_long(optarg, 0, ORDER_MAX, &cfg->spread);
+				break;
+			case OPT_DRIFT:
+				res = parse_long(optarg, 0, ORDER_MAX, &cfg->drift);
+				break;
+			case OPT_QTY_MIN:
+				res = parse_long(optarg, ORDER_MIN, ORDER_MAX, &cfg->qty_min);
+				break;
+			case OPT_QTY_MAX:
+				res = parse_long(optarg, ORDER_MIN, ORDER_MAX, &cfg->qty_max);
+				break;
+			case OPT_QTY_DIST:
+				if (strcmp(optarg, "uniform") == 0) {
+					cfg->qty_dist = QTY_UNIFORM;
+				} else if (strcmp(optarg, "exp") == 0) {
+					cfg->qty_dist = QTY_EXP;
+				} else {
+					res = 1;
+				}
+				break;
+			case OPT_QTY_MEAN:
+				res = parse_long(optarg, 1, ORDER_MAX, &cfg->qty_mean);
+				break;
+			case OPT_PRODUCTS:
+				cfg->product_file = optarg;
+				break;
+			case OPT_NUM_PRODUCTS:
+				res = parse_long(optarg, 1, MAX_LOADGEN_PRODUCTS, &value);
+				cfg->num_products = (int)value;
+				break;
+			case OPT_DEPTH:
+				res = parse_long(optarg, 1, 1000000, &value);
+				cfg->depth = (int)value;
+				break;
+			case OPT_ORDERS:
+				res = parse_long(optarg, 0, LONG_MAX, &cfg->max_orders);
+				break;
+			case OPT_SECONDS:
+				res = parse_double(optarg, &cfg->max_seconds);
+				break;
+			case OPT_SEED:
+				res = parse_long(optarg, 0, LONG_MAX, &value);
+				cfg->seed = (uint64_t)value;
+				break;
+			case OPT_TIMESTAMPS:
+				cfg->timestamps = optarg;
+				break;
+			default:
+				res = 1;
+			}
+		}
+		// only the command line has the trader ID
+		if (!res && v == 0 && optind != env_argc) {
+			res = 1;
+		}
+	}
+	// optarg strings in the environment copy stay in use, it isn't freed
+	if (res || optind != argc - 1 || cfg->qty_min > cfg->qty_max) {
+		return -1;
+	}
+	return optind;
+}
+
+/*
+ * Desc: Reads the product names from the exchange's product file.
+ * Return: 0 on success, 1 if the file can't be read.
+ */
+static int load_products(loadgen *lg) {
+	FILE *fp = fopen(lg->cfg.product_file, "r");
+	int count = 0;
+	if (fp == NULL || fscanf(fp, "%d\n", &count) != 1 || count <= 0 || count > MAX_LOADGEN_PRODUCTS) {
+		if (fp != NULL) {
+			fclose(fp);
+		}
+		return 1;
+	}
+	if (lg->cfg.num_products > 0 && lg->cfg.num_products < count) {
+		count = lg->cfg.num_products;
+	}
+	lg->products = (char**)calloc(count, sizeof(char*));
+	char line[PRODUCT_STR_LEN + 2];
+	while (lg->products != NULL && lg->num_products < count && fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] != '\0') {
+			lg->products[lg->num_products++] = strdup(line);
+		}
+	}
+	fclose(fp);
+	return lg->num_products == 0;
+}
+
+/*
+ * Desc: Draws a quantity from the configured distribution.
+ */
+static long draw_qty(loadgen *lg) {
+	loadgen_config *cfg = &lg->cfg;
+	if (cfg->qty_dist == QTY_UNIFORM) {
+		return uniform(lg, cfg->qty_min, cfg->qty_max);
+	}
+	// inverse transform of a uniform in (0, 1]
+	double u = (double)((next_random(lg) >> 11) + 1) / 9007199254740992.0;
+	long qty = cfg->qty_min + (long)(-log(u) * cfg->qty_mean);
+	return qty > cfg->qty_max ? cfg->qty_max : qty;
+}
+
+/*
+ * Desc: Draws a price around the mid, then moves the mid.
+ */
+static long draw_price(loadgen *lg) {
+	long low = lg->mid - lg->cfg.spread < ORDER_MIN ? ORDER_MIN : lg->mid - lg->cfg.spread;
+	long high = lg->mid + lg->cfg.spread > ORDER_MAX ? ORDER_MAX : lg->mid + lg->cfg.spread;
+	long price = uniform(lg, low, high);
+	lg->mid += uniform(lg, -lg->cfg.drift, lg->cfg.drift);
+	lg->mid = lg->mid < ORDER_MIN ? ORDER_MIN : (lg->mid > ORDER_MAX ? ORDER_MAX : lg->mid);
+	return price;
+}
+
+static void add_live(loadgen *lg, int order_id) {
+	if (lg->live_pos[order_id] == -1) {
+		lg->live_pos[order_id] = lg->num_live;
+		lg->live[lg->num_live++] = order_id;
+	}
+}
+
+static void remove_live(loadgen *lg, int order_id) {
+	int pos = lg->live_pos[order_id];
+	if (pos == -1) {
+		return;
+	}
+	int last = lg->live[--lg->num_live];
+	lg->live[pos] = last;
+	lg->live_pos[last] = pos;
+	lg->live_pos[order_id] = -1;
+}
+
+/*
+ * Desc: Picks the kind of the next order from the mix. AMEND and CANCEL need
+         a resting order and fall back to BUY or SELL without one, as do BUY
+         and SELL once the order IDs run out.
+ * Return: An enum order_kind value, -1 if nothing can be sent.
+ */
+static int pick_kind(loadgen *lg) {
+	long *mix = lg->cfg.mix;
+	long total = mix[KIND_BUY] + mix[KIND_SELL] + mix[KIND_AMEND] + mix[KIND_CANCEL];
+	long pick = uniform(lg, 0, total - 1);
+	int kind = 0;
+	while (pick >= mix[kind]) {
+		pick -= mix[kind++];
+	}
+	int ids_left = lg->next_order_id <= OID_MAX;
+	if ((kind == KIND_AMEND || kind == KIND_CANCEL) && lg->num_live == 0) {
+		kind = uniform(lg, 1, mix[KIND_BUY] + mix[KIND_SELL]) <= mix[KIND_BUY] ? KIND_BUY : KIND_SELL;
+	}
+	if ((kind == KIND_BUY || kind == KIND_SELL) && !ids_left) {
+		return lg->num_live > 0 ? KIND_CANCEL : -1;
+	}
+	return kind;
+}
+
+/*
+ * Desc: Builds and sends the next order, then signals the exchange.
+ * Return: 0 on success, 1 if nothing could be sent.
+ */
+static int send_order(loadgen *lg) {
+	int kind = pick_kind(lg);
+	if (kind == -1) {
+		return 1;
+	}
+	if (lg->sent == lg->capacity) {
+		long capacity = lg->capacity * 2;
+		sent_order *grown = (sent_order*)realloc(lg->orders, capacity * sizeof(sent_order));
+		if (grown == NULL) {
+			return 1;
+		}
+		lg->orders = grown;
+		lg->capacity = capacity;
+	}
+
+	sent_order *o = &lg->orders[lg->sent];
+	memset(o, 0, sizeof(sent_order));
+	o->kind = kind;
+	char msg[BUF_SIZE];
+	int len = 0;
+	if (kind == KIND_BUY || kind == KIND_SELL) {
+		o->order_id = lg->next_order_id++;
+		o->qty = draw_qty(lg);
+		len = snprintf(msg, BUF_SIZE, "%s %d %s %ld %ld;", kind_names[kind], o->order_id,
+			lg->products[uniform(lg, 0, lg->num_products - 1)], o->qty, draw_price(lg));
+	} else if (kind == KIND_AMEND) {
+		o->order_id = lg->live[uniform(lg, 0, lg->num_live - 1)];
+		o->qty = draw_qty(lg);
+		len = snprintf(msg, BUF_SIZE, "AMEND %d %ld %ld;", o->order_id, o->qty, draw_price(lg));
+	} else {
+		o->order_id = lg->live[uniform(lg, 0, lg->num_live - 1)];
+		len = snprintf(msg, BUF_SIZE, "CANCEL %d;", o->order_id);
+		// don't pick it again while the cancel is in flight
+		remove_live(lg, o->order_id);
+	}
+
+	o->send_ns = now_ns();
+	if (write(lg->write_fd, msg, len) != len) {
+		return 1;
+	}
+	kill(getppid(), SIGUSR1);
+	lg->progress_ns = o->send_ns;
+	lg->signal_ns = o->send_ns;
+	lg->sent++;
+	lg->kinds_sent[kind]++;
+	return 0;
+}
+
+/*
+ * Desc: Handles one message from the exchange. ACCEPTED, AMENDED, CANCELLED
+         and INVALID answer the oldest order in flight; FILL updates a
+         resting order; MARKET updates are only counted.
+ * Params: The load generator, the message without its ';' and the time it
+           was read.
+ */
+static void handle_message(loadgen *lg, char *msg, uint64_t recv_ns) {
+	int order_id = -1;
+	long qty = 0;
+	if (strncmp(msg, "MARKET ", 7) == 0) {
+		lg->market++;
+		return;
+	}
+	if (sscanf(msg, "FILL %d %ld", &order_id, &qty) == 2) {
+		lg->fills++;
+		if (order_id >= 0 && order_id <= OID_MAX && lg->remaining[order_id] > 0) {
+			lg->remaining[order_id] -= qty;
+			if (lg->remaining[order_id] <= 0) {
+				lg->remaining[order_id] = 0;
+				remove_live(lg, order_id);
+			}
+		}
+		return;
+	}
+	if (lg->answered == lg->sent) {
+		return; // not an answer to anything we sent
+	}
+
+	sent_order *o = &lg->orders[lg->answered++];
+	o->recv_ns = recv_ns;
+	lg->progress_ns = recv_ns;
+	if (strncmp(msg, "INVALID", 7) == 0) {
+		o->invalid = 1;
+		lg->invalid++;
+		return;
+	}
+	if (o->kind == KIND_BUY || o->kind == KIND_SELL || o->kind == KIND_AMEND) {
+		// an order can be filled before its ACCEPTED is read, FILL comes first
+		if (o->kind == KIND_AMEND || lg->remaining[o->order_id] == 0) {
+			lg->remaining[o->order_id] = o->qty;
+		}
+		add_live(lg, o->order_id);
+	} else {
+		lg->remaining[o->order_id] = 0;
+	}
+}
+
+/*
+ * Desc: Writes the per-order timestamps file.
+ * Return: 0 on success, 1 if the file can't be written.
+ */
+static int write_timestamps(loadgen *lg) {
+	char path[BUF_SIZE];
+	snprintf(path, BUF_SIZE, lg->cfg.timestamps, lg->trader_id);
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		return 1;
+	}
+	fprintf(fp, "kind,order_id,send_ns,recv_ns,invalid\n");
+	for (long i = 0; i < lg->sent; i++) {
+		sent_order *o = &lg->orders[i];
+		fprintf(fp, "%s,%d,%llu,%llu,%d\n", kind_names[o->kind], o->order_id,
+			(unsigned long long)o->send_ns, (unsigned long long)o->recv_ns, o->invalid);
+	}
+	return fclose(fp) != 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Desc: Prints a one-line summary to stderr, stdout is the exchange's log.
+ */
+static void print_summary(loadgen *lg, double elapsed) {
+	uint64_t *latencies = (uint64_t*)malloc((lg->answered > 0 ? lg->answered : 1) * sizeof(uint64_t));
+	long count = 0;
+	for (long i = 0; latencies != NULL && i < lg->answered; i++) {
+		latencies[count++] = lg->orders[i].recv_ns - lg->orders[i].send_ns;
+	}
+	fprintf(stderr, "pex_loadgen T%d: %ld orders (%ld BUY, %ld SELL, %ld AMEND, %ld CANCEL) in %.3f s, %.0f orders/s, "
+		"%ld answered, %ld INVALID, %ld FILL, %ld MARKET, %ld resignalled", lg->trader_id, lg->sent,
+		lg->kinds_sent[KIND_BUY], lg->kinds_sent[KIND_SELL], lg->kinds_sent[KIND_AMEND], lg->kinds_sent[KIND_CANCEL],
+		elapsed, elapsed > 0 ? lg->sent / elapsed : 0, lg->answered, lg->invalid, lg->fills, lg->market,
+		lg->resignals);
+	if (count > 0) {
+		qsort(latencies, count, sizeof(uint64_t), compare_u64);
+		fprintf(stderr, ", response us p50 %.1f p99 %.1f max %.1f", latencies[count / 2] / 1e3,
+			latencies[count * 99 / 100] / 1e3, latencies[count - 1] / 1e3);
+	}
+	fprintf(stderr, "\n");
+	free(latencies);
+}
+
+/*
+ * Desc: Reads what the exchange sent and handles every complete message.
+ * Params: The load generator, its read buffer and the bytes carried over.
+ * Return: 0 on success, 1 once the exchange closed the fifo.
+ */
+static int read_messages(loadgen *lg, char *buf, int *carry) {
+	ssize_t got = read(lg->read_fd, buf + *carry, READ_BUF_SIZE - *carry - 1);
+	if (got == 0) {
+		return 1;
+	} else if (got < 0) {
+		return errno != EAGAIN && errno != EINTR;
+	}
+	uint64_t recv_ns = now_ns();
+	int len = *carry + got;
+	int start = 0;
+	for (int i = 0; i < len; i++) {
+		if (buf[i] == ';') {
+			buf[i] = '\0';
+			handle_message(lg, buf + start, recv_ns);
+			start = i + 1;
+		}
+	}
+	*carry = len - start;
+	memmove(buf, buf + start, *carry);
+	// a message longer than the buffer can't be ours, drop it
+	if (*carry == READ_BUF_SIZE - 1) {
+		*carry = 0;
+	}
+	return 0;
+}
+
+/*
+ * Desc: Opens the trader fifos and waits for MARKET OPEN.
+ * Return: 0 on success, 1 if the fifos can't be opened or the exchange
+           closed them first.
+ */
+static int connect_exchange(loadgen *lg, char *buf) {
+	char path[BUF_SIZE];
+	snprintf(path, BUF_SIZE, FIFO_EXCHANGE, lg->trader_id);
+	lg->read_fd = open(path, O_RDONLY | O_NONBLOCK);
+	snprintf(path, BUF_SIZE, FIFO_TRADER, lg->trader_id);
+	lg->write_fd = open(path, O_WRONLY);
+	if (lg->read_fd == -1 || lg->write_fd == -1) {
+		return 1;
+	}
+
+	int len = 0;
+	while (strstr(buf, "MARKET OPEN;") == NULL) {
+		struct pollfd pfd = {lg->read_fd, POLLIN, 0};
+		poll(&pfd, 1, -1);
+		ssize_t got = read(lg->read_fd, buf + len, READ_BUF_SIZE - len - 1);
+		if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+			return 1;
+		}
+		len += got > 0 ? got : 0;
+		buf[len] = '\0';
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	loadgen lg;
+	memset(&lg, 0, sizeof(loadgen));
+	loadgen_config *cfg = &lg.cfg;
+	cfg->mix[KIND_BUY] = 40;
+	cfg->mix[KIND_SELL] = 40;
+	cfg->mix[KIND_AMEND] = 10;
+	cfg->mix[KIND_CANCEL] = 10;
+	cfg->mid = 100;
+	cfg->spread = 10;
+	cfg->drift = 1;
+	cfg->qty_min = 1;
+	cfg->qty_max = 100;
+	cfg->qty_mean = 10;
+	cfg->product_file = "products.txt";
+	cfg->depth = 1;
+	cfg->max_orders = 1000;
+
+	int id_index = parse_options(cfg, argc, argv);
+	if (id_index < 0) {
+		print_loadgen_usage(argv[0]);
+		return 1;
+	}
+	lg.trader_id = atoi(argv[id_index]);
+	lg.rng = cfg->seed != 0 ? cfg->seed : 0x9E3779B97F4A7C15ull * (lg.trader_id + 1);
+	lg.mid = cfg->mid;
+	if (load_products(&lg)) {
+		fprintf(stderr, "pex_loadgen: can't read products from %s\n", cfg->product_file);
+		return 1;
+	}
+
+	// the exchange signals every message, the fifo is polled instead
+	signal(SIGUSR1, SIG_IGN);
+	lg.capacity = 1024;
+	lg.orders = (sent_order*)malloc(lg.capacity * sizeof(sent_order));
+	lg.remaining = (long*)calloc(OID_MAX + 1, sizeof(long));
+	lg.live = (int*)malloc((OID_MAX + 1) * sizeof(int));
+	lg.live_pos = (int*)malloc((OID_MAX + 1) * sizeof(int));
+	char *buf = (char*)calloc(READ_BUF_SIZE, 1);
+	if (lg.orders == NULL || lg.remaining == NULL || lg.live == NULL || lg.live_pos == NULL || buf == NULL) {
+		return 1;
+	}
+	memset(lg.live_pos, -1, (OID_MAX + 1) * sizeof(int));
+	if (connect_exchange(&lg, buf)) {
+		fprintf(stderr, "pex_loadgen T%d: can't connect to the exchange\n", lg.trader_id);
+		return 1;
+	}
+
+	uint64_t start = now_ns();
+	uint64_t interval = cfg->rate > 0 ? (uint64_t)(1e9 / cfg->rate) : 0;
+	uint64_t next_send = start;
+	uint64_t deadline = cfg->max_seconds > 0 ? start + (uint64_t)(cfg->max_seconds * 1e9) : UINT64_MAX;
+	uint64_t drain_until = 0;
+	int sending = 1;
+	int stalled = 0;
+	int carry = 0;
+	while (1) {
+		uint64_t now = now_ns();
+		if (sending && ((cfg->max_orders > 0 && lg.sent >= cfg->max_orders) || now >= deadline)) {
+			sending = 0;
+		}
+		if (lg.answered < lg.sent && now - lg.progress_ns >= STALL_MS * 1000000ull) {
+			stalled = 1;
+			break;
+		} else if (lg.answered < lg.sent && now - lg.signal_ns >= RESIGNAL_MS * 1000000ull) {
+			// the signal may have been merged with another trader's
+			kill(getppid(), SIGUSR1);
+			lg.signal_ns = now;
+			lg.resignals++;
+		}
+		while (sending && lg.sent - lg.answered < cfg->depth && now >= next_send) {
+			if (send_order(&lg)) {
+				sending = 0;
+				break;
+			}
+			next_send = interval > 0 ? next_send + interval : now;
+			if (cfg->max_orders > 0 && lg.sent >= cfg->max_orders) {
+				sending = 0;
+			}
+		}
+		if (!sending) {
+			// give the last orders a moment to be answered
+			if (drain_until == 0) {
+				drain_until = now + DRAIN_MS * 1000000ull;
+			}
+			if (lg.answered == lg.sent || now >= drain_until) {
+				break;
+			}
+		}
+
+		// sleep until a message arrives, the next send is due or time is up
+		uint64_t wake = !sending ? drain_until : (lg.sent - lg.answered < cfg->depth ? next_send : deadline);
+		if (wake > deadline && sending) {
+			wake = deadline;
+		}
+		if (lg.answered < lg.sent && wake > lg.signal_ns + RESIGNAL_MS * 1000000ull) {
+			wake = lg.signal_ns + RESIGNAL_MS * 1000000ull;
+		}
+		struct timespec timeout = {0, 0};
+		if (wake > now) {
+			uint64_t wait = wake - now;
+			timeout.tv_sec = wait / 1000000000ull;
+			timeout.tv_nsec = wait % 1000000000ull;
+		}
+		struct pollfd pfd = {lg.read_fd, POLLIN, 0};
+		int ready = ppoll(&pfd, 1, wake == UINT64_MAX ? NULL : &timeout, NULL);
+		if (ready > 0 && read_messages(&lg, buf, &carry)) {
+			break; // the exchange closed the fifo
+		}
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	print_summary(&lg, elapsed);
+	int res = 0;
+	if (stalled) {
+		fprintf(stderr, "pex_loadgen T%d: no response for %d ms, %ld orders unanswered%s\n", lg.trader_id,
+			STALL_MS, lg.sent - lg.answered, cfg->depth > 1 ? " (--depth above 1 needs --shards)" : "");
+		res = 1;
+	}
+	if (cfg->timestamps != NULL && write_timestamps(&lg)) {
+		fprintf(stderr, "pex_loadgen T%d: can't write %s\n", lg.trader_id, cfg->timestamps);
+		res = 1;
+	}
+	close(lg.read_fd);
+	close(lg.write_fd);
+	for (int i = 0; i < lg.num_products; i++) {
+		free(lg.products[i]);
+	}
+	free(lg.products);
+	free(lg.orders);
+	free(lg.remaining);
+	free(lg.live);
+	free(lg.live_pos);
+	free(buf);
+	return res;
+}
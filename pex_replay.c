@@ -0,0 +1,322 @@
+/*
+ * Offline replay of a pe_exchange journal.
+ *
+ * Maps a journal written with --journal and drives every record through the
+ * same apply_command path the exchange runs (execute_command, find_matches)
+ * on the shard that applied it, with no traders, fifos or signals. Every
+ * command's events are checked against the digest journaled by the recorded
+ * run, and the replay reports commands and events per second. Segments are
+ * mapped read-only and replayed in place, nothing is copied.
+ *
+ * Usage: pex_replay [--no-format | --print] [--repeat=N] [--json] <journal>
+ */
+
+#include "pe_shard.h"
+#include "pe_journal.h"
+#include <getopt.h>
+#include <time.h>
+
+enum format_mode {
+	FORMAT_NONE = 0, // engine only, events are digested but never formatted
+	FORMAT_MESSAGES, // format every log line and trader message, discard them
+	FORMAT_PRINT // format and print them
+};
+
+enum option_flag {
+	OPT_NO_FORMAT = 256,
+	OPT_PRINT,
+	OPT_REPEAT,
+	OPT_JSON
+};
+
+static struct option long_options[] = {
+	{"no-format", no_argument, NULL, OPT_NO_FORMAT},
+	{"print", no_argument, NULL, OPT_PRINT},
+	{"repeat", required_argument, NULL, OPT_REPEAT},
+	{"json", no_argument, NULL, OPT_JSON},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
+
+/*
+ * Desc: The market a journal was recorded on, rebuilt from its header.
+ * Fields: The products, the books and match cache, and the shards.
+ */
+typedef struct market market;
+struct market {
+    products prods;
+    int num_traders;
+    order **buys;
+    order **sells;
+    long ***matches;
+    int num_shards;
+    shard *shards;
+};
+
+/*
+ * Desc: Totals of one replay.
+ * Fields: Commands and events replayed, bytes formatted, the number of
+           commands whose events differ from the journal and the first one.
+ */
+typedef struct replay_stats replay_stats;
+struct replay_stats {
+    long commands;
+    long events;
+    long formatted_bytes;
+    long mismatched;
+    uint64_t first_mismatch; // seq of the first mismatched record
+};
+
+static void print_replay_usage(char *prog) {
+	printf("Usage: %s [options] <journal>\n", prog);
+	printf("Options:\n");
+	printf("  --no-format  only run the engine, don't format log lines or trader messages\n");
+	printf("  --print      print the log lines and trader messages of the replay\n");
+	printf("  --repeat=N   replay the journal N times on fresh books (default 1)\n");
+	printf("  --json       print the results as one line of JSON\n");
+}
+
+/*
+ * Desc: Sets up empty books and shards for the market described by a
+         journal header. Events go to each shard's batch.
+ * Return: 0 on success, 1 if memory could not be allocated.
+ */
+static int init_market(market *m, journal_header *header, char *names) {
+	memset(m, 0, sizeof(market));
+	m->num_traders = header->num_traders;
+	m->num_shards = header->num_shards;
+	m->prods.product_strings = (char**)pe_calloc(MEM_PRODUCTS, header->num_products, sizeof(char*));
+	if (m->prods.product_strings == NULL) {
+		return 1;
+	}
+	for (int i = 0; i < header->num_products; i++) {
+		m->prods.product_strings[i] = (char*)pe_malloc(MEM_PRODUCTS, PRODUCT_STR_LEN);
+		if (m->prods.product_strings[i] == NULL) {
+			return 1;
+		}
+		snprintf(m->prods.product_strings[i], PRODUCT_STR_LEN, "%.*s", PRODUCT_STR_LEN - 1, names + i * PRODUCT_STR_LEN);
+		m->prods.size++;
+	}
+
+	m->buys = (order**)pe_calloc(MEM_PRODUCTS, m->prods.size, sizeof(order*));
+	m->sells = (order**)pe_calloc(MEM_PRODUCTS, m->prods.size, sizeof(order*));
+	init_matches(&m->matches, m->num_traders, m->prods.size);
+	m->shards = (shard*)calloc(m->num_shards, sizeof(shard));
+	if (m->buys == NULL || m->sells == NULL || m->matches == NULL || m->shards == NULL) {
+		return 1;
+	}
+	for (int i = 0; i < m->num_shards; i++) {
+		init_shard(&m->shards[i], i, m->buys, m->sells, m->matches,
+			(event_sink){collect_event, &m->shards[i].batch});
+	}
+	return 0;
+}
+
+static void free_market(market *m) {
+	free_order_list(m->buys, &m->prods);
+	free_order_list(m->sells, &m->prods);
+	free_matches(m->matches, m->num_traders, m->prods.size);
+	if (m->shards != NULL) {
+		for (int i = 0; i < m->num_shards; i++) {
+			pthread_mutex_destroy(&m->shards[i].lock);
+			pe_free(m->shards[i].batch.events);
+		}
+		free(m->shards);
+	}
+	free_products_list(&m->prods);
+}
+
+/*
+ * Desc: Formats what the exchange would have logged and sent for an event:
+         the Match line, or the owner's message plus the MARKET update the
+         other traders get.
+ * Return: The number of bytes formatted.
+ */
+static long format_output(market *m, event *ev, int mode) {
+	char msg[BUF_SIZE];
+	long total = format_event(msg, ev, 1, &m->prods);
+	if (mode == FORMAT_PRINT) {
+		if (ev->type == EVENT_MATCH) {
+			fputs(msg, stdout);
+		} else {
+			printf("T%d %s\n", ev->trader_id, msg);
+		}
+	}
+	if (ev->type == EVENT_ACCEPTED || ev->type == EVENT_AMENDED || ev->type == EVENT_CANCELLED) {
+		total += format_event(msg, ev, 0, &m->prods);
+		if (mode == FORMAT_PRINT) {
+			printf("* %s\n", msg);
+		}
+	}
+	return total;
+}
+
+/*
+ * Desc: Replays the records on the market's books.
+ * Params: The market, the records and their count, the format mode and the
+           stats to add to.
+ */
+static void replay(market *m, journal_record *records, long count, int mode, replay_stats *stats) {
+	for (long i = 0; i < count; i++) {
+		journal_record *rec = &records[i];
+		if (rec->shard_id < 0 || rec->shard_id >= m->num_shards) {
+			stats->mismatched++;
+			continue;
+		}
+		shard *s = &m->shards[rec->shard_id];
+		apply_command(s, &rec->cmd);
+
+		if (digest_events(&s->batch) != rec->digest) {
+			if (stats->mismatched == 0) {
+				stats->first_mismatch = rec->seq;
+			}
+			stats->mismatched++;
+		}
+		if (mode != FORMAT_NONE) {
+			for (int j = 0; j < s->batch.len; j++) {
+				stats->formatted_bytes += format_output(m, &s->batch.events[j], mode);
+			}
+		}
+		stats->commands++;
+		stats->events += s->batch.len;
+		s->batch.len = 0;
+	}
+}
+
+/*
+ * Desc: Maps the segments of a journal, up to where its valid records end.
+ * Params: The journal path, and where to store the malloc'd segments, the
+           number of valid records in each and the number of segments.
+ * Return: 0 on success, 1 if the first segment can't be mapped.
+ */
+static int map_journal(char *path, journal_segment **segments, long **counts, int *num_segments) {
+	uint64_t next_seq = 1;
+	while (1) {
+		journal_segment seg;
+		if (journal_map_segment(path, *num_segments, 0, &seg)) {
+			return *num_segments == 0;
+		}
+		journal_segment *grown = (journal_segment*)realloc(*segments, (*num_segments + 1) * sizeof(journal_segment));
+		long *grown_counts = (long*)realloc(*counts, (*num_segments + 1) * sizeof(long));
+		if (grown != NULL) {
+			*segments = grown;
+		}
+		if (grown_counts != NULL) {
+			*counts = grown_counts;
+		}
+		if (grown == NULL || grown_counts == NULL) {
+			journal_unmap_segment(&seg);
+			return 1;
+		}
+		long count = journal_valid_records(&seg, next_seq);
+		(*segments)[*num_segments] = seg;
+		(*counts)[*num_segments] = count;
+		(*num_segments)++;
+		next_seq += count;
+		// the valid records end before the end of a segment
+		if (count < seg.capacity) {
+			return 0;
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	CYCLES_THREAD("replay", -1);
+	int mode = FORMAT_MESSAGES;
+	long repeat = 1;
+	int json = 0;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_NO_FORMAT:
+			mode = FORMAT_NONE;
+			break;
+		case OPT_PRINT:
+			mode = FORMAT_PRINT;
+			break;
+		case OPT_REPEAT:
+			repeat = strtol(optarg, NULL, 10);
+			if (repeat < 1) {
+				print_replay_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case OPT_JSON:
+			json = 1;
+			break;
+		default:
+			print_replay_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		print_replay_usage(argv[0]);
+		return 1;
+	}
+
+	journal_segment *segments = NULL;
+	long *counts = NULL;
+	int num_segments = 0;
+	if (map_journal(argv[optind], &segments, &counts, &num_segments)) {
+		printf("Error reading journal %s.\n", argv[optind]);
+		return 1;
+	}
+	journal_header header = *segments[0].header;
+
+	replay_stats stats;
+	memset(&stats, 0, sizeof(replay_stats));
+	double elapsed = 0;
+	int res = 0;
+	for (long run = 0; run < repeat && !res; run++) {
+		market m;
+		res = init_market(&m, &header, segments[0].names);
+		if (!res) {
+			// only the replay itself is timed, not building the books
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (int i = 0; i < num_segments; i++) {
+				replay(&m, segments[i].records, counts[i], mode, &stats);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			elapsed += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		}
+		free_market(&m);
+	}
+	for (int i = 0; i < num_segments; i++) {
+		journal_unmap_segment(&segments[i]);
+	}
+	free(segments);
+	free(counts);
+	if (res) {
+		printf("Error setting up the market.\n");
+		return 1;
+	}
+
+	if (json) {
+		// the same numbers, for scripts comparing runs
+		static const char *mode_names[] = {"no-format", "format", "print"};
+		printf("{\"bench\":\"replay\",\"mode\":\"%s\",\"repeat\":%ld,\"commands\":%ld,\"events\":%ld,"
+			"\"seconds\":%.6f,\"commands_per_sec\":%.0f,\"events_per_sec\":%.0f,\"mismatched\":%ld}\n",
+			mode_names[mode], repeat, stats.commands, stats.events, elapsed,
+			elapsed > 0 ? stats.commands / elapsed : 0, elapsed > 0 ? stats.events / elapsed : 0, stats.mismatched);
+		CYCLES_SUMMARY();
+		return stats.mismatched > 0;
+	}
+	printf("pex_replay: %ld commands, %ld events, %d products, %d traders, %d shards\n",
+		stats.commands, stats.events, header.num_products, header.num_traders, header.num_shards);
+	printf("pex_replay: %.6f s, %.0f commands/s, %.0f events/s", elapsed,
+		elapsed > 0 ? stats.commands / elapsed : 0, elapsed > 0 ? stats.events / elapsed : 0);
+	if (mode != FORMAT_NONE) {
+		printf(", %ld bytes formatted", stats.formatted_bytes);
+	}
+	printf("\n");
+	CYCLES_SUMMARY();
+
+	if (stats.mismatched > 0) {
+		printf("pex_replay: %ld commands produced different events than recorded, first at record %llu\n",
+			stats.mismatched, (unsigned long long)stats.first_mismatch);
+		return 1;
+	}
+	printf("pex_replay: all events match the recorded run\n");
+	return 0;
+}
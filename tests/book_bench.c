@@ -0,0 +1,484 @@
+/*
+ * Microbenchmark for the order book operations.
+ *
+ * Builds a book of a given depth on one product and times the operations the
+ * engine runs on it, one at a time:
+ *   insert   execute_command placing a BUY or SELL that doesn't cross
+ *   cancel   execute_command cancelling a resting order
+ *   amend    execute_command moving a resting order to a new price
+ *   match    execute_command and find_matches for an order that crosses
+ *   display  display_orderbook, written to /dev/null
+ * Every operation is undone outside the timed region so the depth stays the
+ * same while it is measured. Depths go from 10 to 1,000,000 resting orders,
+ * half on each side, with two price distributions:
+ *   random       prices spread over 1000 levels a side, random orders targeted
+ *   adversarial  one level a side, the newest order targeted, so every insert,
+ *                cancel and amend walks the whole list
+ * Allocations are counted by wrapping malloc, calloc and realloc at link time.
+ * Every result is printed as one JSON object per line.
+ *
+ * Usage: book_bench [max depth]
+ */
+
+#include "../pe_engine.h"
+#include <stdint.h>
+#include <time.h>
+
+#define MIN_DEPTH 10
+#define DEFAULT_MAX_DEPTH 1000000
+#define WORK_BUDGET 20000000 // samples * depth per operation, bounds the run time
+#define MIN_SAMPLES 50
+#define MAX_SAMPLES 20000
+#define DISPLAY_BUDGET 2000000 // display prints every order, it gets a smaller budget
+#define MIN_DISPLAY_SAMPLES 3
+#define MID_PRICE 500000
+#define PRICE_LEVELS 1000 // levels a side for the random distribution
+#define MAX_QTY 100
+#define SWEEP_ORDERS 8 // a random crossing order fills up to this many orders
+#define ADVERSARIAL_SWEEP 64 // an adversarial one fills exactly this many
+
+enum distribution {
+	DIST_RANDOM = 0,
+	DIST_ADVERSARIAL,
+	NUM_DISTS
+};
+
+static char *dist_names[NUM_DISTS] = {"random", "adversarial"};
+
+enum book_op {
+	OP_INSERT = 0,
+	OP_CANCEL,
+	OP_AMEND,
+	OP_MATCH,
+	OP_DISPLAY,
+	NUM_OPS
+};
+
+static char *op_names[NUM_OPS] = {"insert", "cancel", "amend", "match", "display"};
+
+// allocation counters, only the wrappers below touch them
+static long alloc_count = 0;
+static long alloc_bytes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	alloc_count++;
+	alloc_bytes += size;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size) {
+	alloc_count++;
+	alloc_bytes += num * size;
+	return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	alloc_count++;
+	alloc_bytes += size;
+	return __real_realloc(ptr, size);
+}
+
+/*
+ * Desc: A book of one product and the resting orders it holds.
+ * Fields: The shard and its lists, the order IDs resting in each slot (the
+           first half are buys, the rest sells) with their prices, the slot
+           of every order ID, the newest sell and the next order ID to use.
+ */
+typedef struct bench_book bench_book;
+struct bench_book {
+    int dist;
+    long depth;
+    shard s;
+    order **buys;
+    order **sells;
+    long ***matches;
+    int *slot_ids;
+    long *slot_prices;
+    long *slot_of; // per order ID
+    long slot_of_cap;
+    long newest_sell; // slot of the sell placed last, the tail of an adversarial book
+    int next_id;
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_rand(void) {
+	// xorshift64*, deterministic so runs are comparable
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static long rand_range(long lo, long hi) {
+	return lo + (long)(next_rand() % (uint64_t)(hi - lo + 1));
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static long draw_price(bench_book *b, int side) {
+	if (b->dist == DIST_ADVERSARIAL) {
+		return side == BUY ? MID_PRICE - 1 : MID_PRICE + 1;
+	}
+	return side == BUY ? rand_range(MID_PRICE - PRICE_LEVELS, MID_PRICE - 1)
+		: rand_range(MID_PRICE + 1, MID_PRICE + PRICE_LEVELS);
+}
+
+static long draw_qty(bench_book *b) {
+	return b->dist == DIST_ADVERSARIAL ? 1 : rand_range(1, MAX_QTY);
+}
+
+/*
+ * Desc: Records which slot an order ID rests in, growing the index as IDs
+         are used up.
+ */
+static void set_slot(bench_book *b, int order_id, long slot) {
+	if (order_id >= b->slot_of_cap) {
+		long cap = b->slot_of_cap;
+		while (order_id >= cap) {
+			cap *= 2;
+		}
+		b->slot_of = (long*)realloc(b->slot_of, cap * sizeof(long));
+		b->slot_of_cap = cap;
+	}
+	b->slot_of[order_id] = slot;
+	b->slot_ids[slot] = order_id;
+}
+
+static int slot_side(bench_book *b, long slot) {
+	return slot < b->depth / 2 ? BUY : SELL;
+}
+
+/*
+ * Desc: Runs a command through the engine without matching. Buys belong to
+         trader 0 and sells to trader 1.
+ */
+static void run_command(bench_book *b, int type, int side, int order_id, long qty, long price) {
+	command cmd;
+	memset(&cmd, 0, sizeof(command));
+	cmd.type = type;
+	cmd.order_id = order_id;
+	cmd.quantity = qty;
+	cmd.price = price;
+	cmd.trader_id = side == BUY ? 0 : 1;
+	cmd.product_index = 0;
+	execute_command(&b->s, &cmd);
+	b->s.batch.len = 0;
+}
+
+/*
+ * Desc: Places a resting order into a slot, replacing the order there.
+ */
+static void place(bench_book *b, long slot, long qty, long price) {
+	int side = slot_side(b, slot);
+	int order_id = b->next_id++;
+	run_command(b, side, side, order_id, qty, price);
+	set_slot(b, order_id, slot);
+	b->slot_prices[slot] = price;
+	if (side == SELL) {
+		b->newest_sell = slot;
+	}
+}
+
+static int compare_sells(const void *a, const void *b) {
+	order *x = *(order**)a;
+	order *y = *(order**)b;
+	if (x->price != y->price) {
+		return x->price < y->price ? -1 : 1;
+	}
+	return x->global_order_num - y->global_order_num;
+}
+
+static int compare_buys(const void *a, const void *b) {
+	order *x = *(order**)a;
+	order *y = *(order**)b;
+	if (x->price != y->price) {
+		return x->price > y->price ? -1 : 1;
+	}
+	return x->global_order_num - y->global_order_num;
+}
+
+/*
+ * Desc: Links the orders of one side into a price sorted list, in the order
+         insert_order keeps them. Orders were allocated in arrival order, so a
+         random book is scattered in memory the way a real one is.
+ */
+static void link_side(order **list, order **sorted, long count, int side) {
+	qsort(sorted, count, sizeof(order*), side == BUY ? compare_buys : compare_sells);
+	*list = NULL;
+	for (long i = count - 1; i >= 0; i--) {
+		sorted[i]->next = *list;
+		*list = sorted[i];
+	}
+}
+
+/*
+ * Desc: Builds a book of depth resting orders directly, inserting them one
+         by one through the engine would take quadratic time.
+ * Return: 0 on success, 1 if memory could not be allocated.
+ */
+static int build_book(bench_book *b, int dist, long depth) {
+	memset(b, 0, sizeof(bench_book));
+	b->dist = dist;
+	b->depth = depth;
+	b->buys = (order**)pe_calloc(MEM_PRODUCTS, 1, sizeof(order*));
+	b->sells = (order**)pe_calloc(MEM_PRODUCTS, 1, sizeof(order*));
+	init_matches(&b->matches, 2, 1);
+	init_shard(&b->s, 0, b->buys, b->sells, b->matches, (event_sink){collect_event, &b->s.batch});
+	b->slot_ids = (int*)malloc(depth * sizeof(int));
+	b->slot_prices = (long*)malloc(depth * sizeof(long));
+	b->slot_of_cap = depth * 2;
+	b->slot_of = (long*)malloc(b->slot_of_cap * sizeof(long));
+	order **sorted = (order**)malloc(depth * sizeof(order*));
+	if (b->buys == NULL || b->sells == NULL || b->slot_ids == NULL || b->slot_prices == NULL
+			|| b->slot_of == NULL || sorted == NULL) {
+		free(sorted);
+		return 1;
+	}
+
+	for (long slot = 0; slot < depth; slot++) {
+		order *o = (order*)pe_malloc(MEM_ORDERS, sizeof(order));
+		int side = slot_side(b, slot);
+		o->order_id = b->next_id++;
+		o->trader_id = side == BUY ? 0 : 1;
+		o->global_order_num = ++b->s.total_order_num;
+		o->product = NULL;
+		o->product_index = 0;
+		o->quantity = draw_qty(b);
+		o->price = draw_price(b, side);
+		o->next = NULL;
+		sorted[slot] = o;
+		set_slot(b, o->order_id, slot);
+		b->slot_prices[slot] = o->price;
+	}
+	b->newest_sell = depth - 1;
+	link_side(&b->buys[0], sorted, depth / 2, BUY);
+	link_side(&b->sells[0], sorted + depth / 2, depth - depth / 2, SELL);
+	free(sorted);
+	return 0;
+}
+
+static void free_book(bench_book *b) {
+	products prods = {1, NULL};
+	free_order_list(b->buys, &prods);
+	free_order_list(b->sells, &prods);
+	free_matches(b->matches, 2, 1);
+	pthread_mutex_destroy(&b->s.lock);
+	pe_free(b->s.batch.events);
+	free(b->slot_ids);
+	free(b->slot_prices);
+	free(b->slot_of);
+}
+
+/*
+ * Desc: Picks the order an operation targets: a random one, or for the
+         adversarial book the newest sell, which is last in the sell list and
+         only found after searching every buy.
+ */
+static long pick_slot(bench_book *b) {
+	if (b->dist == DIST_ADVERSARIAL) {
+		return b->newest_sell;
+	}
+	return rand_range(0, b->depth - 1);
+}
+
+/*
+ * Desc: Runs one sample of an operation.
+ * Return: The time the operation itself took in ns.
+ */
+static uint64_t run_op(bench_book *b, int op, long *allocs, long *bytes) {
+	uint64_t start = 0;
+	uint64_t elapsed = 0;
+	long allocs_before = 0;
+	long bytes_before = 0;
+
+	if (op == OP_INSERT) {
+		int side = b->dist == DIST_ADVERSARIAL || next_rand() & 1 ? BUY : SELL;
+		int order_id = b->next_id++;
+		long qty = draw_qty(b);
+		long price = draw_price(b, side);
+		allocs_before = alloc_count;
+		bytes_before = alloc_bytes;
+		start = now_ns();
+		run_command(b, side, side, order_id, qty, price);
+		elapsed = now_ns() - start;
+		*allocs += alloc_count - allocs_before;
+		*bytes += alloc_bytes - bytes_before;
+		run_command(b, CANCEL, side, order_id, 0, 0);
+		return elapsed;
+	}
+
+	if (op == OP_CANCEL) {
+		long slot = pick_slot(b);
+		allocs_before = alloc_count;
+		bytes_before = alloc_bytes;
+		start = now_ns();
+		run_command(b, CANCEL, slot_side(b, slot), b->slot_ids[slot], 0, 0);
+		elapsed = now_ns() - start;
+		*allocs += alloc_count - allocs_before;
+		*bytes += alloc_bytes - bytes_before;
+		place(b, slot, draw_qty(b), b->slot_prices[slot]);
+		return elapsed;
+	}
+
+	if (op == OP_AMEND) {
+		long slot = pick_slot(b);
+		long price = draw_price(b, slot_side(b, slot));
+		long qty = draw_qty(b);
+		allocs_before = alloc_count;
+		bytes_before = alloc_bytes;
+		start = now_ns();
+		run_command(b, AMEND, slot_side(b, slot), b->slot_ids[slot], qty, price);
+		elapsed = now_ns() - start;
+		*allocs += alloc_count - allocs_before;
+		*bytes += alloc_bytes - bytes_before;
+		b->slot_prices[slot] = price;
+		return elapsed;
+	}
+
+	if (op == OP_MATCH) {
+		// a buy that fills the first few sells exactly
+		long sells = b->depth - b->depth / 2;
+		long sweep = b->dist == DIST_ADVERSARIAL ? ADVERSARIAL_SWEEP : rand_range(1, SWEEP_ORDERS);
+		sweep = sweep < sells ? sweep : sells;
+		long slots[ADVERSARIAL_SWEEP];
+		long qtys[ADVERSARIAL_SWEEP];
+		long total = 0;
+		long price = 0;
+		order *curr = b->sells[0];
+		for (long i = 0; i < sweep; i++) {
+			slots[i] = b->slot_of[curr->order_id];
+			qtys[i] = curr->quantity;
+			total += curr->quantity;
+			price = curr->price;
+			curr = curr->next;
+		}
+		command cmd;
+		memset(&cmd, 0, sizeof(command));
+		cmd.type = BUY;
+		cmd.order_id = b->next_id++;
+		cmd.quantity = total;
+		cmd.price = price;
+		cmd.trader_id = 0;
+		cmd.product_index = 0;
+		allocs_before = alloc_count;
+		bytes_before = alloc_bytes;
+		start = now_ns();
+		if (execute_command(&b->s, &cmd) == 0) {
+			find_matches(&b->s, 0);
+		}
+		elapsed = now_ns() - start;
+		*allocs += alloc_count - allocs_before;
+		*bytes += alloc_bytes - bytes_before;
+		b->s.batch.len = 0;
+		// put the filled sells back
+		for (long i = 0; i < sweep; i++) {
+			place(b, slots[i], qtys[i], b->slot_prices[slots[i]]);
+		}
+		return elapsed;
+	}
+
+	products prods;
+	char *names[] = {"GPU"};
+	prods.size = 1;
+	prods.product_strings = names;
+	allocs_before = alloc_count;
+	bytes_before = alloc_bytes;
+	start = now_ns();
+	display_orderbook(&prods, b->buys, b->sells);
+	fflush(stdout);
+	elapsed = now_ns() - start;
+	*allocs += alloc_count - allocs_before;
+	*bytes += alloc_bytes - bytes_before;
+	return elapsed;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Desc: Times an operation on a book and prints its result line.
+ * Params: The book, the operation and a buffer for the samples.
+ */
+static void bench_op(bench_book *b, int op, uint64_t *samples) {
+	long budget = op == OP_DISPLAY ? DISPLAY_BUDGET : WORK_BUDGET;
+	long min_samples = op == OP_DISPLAY ? MIN_DISPLAY_SAMPLES : MIN_SAMPLES;
+	long num_samples = budget / b->depth;
+	num_samples = num_samples < min_samples ? min_samples : num_samples;
+	num_samples = num_samples > MAX_SAMPLES ? MAX_SAMPLES : num_samples;
+
+	// display output goes to /dev/null, the result lines stay on stdout
+	int saved_stdout = -1;
+	if (op == OP_DISPLAY) {
+		fflush(stdout);
+		saved_stdout = dup(STDOUT_FILENO);
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		close(null_fd);
+	}
+	long allocs = 0;
+	long bytes = 0;
+	uint64_t total = 0;
+	for (long i = 0; i < num_samples; i++) {
+		samples[i] = run_op(b, op, &allocs, &bytes);
+		total += samples[i];
+	}
+	if (op == OP_DISPLAY) {
+		fflush(stdout);
+		dup2(saved_stdout, STDOUT_FILENO);
+		close(saved_stdout);
+	}
+
+	qsort(samples, num_samples, sizeof(uint64_t), compare_u64);
+	printf("{\"bench\":\"book\",\"op\":\"%s\",\"dist\":\"%s\",\"depth\":%ld,\"samples\":%ld,"
+		"\"mean_ns\":%.1f,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu,"
+		"\"allocs_per_op\":%.2f,\"bytes_per_op\":%.1f}\n", op_names[op], dist_names[b->dist], b->depth,
+		num_samples, (double)total / num_samples, (unsigned long long)samples[num_samples / 2],
+		(unsigned long long)samples[num_samples * 9 / 10], (unsigned long long)samples[num_samples * 99 / 100],
+		(unsigned long long)samples[num_samples - 1], (double)allocs / num_samples, (double)bytes / num_samples);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	long max_depth = DEFAULT_MAX_DEPTH;
+	if (argc > 1) {
+		max_depth = atol(argv[1]);
+		if (max_depth < MIN_DEPTH) {
+			printf("Usage: %s [max depth, at least %d]\n", argv[0], MIN_DEPTH);
+			return 1;
+		}
+	}
+
+	uint64_t *samples = (uint64_t*)malloc(MAX_SAMPLES * sizeof(uint64_t));
+	if (samples == NULL) {
+		return 1;
+	}
+	for (long depth = MIN_DEPTH; depth <= max_depth; depth *= 10) {
+		for (int dist = 0; dist < NUM_DISTS; dist++) {
+			bench_book b;
+			if (build_book(&b, dist, depth)) {
+				printf("Error building a book of depth %ld.\n", depth);
+				free_book(&b);
+				free(samples);
+				return 1;
+			}
+			for (int op = 0; op < NUM_OPS; op++) {
+				bench_op(&b, op, samples);
+			}
+			free_book(&b);
+		}
+	}
+	free(samples);
+	return 0;
+}
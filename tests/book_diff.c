@@ -0,0 +1,655 @@
+/*
+ * Differential test of the order book.
+ *
+ * Applies random command streams to the engine, execute_command then
+ * find_matches as a shard does, and to a reference model written to be
+ * obviously correct rather than fast: every resting order sits in one flat
+ * array and the best buy and sell are found by scanning it. After every command the two must
+ * agree on:
+ *   events   ACCEPTED / AMENDED / CANCELLED / INVALID, every Match and FILL
+ *   books    the resting orders of every product, in price-time order
+ *   ledger   every trader's quantity and money on every product
+ *   fees     the total fees collected
+ * The semantics pinned down this way: orders at a price are filled oldest
+ * first, an AMEND loses its time priority, a trade happens at the older
+ * order's price and the newer order pays the 1% fee, rounded half up.
+ *
+ * A failing stream is minimized before it is printed: it is cut after the
+ * first command that differs, then chunks of commands are removed for as long
+ * as it still fails. Any subsequence of a stream is a valid stream (order IDs
+ * stay unique, AMEND / CANCEL of a removed order is simply INVALID), so no
+ * repair is needed.
+ *
+ * Usage: book_diff [streams] [first seed]
+ * Built against libcmocka; only its header is vendored in tests/.
+ */
+
+#include "../pe_engine.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include "cmocka.h"
+
+#define MAX_TRADERS 4
+#define MAX_PRODUCTS 3
+#define MAX_STEPS 400 // commands per stream
+#define MAX_REF_EVENTS (3 * MAX_STEPS + 1) // a command fills at most every resting order
+#define DEFAULT_STREAMS 300
+#define BASE_PRICE 100
+#define MAX_PRICE_LEVELS 8 // few levels a side, so most orders cross or queue behind others
+#define MAX_QTY 20
+
+enum ref_mutation {
+	REF_EXACT = 0, // the reference as specified
+	REF_NEWER_PRICE, // trades at the newer order's price, used to test the harness
+};
+
+/*
+ * Desc: A generated command stream and the market it runs on.
+ * Fields: The seed it was generated from, the number of traders and
+           products, the price levels a side and the commands.
+ */
+typedef struct stream stream;
+struct stream {
+    uint64_t seed;
+    int num_traders;
+    int num_products;
+    int price_levels;
+    command cmds[MAX_STEPS];
+    int len;
+};
+
+/*
+ * Desc: A resting order of the reference model.
+ * Fields: The owner and order ID, the side and product, what is left of it,
+           its price and its time priority (lower is older).
+ */
+typedef struct ref_order ref_order;
+struct ref_order {
+    int trader_id;
+    int order_id;
+    int side;
+    int product_index;
+    long quantity;
+    long price;
+    int seq;
+};
+
+/*
+ * Desc: The reference model: every resting order, the ledger, the fees and
+         the events of the last command.
+ */
+typedef struct reference reference;
+struct reference {
+    ref_order orders[MAX_STEPS];
+    int len;
+    int seq;
+    long position[MAX_TRADERS][MAX_PRODUCTS][2]; // quantity, money
+    long fees;
+    event events[MAX_REF_EVENTS];
+    int num_events;
+    int mutation;
+};
+
+/*
+ * Desc: The engine under test, set up the way one shard of the exchange is.
+ */
+typedef struct engine engine;
+struct engine {
+    order **buys;
+    order **sells;
+    long ***matches;
+    shard s;
+};
+
+static long num_streams = DEFAULT_STREAMS;
+static uint64_t first_seed = 1;
+
+static uint64_t next_random(uint64_t *state) {
+	// xorshift64*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+static long draw(uint64_t *state, long n) {
+	return (long)(next_random(state) % (uint64_t)n);
+}
+
+/*
+ * Desc: Generates a stream of valid commands: BUY and SELL with each
+         trader's next order ID, AMEND and CANCEL of an order the trader
+         placed earlier (possibly filled or cancelled since).
+ */
+static void generate_stream(stream *st, uint64_t seed) {
+	uint64_t rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+	memset(st, 0, sizeof(stream));
+	st->seed = seed;
+	st->num_traders = 1 + draw(&rng, MAX_TRADERS);
+	st->num_products = 1 + draw(&rng, MAX_PRODUCTS);
+	st->price_levels = 1 + draw(&rng, MAX_PRICE_LEVELS);
+	int placed[MAX_TRADERS] = {0};
+	int product_of[MAX_TRADERS][MAX_STEPS];
+
+	for (int i = 0; i < MAX_STEPS; i++) {
+		command *cmd = &st->cmds[i];
+		int t = draw(&rng, st->num_traders);
+		long roll = draw(&rng, 100);
+		cmd->trader_id = t;
+		cmd->quantity = 1 + draw(&rng, roll < 10 ? 5 * MAX_QTY : MAX_QTY);
+		cmd->price = BASE_PRICE + draw(&rng, 2 * st->price_levels) - st->price_levels;
+		if (placed[t] == 0 || roll < 55) {
+			cmd->type = draw(&rng, 2) == 0 ? BUY : SELL;
+			cmd->order_id = placed[t];
+			cmd->product_index = draw(&rng, st->num_products);
+			snprintf(cmd->product, PRODUCT_STR_LEN, "P%d", cmd->product_index);
+			product_of[t][placed[t]++] = cmd->product_index;
+		} else {
+			// mostly recent orders, they are the ones still resting
+			int back = draw(&rng, placed[t] < 8 ? placed[t] : 8);
+			cmd->type = roll < 80 ? AMEND : CANCEL;
+			cmd->order_id = placed[t] - 1 - back;
+			cmd->product_index = product_of[t][cmd->order_id];
+			if (cmd->type == CANCEL) {
+				cmd->quantity = 0;
+				cmd->price = 0;
+			}
+		}
+	}
+	st->len = MAX_STEPS;
+}
+
+static void ref_emit(reference *r, event *ev) {
+	if (r->num_events < MAX_REF_EVENTS) {
+		r->events[r->num_events++] = *ev;
+	}
+}
+
+/*
+ * Desc: Finds the best order on one side of a product: highest buy or
+         lowest sell, the oldest among equal prices.
+ * Return: Its index in the order array, -1 if the side is empty.
+ */
+static int ref_best(reference *r, int product_index, int side) {
+	int best = -1;
+	for (int i = 0; i < r->len; i++) {
+		ref_order *o = &r->orders[i];
+		if (o->product_index != product_index || o->side != side) {
+			continue;
+		}
+		if (best == -1) {
+			best = i;
+			continue;
+		}
+		ref_order *b = &r->orders[best];
+		int better = side == BUY ? o->price > b->price : o->price < b->price;
+		if (better || (o->price == b->price && o->seq < b->seq)) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+static void ref_remove(reference *r, int i) {
+	r->orders[i] = r->orders[--r->len];
+}
+
+static void ref_match(reference *r, int product_index) {
+	while (1) {
+		int b = ref_best(r, product_index, BUY);
+		int s = ref_best(r, product_index, SELL);
+		if (b == -1 || s == -1 || r->orders[b].price < r->orders[s].price) {
+			return;
+		}
+		ref_order *buy = &r->orders[b];
+		ref_order *sell = &r->orders[s];
+		ref_order *newer = buy->seq > sell->seq ? buy : sell;
+		ref_order *older = newer == buy ? sell : buy;
+		long traded = buy->quantity < sell->quantity ? buy->quantity : sell->quantity;
+		long price = r->mutation == REF_NEWER_PRICE ? newer->price : older->price;
+		long value = price * traded;
+		long fee = (value + 50) / 100; // 1%, half up
+
+		r->position[buy->trader_id][product_index][0] += traded;
+		r->position[buy->trader_id][product_index][1] -= value;
+		r->position[sell->trader_id][product_index][0] -= traded;
+		r->position[sell->trader_id][product_index][1] += value;
+		r->position[newer->trader_id][product_index][1] -= fee;
+		r->fees += fee;
+
+		event ev;
+		memset(&ev, 0, sizeof(event));
+		ev.type = EVENT_MATCH;
+		ev.trader_id = newer->trader_id;
+		ev.order_id = newer->order_id;
+		ev.side = newer->side;
+		ev.product_index = product_index;
+		ev.quantity = traded;
+		ev.price = value;
+		ev.resting_trader_id = older->trader_id;
+		ev.resting_order_id = older->order_id;
+		ev.fee = fee;
+		ref_emit(r, &ev);
+		// the fills carry the match's other fields, the journal digests them
+		ev.type = EVENT_FILL;
+		ev.trader_id = buy->trader_id;
+		ev.order_id = buy->order_id;
+		ref_emit(r, &ev);
+		ev.trader_id = sell->trader_id;
+		ev.order_id = sell->order_id;
+		ref_emit(r, &ev);
+
+		buy->quantity -= traded;
+		sell->quantity -= traded;
+		// remove the higher index first so the other stays where it is
+		int first = b > s ? b : s;
+		int second = b > s ? s : b;
+		if (r->orders[first].quantity == 0) {
+			ref_remove(r, first);
+		}
+		if (r->orders[second].quantity == 0) {
+			ref_remove(r, second);
+		}
+	}
+}
+
+static void ref_apply(reference *r, command *cmd) {
+	event ev;
+	memset(&ev, 0, sizeof(event));
+	ev.trader_id = cmd->trader_id;
+	ev.order_id = cmd->order_id;
+	ev.product_index = cmd->product_index;
+	r->num_events = 0;
+
+	if (cmd->type == BUY || cmd->type == SELL) {
+		ref_order *o = &r->orders[r->len++];
+		o->trader_id = cmd->trader_id;
+		o->order_id = cmd->order_id;
+		o->side = cmd->type;
+		o->product_index = cmd->product_index;
+		o->quantity = cmd->quantity;
+		o->price = cmd->price;
+		o->seq = ++r->seq;
+		ev.type = EVENT_ACCEPTED;
+		ev.side = cmd->type;
+		ev.quantity = cmd->quantity;
+		ev.price = cmd->price;
+		ref_emit(r, &ev);
+		ref_match(r, cmd->product_index);
+		return;
+	}
+
+	int found = -1;
+	for (int i = 0; i < r->len; i++) {
+		ref_order *o = &r->orders[i];
+		if (o->trader_id == cmd->trader_id && o->order_id == cmd->order_id
+				&& o->product_index == cmd->product_index) {
+			found = i;
+		}
+	}
+	if (found == -1) {
+		ev.type = EVENT_INVALID;
+		ref_emit(r, &ev);
+		return;
+	}
+	ev.side = r->orders[found].side;
+	if (cmd->type == AMEND) {
+		r->orders[found].quantity = cmd->quantity;
+		r->orders[found].price = cmd->price;
+		r->orders[found].seq = ++r->seq;
+		ev.type = EVENT_AMENDED;
+		ev.quantity = cmd->quantity;
+		ev.price = cmd->price;
+	} else {
+		ref_remove(r, found);
+		ev.type = EVENT_CANCELLED;
+	}
+	ref_emit(r, &ev);
+	ref_match(r, cmd->product_index);
+}
+
+static int engine_init(engine *e, int num_traders, int num_products) {
+	memset(e, 0, sizeof(engine));
+	e->buys = (order**)pe_calloc(MEM_PRODUCTS, num_products, sizeof(order*));
+	e->sells = (order**)pe_calloc(MEM_PRODUCTS, num_products, sizeof(order*));
+	init_matches(&e->matches, num_traders, num_products);
+	init_shard(&e->s, 0, e->buys, e->sells, e->matches, (event_sink){collect_event, &e->s.batch});
+	return e->buys == NULL || e->sells == NULL;
+}
+
+static void engine_free(engine *e, int num_traders, int num_products) {
+	products prods = {num_products, NULL};
+	free_order_list(e->buys, &prods);
+	free_order_list(e->sells, &prods);
+	free_matches(e->matches, num_traders, num_products);
+	pthread_mutex_destroy(&e->s.lock);
+	pe_free(e->s.batch.events);
+}
+
+static int same_event(event *a, event *b) {
+	return a->type == b->type && a->trader_id == b->trader_id && a->order_id == b->order_id
+		&& a->side == b->side && a->product_index == b->product_index
+		&& a->quantity == b->quantity && a->price == b->price
+		&& a->resting_trader_id == b->resting_trader_id && a->resting_order_id == b->resting_order_id
+		&& a->fee == b->fee;
+}
+
+static void describe_event(char *out, size_t len, event *ev) {
+	snprintf(out, len, "{type %d trader %d order %d side %d product %d qty %ld price %ld resting %d/%d fee %ld}",
+		ev->type, ev->trader_id, ev->order_id, ev->side, ev->product_index, ev->quantity, ev->price,
+		ev->resting_trader_id, ev->resting_order_id, ev->fee);
+}
+
+static int compare_buys(const void *a, const void *b) {
+	const ref_order *x = *(ref_order* const*)a;
+	const ref_order *y = *(ref_order* const*)b;
+	if (x->price != y->price) {
+		return x->price > y->price ? -1 : 1;
+	}
+	return x->seq - y->seq;
+}
+
+static int compare_sells(const void *a, const void *b) {
+	const ref_order *x = *(ref_order* const*)a;
+	const ref_order *y = *(ref_order* const*)b;
+	if (x->price != y->price) {
+		return x->price < y->price ? -1 : 1;
+	}
+	return x->seq - y->seq;
+}
+
+/*
+ * Desc: Compares one side of a product's book with the reference, order by
+         order in price-time order.
+ * Return: 0 if they agree, 1 otherwise with the difference in why.
+ */
+static int compare_side(reference *r, order *list, int product_index, int side, char *why, size_t len) {
+	ref_order *expected[MAX_STEPS];
+	int n = 0;
+	for (int i = 0; i < r->len; i++) {
+		if (r->orders[i].product_index == product_index && r->orders[i].side == side) {
+			expected[n++] = &r->orders[i];
+		}
+	}
+	qsort(expected, n, sizeof(ref_order*), side == BUY ? compare_buys : compare_sells);
+
+	const char *name = side == BUY ? "buy" : "sell";
+	int i = 0;
+	for (order *o = list; o != NULL; o = o->next, i++) {
+		if (i == n) {
+			snprintf(why, len, "P%d %s book: engine has more than %d orders", product_index, name, n);
+			return 1;
+		}
+		ref_order *x = expected[i];
+		if (o->trader_id != x->trader_id || o->order_id != x->order_id || o->quantity != x->quantity
+				|| o->price != x->price || o->global_order_num != x->seq) {
+			snprintf(why, len, "P%d %s book, position %d: engine T%d #%d %ld@%ld (time %d), "
+				"reference T%d #%d %ld@%ld (time %d)", product_index, name, i, o->trader_id, o->order_id,
+				o->quantity, o->price, o->global_order_num, x->trader_id, x->order_id, x->quantity,
+				x->price, x->seq);
+			return 1;
+		}
+	}
+	if (i != n) {
+		snprintf(why, len, "P%d %s book: engine has %d orders, reference %d", product_index, name, i, n);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Desc: Compares the events of the last command, the books, the ledger and
+         the fees of the engine and the reference.
+ * Return: 0 if they agree, 1 otherwise with the first difference in why.
+ */
+static int compare_state(stream *st, engine *e, reference *r, char *why, size_t len) {
+	event_batch *batch = &e->s.batch;
+	char a[BUF_SIZE];
+	char b[BUF_SIZE];
+	for (int i = 0; i < batch->len || i < r->num_events; i++) {
+		if (i >= batch->len || i >= r->num_events || !same_event(&batch->events[i], &r->events[i])) {
+			if (i < batch->len) {
+				describe_event(a, BUF_SIZE, &batch->events[i]);
+			} else {
+				snprintf(a, BUF_SIZE, "none");
+			}
+			if (i < r->num_events) {
+				describe_event(b, BUF_SIZE, &r->events[i]);
+			} else {
+				snprintf(b, BUF_SIZE, "none");
+			}
+			snprintf(why, len, "event %d: engine %s, reference %s", i, a, b);
+			return 1;
+		}
+	}
+	for (int p = 0; p < st->num_products; p++) {
+		if (compare_side(r, e->buys[p], p, BUY, why, len) || compare_side(r, e->sells[p], p, SELL, why, len)) {
+			return 1;
+		}
+	}
+	for (int t = 0; t < st->num_traders; t++) {
+		for (int p = 0; p < st->num_products; p++) {
+			long *pos = e->matches[t][p];
+			long *ref = r->position[t][p];
+			if (pos[0] != ref[0] || pos[1] != ref[1]) {
+				snprintf(why, len, "ledger T%d P%d: engine %ld ($%ld), reference %ld ($%ld)",
+					t, p, pos[0], pos[1], ref[0], ref[1]);
+				return 1;
+			}
+		}
+	}
+	if (e->s.total_fees != (double)r->fees) {
+		snprintf(why, len, "fees: engine $%.0f, reference $%ld", e->s.total_fees, r->fees);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Desc: Runs a stream through a fresh engine and reference, comparing them
+         after every command.
+ * Params: The stream, the reference mutation, where to describe the first
+           difference (may be NULL) and where to leave the final reference
+           state (may be NULL).
+ * Return: The index of the first command after which they differ, -1 if
+           they agree throughout.
+ */
+static int run_stream(stream *st, int mutation, char *why, size_t len, reference *final) {
+	char scratch[BUF_SIZE];
+	if (why == NULL) {
+		why = scratch;
+		len = BUF_SIZE;
+	}
+	engine e;
+	reference *r = (reference*)calloc(1, sizeof(reference));
+	if (r == NULL || engine_init(&e, st->num_traders, st->num_products)) {
+		fail_msg("out of memory");
+	}
+	r->mutation = mutation;
+
+	int failed_at = -1;
+	for (int i = 0; i < st->len && failed_at == -1; i++) {
+		command cmd = st->cmds[i];
+		if (execute_command(&e.s, &cmd) == 0) {
+			find_matches(&e.s, cmd.product_index);
+		}
+		ref_apply(r, &st->cmds[i]);
+		if (compare_state(st, &e, r, why, len)) {
+			failed_at = i;
+		}
+		e.s.batch.len = 0;
+	}
+	if (final != NULL) {
+		*final = *r;
+	}
+	engine_free(&e, st->num_traders, st->num_products);
+	free(r);
+	return failed_at;
+}
+
+/*
+ * Desc: Shrinks a failing stream: cuts it after the first difference, then
+         removes chunks of commands, halving the chunk size whenever none can
+         be removed, for as long as the stream still fails.
+ */
+static void minimize_stream(stream *st, int mutation) {
+	static stream trial;
+	int failed_at = run_stream(st, mutation, NULL, 0, NULL);
+	if (failed_at == -1) {
+		return;
+	}
+	st->len = failed_at + 1;
+
+	int chunk = st->len / 2 > 0 ? st->len / 2 : 1;
+	while (1) {
+		int removed = 0;
+		int start = 0;
+		while (start < st->len && st->len > 1) {
+			int end = start + chunk < st->len ? start + chunk : st->len;
+			trial = *st;
+			memmove(&trial.cmds[start], &st->cmds[end], (st->len - end) * sizeof(command));
+			trial.len = st->len - (end - start);
+			failed_at = run_stream(&trial, mutation, NULL, 0, NULL);
+			if (failed_at != -1) {
+				trial.len = failed_at + 1;
+				*st = trial;
+				removed = 1;
+			} else {
+				start = end;
+			}
+		}
+		if (!removed) {
+			if (chunk == 1) {
+				return;
+			}
+			chunk /= 2;
+		}
+	}
+}
+
+static void print_stream(stream *st) {
+	print_message("seed %llu: %d traders, %d products, %d price levels a side, %d commands\n",
+		(unsigned long long)st->seed, st->num_traders, st->num_products, st->price_levels, st->len);
+	for (int i = 0; i < st->len; i++) {
+		command *cmd = &st->cmds[i];
+		switch (cmd->type) {
+		case BUY:
+		case SELL:
+			print_message("  T%d %s %d P%d %ld %ld\n", cmd->trader_id, cmd->type == BUY ? "BUY" : "SELL",
+				cmd->order_id, cmd->product_index, cmd->quantity, cmd->price);
+			break;
+		case AMEND:
+			print_message("  T%d AMEND %d %ld %ld (P%d)\n", cmd->trader_id, cmd->order_id, cmd->quantity,
+				cmd->price, cmd->product_index);
+			break;
+		default:
+			print_message("  T%d CANCEL %d (P%d)\n", cmd->trader_id, cmd->order_id, cmd->product_index);
+		}
+	}
+}
+
+static void add_command(stream *st, int trader_id, int type, int order_id, int product_index, long quantity, long price) {
+	command *cmd = &st->cmds[st->len++];
+	memset(cmd, 0, sizeof(command));
+	cmd->type = type;
+	cmd->trader_id = trader_id;
+	cmd->order_id = order_id;
+	cmd->product_index = product_index;
+	snprintf(cmd->product, PRODUCT_STR_LEN, "P%d", product_index);
+	cmd->quantity = quantity;
+	cmd->price = price;
+}
+
+/*
+ * A hand-written stream whose outcome is checked against known values too,
+ * so the engine and the reference can't agree on something wrong.
+ */
+static void test_priority_and_fees(void **state) {
+	(void)state;
+	static stream st;
+	static reference final;
+	memset(&st, 0, sizeof(stream));
+	st.num_traders = 3;
+	st.num_products = 1;
+	add_command(&st, 0, SELL, 0, 0, 10, 100);
+	add_command(&st, 1, SELL, 0, 0, 10, 100);
+	add_command(&st, 0, AMEND, 0, 0, 10, 100); // T0 goes behind T1
+	add_command(&st, 2, BUY, 0, 0, 15, 105); // fills T1 10 then T0 5, at 100
+	add_command(&st, 1, BUY, 1, 0, 5, 95);
+	add_command(&st, 0, SELL, 1, 0, 8, 90); // older buy's price: 5 at 95
+	add_command(&st, 1, CANCEL, 1, 0, 0, 0); // already filled
+
+	char why[BUF_SIZE];
+	int failed_at = run_stream(&st, REF_EXACT, why, BUF_SIZE, &final);
+	if (failed_at != -1) {
+		print_stream(&st);
+		fail_msg("command %d: %s", failed_at, why);
+	}
+	// fees: 1000 -> 10 and 500 -> 5 paid by T2, 475 -> 4.75 -> 5 paid by T0
+	assert_int_equal(final.fees, 20);
+	assert_int_equal(final.position[2][0][0], 15);
+	assert_int_equal(final.position[2][0][1], -1500 - 15);
+	assert_int_equal(final.position[1][0][0], -10 + 5);
+	assert_int_equal(final.position[1][0][1], 1000 - 475);
+	assert_int_equal(final.position[0][0][0], -5 - 5);
+	assert_int_equal(final.position[0][0][1], 500 + 475 - 5);
+	// T0's sell 1 rests with 3 left, T0's sell 0 with 5
+	assert_int_equal(final.len, 2);
+	assert_int_equal(final.events[0].type, EVENT_INVALID);
+}
+
+static void test_random_streams(void **state) {
+	(void)state;
+	static stream st;
+	char why[BUF_SIZE];
+	for (long i = 0; i < num_streams; i++) {
+		generate_stream(&st, first_seed + i);
+		int failed_at = run_stream(&st, REF_EXACT, why, BUF_SIZE, NULL);
+		if (failed_at == -1) {
+			continue;
+		}
+		print_error("seed %llu differs after command %d: %s\n", (unsigned long long)st.seed, failed_at, why);
+		minimize_stream(&st, REF_EXACT);
+		run_stream(&st, REF_EXACT, why, BUF_SIZE, NULL);
+		print_stream(&st);
+		fail_msg("minimized stream differs after its last command: %s", why);
+	}
+}
+
+/*
+ * The harness itself: a reference that trades at the wrong price must be
+ * caught and its stream minimized to a handful of commands.
+ */
+static void test_harness_catches_mutation(void **state) {
+	(void)state;
+	static stream st;
+	long i = 0;
+	for (; i < DEFAULT_STREAMS; i++) {
+		generate_stream(&st, i + 1);
+		if (run_stream(&st, REF_NEWER_PRICE, NULL, 0, NULL) != -1) {
+			break;
+		}
+	}
+	assert_true(i < DEFAULT_STREAMS);
+	minimize_stream(&st, REF_NEWER_PRICE);
+	assert_true(run_stream(&st, REF_NEWER_PRICE, NULL, 0, NULL) == st.len - 1);
+	// two crossing orders at different prices, or an AMEND making them cross
+	assert_true(st.len <= 3);
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1) {
+		num_streams = strtol(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		first_seed = strtoull(argv[2], NULL, 10);
+	}
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_priority_and_fees),
+		cmocka_unit_test(test_random_streams),
+		cmocka_unit_test(test_harness_catches_mutation),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
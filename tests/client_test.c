@@ -0,0 +1,474 @@
+/*
+ * Tests of the client library over pipes standing in for the trader fifos.
+ *
+ * The test plays the exchange: it writes messages into the client's read
+ * pipe and reads what the client sends from its write pipe. The client
+ * signals its own process, which pex_attach made ignore SIGUSR1.
+ *
+ * The book replica is checked against the engine itself: random commands
+ * from the client and other traders are applied to a shard with
+ * --market-detail on, its events are sent to the client as the exchange
+ * formats them, and after every command the client's levels must add up to
+ * the orders resting in the engine.
+ *
+ * Usage: client_test
+ * Built against libcmocka; only its header is vendored in tests/.
+ */
+
+#include "../pex_client.h"
+#include "../pe_engine.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include "cmocka.h"
+
+#define MAX_RECORDED 32
+#define DIFF_STEPS 3000
+#define DIFF_TRADERS 3 // trader 0 is the client
+#define DIFF_PRODUCTS 2
+
+/*
+ * Desc: The events the callbacks saw, in order.
+ */
+typedef struct recorder recorder;
+struct recorder {
+    pex_event events[MAX_RECORDED];
+    int len;
+};
+
+/*
+ * Desc: A client attached to two pipes and the test's ends of them.
+ * Fields: The client, the fd the test writes exchange messages to and the fd
+           it reads the client's orders from, and the recorded events.
+ */
+typedef struct harness harness;
+struct harness {
+    pex_client client;
+    int exchange_out;
+    int exchange_in;
+    recorder rec;
+};
+
+static void record(pex_client *c, pex_event *ev) {
+	recorder *rec = (recorder*)c->ctx;
+	if (rec->len < MAX_RECORDED) {
+		rec->events[rec->len++] = *ev;
+	}
+}
+
+static int setup(void **state) {
+	harness *h = (harness*)calloc(1, sizeof(harness));
+	int to_client[2];
+	int from_client[2];
+	if (h == NULL || pipe(to_client) == -1 || pipe(from_client) == -1) {
+		return -1;
+	}
+	pex_attach(&h->client, 0, to_client[0], from_client[1], getpid(), &h->rec);
+	h->exchange_out = to_client[1];
+	h->exchange_in = from_client[0];
+	fcntl(h->exchange_in, F_SETFL, fcntl(h->exchange_in, F_GETFL) | O_NONBLOCK);
+	for (int type = 0; type < NUM_PEX_EVENTS; type++) {
+		pex_on(&h->client, type, record);
+	}
+	*state = h;
+	return 0;
+}
+
+static int teardown(void **state) {
+	harness *h = (harness*)*state;
+	pex_close(&h->client);
+	if (h->exchange_out != -1) {
+		close(h->exchange_out);
+	}
+	close(h->exchange_in);
+	free(h);
+	return 0;
+}
+
+static void exchange_sends(harness *h, const char *msg) {
+	assert_int_equal(write(h->exchange_out, msg, strlen(msg)), strlen(msg));
+}
+
+/*
+ * Desc: Reads everything the client has written so far, "" if nothing.
+ */
+static char *exchange_reads(harness *h) {
+	static char buf[PEX_TX_BUF_SIZE + 1];
+	ssize_t got = read(h->exchange_in, buf, PEX_TX_BUF_SIZE);
+	buf[got > 0 ? got : 0] = '\0';
+	return buf;
+}
+
+static void open_market(harness *h) {
+	exchange_sends(h, "MARKET OPEN;");
+	assert_int_equal(pex_poll(&h->client, 0), 1);
+	assert_true(h->client.market_open);
+	h->rec.len = 0;
+}
+
+// messages are framed on ; wherever the reads split them
+static void test_framing(void **state) {
+	harness *h = (harness*)*state;
+	exchange_sends(h, "MARKET OPEN;ACCEP");
+	assert_int_equal(pex_poll(&h->client, 0), 1);
+	exchange_sends(h, "TED 3;FILL 3 10;MARKET SELL GPU 5 100;MARKET BUY Router 0 0;INVALID;BOGUS 1;AMENDED 4;CANCELL");
+	assert_int_equal(pex_poll(&h->client, 0), 6);
+	exchange_sends(h, "ED 4;");
+	assert_int_equal(pex_poll(&h->client, 0), 1);
+
+	recorder *rec = &h->rec;
+	assert_int_equal(rec->len, 8);
+	assert_int_equal(rec->events[0].type, PEX_MARKET_OPEN);
+	assert_int_equal(rec->events[1].type, PEX_ACCEPTED);
+	assert_int_equal(rec->events[1].order_id, 3);
+	assert_int_equal(rec->events[2].type, PEX_FILL);
+	assert_int_equal(rec->events[2].order_id, 3);
+	assert_int_equal(rec->events[2].quantity, 10);
+	assert_int_equal(rec->events[3].type, PEX_MARKET);
+	assert_int_equal(rec->events[3].side, PEX_SELL);
+	assert_string_equal(rec->events[3].product, "GPU");
+	assert_int_equal(rec->events[3].quantity, 5);
+	assert_int_equal(rec->events[3].price, 100);
+	assert_int_equal(rec->events[4].type, PEX_MARKET);
+	assert_int_equal(rec->events[4].side, PEX_BUY);
+	assert_string_equal(rec->events[4].product, "Router");
+	assert_int_equal(rec->events[4].quantity, 0);
+	assert_int_equal(rec->events[5].type, PEX_INVALID);
+	assert_int_equal(rec->events[6].type, PEX_AMENDED);
+	assert_int_equal(rec->events[7].type, PEX_CANCELLED);
+	assert_int_equal(rec->events[7].order_id, 4);
+	assert_int_equal(h->client.unknown, 1);
+	assert_int_equal(h->client.events[PEX_MARKET], 2);
+}
+
+static void test_parse_detail(void **state) {
+	(void)state;
+	pex_event ev;
+	assert_int_equal(pex_parse_event("MARKET SELL GPU 5 100 7 101", &ev), 0);
+	assert_true(ev.detailed);
+	assert_int_equal(ev.quantity, 5);
+	assert_int_equal(ev.price, 100);
+	assert_int_equal(ev.prev_quantity, 7);
+	assert_int_equal(ev.prev_price, 101);
+	assert_int_equal(pex_parse_event("MARKET BUY GPU 5 100", &ev), 0);
+	assert_false(ev.detailed);
+	assert_int_equal(pex_parse_event("MARKET BUY GPU 5 100 7 101 1", &ev), 1);
+}
+
+static void test_parse_rejects(void **state) {
+	(void)state;
+	pex_event ev;
+	assert_int_equal(pex_parse_event("MARKET HOLD GPU 1 1", &ev), 1);
+	assert_int_equal(pex_parse_event("MARKET SELL GPU 1", &ev), 1);
+	assert_int_equal(pex_parse_event("MARKET SELL GPU 1 1 1", &ev), 1);
+	assert_int_equal(pex_parse_event("ACCEPTED 1 2", &ev), 1);
+	assert_int_equal(pex_parse_event("FILL 1", &ev), 1);
+	assert_int_equal(pex_parse_event("INVALID 1", &ev), 1);
+	assert_int_equal(pex_parse_event("", &ev), 1);
+	assert_int_equal(pex_parse_event("CANCELLED 7", &ev), 0);
+	assert_int_equal(ev.order_id, 7);
+}
+
+// nothing goes out before MARKET OPEN, the exchange isn't reading yet
+static void test_held_until_open(void **state) {
+	harness *h = (harness*)*state;
+	assert_int_equal(pex_buy(&h->client, "GPU", 1, 10), 0);
+	assert_int_equal(pex_flush(&h->client), 0);
+	assert_string_equal(exchange_reads(h), "");
+	open_market(h);
+	assert_string_equal(exchange_reads(h), "BUY 0 GPU 1 10;");
+	assert_int_equal(h->client.in_flight, 1);
+}
+
+// by default one command at a time: the next goes out with the answer
+static void test_in_flight_window(void **state) {
+	harness *h = (harness*)*state;
+	open_market(h);
+	assert_int_equal(pex_buy(&h->client, "GPU", 1, 10), 0);
+	assert_int_equal(pex_sell(&h->client, "GPU", 2, 20), 1);
+	assert_int_equal(pex_cancel(&h->client, 0), 0);
+	assert_int_equal(pex_flush(&h->client), 0);
+	assert_string_equal(exchange_reads(h), "BUY 0 GPU 1 10;");
+
+	// FILL and MARKET don't answer a command
+	exchange_sends(h, "FILL 0 1;MARKET SELL GPU 3 30;");
+	pex_poll(&h->client, 0);
+	assert_string_equal(exchange_reads(h), "");
+	exchange_sends(h, "ACCEPTED 0;");
+	pex_poll(&h->client, 0);
+	assert_string_equal(exchange_reads(h), "SELL 1 GPU 2 20;");
+	exchange_sends(h, "INVALID;");
+	pex_poll(&h->client, 0);
+	assert_string_equal(exchange_reads(h), "CANCEL 0;");
+	assert_int_equal(h->client.in_flight, 1);
+	assert_int_equal(h->client.flushes, 3);
+}
+
+// without a limit everything queued goes out in one write and one signal
+static void test_batched_submit(void **state) {
+	harness *h = (harness*)*state;
+	h->client.max_in_flight = 0;
+	open_market(h);
+	assert_int_equal(pex_buy(&h->client, "GPU", 1, 10), 0);
+	assert_int_equal(pex_sell(&h->client, "Router", 2, 20), 1);
+	assert_int_equal(pex_amend(&h->client, 1, 3, 30), 0);
+	assert_int_equal(pex_cancel(&h->client, 0), 0);
+	assert_int_equal(pex_flush(&h->client), 0);
+	assert_string_equal(exchange_reads(h), "BUY 0 GPU 1 10;SELL 1 Router 2 20;AMEND 1 3 30;CANCEL 0;");
+	assert_int_equal(h->client.in_flight, 4);
+	assert_int_equal(h->client.flushes, 1);
+}
+
+// orders queued by a callback go out in the same pex_poll
+static void buy_back(pex_client *c, pex_event *ev) {
+	pex_buy(c, ev->product, ev->quantity, ev->price);
+}
+
+static void test_callback_orders(void **state) {
+	harness *h = (harness*)*state;
+	open_market(h);
+	pex_on(&h->client, PEX_MARKET, buy_back);
+	exchange_sends(h, "MARKET SELL GPU 5 100;");
+	assert_int_equal(pex_poll(&h->client, 0), 1);
+	assert_string_equal(exchange_reads(h), "BUY 0 GPU 5 100;");
+}
+
+// a full queue refuses orders instead of blocking
+static void test_queue_full(void **state) {
+	harness *h = (harness*)*state;
+	int queued = 0;
+	while (pex_cancel(&h->client, 1) == 0) {
+		queued++;
+	}
+	assert_int_equal(queued, PEX_TX_BUF_SIZE / strlen("CANCEL 1;"));
+	assert_int_equal(pex_buy(&h->client, "GPU", 1, 1), -1);
+	assert_int_equal(h->client.next_order_id, 0);
+}
+
+static void test_exchange_closes(void **state) {
+	harness *h = (harness*)*state;
+	exchange_sends(h, "MARKET OPEN;");
+	close(h->exchange_out);
+	h->exchange_out = -1;
+	// the last events are handled before the close is reported
+	assert_int_equal(pex_poll(&h->client, 0), 1);
+	assert_int_equal(pex_poll(&h->client, 0), -1);
+	assert_true(h->client.closed);
+}
+
+// an order trades through the opposite levels before the rest of it rests
+static void test_book_levels(void **state) {
+	(void)state;
+	pex_book b;
+	pex_book_init(&b, "GPU");
+	assert_int_equal(pex_book_add(&b, PEX_SELL, 10, 102), 0);
+	assert_int_equal(pex_book_add(&b, PEX_SELL, 5, 101), 0);
+	assert_int_equal(pex_book_add(&b, PEX_SELL, 5, 101), 0);
+	assert_int_equal(pex_book_add(&b, PEX_BUY, 4, 99), 0);
+	assert_int_equal(pex_best_price(&b, PEX_SELL), 101);
+	assert_int_equal(pex_best_quantity(&b, PEX_SELL), 10);
+	assert_int_equal(pex_depth(&b, PEX_SELL), 2);
+	assert_int_equal(pex_level_at(&b, PEX_SELL, 1)->price, 102);
+	assert_null(pex_level_at(&b, PEX_SELL, 2));
+
+	// takes all of 101 and 2 of 102
+	assert_int_equal(pex_book_add(&b, PEX_BUY, 12, 102), 12);
+	assert_int_equal(pex_best_price(&b, PEX_SELL), 102);
+	assert_int_equal(pex_best_quantity(&b, PEX_SELL), 8);
+	assert_int_equal(pex_best_price(&b, PEX_BUY), 99);
+	// empties the SELL side and the rest of it rests
+	assert_int_equal(pex_book_add(&b, PEX_BUY, 20, 103), 8);
+	assert_int_equal(pex_depth(&b, PEX_SELL), 0);
+	assert_int_equal(pex_best_price(&b, PEX_BUY), 103);
+	assert_int_equal(pex_best_quantity(&b, PEX_BUY), 12);
+	assert_int_equal(pex_side_quantity(&b, PEX_BUY), 16);
+	assert_int_equal(b.volume, 20);
+
+	pex_book_remove(&b, PEX_BUY, 12, 103);
+	assert_int_equal(pex_best_price(&b, PEX_BUY), 99);
+	assert_true(b.exact);
+	pex_book_remove(&b, PEX_BUY, 1, 100);
+	assert_false(b.exact);
+	pex_book_free(&b);
+}
+
+// the client's own orders reach its books through the answers to them
+static void test_own_orders(void **state) {
+	harness *h = (harness*)*state;
+	h->client.max_in_flight = 0;
+	open_market(h);
+	assert_int_equal(pex_sell(&h->client, "GPU", 10, 100), 0);
+	assert_int_equal(pex_buy(&h->client, "GPU", 3, 100), 1);
+	assert_int_equal(pex_amend(&h->client, 0, 4, 105), 0);
+	assert_int_equal(pex_buy(&h->client, "GPU", 4, 90), 2);
+	assert_int_equal(pex_cancel(&h->client, 2), 0);
+	pex_flush(&h->client);
+	assert_null(pex_book_for(&h->client, "GPU"));
+
+	exchange_sends(h, "ACCEPTED 0;ACCEPTED 1;FILL 0 3;FILL 1 3;");
+	pex_poll(&h->client, 0);
+	pex_book *b = pex_book_for(&h->client, "GPU");
+	assert_non_null(b);
+	assert_int_equal(pex_best_price(b, PEX_SELL), 100);
+	assert_int_equal(pex_best_quantity(b, PEX_SELL), 7);
+	assert_int_equal(pex_depth(b, PEX_BUY), 0);
+
+	exchange_sends(h, "AMENDED 0;ACCEPTED 2;CANCELLED 2;");
+	pex_poll(&h->client, 0);
+	assert_int_equal(pex_best_price(b, PEX_SELL), 105);
+	assert_int_equal(pex_best_quantity(b, PEX_SELL), 4);
+	assert_int_equal(pex_depth(b, PEX_BUY), 0);
+	assert_int_equal(h->client.pending_len, 0);
+	assert_true(b->exact);
+
+	// without --market-detail an amend can't be told from a new order
+	exchange_sends(h, "MARKET BUY GPU 2 95;");
+	pex_poll(&h->client, 0);
+	assert_int_equal(pex_best_price(b, PEX_BUY), 95);
+	assert_false(b->exact);
+}
+
+static uint64_t next_random(uint64_t *state) {
+	// xorshift64*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+static long draw(uint64_t *state, long n) {
+	return (long)(next_random(state) % (uint64_t)n);
+}
+
+/*
+ * Desc: Checks one side of a replica against the engine's orders, summed
+         per price. A product the client hasn't seen must have none.
+ */
+static void assert_same_levels(pex_book *b, order *list, int side) {
+	int depth = 0;
+	while (list != NULL) {
+		long price = list->price;
+		long quantity = 0;
+		for (; list != NULL && list->price == price; list = list->next) {
+			quantity += list->quantity;
+		}
+		const pex_level *level = b != NULL ? pex_level_at(b, side, depth) : NULL;
+		assert_non_null(level);
+		assert_int_equal(level->price, price);
+		assert_int_equal(level->quantity, quantity);
+		depth++;
+	}
+	assert_int_equal(b != NULL ? pex_depth(b, side) : 0, depth);
+}
+
+static void test_replica_matches_engine(void **state) {
+	harness *h = (harness*)*state;
+	h->client.max_in_flight = 0;
+	open_market(h);
+
+	char *names[DIFF_PRODUCTS] = {"GPU", "Router"};
+	products prods = {DIFF_PRODUCTS, names};
+	order **buys = (order**)pe_calloc(MEM_PRODUCTS, DIFF_PRODUCTS, sizeof(order*));
+	order **sells = (order**)pe_calloc(MEM_PRODUCTS, DIFF_PRODUCTS, sizeof(order*));
+	long ***matches;
+	init_matches(&matches, DIFF_TRADERS, DIFF_PRODUCTS);
+	shard s;
+	init_shard(&s, 0, buys, sells, matches, (event_sink){collect_event, &s.batch});
+	s.market_detail = 1;
+
+	static int placed_on[DIFF_TRADERS][DIFF_STEPS]; // product of each order
+	int next_id[DIFF_TRADERS] = {0};
+	uint64_t rng = 1;
+	for (int step = 0; step < DIFF_STEPS; step++) {
+		command cmd;
+		memset(&cmd, 0, sizeof(command));
+		int t = (int)draw(&rng, DIFF_TRADERS);
+		cmd.trader_id = t;
+		cmd.type = (int)draw(&rng, 4);
+		cmd.quantity = 1 + draw(&rng, 20);
+		cmd.price = 95 + draw(&rng, 10);
+		if (cmd.type == AMEND || cmd.type == CANCEL) {
+			if (next_id[t] == 0) {
+				cmd.type = BUY;
+			} else {
+				// possibly filled or cancelled since, then it's INVALID
+				cmd.order_id = (int)draw(&rng, next_id[t]);
+				cmd.product_index = placed_on[t][cmd.order_id];
+			}
+		}
+		if (cmd.type == BUY || cmd.type == SELL) {
+			cmd.order_id = next_id[t]++;
+			cmd.product_index = (int)draw(&rng, DIFF_PRODUCTS);
+			placed_on[t][cmd.order_id] = cmd.product_index;
+		}
+		if (cmd.type == CANCEL) {
+			cmd.quantity = 0;
+			cmd.price = 0;
+		}
+
+		if (t == 0) {
+			char *product = names[cmd.product_index];
+			if (cmd.type == BUY) {
+				assert_int_equal(pex_buy(&h->client, product, cmd.quantity, cmd.price), cmd.order_id);
+			} else if (cmd.type == SELL) {
+				assert_int_equal(pex_sell(&h->client, product, cmd.quantity, cmd.price), cmd.order_id);
+			} else if (cmd.type == AMEND) {
+				assert_int_equal(pex_amend(&h->client, cmd.order_id, cmd.quantity, cmd.price), 0);
+			} else {
+				assert_int_equal(pex_cancel(&h->client, cmd.order_id), 0);
+			}
+			assert_int_equal(pex_flush(&h->client), 0);
+			exchange_reads(h);
+		}
+
+		if (execute_command(&s, &cmd) == 0) {
+			find_matches(&s, cmd.product_index);
+		}
+		// what the exchange would write to the client's fifo
+		for (int i = 0; i < s.batch.len; i++) {
+			event *ev = &s.batch.events[i];
+			int only_owner = ev->type == EVENT_FILL || ev->type == EVENT_INVALID;
+			if (ev->type == EVENT_MATCH || (only_owner && ev->trader_id != 0)) {
+				continue;
+			}
+			char msg[BUF_SIZE];
+			format_event(msg, ev, ev->trader_id == 0, &prods);
+			exchange_sends(h, msg);
+		}
+		s.batch.len = 0;
+		pex_poll(&h->client, 0);
+
+		for (int p = 0; p < DIFF_PRODUCTS; p++) {
+			pex_book *b = pex_book_for(&h->client, names[p]);
+			assert_same_levels(b, buys[p], PEX_BUY);
+			assert_same_levels(b, sells[p], PEX_SELL);
+			assert_true(b == NULL || b->exact);
+		}
+	}
+	assert_int_equal(h->client.pending_len, 0);
+
+	free_order_list(buys, &prods);
+	free_order_list(sells, &prods);
+	free_matches(matches, DIFF_TRADERS, DIFF_PRODUCTS);
+	pthread_mutex_destroy(&s.lock);
+	pe_free(s.batch.events);
+}
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_framing, setup, teardown),
+		cmocka_unit_test(test_parse_detail),
+		cmocka_unit_test(test_parse_rejects),
+		cmocka_unit_test_setup_teardown(test_held_until_open, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_in_flight_window, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_batched_submit, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_callback_orders, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_queue_full, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_exchange_closes, setup, teardown),
+		cmocka_unit_test(test_book_levels),
+		cmocka_unit_test_setup_teardown(test_own_orders, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_replica_matches_engine, setup, teardown),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,193 @@
+/*
+ * Throughput benchmark for the trader message decoder.
+ *
+ * Feeds a pool of valid and malformed messages through the same steps the
+ * exchange runs on every read (format_message, determine_cmd_type,
+ * parse_command) and reports messages per second and cycles per message.
+ *
+ * Usage: decoder_bench [messages per run]
+ */
+
+#include "../pe_protocol.h"
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#define POOL_SIZE 4096 // distinct messages per pool, power of two
+#define DEFAULT_MESSAGES 4000000
+
+/*
+ * Desc: One pre-generated message as it would come out of read().
+ */
+typedef struct raw_message raw_message;
+struct raw_message {
+	int len;
+	char data[BUF_SIZE];
+};
+
+static char *bench_products[] = {"GPU", "Router", "CPU", "SSD", "Motherboard"};
+#define NUM_BENCH_PRODUCTS 5
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_rand(void) {
+	// xorshift64*, deterministic so runs are comparable
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static long rand_range(long lo, long hi) {
+	return lo + (long)(next_rand() % (uint64_t)(hi - lo + 1));
+}
+
+static void make_valid(raw_message *msg) {
+	char *product = bench_products[next_rand() % NUM_BENCH_PRODUCTS];
+	switch (next_rand() % 4) {
+	case BUY:
+		msg->len = snprintf(msg->data, BUF_SIZE, "BUY %ld %s %ld %ld;", rand_range(OID_MIN, OID_MAX),
+							product, rand_range(ORDER_MIN, 1000), rand_range(ORDER_MIN, ORDER_MAX));
+		break;
+	case SELL:
+		msg->len = snprintf(msg->data, BUF_SIZE, "SELL %ld %s %ld %ld;", rand_range(OID_MIN, OID_MAX),
+							product, rand_range(ORDER_MIN, 1000), rand_range(ORDER_MIN, ORDER_MAX));
+		break;
+	case AMEND:
+		msg->len = snprintf(msg->data, BUF_SIZE, "AMEND %ld %ld %ld;", rand_range(OID_MIN, OID_MAX),
+							rand_range(ORDER_MIN, 1000), rand_range(ORDER_MIN, ORDER_MAX));
+		break;
+	default:
+		msg->len = snprintf(msg->data, BUF_SIZE, "CANCEL %ld;", rand_range(OID_MIN, OID_MAX));
+		break;
+	}
+}
+
+static void make_malformed(raw_message *msg) {
+	switch (next_rand() % 8) {
+	case 0:
+		// missing delimiter
+		msg->len = snprintf(msg->data, BUF_SIZE, "BUY %ld GPU 10 100", rand_range(OID_MIN, OID_MAX));
+		break;
+	case 1:
+		// trailing argument
+		msg->len = snprintf(msg->data, BUF_SIZE, "SELL %ld GPU 10 100 7;", rand_range(OID_MIN, OID_MAX));
+		break;
+	case 2:
+		// out of range quantity and price
+		msg->len = snprintf(msg->data, BUF_SIZE, "BUY 1 GPU %ld -5;", rand_range(ORDER_MAX + 1, 10 * ORDER_MAX));
+		break;
+	case 3:
+		// unknown and overlong command types
+		msg->len = snprintf(msg->data, BUF_SIZE, "%s 1 GPU 1 1;", next_rand() & 1 ? "HOLD" : "CANCELLATION");
+		break;
+	case 4:
+		// missing arguments
+		msg->len = snprintf(msg->data, BUF_SIZE, "AMEND %ld;", rand_range(OID_MIN, OID_MAX));
+		break;
+	case 5:
+		// product name longer than PRODUCT_STR_LEN
+		msg->len = snprintf(msg->data, BUF_SIZE, "BUY 1 ThisProductNameIsWayTooLong 1 1;");
+		break;
+	case 6:
+		// non-numeric fields
+		msg->len = snprintf(msg->data, BUF_SIZE, "CANCEL abc;");
+		break;
+	default:
+		// random bytes, delimiter somewhere inside
+		msg->len = (int)rand_range(1, BUF_SIZE);
+		for (int i = 0; i < msg->len; i++) {
+			msg->data[i] = (char)(next_rand() & 0xff);
+		}
+		msg->data[next_rand() % msg->len] = ';';
+		break;
+	}
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t now_cycles(void) {
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Desc: Decodes num_messages messages from the pool and prints the results.
+ * Params: The name of the run, the pool and the number of messages.
+ */
+static void run(char *name, raw_message *pool, long num_messages) {
+	char message_in[BUF_SIZE];
+	command cmd;
+	long accepted = 0;
+
+	uint64_t start_ns = now_ns();
+	uint64_t start_cycles = now_cycles();
+	for (long i = 0; i < num_messages; i++) {
+		raw_message *msg = &pool[i & (POOL_SIZE - 1)];
+		// the copy stands in for read(), format_message writes into the buffer
+		memcpy(message_in, msg->data, msg->len);
+		if (format_message(message_in, msg->len)) {
+			continue;
+		}
+		int cmd_type = determine_cmd_type(message_in);
+		if (parse_command(message_in, cmd_type, &cmd) == 0) {
+			accepted++;
+		}
+	}
+	uint64_t cycles = now_cycles() - start_cycles;
+	uint64_t elapsed = now_ns() - start_ns;
+
+	double seconds = elapsed / 1e9;
+	printf("%-10s %10ld msgs %10ld accepted %10.3f Mmsg/s %9.1f ns/msg", name, num_messages,
+		   accepted, num_messages / seconds / 1e6, (double)elapsed / num_messages);
+#ifdef HAVE_RDTSC
+	printf(" %9.1f cycles/msg\n", (double)cycles / num_messages);
+#else
+	(void)cycles;
+	printf("       n/a cycles/msg\n");
+#endif
+}
+
+int main(int argc, char **argv) {
+	long num_messages = DEFAULT_MESSAGES;
+	if (argc > 1) {
+		num_messages = atol(argv[1]);
+		if (num_messages <= 0) {
+			printf("Usage: %s [messages per run]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	raw_message *valid = malloc(POOL_SIZE * sizeof(raw_message));
+	raw_message *malformed = malloc(POOL_SIZE * sizeof(raw_message));
+	raw_message *mixed = malloc(POOL_SIZE * sizeof(raw_message));
+	for (int i = 0; i < POOL_SIZE; i++) {
+		make_valid(&valid[i]);
+		make_malformed(&malformed[i]);
+		// roughly what a busy session looks like: mostly valid traffic
+		if (next_rand() % 10 == 0) {
+			make_malformed(&mixed[i]);
+		} else {
+			make_valid(&mixed[i]);
+		}
+	}
+
+	run("valid", valid, num_messages);
+	run("malformed", malformed, num_messages);
+	run("mixed", mixed, num_messages);
+
+	free(valid);
+	free(malformed);
+	free(mixed);
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Fuzz target for the trader message decoder (format_message,
+ * determine_cmd_type and parse_command).
+ *
+ * Built two ways:
+ *   clang -fsanitize=fuzzer,address -DPEX_LIBFUZZER  --> libFuzzer binary
+ *   gcc (no PEX_LIBFUZZER)                          --> corpus replay driver
+ * The replay driver runs every file or directory given on the command line
+ * through the same entry point, so the seed corpus doubles as a regression
+ * test with any compiler.
+ */
+
+#include "../pe_protocol.h"
+#include <stdint.h>
+#include <dirent.h>
+
+/*
+ * Desc: Checks the invariants every accepted command must hold. Aborts on
+         violation so the fuzzer records the input as a crash.
+ * Params: The framed message and the command decoded from it.
+ */
+static void check_command(char *message_in, command *cmd) {
+	if (cmd->order_id < OID_MIN || cmd->order_id > OID_MAX) {
+		abort();
+	}
+	if (cmd->type == CANCEL) {
+		return;
+	}
+	if (cmd->quantity < ORDER_MIN || cmd->quantity > ORDER_MAX
+		|| cmd->price < ORDER_MIN || cmd->price > ORDER_MAX) {
+		abort();
+	}
+	if (strnlen(cmd->product, PRODUCT_STR_LEN) == PRODUCT_STR_LEN) {
+		// product must always be null-terminated
+		abort();
+	}
+
+	// re-encoding the command and decoding it again must be lossless
+	char encoded[BUF_SIZE];
+	command again;
+	if (cmd->type == BUY || cmd->type == SELL) {
+		snprintf(encoded, BUF_SIZE, "%s %d %s %ld %ld", cmd->type == BUY ? "BUY" : "SELL",
+				 cmd->order_id, cmd->product, cmd->quantity, cmd->price);
+	} else {
+		snprintf(encoded, BUF_SIZE, "AMEND %d %ld %ld", cmd->order_id, cmd->quantity, cmd->price);
+	}
+	if (determine_cmd_type(encoded) != cmd->type
+		|| parse_command(encoded, cmd->type, &again)
+		|| memcmp(&again, cmd, sizeof(command)) != 0) {
+		(void)message_in;
+		abort();
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	// a single read() from a trader fifo never returns more than BUF_SIZE
+	char message_in[BUF_SIZE];
+	if (size > BUF_SIZE) {
+		size = BUF_SIZE;
+	}
+	memcpy(message_in, data, size);
+
+	if (format_message(message_in, (int)size)) {
+		return 0;
+	}
+	int cmd_type = determine_cmd_type(message_in);
+	command cmd;
+	if (parse_command(message_in, cmd_type, &cmd) == 0) {
+		check_command(message_in, &cmd);
+	}
+	return 0;
+}
+
+#ifndef PEX_LIBFUZZER
+
+/*
+ * Desc: Runs a single corpus file through the fuzz target.
+ * Params: The path of the file.
+ * Return: 0 on success, 1 if the file could not be read.
+ */
+static int run_file(char *path) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return 1;
+	}
+	uint8_t data[BUF_SIZE * 4];
+	size_t size = fread(data, 1, sizeof(data), fp);
+	fclose(fp);
+	LLVMFuzzerTestOneInput(data, size);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int runs = 0;
+	for (int i = 1; i < argc; i++) {
+		DIR *dir = opendir(argv[i]);
+		if (dir == NULL) {
+			if (run_file(argv[i])) {
+				printf("Error reading %s: %s\n", argv[i], strerror(errno));
+				return 1;
+			}
+			runs++;
+			continue;
+		}
+
+		struct dirent *entry;
+		char path[4096];
+		while ((entry = readdir(dir)) != NULL) {
+			if (entry->d_name[0] == '.') {
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s/%s", argv[i], entry->d_name);
+			if (run_file(path)) {
+				printf("Error reading %s: %s\n", path, strerror(errno));
+				closedir(dir);
+				return 1;
+			}
+			runs++;
+		}
+		closedir(dir);
+	}
+	printf("decoder_fuzz: %d inputs ok\n", runs);
+	return 0;
+}
+
+#endif
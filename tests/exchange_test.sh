@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# End-to-end runs of the exchange with pex_loadgen traders, for the paths
+# the library tests can't reach: trader startup and the threaded gateways.
+# Each run must finish within a time limit, exit 0 and complete trading,
+# with the exchange's sanitizers watching, and log the line it expects.
+# Runs whose outcome has to be exact use script_trader.
+#
+# Usage: tests/exchange_test.sh (from the repo root, after make)
+
+TIME_LIMIT=60
+failed=0
+
+# run <name> <expected log line> <exchange args...>
+run() {
+	name=$1
+	expected=$2
+	shift 2
+	log=$(mktemp)
+	PEX_LOADGEN="--orders=50 --seed=1" timeout $TIME_LIMIT ./pe_exchange "$@" > "$log" 2>&1
+	status=$?
+	if [ $status -ne 0 ] || ! grep -q "Trading completed" "$log"; then
+		echo "FAIL $name: exit status $status"
+		tail -n 20 "$log"
+		failed=1
+	elif ! grep -qF "$expected" "$log"; then
+		echo "FAIL $name: no <$expected> in the log"
+		tail -n 20 "$log"
+		failed=1
+	else
+		echo "ok   $name"
+	fi
+	rm -f "$log"
+}
+
+# SIGUSR1s from several traders can be merged, the traders signal again
+run "inline, four traders" "Trading completed" products.txt ./pex_loadgen ./pex_loadgen ./pex_loadgen ./pex_loadgen
+
+# a trader that can't be launched is left out, its gateway slot stays empty
+run "threaded, first trader not launched" "Trading completed" --shards=1 products.txt ./nonexistent ./pex_loadgen ./pex_loadgen
+run "threaded, middle trader not launched, 2 gateways" "Trading completed" --shards=2 --gateways=2 products.txt \
+	./pex_loadgen ./nonexistent ./pex_loadgen ./pex_loadgen
+
+# an AMEND is matched on its own order's product, not on the product of the
+# last BUY or SELL: the amended buy crosses the Router sell straight away
+export PEX_SCRIPT="SELL Router 10 105;BUY Router 10 100;BUY GPU 1 50;AMEND 1 10 105"
+run "inline, AMEND matches its own product" "Match: Order 0 [T0], New Order 1 [T0], value: \$1050" \
+	products.txt ./script_trader
+run "threaded, AMEND matches its own product" "Match: Order 0 [T0], New Order 1 [T0], value: \$1050" \
+	--shards=2 products.txt ./script_trader
+
+# halts <name> <exchange args...>: a journal that can't roll to its next
+# segment (a directory is in the way) must stop trading with exit status 1,
+# and what it holds must still replay without a gap
+halts() {
+	name=$1
+	shift
+	dir=$(mktemp -d)
+	mkdir "$dir/journal.000001"
+	log="$dir/log"
+	PEX_LOADGEN="--orders=50 --seed=1" timeout $TIME_LIMIT ./pe_exchange --journal="$dir/journal" \
+		--journal-segment=1 "$@" > "$log" 2>&1
+	status=$?
+	if [ $status -ne 1 ] || ! grep -q "Trading halted" "$log"; then
+		echo "FAIL $name: exit status $status"
+		tail -n 20 "$log"
+		failed=1
+	elif [ -e "$dir/journal.snap" ]; then
+		echo "FAIL $name: snapshot published past the journal"
+		failed=1
+	elif ! ./pex_replay --no-format "$dir/journal" > "$log" 2>&1; then
+		echo "FAIL $name: journal doesn't replay"
+		tail -n 20 "$log"
+		failed=1
+	else
+		echo "ok   $name"
+	fi
+	rm -rf "$dir"
+}
+
+halts "inline, journal fails" products.txt ./pex_loadgen ./pex_loadgen
+halts "threaded, journal fails" --shards=2 products.txt ./pex_loadgen ./pex_loadgen
+
+exit $failed
@@ -0,0 +1,422 @@
+/*
+ * Performance regression gate, run by make perfcheck.
+ *
+ * Reads the JSON lines written by pex_replay --json and book_bench, keeps the
+ * best result of every benchmark over the runs in the file (the fastest
+ * throughput and the lowest tail, which is what noise can't improve), and
+ * compares them with a baseline in the same format:
+ *   replay   commands_per_sec may drop by at most --tolerance percent
+ *   book     mean_ns may rise by at most --tolerance percent, p99_ns by at
+ *            most --tail-tolerance percent
+ * Differences below --slack-ns are ignored, a few ns are timer noise.
+ * Benchmarks whose key contains a --report-only text are printed but can't
+ * fail, for ones too noisy to gate on. Every comparison is printed; any
+ * regression makes the exit status 1. The best
+ * results can be appended to a history file, one JSON line per benchmark
+ * tagged with the time and a label, or written out as a new baseline.
+ *
+ * Usage: perfcheck [options] <results>
+ */
+
+#include "../pe_common.h"
+#include <getopt.h>
+#include <time.h>
+
+#define LINE_LEN 1024
+#define NAME_LEN 64
+#define KEY_LEN 256
+#define MAX_RESULTS 512
+#define DEFAULT_TOLERANCE 25.0 // percent
+#define DEFAULT_TAIL_TOLERANCE 50.0 // percent
+#define DEFAULT_SLACK_NS 50.0
+#define MAX_REPORT_ONLY 16
+
+enum metric {
+	METRIC_RATE = 0, // commands_per_sec, higher is better
+	METRIC_MEAN, // mean_ns, lower is better
+	METRIC_TAIL, // p99_ns, lower is better
+	NUM_METRICS
+};
+
+static const char *metric_names[NUM_METRICS] = {"commands_per_sec", "mean_ns", "p99_ns"};
+
+/*
+ * Desc: The best result of one benchmark.
+ * Fields: The key naming the benchmark, the line of the run with the best
+           throughput (its metrics replaced by the best of every run), and
+           the best value of every metric it has.
+ */
+typedef struct result result;
+struct result {
+    char key[KEY_LEN];
+    char line[LINE_LEN];
+    int has[NUM_METRICS];
+    double value[NUM_METRICS];
+};
+
+/*
+ * Desc: The best results of every benchmark in a file.
+ */
+typedef struct result_set result_set;
+struct result_set {
+    result results[MAX_RESULTS];
+    int len;
+};
+
+enum option_flag {
+	OPT_BASELINE = 256,
+	OPT_TOLERANCE,
+	OPT_TAIL_TOLERANCE,
+	OPT_SLACK_NS,
+	OPT_HISTORY,
+	OPT_LABEL,
+	OPT_WRITE_BASELINE,
+	OPT_REPORT_ONLY
+};
+
+static struct option long_options[] = {
+	{"baseline", required_argument, NULL, OPT_BASELINE},
+	{"tolerance", required_argument, NULL, OPT_TOLERANCE},
+	{"tail-tolerance", required_argument, NULL, OPT_TAIL_TOLERANCE},
+	{"slack-ns", required_argument, NULL, OPT_SLACK_NS},
+	{"history", required_argument, NULL, OPT_HISTORY},
+	{"label", required_argument, NULL, OPT_LABEL},
+	{"write-baseline", required_argument, NULL, OPT_WRITE_BASELINE},
+	{"report-only", required_argument, NULL, OPT_REPORT_ONLY},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
+
+static void print_usage(char *prog) {
+	printf("Usage: %s [options] <results>\n", prog);
+	printf("Options:\n");
+	printf("  --baseline=FILE        compare with the results in FILE\n");
+	printf("  --tolerance=PCT        allowed throughput and mean latency regression\n");
+	printf("                         (default %.0f)\n", DEFAULT_TOLERANCE);
+	printf("  --tail-tolerance=PCT   allowed p99 latency regression (default %.0f)\n", DEFAULT_TAIL_TOLERANCE);
+	printf("  --slack-ns=NS          ignore latency changes below NS ns (default %.0f)\n", DEFAULT_SLACK_NS);
+	printf("  --history=FILE         append the best results to FILE\n");
+	printf("  --label=TEXT           tag the history lines with TEXT, e.g. a commit\n");
+	printf("  --write-baseline=FILE  write the best results to FILE as the new baseline\n");
+	printf("  --report-only=TEXT     don't fail on benchmarks whose key contains TEXT\n");
+	printf("                         (repeatable)\n");
+}
+
+/*
+ * Desc: Finds "key": in a flat JSON object and copies its string value.
+ * Return: 0 if found, 1 otherwise.
+ */
+static int json_string(const char *line, const char *key, char *out, size_t len) {
+	char pattern[KEY_LEN];
+	snprintf(pattern, KEY_LEN, "\"%s\":\"", key);
+	const char *start = strstr(line, pattern);
+	if (start == NULL) {
+		return 1;
+	}
+	start += strlen(pattern);
+	const char *end = strchr(start, '"');
+	if (end == NULL) {
+		return 1;
+	}
+	snprintf(out, len, "%.*s", (int)(end - start), start);
+	return 0;
+}
+
+/*
+ * Desc: Finds "key": in a flat JSON object and reads its number.
+ * Return: 0 if found, 1 otherwise.
+ */
+static int json_number(const char *line, const char *key, double *out) {
+	char pattern[KEY_LEN];
+	snprintf(pattern, KEY_LEN, "\"%s\":", key);
+	const char *start = strstr(line, pattern);
+	if (start == NULL) {
+		return 1;
+	}
+	char *end = NULL;
+	*out = strtod(start + strlen(pattern), &end);
+	return end == start + strlen(pattern);
+}
+
+/*
+ * Desc: Replaces the number after "key": in a flat JSON object.
+ */
+static void json_set_number(char *line, const char *key, double value) {
+	char pattern[KEY_LEN];
+	snprintf(pattern, KEY_LEN, "\"%s\":", key);
+	char *start = strstr(line, pattern);
+	if (start == NULL) {
+		return;
+	}
+	start += strlen(pattern);
+	char *end = start + strcspn(start, ",}");
+	char rest[LINE_LEN];
+	snprintf(rest, LINE_LEN, "%s", end);
+	snprintf(start, LINE_LEN - (start - line), "%.1f%s", value, rest);
+}
+
+/*
+ * Desc: Names the benchmark a line is a result of, e.g. book/insert/random/10
+         or replay/no-format.
+ * Return: 0 on success, 1 if the line isn't a benchmark result.
+ */
+static int result_key(const char *line, char *key) {
+	char bench[NAME_LEN];
+	char op[NAME_LEN];
+	char dist[NAME_LEN];
+	double depth;
+	if (json_string(line, "bench", bench, NAME_LEN)) {
+		return 1;
+	}
+	if (strcmp(bench, "replay") == 0) {
+		if (json_string(line, "mode", op, NAME_LEN)) {
+			return 1;
+		}
+		snprintf(key, KEY_LEN, "replay/%s", op);
+		return 0;
+	}
+	if (json_string(line, "op", op, NAME_LEN) || json_string(line, "dist", dist, NAME_LEN)
+			|| json_number(line, "depth", &depth)) {
+		return 1;
+	}
+	snprintf(key, KEY_LEN, "%s/%s/%s/%.0f", bench, op, dist, depth);
+	return 0;
+}
+
+/*
+ * Desc: Reads a file of JSON lines, keeping the best value of every metric
+         per benchmark. Lines that aren't results are skipped.
+ * Return: 0 on success, 1 if the file can't be read or holds too many
+           benchmarks.
+ */
+static int read_results(const char *path, result_set *set) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("perfcheck: can't read %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	set->len = 0;
+	char line[LINE_LEN];
+	char key[KEY_LEN];
+	while (fgets(line, LINE_LEN, fp) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if (result_key(line, key)) {
+			continue;
+		}
+		double mismatched = 0;
+		if (json_number(line, "mismatched", &mismatched) == 0 && mismatched > 0) {
+			printf("perfcheck: %s replayed different events than recorded\n", key);
+			fclose(fp);
+			return 1;
+		}
+		result *r = NULL;
+		for (int i = 0; i < set->len; i++) {
+			if (strcmp(set->results[i].key, key) == 0) {
+				r = &set->results[i];
+			}
+		}
+		if (r == NULL) {
+			if (set->len == MAX_RESULTS) {
+				printf("perfcheck: more than %d benchmarks in %s\n", MAX_RESULTS, path);
+				fclose(fp);
+				return 1;
+			}
+			r = &set->results[set->len++];
+			memset(r, 0, sizeof(result));
+			snprintf(r->key, KEY_LEN, "%s", key);
+		}
+		int better_run = 0;
+		for (int m = 0; m < NUM_METRICS; m++) {
+			double value;
+			if (json_number(line, metric_names[m], &value)) {
+				continue;
+			}
+			int better = m == METRIC_RATE ? value > r->value[m] : value < r->value[m];
+			if (!r->has[m] || better) {
+				// the line kept is the run with the best throughput
+				better_run |= m != METRIC_TAIL;
+				r->value[m] = value;
+				r->has[m] = 1;
+			}
+		}
+		if (better_run || r->line[0] == '\0') {
+			snprintf(r->line, LINE_LEN, "%s", line);
+		}
+	}
+	fclose(fp);
+
+	// the lines kept carry the best of every metric, not only of throughput
+	for (int i = 0; i < set->len; i++) {
+		for (int m = 0; m < NUM_METRICS; m++) {
+			if (set->results[i].has[m]) {
+				json_set_number(set->results[i].line, metric_names[m], set->results[i].value[m]);
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Desc: Compares one metric of a benchmark with its baseline and prints the
+         comparison.
+ * Params: The benchmark now and in the baseline, the metric, the allowed
+           regression, and whether it is only reported.
+ * Return: 1 if it regressed beyond the tolerance, 0 otherwise.
+ */
+static int compare_metric(result *now, result *base, int m, double tolerance, double slack_ns, int report_only) {
+	double change = base->value[m] != 0 ? (now->value[m] - base->value[m]) / base->value[m] * 100 : 0;
+	int regressed;
+	if (m == METRIC_RATE) {
+		regressed = change < -tolerance;
+	} else {
+		regressed = change > tolerance && now->value[m] - base->value[m] > slack_ns;
+	}
+	if (report_only) {
+		printf("%-40s %-17s %14.1f %14.1f %+8.1f%%  %s\n", now->key, metric_names[m], base->value[m],
+			now->value[m], change, regressed ? "slower (report only)" : "ok");
+		return 0;
+	}
+	printf("%-40s %-17s %14.1f %14.1f %+8.1f%%  %s\n", now->key, metric_names[m], base->value[m],
+		now->value[m], change, regressed ? "REGRESSED" : "ok");
+	return regressed;
+}
+
+/*
+ * Desc: Writes the best result lines, one per benchmark, to a file.
+ * Params: The file, the results, and the label and time to tag each line
+           with (label NULL --> lines are written as they are).
+ * Return: 0 on success, 1 if the file can't be written.
+ */
+static int write_results(const char *path, const char *mode, result_set *set, const char *label, long now) {
+	FILE *fp = fopen(path, mode);
+	if (fp == NULL) {
+		printf("perfcheck: can't write %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	for (int i = 0; i < set->len; i++) {
+		if (label != NULL) {
+			// the lines are flat objects, tag them after the opening brace
+			fprintf(fp, "{\"time\":%ld,\"label\":\"%s\",%s\n", now, label, set->results[i].line + 1);
+		} else {
+			fprintf(fp, "%s\n", set->results[i].line);
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	char *baseline_path = NULL;
+	char *history_path = NULL;
+	char *write_path = NULL;
+	char *label = "";
+	double tolerance = DEFAULT_TOLERANCE;
+	double tail_tolerance = DEFAULT_TAIL_TOLERANCE;
+	double slack_ns = DEFAULT_SLACK_NS;
+	char *report_only[MAX_REPORT_ONLY];
+	int num_report_only = 0;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_BASELINE:
+			baseline_path = optarg;
+			break;
+		case OPT_TOLERANCE:
+			tolerance = strtod(optarg, NULL);
+			break;
+		case OPT_TAIL_TOLERANCE:
+			tail_tolerance = strtod(optarg, NULL);
+			break;
+		case OPT_SLACK_NS:
+			slack_ns = strtod(optarg, NULL);
+			break;
+		case OPT_HISTORY:
+			history_path = optarg;
+			break;
+		case OPT_LABEL:
+			label = optarg;
+			break;
+		case OPT_WRITE_BASELINE:
+			write_path = optarg;
+			break;
+		case OPT_REPORT_ONLY:
+			if (num_report_only == MAX_REPORT_ONLY) {
+				printf("perfcheck: at most %d --report-only options\n", MAX_REPORT_ONLY);
+				return 1;
+			}
+			report_only[num_report_only++] = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || (baseline_path == NULL && write_path == NULL)) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	static result_set now;
+	static result_set base;
+	if (read_results(argv[optind], &now)) {
+		return 1;
+	}
+	if (now.len == 0) {
+		printf("perfcheck: no results in %s\n", argv[optind]);
+		return 1;
+	}
+	if (history_path != NULL && write_results(history_path, "a", &now, label, (long)time(NULL))) {
+		return 1;
+	}
+	if (write_path != NULL) {
+		if (write_results(write_path, "w", &now, NULL, 0)) {
+			return 1;
+		}
+		printf("perfcheck: wrote %d baseline results to %s\n", now.len, write_path);
+		if (baseline_path == NULL) {
+			return 0;
+		}
+	}
+	if (read_results(baseline_path, &base)) {
+		return 1;
+	}
+
+	printf("%-40s %-17s %14s %14s %9s\n", "benchmark", "metric", "baseline", "now", "change");
+	int regressions = 0;
+	int missing = 0;
+	for (int i = 0; i < base.len; i++) {
+		result *b = &base.results[i];
+		result *r = NULL;
+		for (int j = 0; j < now.len; j++) {
+			if (strcmp(now.results[j].key, b->key) == 0) {
+				r = &now.results[j];
+			}
+		}
+		if (r == NULL) {
+			printf("%-40s not run\n", b->key);
+			missing++;
+			continue;
+		}
+		int only_reported = 0;
+		for (int k = 0; k < num_report_only; k++) {
+			only_reported |= strstr(b->key, report_only[k]) != NULL;
+		}
+		for (int m = 0; m < NUM_METRICS; m++) {
+			if (b->has[m] && r->has[m]) {
+				regressions += compare_metric(r, b, m, m == METRIC_TAIL ? tail_tolerance : tolerance,
+					slack_ns, only_reported);
+			}
+		}
+	}
+
+	if (regressions > 0 || missing > 0) {
+		printf("\n");
+		printf("**************************************************************\n");
+		printf("* perfcheck FAILED: %d regressions beyond tolerance, %d missing\n", regressions, missing);
+		printf("* (throughput/mean %.0f%%, p99 %.0f%%, slack %.0f ns)\n", tolerance, tail_tolerance, slack_ns);
+		printf("**************************************************************\n");
+		return 1;
+	}
+	printf("perfcheck: %d benchmarks within tolerance of %s\n", base.len, baseline_path);
+	return 0;
+}
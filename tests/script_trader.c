@@ -0,0 +1,70 @@
+/*
+ * A trader that sends a fixed list of commands, for end-to-end tests whose
+ * outcome has to be exact. Each command goes out once the previous one is
+ * answered, then the trader exits.
+ *
+ * The exchange passes a trader nothing but its ID, so the commands are read
+ * from the PEX_SCRIPT environment variable, ;-separated, without order IDs
+ * on BUY and SELL (they are numbered from 0):
+ *   PEX_SCRIPT="SELL GPU 10 105;BUY GPU 10 100;AMEND 1 10 105" ./pe_exchange products.txt ./script_trader
+ *
+ * Usage: script_trader <trader id>
+ */
+
+#include "../pex_client.h"
+
+#define SCRIPT_ENV "PEX_SCRIPT"
+
+/*
+ * Desc: Queues one scripted command.
+ * Return: 0 on success, 1 if it isn't a command or can't be queued.
+ */
+static int queue_command(pex_client *c, char *line) {
+	char product[PRODUCT_STR_LEN];
+	long quantity = 0;
+	long price = 0;
+	int order_id = 0;
+	if (sscanf(line, " BUY %16s %ld %ld", product, &quantity, &price) == 3) {
+		return pex_buy(c, product, quantity, price) == -1;
+	} else if (sscanf(line, " SELL %16s %ld %ld", product, &quantity, &price) == 3) {
+		return pex_sell(c, product, quantity, price) == -1;
+	} else if (sscanf(line, " AMEND %d %ld %ld", &order_id, &quantity, &price) == 3) {
+		return pex_amend(c, order_id, quantity, price);
+	} else if (sscanf(line, " CANCEL %d", &order_id) == 1) {
+		return pex_cancel(c, order_id);
+	}
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	char *script = getenv(SCRIPT_ENV);
+	if (argc < 2 || script == NULL) {
+		fprintf(stderr, "Usage: %s <trader id>, commands in $%s\n", argv[0], SCRIPT_ENV);
+		return 1;
+	}
+
+	static pex_client client;
+	if (pex_connect(&client, atoi(argv[1]), NULL)) {
+		fprintf(stderr, "script_trader: can't connect to the exchange\n");
+		return 1;
+	}
+
+	// queued up front, the client sends the next one with each answer
+	char *copy = strdup(script);
+	char *save = NULL;
+	for (char *line = strtok_r(copy, ";", &save); line != NULL; line = strtok_r(NULL, ";", &save)) {
+		if (queue_command(&client, line)) {
+			fprintf(stderr, "script_trader: bad command <%s>\n", line);
+			free(copy);
+			pex_close(&client);
+			return 1;
+		}
+	}
+	free(copy);
+
+	while (client.pending_len > 0 && pex_poll(&client, -1) >= 0) {
+	}
+	int res = client.pending_len > 0;
+	pex_close(&client);
+	return res;
+}